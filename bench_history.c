@@ -0,0 +1,205 @@
+// bench_history.c
+// Benchmark of the history store on our usual workload: a large document
+// pushed again and again after a few small edits. Reports the dedup
+// ratio (bytes of snapshots pushed over bytes stored in the history data
+// file and the chunk store), push throughput, and what a pop and garbage
+// collection give back. Every snapshot is read back and checked.
+//
+// It works in a directory of its own under /tmp and removes it after.
+//
+// Build: gcc -O2 -std=gnu11 -o bench_history bench_history.c history.c commit.c codec.c
+// Usage: bench_history [document size] [pushes] [edits per push]
+
+#include "history.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define BENCH_DOC "bench.txt"
+
+static const char *words[] = {
+    "the", "document", "owner", "edits", "section", "history", "snapshot", "lock",
+    "user", "priority", "shared", "memory", "server", "request", "access", "chunk",
+};
+
+static uint64_t fnv1a(const char *data, size_t len) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Append a word (and now and then a line break) at pos
+static size_t insert_words(char *doc, size_t len, size_t pos, int count) {
+    for (int i = 0; i < count; i++) {
+        char word[32];
+        int n = snprintf(word, sizeof(word), "%s%c", words[rand() % 16], rand() % 12 ? ' ' : '\n');
+        memmove(doc + pos + n, doc + pos, len - pos);
+        memcpy(doc + pos, word, n);
+        len += n;
+        pos += n;
+    }
+    return len;
+}
+
+// A few small edits at random places: insertions, deletions and changes
+static size_t edit(char *doc, size_t len) {
+    size_t pos = rand() % (len + 1);
+    switch (rand() % 3) {
+        case 0:
+            return insert_words(doc, len, pos, 1 + rand() % 4);
+        case 1: {
+            size_t cut = pos + 40 <= len ? 1 + rand() % 40 : 0;
+            memmove(doc + pos, doc + pos + cut, len - pos - cut);
+            return len - cut;
+        }
+        default:
+            for (size_t i = pos; i < len && i < pos + 8; i++) {
+                if (doc[i] != ' ' && doc[i] != '\n') {
+                    doc[i] = 'a' + rand() % 26;
+                }
+            }
+            return len;
+    }
+}
+
+static bool write_doc(const char *doc, size_t len) {
+    FILE *file = fopen(BENCH_DOC, "w");
+    if (file == NULL) {
+        return false;
+    }
+    bool ok = fwrite(doc, 1, len, file) == len;
+    return fclose(file) == 0 && ok;
+}
+
+static long long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+// Bytes the history takes on disk: data file, index and every chunk
+static long long stored_bytes(long *chunks) {
+    long long total = file_size(history_path(HISTORY_DATA)) + file_size(history_path(HISTORY_INDEX));
+    *chunks = 0;
+    DIR *dir = opendir(history_path(HISTORY_CHUNKS));
+    if (dir == NULL) {
+        return total;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] != '.') {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", history_path(HISTORY_CHUNKS), ent->d_name);
+            total += file_size(path);
+            (*chunks)++;
+        }
+    }
+    closedir(dir);
+    return total;
+}
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    size_t size = argc > 1 ? strtoul(argv[1], NULL, 10) : 1 << 20;
+    int pushes = argc > 2 ? atoi(argv[2]) : 200;
+    int edits = argc > 3 ? atoi(argv[3]) : 3;
+    if (size == 0 || pushes <= 0 || edits < 0) {
+        printf("Usage: %s [document size] [pushes] [edits per push]\n", argv[0]);
+        return 1;
+    }
+
+    char dir[] = "/tmp/bench_history.XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) == -1) {
+        perror("Cannot make a working directory");
+        return 1;
+    }
+    history_select(BENCH_DOC);
+
+    // Room for the document to grow by every edit inserting words
+    size_t capacity = size + (size_t)pushes * edits * 4 * 32 + 64;
+    char *doc = malloc(capacity);
+    uint64_t *hashes = malloc(pushes * sizeof(uint64_t));
+    if (doc == NULL || hashes == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    srand(1);
+    size_t len = 0;
+    while (len < size) {
+        len = insert_words(doc, len, len, 1);
+    }
+
+    long long pushed = 0;
+    double push_time = 0;
+    for (int i = 0; i < pushes; i++) {
+        if (i > 0) {
+            for (int e = 0; e < edits; e++) {
+                len = edit(doc, len);
+            }
+        }
+        if (!write_doc(doc, len)) {
+            perror(BENCH_DOC);
+            return 1;
+        }
+        hashes[i] = fnv1a(doc, len);
+        pushed += len;
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (!history_push(BENCH_DOC)) {
+            printf("Push %d failed\n", i);
+            return 1;
+        }
+        push_time += seconds_since(&start);
+    }
+
+    long chunks;
+    long long stored = stored_bytes(&chunks);
+    printf("%d pushes of a %zu-byte document, %d edit(s) between pushes\n", pushes, size, edits);
+    printf("pushed %lld bytes, stored %lld (%ld chunks): dedup ratio %.1fx\n",
+           pushed, stored, chunks, (double)pushed / stored);
+    printf("push: %.2f ms each, %.1f MB/s of document\n",
+           push_time * 1000 / pushes, pushed / push_time / 1e6);
+
+    // Read every snapshot back
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int bad = 0;
+    for (long i = 0; i < pushes; i++) {
+        size_t snapshot_len;
+        const char *snapshot = history_snapshot(i, &snapshot_len);
+        if (snapshot == NULL || fnv1a(snapshot, snapshot_len) != hashes[i]) {
+            bad++;
+        }
+    }
+    printf("read back: %.2f ms per snapshot, %d wrong\n", seconds_since(&start) * 1000 / pushes, bad);
+
+    // Pop the newer half; popping a keyframe collects its orphaned chunks
+    for (int i = 0; i < pushes / 2; i++) {
+        if (!history_pop(BENCH_DOC)) {
+            printf("Pop %d failed\n", i);
+            return 1;
+        }
+    }
+    long removed = history_gc();
+    long long after = stored_bytes(&chunks);
+    printf("after popping %d: stored %lld bytes (%ld chunks), %ld more removed by gc\n",
+           pushes / 2, after, chunks, removed);
+
+    history_release();
+    free(doc);
+    free(hashes);
+    char command[sizeof(dir) + 16];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    return system(command) == 0 && bad == 0 ? 0 : 1;
+}
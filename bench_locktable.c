@@ -0,0 +1,138 @@
+// bench_locktable.c
+// Benchmark of the document lock table under many processes working on
+// many documents. Each process takes the locks of random documents, one
+// time in four for writing, with the locks in three layouts:
+//   table:  where the registry puts them, in each document's slot
+//           (found by hashing its name): the lock fills the slot's first
+//           64-byte cache line, and the name and bookkeeping take two more,
+//           so each slot is 192 bytes
+//   single: one lock for every document, as before the registry
+//   packed: one lock per document, but packed together without padding,
+//           so neighbouring documents share cache lines
+//
+// The padding is there so that processes on different CPUs never pass
+// one cache line back and forth for different documents. With a single
+// CPU there is no such traffic, and the smaller packed layout comes out
+// ahead: on a one-CPU machine, 64 processes on 10,000 documents ran at
+// 35.3M locks/s with the table and 37.7M with the packed locks. Only a
+// run on a multi-core machine shows what the padding buys.
+//
+// The table is filled by registry_add() into a registry of its own. Its
+// documents' range and section tables get the names a running owner's
+// would, so it will not run while an owner is.
+//
+// Build: gcc -O2 -std=gnu11 -o bench_locktable bench_locktable.c shared.c registry.c
+//        history.c commit.c oplog.c rangelock.c section.c crdt.c codec.c -lpthread
+// Usage: bench_locktable [processes] [documents] [locks per process]
+
+#include "shared.h"
+
+enum { LAYOUT_TABLE, LAYOUT_SINGLE, LAYOUT_PACKED };
+static const char *layout_names[] = { "table", "single", "packed" };
+
+// What a write touches besides the lock word, without the slot's padding
+typedef struct {
+    RwLock rwlock;
+    _Atomic unsigned long doc_version;
+} PackedLock;
+
+static int *slots;             // Registry slot of each document
+static PackedLock *packed;
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void lock_documents(int layout, int process, int documents, long iterations) {
+    uint32_t rng = process * 2654435761u + 1;
+    for (long i = 0; i < iterations; i++) {
+        rng = rng * 1103515245u + 12345;
+        int doc = (rng >> 8) % documents;
+        RwLock *lock;
+        _Atomic unsigned long *version;
+        if (layout == LAYOUT_PACKED) {
+            lock = &packed[doc].rwlock;
+            version = &packed[doc].doc_version;
+        } else {
+            LockInfo *info = &registry->docs[slots[layout == LAYOUT_SINGLE ? 0 : doc]].lock;
+            lock = &info->rwlock;
+            version = &info->doc_version;
+        }
+        if ((rng >> 4) & 3) {
+            rwlock_read_lock(lock, false, -1);
+            rwlock_read_unlock(lock);
+        } else {
+            rwlock_write_lock(lock, false, -1);
+            atomic_fetch_add(version, 1);
+            rwlock_write_unlock(lock);
+        }
+    }
+}
+
+static void bench_layout(int layout, int processes, int documents, long iterations) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int p = 0; p < processes; p++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            lock_documents(layout, p, documents, iterations);
+            _exit(0);
+        }
+    }
+    while (wait(NULL) > 0) {
+    }
+    double elapsed = seconds_since(&start);
+    printf("%-7s %d processes, %d documents: %10.0f locks/s\n", layout_names[layout], processes,
+           layout == LAYOUT_SINGLE ? 1 : documents, processes * iterations / elapsed);
+}
+
+int main(int argc, char *argv[]) {
+    int processes = argc > 1 ? atoi(argv[1]) : 64;
+    int documents = argc > 2 ? atoi(argv[2]) : 10000;
+    long iterations = argc > 3 ? atol(argv[3]) : 100000;
+    if (processes <= 0 || documents <= 0 || documents > REGISTRY_MAX_DOCS || iterations <= 0) {
+        printf("Usage: %s [processes] [documents, up to %d] [locks per process]\n", argv[0],
+               REGISTRY_MAX_DOCS);
+        return 1;
+    }
+    if (owner_running()) {
+        printf("An owner is running; stop it first.\n");
+        return 1;
+    }
+
+    registry = mmap(NULL, sizeof(DocRegistry), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    packed = mmap(NULL, documents * sizeof(PackedLock), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    slots = malloc(documents * sizeof(int));
+    if (registry == MAP_FAILED || packed == MAP_FAILED || slots == NULL) {
+        perror("Cannot set up the lock tables");
+        return 1;
+    }
+    int failed = 0;
+    for (int i = 0; i < documents && !failed; i++) {
+        char name[DOC_PATH_MAX];
+        snprintf(name, sizeof(name), "bench%05d.txt", i);
+        slots[i] = registry_add(name);
+        failed = slots[i] < 0 || registry_find(name) != slots[i];
+        rwlock_init(&packed[i].rwlock);
+    }
+    if (failed) {
+        printf("Could not add %d documents to the registry.\n", documents);
+    } else {
+        for (int layout = LAYOUT_TABLE; layout <= LAYOUT_PACKED; layout++) {
+            bench_layout(layout, processes, documents, iterations);
+        }
+    }
+
+    registry_release();
+    munmap(registry, sizeof(DocRegistry));
+    munmap(packed, documents * sizeof(PackedLock));
+    free(slots);
+    return failed;
+}
@@ -0,0 +1,322 @@
+// bench_ot.c
+// Load test of the live editing hub in OT mode (`owner --ot`). Clients
+// connect to the hub's socket and type at random, each keeping one
+// change in flight and buffering the keystrokes made meanwhile, as myapp
+// does. Reports the operations the hub commits per second and keystroke
+// latency: from a key being typed to the hub acknowledging the change
+// that carries it. Once everyone is done, every client must hold the
+// same text.
+//
+// The typing goes into the document when the hub syncs, so point it at a
+// scratch document (the owner's menu adds one) rather than a real one.
+//
+// Build: gcc -O2 -std=gnu11 -o bench_ot bench_ot.c ot.c
+// Usage: bench_ot [socket] [clients] [keystrokes per client] [ms between keystrokes]
+
+#include "ot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define BENCH_SOCKET "shared_docs.txt.sock"
+#define BENCH_QUIET_MS 500    // Clients stop listening after this long without news
+
+typedef struct {
+    _Atomic int connected;
+    _Atomic int finished;
+    _Atomic int go;
+    double start_ms;          // When typing started
+} BenchShared;
+
+typedef struct {
+    double done_ms;           // When its last keystroke was acknowledged
+    uint64_t hash;            // Of its final text
+    bool failed;
+} ClientResult;
+
+static BenchShared *shared;
+static ClientResult *results;
+static double *latencies;     // Per client, per keystroke
+
+// One client's state
+static int fd = -1;
+static OtText text;
+static uint32_t site;
+static uint32_t revision;
+static OtChange outstanding;   // Sent, waiting for OT_ACK
+static OtChange buffer;        // Typed since, sent on the next OT_ACK
+static OtChange incoming;      // Another client's change, until its OT_COMMIT
+static double *typed_at;       // Time each keystroke was typed
+static int acked;              // Keystrokes acknowledged
+static int sent;               // Keystrokes sent; the outstanding change is [acked, sent)
+static int typed;
+
+static double now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+static bool send_all(const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool send_outstanding(void) {
+    OtOp commit = { .kind = OT_COMMIT, .revision = revision };
+    return send_all(outstanding.ops, outstanding.count * sizeof(OtOp)) &&
+           send_all(&commit, sizeof(commit));
+}
+
+static bool receive_op(const OtOp *op, double *latency) {
+    if (op->kind == OT_ACK) {
+        double now = now_ms();
+        for (; acked < sent; acked++) {
+            latency[acked] = now - typed_at[acked];
+        }
+        revision++;
+        ot_change_free(&outstanding);
+        outstanding = buffer;
+        buffer = (OtChange){ 0 };
+        sent = typed;
+        return outstanding.count == 0 || send_outstanding();
+    }
+    if (op->kind == OT_COMMIT) {
+        revision++;
+        ot_transform(outstanding.ops, outstanding.count, incoming.ops, incoming.count);
+        ot_transform(buffer.ops, buffer.count, incoming.ops, incoming.count);
+        for (size_t i = 0; i < incoming.count; i++) {
+            if (!ot_apply(&text, &incoming.ops[i])) {
+                printf("client %u: a change from the hub does not apply\n", site);
+                return false;
+            }
+        }
+        incoming.count = 0;
+        return true;
+    }
+    return ot_change_push(&incoming, op);
+}
+
+// Handle what the hub sends for up to timeout_ms (0: only what is there)
+static bool receive(int timeout_ms, double *latency) {
+    static char in[64 * sizeof(OtOp)];
+    static size_t in_len;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while (poll(&pfd, 1, timeout_ms) > 0) {
+        ssize_t n = read(fd, in + in_len, sizeof(in) - in_len);
+        if (n <= 0) {
+            printf("client %u: the hub closed the connection\n", site);
+            return false;
+        }
+        in_len += n;
+        size_t count = in_len / sizeof(OtOp);
+        for (size_t i = 0; i < count; i++) {
+            OtOp op;
+            memcpy(&op, in + i * sizeof(OtOp), sizeof(op));
+            if (!receive_op(&op, latency)) {
+                return false;
+            }
+        }
+        in_len -= count * sizeof(OtOp);
+        memmove(in, in + count * sizeof(OtOp), in_len);
+        timeout_ms = 0;
+    }
+    return true;
+}
+
+// A random insert or delete, applied here at once and sent or buffered
+static bool type_key(void) {
+    OtOp op = { .site = site };
+    if (text.len == 0 || rand() % 3 != 0) {
+        op.kind = OT_INSERT;
+        op.pos = rand() % (text.len + 1);
+        op.ch = 'a' + rand() % 26;
+    } else {
+        op.kind = OT_DELETE;
+        op.pos = rand() % text.len;
+    }
+    if (!ot_apply(&text, &op)) {
+        return false;
+    }
+    typed_at[typed++] = now_ms();
+    if (outstanding.count > 0) {
+        return ot_change_push(&buffer, &op);
+    }
+    sent = typed;
+    return ot_change_push(&outstanding, &op) && send_outstanding();
+}
+
+static bool connect_hub(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(path);
+        return false;
+    }
+    OtOp welcome;
+    if (!read_all(&welcome, sizeof(welcome)) || welcome.kind != OT_WELCOME) {
+        printf("%s: not a hub in OT mode (start the owner with --ot)\n", path);
+        return false;
+    }
+    site = welcome.site;
+    revision = welcome.revision;
+    text.buf = malloc(welcome.pos + 1);
+    text.len = text.capacity = welcome.pos;
+    return text.buf != NULL && read_all(text.buf, text.len);
+}
+
+static bool run_client(int index, const char *path, int clients, int keystrokes, int interval_ms) {
+    ClientResult *result = &results[index];
+    double *latency = latencies + (size_t)index * keystrokes;
+    srand(index + 1);
+    typed_at = malloc(keystrokes * sizeof(double));
+    bool ok = typed_at != NULL && connect_hub(path);
+    atomic_fetch_add(&shared->connected, 1);
+    while (!atomic_load(&shared->go)) {
+        usleep(1000);
+    }
+
+    for (int i = 0; ok && i < keystrokes; i++) {
+        double next = shared->start_ms + (double)i * interval_ms;
+        double left;
+        while (ok && (left = next - now_ms()) > 0) {
+            ok = receive((int)left + 1, latency);
+        }
+        ok = ok && type_key() && receive(0, latency);
+    }
+    while (ok && acked < typed) {
+        ok = receive(-1, latency);
+    }
+    result->done_ms = now_ms();
+    atomic_fetch_add(&shared->finished, 1);
+
+    // Keep taking the others' changes until everyone is done and the hub
+    // has gone quiet
+    while (ok && atomic_load(&shared->finished) < clients) {
+        ok = receive(10, latency);
+    }
+    double last = now_ms();
+    while (ok && now_ms() - last < BENCH_QUIET_MS) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, BENCH_QUIET_MS) > 0) {
+            ok = receive(0, latency);
+            last = now_ms();
+        }
+    }
+
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < text.len; i++) {
+        hash = (hash ^ (unsigned char)text.buf[i]) * 1099511628211ULL;
+    }
+    result->hash = hash;
+    return ok;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : BENCH_SOCKET;
+    int clients = argc > 2 ? atoi(argv[2]) : 20;
+    int keystrokes = argc > 3 ? atoi(argv[3]) : 500;
+    int interval_ms = argc > 4 ? atoi(argv[4]) : 10;
+    if (clients <= 0 || keystrokes <= 0 || interval_ms < 0) {
+        printf("Usage: %s [socket] [clients] [keystrokes per client] [ms between keystrokes]\n", argv[0]);
+        return 1;
+    }
+
+    size_t total = (size_t)clients * keystrokes;
+    size_t size = sizeof(BenchShared) + clients * sizeof(ClientResult) + total * sizeof(double);
+    shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    results = (ClientResult *)(shared + 1);
+    latencies = (double *)(results + clients);
+
+    for (int c = 0; c < clients; c++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            results[c].failed = !run_client(c, path, clients, keystrokes, interval_ms);
+            _exit(0);
+        }
+    }
+    while (atomic_load(&shared->connected) < clients) {
+        usleep(1000);
+    }
+    shared->start_ms = now_ms();
+    atomic_store(&shared->go, 1);
+    while (wait(NULL) > 0) {
+    }
+
+    int failed = 0, differ = 0;
+    double end_ms = shared->start_ms;
+    for (int c = 0; c < clients; c++) {
+        failed += results[c].failed;
+        differ += results[c].hash != results[0].hash;
+        if (results[c].done_ms > end_ms) {
+            end_ms = results[c].done_ms;
+        }
+    }
+    if (failed > 0) {
+        printf("%d of %d clients failed\n", failed, clients);
+        return 1;
+    }
+
+    double elapsed = (end_ms - shared->start_ms) / 1000;
+    qsort(latencies, total, sizeof(double), compare_double);
+    double sum = 0;
+    for (size_t i = 0; i < total; i++) {
+        sum += latencies[i];
+    }
+    printf("%d clients, %d keystrokes each, one every %d ms\n", clients, keystrokes, interval_ms);
+    printf("committed %zu operations in %.2f s: %.0f ops/s\n", total, elapsed, total / elapsed);
+    printf("keystroke latency: avg %.2f ms, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           sum / total, latencies[total / 2], latencies[total * 99 / 100], latencies[total - 1]);
+    printf("%s\n", differ ? "CLIENTS DIVERGED" : "all clients hold the same text");
+    return differ ? 1 : 0;
+}
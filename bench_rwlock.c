@@ -0,0 +1,207 @@
+// bench_rwlock.c
+// Microbenchmark of the document lock: the futex reader-writer lock in
+// shared.c against the path it replaced (a named semaphore around fcntl
+// record locks on the document) and against a process-shared
+// pthread_rwlock_t.
+//
+// The old path is timed in one process only. Its first reader takes the
+// fcntl lock for all readers, and fcntl locks belong to the process that
+// took them, so with several processes it deadlocks as soon as a reader
+// other than the first is the last to leave.
+//
+// Build: gcc -O2 -std=gnu11 -o bench_rwlock bench_rwlock.c shared.c registry.c history.c
+//        commit.c oplog.c rangelock.c section.c crdt.c codec.c -lpthread
+// Usage: bench_rwlock [processes] [iterations per process]
+
+#include "shared.h"
+#include <pthread.h>
+#include <semaphore.h>
+
+#define BENCH_SEM "/bench_rwlock_access"
+#define BENCH_FILE "bench_rwlock.tmp"
+
+typedef struct {
+    RwLock futex;
+    pthread_rwlock_t pthread;
+    int reader_count;          // Old path: readers in, under the semaphore
+    long writes;               // Incremented under each write lock, to check exclusion
+} BenchShared;
+
+static BenchShared *shared;
+static sem_t *access_sem;
+static int file_fd;
+
+enum { LOCK_FUTEX, LOCK_PTHREAD, LOCK_OLD };
+static const char *lock_names[] = { "futex rwlock", "pthread rwlock", "semaphore + fcntl" };
+
+static void set_file_lock(short type) {
+    struct flock lock = { .l_type = type, .l_whence = SEEK_SET, .l_start = 0, .l_len = 0 };
+    while (fcntl(file_fd, F_SETLKW, &lock) == -1 && errno == EINTR) {
+    }
+}
+
+static void read_lock(int kind) {
+    switch (kind) {
+        case LOCK_FUTEX:
+            rwlock_read_lock(&shared->futex, false, -1);
+            break;
+        case LOCK_PTHREAD:
+            pthread_rwlock_rdlock(&shared->pthread);
+            break;
+        case LOCK_OLD:
+            sem_wait(access_sem);
+            if (++shared->reader_count == 1) {
+                set_file_lock(F_WRLCK);
+            }
+            sem_post(access_sem);
+            break;
+    }
+}
+
+static void read_unlock(int kind) {
+    switch (kind) {
+        case LOCK_FUTEX:
+            rwlock_read_unlock(&shared->futex);
+            break;
+        case LOCK_PTHREAD:
+            pthread_rwlock_unlock(&shared->pthread);
+            break;
+        case LOCK_OLD:
+            sem_wait(access_sem);
+            if (--shared->reader_count == 0) {
+                set_file_lock(F_UNLCK);
+            }
+            sem_post(access_sem);
+            break;
+    }
+}
+
+static void write_lock(int kind) {
+    switch (kind) {
+        case LOCK_FUTEX:
+            rwlock_write_lock(&shared->futex, false, -1);
+            break;
+        case LOCK_PTHREAD:
+            pthread_rwlock_wrlock(&shared->pthread);
+            break;
+        case LOCK_OLD:
+            sem_wait(access_sem);
+            set_file_lock(F_WRLCK);
+            break;
+    }
+}
+
+static void write_unlock(int kind) {
+    switch (kind) {
+        case LOCK_FUTEX:
+            rwlock_write_unlock(&shared->futex);
+            break;
+        case LOCK_PTHREAD:
+            pthread_rwlock_unlock(&shared->pthread);
+            break;
+        case LOCK_OLD:
+            set_file_lock(F_UNLCK);
+            sem_post(access_sem);
+            break;
+    }
+}
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// One process taking and dropping the lock: the uncontended cost
+static void bench_uncontended(int kind, long iterations) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iterations; i++) {
+        read_lock(kind);
+        read_unlock(kind);
+    }
+    double read_ns = seconds_since(&start) * 1e9 / iterations;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iterations; i++) {
+        write_lock(kind);
+        write_unlock(kind);
+    }
+    double write_ns = seconds_since(&start) * 1e9 / iterations;
+    printf("%-18s uncontended: read %7.1f ns, write %7.1f ns per lock and unlock\n",
+           lock_names[kind], read_ns, write_ns);
+}
+
+// Processes taking the lock at once, one time in four for writing
+static void bench_contended(int kind, int processes, long iterations) {
+    shared->writes = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int p = 0; p < processes; p++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            for (long i = 0; i < iterations; i++) {
+                if (i % 4 == 0) {
+                    write_lock(kind);
+                    shared->writes++;
+                    write_unlock(kind);
+                } else {
+                    read_lock(kind);
+                    read_unlock(kind);
+                }
+            }
+            _exit(0);
+        }
+    }
+    while (wait(NULL) > 0) {
+    }
+    double elapsed = seconds_since(&start);
+    long expected = processes * ((iterations + 3) / 4);
+    printf("%-18s %d processes: %10.0f locks/s%s\n", lock_names[kind], processes,
+           processes * iterations / elapsed, shared->writes == expected ? "" : "  (WRITES LOST)");
+}
+
+int main(int argc, char *argv[]) {
+    int processes = argc > 1 ? atoi(argv[1]) : 8;
+    long iterations = argc > 2 ? atol(argv[2]) : 200000;
+    if (processes <= 0 || iterations <= 0) {
+        printf("Usage: %s [processes] [iterations per process]\n", argv[0]);
+        return 1;
+    }
+
+    shared = mmap(NULL, sizeof(BenchShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    rwlock_init(&shared->futex);
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_rwlock_init(&shared->pthread, &attr);
+
+    sem_unlink(BENCH_SEM);
+    access_sem = sem_open(BENCH_SEM, O_CREAT, 0644, 1);
+    file_fd = open(BENCH_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (access_sem == SEM_FAILED || file_fd == -1) {
+        perror("Cannot set up the old lock path");
+        return 1;
+    }
+
+    for (int kind = LOCK_FUTEX; kind <= LOCK_OLD; kind++) {
+        bench_uncontended(kind, iterations);
+    }
+    for (int kind = LOCK_FUTEX; kind <= LOCK_PTHREAD; kind++) {
+        bench_contended(kind, processes, iterations);
+    }
+
+    close(file_fd);
+    unlink(BENCH_FILE);
+    sem_close(access_sem);
+    sem_unlink(BENCH_SEM);
+    return 0;
+}
@@ -0,0 +1,209 @@
+// codec.c
+// LZ4-style block codec. A compressed payload is a series of sequences:
+//   token          high nibble: literal count, low nibble: match length - 4
+//   [extra bytes]  when a nibble is 15, further bytes of 255 are added
+//   literals
+//   offset         2 bytes, little endian, distance back to the match
+//   [extra bytes]  for the match length
+// The last sequence has literals only. Matches are found with a single
+// hash table of 4-byte prefixes, which keeps compression fast and memory
+// use fixed.
+
+#include "codec.h"
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(const unsigned char *p) {
+    return (read32(p) * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static void write_header(char *dst, int mode, size_t len) {
+    uint32_t len32 = (uint32_t)len;
+    dst[0] = 'L';
+    dst[1] = 'Z';
+    dst[2] = 'B';
+    dst[3] = (char)mode;
+    memcpy(dst + 4, &len32, sizeof(len32));
+}
+
+// Largest block codec_compress() can produce for len input bytes
+size_t codec_bound(size_t len) {
+    return CODEC_HEADER_SIZE + len + len / 255 + 16;
+}
+
+// Write a length nibble's overflow bytes
+static unsigned char *put_length(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *literals,
+                                   size_t literal_len, size_t offset, size_t match_len) {
+    unsigned char *token = op++;
+    *token = (unsigned char)((literal_len < 15 ? literal_len : 15) << 4);
+    if (literal_len >= 15) {
+        op = put_length(op, literal_len - 15);
+    }
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    if (match_len > 0) {
+        size_t extra = match_len - MIN_MATCH;
+        *token |= (unsigned char)(extra < 15 ? extra : 15);
+        *op++ = (unsigned char)(offset & 0xFF);
+        *op++ = (unsigned char)(offset >> 8);
+        if (extra >= 15) {
+            op = put_length(op, extra - 15);
+        }
+    }
+    return op;
+}
+
+// Compress src into dst (at least codec_bound(len) bytes). Falls back to
+// a stored block when compression does not help. Returns the block size,
+// or 0 if dst is too small or len does not fit the header.
+size_t codec_compress(const char *src, size_t len, char *dst, size_t capacity) {
+    if (capacity < codec_bound(len) || len > UINT32_MAX) {
+        return 0;
+    }
+
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dst + CODEC_HEADER_SIZE;
+    unsigned char *op = out;
+    uint32_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t anchor = 0;
+    size_t i = 0;
+    while (len >= MIN_MATCH && i + MIN_MATCH <= len) {
+        uint32_t h = hash4(in + i);
+        size_t candidate = table[h];
+        table[h] = (uint32_t)i;
+
+        if (candidate < i && i - candidate <= MAX_OFFSET &&
+            read32(in + candidate) == read32(in + i)) {
+            size_t match_len = MIN_MATCH;
+            while (i + match_len < len && in[candidate + match_len] == in[i + match_len]) {
+                match_len++;
+            }
+            op = put_sequence(op, in + anchor, i - anchor, i - candidate, match_len);
+            i += match_len;
+            anchor = i;
+            continue;
+        }
+        i++;
+    }
+    op = put_sequence(op, in + anchor, len - anchor, 0, 0);
+
+    size_t compressed = op - out;
+    if (compressed >= len) {
+        write_header(dst, CODEC_STORED, len);
+        memcpy(dst + CODEC_HEADER_SIZE, src, len);
+        return CODEC_HEADER_SIZE + len;
+    }
+    write_header(dst, CODEC_LZ, len);
+    return CODEC_HEADER_SIZE + compressed;
+}
+
+bool codec_raw_length(const char *block, size_t block_len, size_t *raw_len) {
+    uint32_t len32;
+
+    if (block_len < CODEC_HEADER_SIZE || memcmp(block, "LZB", 3) != 0) {
+        return false;
+    }
+    memcpy(&len32, block + 4, sizeof(len32));
+    *raw_len = len32;
+    return true;
+}
+
+// Read a length nibble's overflow bytes; false if the block ends first
+static bool get_length(const unsigned char **ip, const unsigned char *end, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= end) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decompress a whole block into dst, which must hold exactly raw_len
+// bytes. Every length and offset is checked, so a damaged block fails
+// instead of writing out of bounds.
+bool codec_decompress(const char *block, size_t block_len, char *dst, size_t raw_len) {
+    size_t expected;
+    if (!codec_raw_length(block, block_len, &expected) || expected != raw_len) {
+        return false;
+    }
+
+    const unsigned char *ip = (const unsigned char *)block + CODEC_HEADER_SIZE;
+    const unsigned char *end = (const unsigned char *)block + block_len;
+    unsigned char *out = (unsigned char *)dst;
+    size_t pos = 0;
+
+    if (block[3] == CODEC_STORED) {
+        if ((size_t)(end - ip) != raw_len) {
+            return false;
+        }
+        memcpy(dst, ip, raw_len);
+        return true;
+    }
+    if (block[3] != CODEC_LZ) {
+        return false;
+    }
+
+    while (ip < end) {
+        unsigned char token = *ip++;
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && !get_length(&ip, end, &literal_len)) {
+            return false;
+        }
+        if (literal_len > (size_t)(end - ip) || literal_len > raw_len - pos) {
+            return false;
+        }
+        memcpy(out + pos, ip, literal_len);
+        ip += literal_len;
+        pos += literal_len;
+
+        if (ip == end) {
+            break;  // Final sequence: literals only
+        }
+
+        if (end - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t match_len = token & 0x0F;
+        if (match_len == 15 && !get_length(&ip, end, &match_len)) {
+            return false;
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > pos || match_len > raw_len - pos) {
+            return false;
+        }
+
+        // Byte by byte: matches may overlap the bytes they produce
+        for (size_t k = 0; k < match_len; k++, pos++) {
+            out[pos] = out[pos - offset];
+        }
+    }
+    return pos == raw_len;
+}
@@ -0,0 +1,22 @@
+// codec.h
+// Small LZ77 block codec in the style of LZ4, used to compress old history
+// chunks. Every block carries its own header, so any block can be
+// decompressed on its own.
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Header: 'L' 'Z' 'B' mode, then the uncompressed length (uint32_t)
+#define CODEC_HEADER_SIZE 8
+#define CODEC_STORED 0   // Block did not shrink; payload is the raw bytes
+#define CODEC_LZ 1       // Payload is a sequence of literal/match tokens
+
+size_t codec_bound(size_t len);
+size_t codec_compress(const char *src, size_t len, char *dst, size_t capacity);
+bool codec_raw_length(const char *block, size_t block_len, size_t *raw_len);
+bool codec_decompress(const char *block, size_t block_len, char *dst, size_t raw_len);
+
+#endif // CODEC_H
@@ -0,0 +1,628 @@
+// collab.c
+// Live editing hub. A single poll() loop serves the listening socket,
+// the clients and the owner's stop pipe. The hub's own copy of the text
+// orders everything: a client's operations are applied there before they
+// are passed on, so every client receives operations after the ones they
+// depend on, while its own are already applied locally.
+//
+// In CRDT mode the hub keeps a replica like any client. In OT mode it
+// holds the authoritative text and a history of committed changes; a
+// client sends one change at a time, made against the last revision it
+// has seen, and the hub transforms it past the changes committed since.
+//
+// A session starts when the first client connects and ends once the
+// last client has left and the text is written back. base remembers the
+// document as last synced (base_ids: the CRDT element of each character,
+// base_rev: the OT revision), so a change made there through the locks
+// can be merged into the session as an edit of the hub's own.
+
+#define _GNU_SOURCE  // accept4, pipe2
+#include "shared.h"
+#include "crdt.h"
+#include "ot.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Clients read the first record to find out which protocol the hub speaks
+_Static_assert(sizeof(OtOp) == sizeof(CrdtOp), "CRDT and OT records must be the same size");
+#define RECORD_SIZE sizeof(CrdtOp)
+
+typedef struct {
+    int fd;
+    uint32_t site;
+    char in[64 * RECORD_SIZE];     // Partial records read so far
+    size_t in_len;
+    char *out;                     // Records the socket would not take yet
+    size_t out_len;
+    size_t out_cap;
+    OtChange pending;              // OT: change being received, up to its OT_COMMIT
+    bool failed;                   // Dropped at the end of the poll round
+} Client;
+
+// Owner side: one hub per document, by registry slot
+static pid_t hub_pids[REGISTRY_MAX_DOCS];
+static int hub_stop_fds[REGISTRY_MAX_DOCS];  // Owner's end of each stop pipe
+static int hub_mode = COLLAB_CRDT;
+
+static Client clients[COLLAB_MAX_CLIENTS];
+static int client_count = 0;
+static uint32_t next_site = CRDT_HUB_SITE + 1;
+
+static bool in_session = false;
+static Crdt session;                    // CRDT mode
+static OtText ot_text;                  // OT mode: the text at revision ot_revision
+static OtChange *ot_history = NULL;     // Committed changes; change r took revision r to r + 1
+static size_t ot_revision = 0;
+static size_t ot_history_capacity = 0;
+
+static bool dirty = false;              // Operations not yet in the document
+static char *base = NULL;
+static CrdtId *base_ids = NULL;
+static size_t base_len = 0;
+static size_t base_rev = 0;
+static unsigned long synced_version = 0;
+static struct timespec last_op, last_sync, session_start;
+static unsigned long session_ops = 0;
+
+static long ms_since(const struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+static void drop_client(int i) {
+    close(clients[i].fd);
+    free(clients[i].out);
+    ot_change_free(&clients[i].pending);
+    clients[i] = clients[--client_count];
+}
+
+// Send what the socket takes now and keep the rest for POLLOUT
+static bool flush_client(Client *client) {
+    size_t sent = 0;
+    while (sent < client->out_len) {
+        ssize_t n = send(client->fd, client->out + sent, client->out_len - sent,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        sent += n;
+    }
+    memmove(client->out, client->out + sent, client->out_len - sent);
+    client->out_len -= sent;
+    return true;
+}
+
+static bool queue_bytes(Client *client, const void *data, size_t bytes) {
+    if (client->out_len + bytes > COLLAB_OUT_MAX) {
+        return false;
+    }
+    if (client->out_len + bytes > client->out_cap) {
+        size_t cap = client->out_cap ? client->out_cap : 4096;
+        while (cap < client->out_len + bytes) {
+            cap *= 2;
+        }
+        char *out = realloc(client->out, cap);
+        if (out == NULL) {
+            return false;
+        }
+        client->out = out;
+        client->out_cap = cap;
+    }
+    memcpy(client->out + client->out_len, data, bytes);
+    client->out_len += bytes;
+    return flush_client(client);
+}
+
+// Pass records on to every client except the one they came from
+static void broadcast(const void *records, size_t count, int from) {
+    for (int i = 0; i < client_count; i++) {
+        if (i != from && !clients[i].failed && !queue_bytes(&clients[i], records, count * RECORD_SIZE)) {
+            clients[i].failed = true;
+        }
+    }
+}
+
+static void set_base(char *text, CrdtId *ids, size_t len) {
+    free(base);
+    free(base_ids);
+    base = text;
+    base_ids = ids;
+    base_len = len;
+    base_rev = ot_revision;
+}
+
+// The session's current text, and in CRDT mode the element ids of its
+// characters
+static char *session_text(size_t *len, CrdtId **ids) {
+    if (hub_mode == COLLAB_CRDT) {
+        return crdt_text(&session, len, ids);
+    }
+    char *text = malloc(ot_text.len + 1);
+    if (text != NULL) {
+        memcpy(text, ot_text.buf, ot_text.len);
+        *len = ot_text.len;
+    }
+    *ids = NULL;
+    return text;
+}
+
+static bool start_session(void) {
+    synced_version = atomic_load(&lock_info->doc_version);
+    size_t len;
+    char *doc = read_document(&len);
+    if (doc == NULL) {
+        perror("Live session: error reading document");
+        return false;
+    }
+
+    if (hub_mode == COLLAB_CRDT) {
+        // The document as hub-site inserts, each after the one before
+        crdt_init(&session, CRDT_HUB_SITE);
+        CrdtOp op = { .id = { CRDT_HEAD_SITE, 0 } };
+        for (size_t i = 0; i < len; i++) {
+            if (!crdt_insert_after(&session, op.id, doc[i], &op)) {
+                fprintf(stderr, "Live session: out of memory loading document\n");
+                crdt_free(&session);
+                free(doc);
+                return false;
+            }
+        }
+    } else {
+        ot_text = (OtText){ doc, len, len };
+        doc = NULL;
+        ot_revision = 0;
+    }
+    free(doc);
+
+    CrdtId *ids;
+    char *text = session_text(&len, &ids);
+    if (text == NULL) {
+        if (hub_mode == COLLAB_CRDT) {
+            crdt_free(&session);
+        }
+        return false;
+    }
+    set_base(text, ids, len);
+    in_session = true;
+    dirty = false;
+    session_ops = 0;
+    clock_gettime(CLOCK_MONOTONIC, &session_start);
+    last_sync = last_op = session_start;
+    return true;
+}
+
+static void end_session(void) {
+    long ms = ms_since(&session_start);
+    if (session_ops > 0) {
+        printf("Live session ended: %lu operations in %.1f s (%.0f ops/s)\n",
+               session_ops, ms / 1000.0, ms > 0 ? session_ops * 1000.0 / ms : 0.0);
+        fflush(stdout);
+    }
+
+    if (hub_mode == COLLAB_CRDT) {
+        crdt_free(&session);
+    } else {
+        free(ot_text.buf);
+        ot_text = (OtText){ NULL, 0, 0 };
+        for (size_t r = 0; r < ot_revision; r++) {
+            ot_change_free(&ot_history[r]);
+        }
+        ot_revision = 0;
+    }
+    set_base(NULL, NULL, 0);
+    in_session = false;
+}
+
+// OT: commit a change made against revision. It is transformed past the
+// changes committed since, applied, acknowledged to the client it came
+// from and passed on to the others (from is -1 for the hub's own
+// changes). Returns false if it does not fit the text.
+static bool commit_change(OtChange *change, size_t revision, uint32_t site, int from) {
+    OtChange past = { 0 };
+    for (size_t r = revision; r < ot_revision; r++) {
+        past.count = 0;
+        for (size_t k = 0; k < ot_history[r].count; k++) {
+            if (!ot_change_push(&past, &ot_history[r].ops[k])) {
+                ot_change_free(&past);
+                return false;
+            }
+        }
+        ot_transform(change->ops, change->count, past.ops, past.count);
+    }
+    ot_change_free(&past);
+
+    // Check the whole change fits before applying any of it
+    size_t len = ot_text.len;
+    for (size_t k = 0; k < change->count; k++) {
+        const OtOp *op = &change->ops[k];
+        if (op->kind == OT_INSERT && op->pos <= len) {
+            len++;
+        } else if (op->kind == OT_DELETE && op->pos < len) {
+            len--;
+        } else if (op->kind != OT_NOOP) {
+            return false;
+        }
+    }
+
+    if (ot_revision == ot_history_capacity) {
+        size_t capacity = ot_history_capacity ? ot_history_capacity * 2 : 256;
+        OtChange *grown = realloc(ot_history, capacity * sizeof(OtChange));
+        if (grown == NULL) {
+            return false;
+        }
+        ot_history = grown;
+        ot_history_capacity = capacity;
+    }
+    for (size_t k = 0; k < change->count; k++) {
+        ot_apply(&ot_text, &change->ops[k]);
+    }
+    ot_history[ot_revision++] = *change;
+    *change = (OtChange){ 0 };
+
+    const OtChange *committed = &ot_history[ot_revision - 1];
+    OtOp commit = { .kind = OT_COMMIT, .site = site };
+    broadcast(committed->ops, committed->count, from);
+    broadcast(&commit, 1, from);
+    if (from >= 0) {
+        OtOp ack = { .kind = OT_ACK, .revision = ot_revision };
+        if (!queue_bytes(&clients[from], &ack, RECORD_SIZE)) {
+            clients[from].failed = true;
+        }
+    }
+    session_ops += committed->count;
+    return true;
+}
+
+// The document differs from base: turn the change into a hub edit of
+// the session and send it to the clients
+static void merge_outside_edit(const char *doc, size_t doc_len) {
+    size_t prefix = 0;
+    size_t limit = base_len < doc_len ? base_len : doc_len;
+    while (prefix < limit && base[prefix] == doc[prefix]) {
+        prefix++;
+    }
+    size_t suffix = 0;
+    while (suffix < limit - prefix && base[base_len - 1 - suffix] == doc[doc_len - 1 - suffix]) {
+        suffix++;
+    }
+    size_t deleted = base_len - prefix - suffix;
+    size_t inserted = doc_len - prefix - suffix;
+    if (deleted == 0 && inserted == 0) {
+        return;
+    }
+
+    if (hub_mode == COLLAB_OT) {
+        // Made against base_rev; commit_change moves it past the rest
+        OtChange change = { 0 };
+        bool ok = true;
+        for (size_t i = 0; i < deleted && ok; i++) {
+            OtOp op = { .kind = OT_DELETE, .site = CRDT_HUB_SITE, .pos = prefix };
+            ok = ot_change_push(&change, &op);
+        }
+        for (size_t i = 0; i < inserted && ok; i++) {
+            OtOp op = { .kind = OT_INSERT, .site = CRDT_HUB_SITE, .pos = prefix + i, .ch = doc[prefix + i] };
+            ok = ot_change_push(&change, &op);
+        }
+        if (!ok || !commit_change(&change, base_rev, CRDT_HUB_SITE, -1)) {
+            fprintf(stderr, "Live session: could not merge an outside edit\n");
+        }
+        ot_change_free(&change);
+        return;
+    }
+
+    CrdtOp *ops = malloc((deleted + inserted) * sizeof(CrdtOp));
+    if (ops == NULL) {
+        return;
+    }
+    size_t count = 0;
+    for (size_t i = prefix; i < prefix + deleted; i++) {
+        // Characters the clients deleted as well need nothing more
+        if (crdt_delete_id(&session, base_ids[i], &ops[count])) {
+            count++;
+        }
+    }
+    CrdtId ref = prefix > 0 ? base_ids[prefix - 1] : (CrdtId){ CRDT_HEAD_SITE, 0 };
+    for (size_t i = prefix; i < prefix + inserted; i++) {
+        if (!crdt_insert_after(&session, ref, doc[i], &ops[count])) {
+            break;
+        }
+        ref = ops[count++].id;
+    }
+    broadcast(ops, count, -1);
+    free(ops);
+}
+
+// Bring the document and the session together under the document's
+// write lock, as a user without priority: merge edits made there since
+// the last sync, then log the session's text over it. Returns false if
+// the lock was not free; the hub tries again later.
+static bool sync_document(void) {
+    if (!rwlock_write_lock(&lock_info->rwlock, false, COLLAB_LOCK_TIMEOUT_MS)) {
+        return false;
+    }
+    int range;
+    if (!lock_document_range(RANGE_WRITE, false, COLLAB_LOCK_TIMEOUT_MS, &range)) {
+        rwlock_write_unlock(&lock_info->rwlock);
+        return false;
+    }
+
+    size_t doc_len, len;
+    CrdtId *ids = NULL;
+    char *text = NULL;
+    char *doc = read_document(&doc_len);
+    bool ok = doc != NULL;
+    if (ok) {
+        merge_outside_edit(doc, doc_len);
+        text = session_text(&len, &ids);
+        ok = text != NULL && oplog_append_edit(SHARED_DOC, doc, doc_len, text, len, COLLAB_USER);
+    }
+    if (ok) {
+        if (len != doc_len || memcmp(text, doc, len) != 0) {
+            atomic_fetch_add(&lock_info->doc_version, 1);
+        }
+        set_base(text, ids, len);
+        dirty = false;
+        clock_gettime(CLOCK_MONOTONIC, &last_sync);
+    } else {
+        free(text);
+        free(ids);
+        fprintf(stderr, "Live session: could not write the document, will retry\n");
+    }
+    synced_version = atomic_load(&lock_info->doc_version);
+    free(doc);
+
+    range_unlock(&doc_tables->ranges, range);
+    rwlock_write_unlock(&lock_info->rwlock);
+    return ok;
+}
+
+static void accept_client(int listen_fd) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if (client_count == COLLAB_MAX_CLIENTS || (!in_session && !start_session())) {
+        close(fd);
+        return;
+    }
+
+    Client *client = &clients[client_count++];
+    memset(client, 0, sizeof(*client));
+    client->fd = fd;
+    client->site = next_site++;
+
+    if (hub_mode == COLLAB_OT) {
+        // Site and revision, then the text at that revision
+        OtOp welcome = { .kind = OT_WELCOME, .site = client->site, .revision = ot_revision,
+                         .pos = ot_text.len };
+        if (!queue_bytes(client, &welcome, RECORD_SIZE) || !queue_bytes(client, ot_text.buf, ot_text.len)) {
+            client->failed = true;
+        }
+        return;
+    }
+
+    // The session so far, then the client's site
+    size_t count;
+    CrdtOp *ops = crdt_snapshot(&session, &count);
+    CrdtOp welcome = { .kind = CRDT_WELCOME, .id = { client->site, session.clock } };
+    if (ops == NULL || !queue_bytes(client, ops, count * RECORD_SIZE) ||
+        !queue_bytes(client, &welcome, RECORD_SIZE)) {
+        client->failed = true;
+    }
+    free(ops);
+}
+
+// CRDT: apply the client's operations and pass on those that changed
+// the text
+static bool receive_crdt_ops(int i, CrdtOp *ops, size_t count) {
+    size_t applied = 0;
+    for (size_t k = 0; k < count; k++) {
+        if (ops[k].kind != CRDT_INSERT && ops[k].kind != CRDT_DELETE) {
+            return false;
+        }
+        if (ops[k].kind == CRDT_INSERT && ops[k].id.site != clients[i].site) {
+            return false;  // Clients only create elements of their own site
+        }
+        // Operations that changed nothing here change nothing elsewhere
+        if (crdt_apply(&session, &ops[k]) >= 0) {
+            ops[applied++] = ops[k];
+        }
+    }
+    if (applied > 0) {
+        broadcast(ops, applied, i);
+        session_ops += applied;
+        dirty = true;
+        clock_gettime(CLOCK_MONOTONIC, &last_op);
+    }
+    return true;
+}
+
+// OT: collect the client's change and commit it at its OT_COMMIT
+static bool receive_ot_ops(int i, OtOp *ops, size_t count) {
+    Client *client = &clients[i];
+    for (size_t k = 0; k < count; k++) {
+        if (ops[k].kind != OT_COMMIT) {
+            ops[k].site = client->site;
+            if (!ot_change_push(&client->pending, &ops[k])) {
+                return false;
+            }
+            continue;
+        }
+        if (ops[k].revision > ot_revision ||
+            !commit_change(&client->pending, ops[k].revision, client->site, i)) {
+            return false;
+        }
+        dirty = true;
+        clock_gettime(CLOCK_MONOTONIC, &last_op);
+    }
+    return true;
+}
+
+// Handle the complete records a client has sent. Returns false when the
+// client has gone or sent something invalid.
+static bool read_client(int i) {
+    Client *client = &clients[i];
+    ssize_t n = read(client->fd, client->in + client->in_len, sizeof(client->in) - client->in_len);
+    if (n <= 0) {
+        return n < 0 && errno == EINTR;
+    }
+    client->in_len += n;
+
+    size_t count = client->in_len / RECORD_SIZE;
+    union {
+        CrdtOp crdt[sizeof(client->in) / RECORD_SIZE];
+        OtOp ot[sizeof(client->in) / RECORD_SIZE];
+    } records;
+    memcpy(&records, client->in, count * RECORD_SIZE);
+    client->in_len -= count * RECORD_SIZE;
+    memmove(client->in, client->in + count * RECORD_SIZE, client->in_len);
+
+    if (hub_mode == COLLAB_OT) {
+        return receive_ot_ops(i, records.ot, count);
+    }
+    return receive_crdt_ops(i, records.crdt, count);
+}
+
+static void hub_main(int stop_fd) {
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", COLLAB_SOCKET);
+    unlink(COLLAB_SOCKET);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, COLLAB_MAX_CLIENTS) == -1) {
+        fprintf(stderr, "Live session: cannot listen on %s: %s\n", COLLAB_SOCKET, strerror(errno));
+        return;
+    }
+    chmod(COLLAB_SOCKET, 0666);
+
+    for (;;) {
+        struct pollfd fds[COLLAB_MAX_CLIENTS + 2];
+        fds[0] = (struct pollfd){ .fd = stop_fd, .events = POLLIN };
+        fds[1] = (struct pollfd){ .fd = listen_fd, .events = POLLIN };
+        for (int i = 0; i < client_count; i++) {
+            fds[i + 2] = (struct pollfd){ .fd = clients[i].fd,
+                                          .events = POLLIN | (clients[i].out_len ? POLLOUT : 0) };
+        }
+        int polled = client_count;
+        if (poll(fds, polled + 2, in_session ? COLLAB_FLUSH_MS : -1) < 0 && errno != EINTR) {
+            perror("Live session: poll");
+            break;
+        }
+        if (fds[0].revents) {
+            break;  // The owner closed its end of the pipe, or exited
+        }
+
+        // Clients only leave in the sweep below, so indexes stay valid
+        for (int i = 0; i < polled; i++) {
+            short revents = fds[i + 2].revents;
+            if (clients[i].failed) {
+                continue;
+            }
+            if ((revents & POLLOUT) && !flush_client(&clients[i])) {
+                clients[i].failed = true;
+            } else if ((revents & (POLLIN | POLLHUP | POLLERR)) && !read_client(i)) {
+                clients[i].failed = true;
+            }
+        }
+        for (int i = client_count - 1; i >= 0; i--) {
+            if (clients[i].failed) {
+                drop_client(i);
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            accept_client(listen_fd);
+        }
+
+        if (!in_session) {
+            continue;
+        }
+        bool outside = atomic_load(&lock_info->doc_version) != synced_version;
+        bool quiet = ms_since(&last_op) >= COLLAB_FLUSH_MS || client_count == 0;
+        if ((dirty && (quiet || ms_since(&last_sync) >= COLLAB_SYNC_MAX_MS)) || outside) {
+            sync_document();
+        }
+        if (client_count == 0 && !dirty) {
+            end_session();
+        }
+    }
+
+    while (client_count > 0) {
+        drop_client(client_count - 1);
+    }
+    for (int tries = 0; in_session && dirty && tries < COLLAB_STOP_TRIES; tries++) {
+        sync_document();
+    }
+    if (in_session && dirty) {
+        fprintf(stderr, "Live session: document locked, last edits were not saved\n");
+    }
+    close(listen_fd);
+    unlink(COLLAB_SOCKET);
+}
+
+// Fork the selected document's hub, in COLLAB_CRDT or COLLAB_OT mode. It
+// serves until collab_hub_stop(), or until the owner exits and the stop
+// pipe closes with it.
+bool collab_hub_start(int mode) {
+    int slot = current_doc.slot;
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        perror("Failed to create live session pipe");
+        return false;
+    }
+
+    hub_mode = mode;
+    fflush(NULL);  // Or the hub would repeat the owner's buffered output
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Failed to start live session hub");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(pipe_fds[1]);
+        // Other documents' hubs must see their pipes close with the owner
+        for (int i = 0; i < REGISTRY_MAX_DOCS; i++) {
+            if (hub_pids[i] > 0) {
+                close(hub_stop_fds[i]);
+            }
+        }
+        // The hub takes locks as a plain user and gives them up on its own
+        signal(PRIORITY_SIGNAL, SIG_IGN);
+        signal(LOCK_STATE_SIGNAL, SIG_IGN);
+        signal(SIGINT, SIG_IGN);
+        hub_main(pipe_fds[0]);
+        fflush(NULL);
+        _exit(0);
+    }
+
+    close(pipe_fds[0]);
+    hub_pids[slot] = pid;
+    hub_stop_fds[slot] = pipe_fds[1];
+    printf("Live editing hub (%s) for %s started with PID: %d\n", mode == COLLAB_OT ? "OT" : "CRDT",
+           SHARED_DOC, pid);
+    return true;
+}
+
+// Ask the selected document's hub to write back the session and wait for
+// it to exit. Later children hold the pipe open too, so a byte tells it to stop.
+void collab_hub_stop(void) {
+    int slot = current_doc.slot;
+    if (hub_pids[slot] <= 0) {
+        return;
+    }
+    if (write(hub_stop_fds[slot], "", 1) == -1) {
+        perror("Live session: stop");
+    }
+    close(hub_stop_fds[slot]);
+    waitpid(hub_pids[slot], NULL, 0);
+    hub_pids[slot] = 0;
+}
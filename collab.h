@@ -0,0 +1,40 @@
+// collab.h
+// Live editing hub. The owner runs it in a child process listening on
+// COLLAB_SOCKET; `myapp --collab` clients type into their own copy of
+// the text and send the operations to the hub, which applies them to its
+// copy and passes them on to every other client. Nobody waits for a
+// lock while typing. The hub writes the merged text into the document
+// once the session goes quiet, and edits made there through the locks
+// are merged back into the session as operations of its own.
+//
+// The hub merges concurrent edits with a sequence CRDT (crdt.h) or, with
+// `owner --ot`, by operational transformation against an authoritative
+// text and revision number (ot.h).
+
+#ifndef COLLAB_H
+#define COLLAB_H
+
+#include <stdbool.h>
+
+#define COLLAB_CRDT 0   // Hub modes
+#define COLLAB_OT 1
+
+#define COLLAB_MAX_CLIENTS 32
+#define COLLAB_EDITOR "./myapp"          // Client run by "Edit live with others"
+#define COLLAB_USER "live-session"       // Author of the hub's log records
+
+// The document is written back after this long without operations, and
+// at least this often while they keep coming
+#define COLLAB_FLUSH_MS 1000
+#define COLLAB_SYNC_MAX_MS 5000
+// How long the hub waits for the document locks before trying later
+#define COLLAB_LOCK_TIMEOUT_MS 200
+// Attempts to write back the session when the hub is stopped
+#define COLLAB_STOP_TRIES 25
+// A client that falls this far behind on reading is disconnected
+#define COLLAB_OUT_MAX (4 * 1024 * 1024)
+
+bool collab_hub_start(int mode);
+void collab_hub_stop(void);
+
+#endif // COLLAB_H
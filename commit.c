@@ -0,0 +1,161 @@
+// commit.c
+// Atomic write-to-temp + flush + rename + directory fsync, with group
+// commit so that several files pay for a single flush.
+
+#define _GNU_SOURCE  // syncfs
+#include "commit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+// Directory part of path, e.g. "." for "shared_docs.txt"
+static void dir_of(const char *path, char *dir, size_t size) {
+    char copy[COMMIT_PATH_MAX];
+    snprintf(copy, sizeof(copy), "%s", path);
+    snprintf(dir, size, "%s", dirname(copy));
+}
+
+static bool write_iov(int fd, const struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        const char *data = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        while (len > 0) {
+            ssize_t n = write(fd, data, len);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += n;
+            len -= n;
+        }
+    }
+    return true;
+}
+
+void commit_group_init(CommitGroup *group) {
+    group->count = 0;
+}
+
+// Write the new contents of path to a temporary file next to it. Nothing
+// is visible at path until commit_group_finish().
+bool commit_group_add(CommitGroup *group, const char *path, const struct iovec *iov, int iovcnt) {
+    if (group->count >= COMMIT_MAX_FILES || strlen(path) + 8 >= COMMIT_PATH_MAX) {
+        fprintf(stderr, "Error: Cannot add %s to commit group.\n", path);
+        return false;
+    }
+
+    // "dir/name" becomes "dir/.name.XXXXXX", on the same filesystem as path
+    char *temp = group->temps[group->count];
+    const char *slash = strrchr(path, '/');
+    size_t dir_len = slash ? (size_t)(slash - path + 1) : 0;
+    memcpy(temp, path, dir_len);
+    snprintf(temp + dir_len, COMMIT_PATH_MAX - dir_len, ".%s.XXXXXX", path + dir_len);
+
+    int fd = mkstemp(temp);
+    if (fd == -1) {
+        perror("Failed to create temporary file for commit");
+        return false;
+    }
+
+    // Keep the permissions of the file being replaced
+    struct stat st;
+    fchmod(fd, stat(path, &st) == 0 ? (st.st_mode & 0777) : 0644);
+
+    if (!write_iov(fd, iov, iovcnt)) {
+        perror("Failed to write temporary file for commit");
+        close(fd);
+        unlink(temp);
+        return false;
+    }
+
+    snprintf(group->targets[group->count], COMMIT_PATH_MAX, "%s", path);
+    group->fds[group->count] = fd;
+    group->count++;
+    return true;
+}
+
+// Make every file in the group durable, then swap them all into place
+bool commit_group_finish(CommitGroup *group) {
+    bool ok = true;
+
+    // One file: flush just its data. Several: one syncfs covers them all
+    // (they share a directory, or at worst a filesystem).
+    if (group->count == 1) {
+        ok = fdatasync(group->fds[0]) == 0;
+    } else if (group->count > 1 && syncfs(group->fds[0]) == -1) {
+        for (int i = 0; i < group->count && ok; i++) {
+            ok = fdatasync(group->fds[i]) == 0;
+        }
+    }
+    for (int i = 0; i < group->count; i++) {
+        close(group->fds[i]);
+    }
+    if (!ok) {
+        perror("Failed to flush commit");
+        for (int i = 0; i < group->count; i++) {
+            unlink(group->temps[i]);
+        }
+        group->count = 0;
+        return false;
+    }
+
+    for (int i = 0; i < group->count; i++) {
+        if (rename(group->temps[i], group->targets[i]) == -1) {
+            perror("Failed to rename committed file into place");
+            unlink(group->temps[i]);
+            ok = false;
+        }
+    }
+
+    // Persist the renames: fsync each distinct directory once
+    for (int i = 0; i < group->count; i++) {
+        char dir[COMMIT_PATH_MAX], other[COMMIT_PATH_MAX];
+        bool seen = false;
+        dir_of(group->targets[i], dir, sizeof(dir));
+        for (int j = 0; j < i && !seen; j++) {
+            dir_of(group->targets[j], other, sizeof(other));
+            seen = strcmp(dir, other) == 0;
+        }
+        if (seen) {
+            continue;
+        }
+
+        int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+        if (dir_fd == -1 || fsync(dir_fd) == -1) {
+            perror("Failed to sync directory after commit");
+            ok = false;
+        }
+        if (dir_fd != -1) {
+            close(dir_fd);
+        }
+    }
+
+    group->count = 0;
+    return ok;
+}
+
+void commit_group_abort(CommitGroup *group) {
+    for (int i = 0; i < group->count; i++) {
+        close(group->fds[i]);
+        unlink(group->temps[i]);
+    }
+    group->count = 0;
+}
+
+bool commit_filev(const char *path, const struct iovec *iov, int iovcnt) {
+    CommitGroup group;
+    commit_group_init(&group);
+    return commit_group_add(&group, path, iov, iovcnt) && commit_group_finish(&group);
+}
+
+bool commit_file(const char *path, const char *data, size_t len) {
+    struct iovec iov = { (void *)data, len };
+    return commit_filev(path, &iov, 1);
+}
@@ -0,0 +1,34 @@
+// commit.h
+// Crash-safe replacement of whole files: new contents go to a temporary
+// file in the same directory, are flushed to disk and then renamed over
+// the target, so anyone opening the target sees either the old or the
+// new version in full, never a partial one.
+
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define COMMIT_MAX_FILES 16
+#define COMMIT_PATH_MAX 256
+
+// Several files committed together share one flush of their data and one
+// fsync per directory, instead of paying for both on every file
+typedef struct {
+    int count;
+    int fds[COMMIT_MAX_FILES];
+    char targets[COMMIT_MAX_FILES][COMMIT_PATH_MAX];
+    char temps[COMMIT_MAX_FILES][COMMIT_PATH_MAX];
+} CommitGroup;
+
+void commit_group_init(CommitGroup *group);
+bool commit_group_add(CommitGroup *group, const char *path, const struct iovec *iov, int iovcnt);
+bool commit_group_finish(CommitGroup *group);
+void commit_group_abort(CommitGroup *group);
+
+bool commit_file(const char *path, const char *data, size_t len);
+bool commit_filev(const char *path, const struct iovec *iov, int iovcnt);
+
+#endif // COMMIT_H
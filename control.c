@@ -0,0 +1,386 @@
+// control.c
+// Control file. The request server maps the whole file and keeps the
+// indexes of free records in memory; a removed user's record is reused by
+// the next add, and the file grows by doubling when none is free, so an
+// add, update or remove writes one record and the header. Only record 0,
+// the admin, is never removed.
+
+#define _GNU_SOURCE  // mremap
+#include "control.h"
+#include "commit.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CONTROL_MIN_RECORDS 64
+#define CONTROL_READ_TRIES 1000   // Before a record with an odd seq counts as torn
+
+static ControlHeader *header = NULL;  // Start of the server's mapping
+static ControlRecord *records = NULL;
+static size_t map_size = 0;
+static int control_fd = -1;
+static uint32_t *free_records = NULL;
+static size_t free_count = 0;
+static size_t free_cap = 0;
+
+static size_t file_size(uint32_t count) {
+    return sizeof(ControlHeader) + (size_t)count * sizeof(ControlRecord);
+}
+
+static uint64_t record_hash(const ControlRecord *record) {
+    uint64_t hash = 14695981039346656037ull;  // FNV-1a over the fields that matter
+    const unsigned char *parts[] = {
+        (const unsigned char *)&record->used, (const unsigned char *)record->name,
+        (const unsigned char *)&record->priority, (const unsigned char *)&record->access_type,
+    };
+    size_t sizes[] = { sizeof(record->used), sizeof(record->name),
+                       sizeof(record->priority), sizeof(record->access_type) };
+    for (int p = 0; p < 4; p++) {
+        for (size_t i = 0; i < sizes[p]; i++) {
+            hash = (hash ^ parts[p][i]) * 1099511628211ull;
+        }
+    }
+    return record->used ? hash : 0;
+}
+
+static void record_from_user(ControlRecord *record, const UserRecord *user) {
+    memset(record->name, 0, sizeof(record->name));
+    snprintf(record->name, sizeof(record->name), "%s", user->name);
+    record->priority = user->priority;
+    record->access_type = user->access_type;
+    record->pid = user->pid;
+}
+
+// Copy a record that may be being written. False if it stays torn, which
+// only happens when its writer died halfway.
+static bool read_record(const ControlRecord *record, ControlRecord *copy) {
+    for (int tries = 0; tries < CONTROL_READ_TRIES; tries++) {
+        uint32_t seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy((char *)copy + sizeof(copy->seq), (const char *)record + sizeof(record->seq),
+               sizeof(*copy) - sizeof(copy->seq));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&record->seq, memory_order_relaxed) == seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// count is the header's record count as the caller read it, once
+static bool valid_header(const ControlHeader *h, uint32_t count, size_t size) {
+    return size >= sizeof(ControlHeader) && h->magic == CONTROL_MAGIC &&
+           h->version == CONTROL_VERSION && h->record_size == sizeof(ControlRecord) &&
+           count > 0 && file_size(count) <= size;
+}
+
+// Write a new file in one go: the admin first, then the other users
+bool control_create(const char *path, const char *document, const UserRecord *users, size_t count) {
+    size_t size = file_size(count);
+    char *data = calloc(1, size);
+    if (data == NULL) {
+        return false;
+    }
+    ControlHeader *h = (ControlHeader *)data;
+    ControlRecord *r = (ControlRecord *)(data + sizeof(ControlHeader));
+    h->magic = CONTROL_MAGIC;
+    h->version = CONTROL_VERSION;
+    h->record_size = sizeof(ControlRecord);
+    h->count = count;
+    snprintf(h->document, sizeof(h->document), "%s", document);
+    for (size_t i = 0; i < count; i++) {
+        r[i].used = 1;
+        record_from_user(&r[i], &users[i]);
+        h->checksum ^= record_hash(&r[i]);
+    }
+    bool ok = commit_file(path, data, size);
+    free(data);
+    return ok;
+}
+
+// Read the old text format: document, "admin priority access [pid]", the
+// number of other users, then one "name priority access [pid]" line each.
+// Returns the users with the admin first, or NULL.
+UserRecord *control_parse_text(const char *text_path, size_t *count) {
+    FILE *file = fopen(text_path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    char line[256];
+    long others = 0;
+    UserRecord admin = { 0 };
+    if (!fgets(line, sizeof(line), file) || !fgets(line, sizeof(line), file) ||
+        sscanf(line, "%49s %d %d", admin.name, &admin.priority, &admin.access_type) != 3) {
+        fclose(file);
+        return NULL;
+    }
+    if (fgets(line, sizeof(line), file)) {
+        sscanf(line, "%ld", &others);
+    }
+    size_t cap = 64, n = 0;
+    UserRecord *users = malloc(cap * sizeof(UserRecord));
+    if (users == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    users[n++] = admin;
+    for (long i = 0; i < others && fgets(line, sizeof(line), file); i++) {
+        UserRecord user = { 0 };
+        if (sscanf(line, "%49s %d %d", user.name, &user.priority, &user.access_type) != 3) {
+            continue;
+        }
+        if (n == cap) {
+            UserRecord *grown = realloc(users, cap * 2 * sizeof(UserRecord));
+            if (grown == NULL) {
+                free(users);
+                fclose(file);
+                return NULL;
+            }
+            users = grown;
+            cap *= 2;
+        }
+        users[n++] = user;
+    }
+    fclose(file);
+    *count = n;
+    return users;
+}
+
+// Print the file in the text format, readable by control_parse_text(). It
+// may be dumped while the server is changing it.
+bool control_dump(const char *path, FILE *out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ControlHeader)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    const ControlHeader *h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        return false;
+    }
+    // The owner may add a record meanwhile, growing the file past our
+    // mapping and then raising the count: read the count once and use
+    // only that value, checked against the size mapped
+    uint32_t count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+    if (!valid_header(h, count, st.st_size)) {
+        munmap((void *)h, st.st_size);
+        return false;
+    }
+    const ControlRecord *r = (const ControlRecord *)(h + 1);
+    ControlRecord *copies = malloc(count * sizeof(ControlRecord));
+    if (copies == NULL) {
+        munmap((void *)h, st.st_size);
+        return false;
+    }
+    uint64_t checksum = 0;
+    uint32_t others = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!read_record(&r[i], &copies[i])) {
+            fprintf(stderr, "Control file record %u is torn; skipped.\n", i);
+            copies[i].used = 0;
+        }
+        copies[i].name[sizeof(copies[i].name) - 1] = '\0';
+        checksum ^= record_hash(&copies[i]);
+        others += i > 0 && copies[i].used;
+    }
+    if (checksum != h->checksum) {
+        fprintf(stderr, "Control file checksum does not match; it may be changing or damaged.\n");
+    }
+
+    fprintf(out, "%.*s\n", CONTROL_DOC_MAX, h->document);
+    fprintf(out, "%s %d %d %d\n", copies[0].name, copies[0].priority, copies[0].access_type, copies[0].pid);
+    fprintf(out, "%u\n", others);
+    for (uint32_t i = 1; i < count; i++) {
+        if (copies[i].used) {
+            fprintf(out, "%s %d %d %d\n", copies[i].name, copies[i].priority,
+                    copies[i].access_type, copies[i].pid);
+        }
+    }
+    free(copies);
+    munmap((void *)h, st.st_size);
+    return true;
+}
+
+static bool map_file(size_t size) {
+    void *map = header == NULL ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, control_fd, 0)
+                               : mremap(header, map_size, size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    header = map;
+    records = (ControlRecord *)(header + 1);
+    map_size = size;
+    return true;
+}
+
+// Flush the pages under [addr, addr + len) to disk
+static bool sync_range(const void *addr, size_t len) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr & ~(page - 1);
+    return msync((void *)start, (uintptr_t)addr + len - start, MS_SYNC) == 0;
+}
+
+static bool push_free(uint32_t index) {
+    if (free_count == free_cap) {
+        size_t cap = free_cap ? free_cap * 2 : 64;
+        uint32_t *grown = realloc(free_records, cap * sizeof(uint32_t));
+        if (grown == NULL) {
+            return false;
+        }
+        free_records = grown;
+        free_cap = cap;
+    }
+    free_records[free_count++] = index;
+    return true;
+}
+
+// Map the file for updating in place. A record left half-written by a
+// crash is kept as it is, and the checksum is brought back in line.
+bool control_open(const char *path) {
+    control_fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (control_fd == -1 || fstat(control_fd, &st) == -1 || !map_file(st.st_size)) {
+        control_close();
+        return false;
+    }
+    if (!valid_header(header, header->count, st.st_size)) {
+        fprintf(stderr, "%s is not a control file of this version.\n", path);
+        control_close();
+        return false;
+    }
+    uint64_t checksum = 0;
+    for (uint32_t i = 0; i < header->count; i++) {
+        uint32_t seq = atomic_load(&records[i].seq);
+        if (seq & 1) {
+            atomic_store(&records[i].seq, seq + 1);
+        }
+        records[i].name[sizeof(records[i].name) - 1] = '\0';
+        checksum ^= record_hash(&records[i]);
+        if (!records[i].used && !push_free(i)) {
+            control_close();
+            return false;
+        }
+    }
+    if (checksum != header->checksum) {
+        fprintf(stderr, "%s: checksum does not match; a write was cut short.\n", path);
+        header->checksum = checksum;
+    }
+    return true;
+}
+
+void control_close(void) {
+    if (header != NULL) {
+        munmap(header, map_size);
+        header = NULL;
+        records = NULL;
+        map_size = 0;
+    }
+    if (control_fd != -1) {
+        close(control_fd);
+        control_fd = -1;
+    }
+    free(free_records);
+    free_records = NULL;
+    free_count = free_cap = 0;
+}
+
+uint32_t control_count(void) {
+    return header ? header->count : 0;
+}
+
+// False if the record is free
+bool control_read(uint32_t index, UserRecord *user) {
+    ControlRecord copy;
+    if (header == NULL || index >= header->count || !read_record(&records[index], &copy) || !copy.used) {
+        return false;
+    }
+    memset(user, 0, sizeof(*user));
+    memcpy(user->name, copy.name, sizeof(user->name));
+    user->priority = copy.priority;
+    user->access_type = copy.access_type;
+    user->pid = copy.pid;
+    user->record = index;
+    return true;
+}
+
+// Write one record under its seq and fold the change into the checksum
+static bool write_record(uint32_t index, const UserRecord *user, bool sync) {
+    ControlRecord *record = &records[index];
+    uint64_t old_hash = record_hash(record);
+    atomic_fetch_add_explicit(&record->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    if (user != NULL) {
+        record->used = 1;
+        record_from_user(record, user);
+    } else {
+        memset((char *)record + sizeof(record->seq), 0, sizeof(*record) - sizeof(record->seq));
+    }
+    atomic_fetch_add_explicit(&record->seq, 1, memory_order_release);
+    header->checksum ^= old_hash ^ record_hash(record);
+    return !sync || (sync_range(record, sizeof(*record)) && sync_range(header, sizeof(*header)));
+}
+
+// Store a new user in a free record, growing the file if there is none.
+// Sets user->record.
+bool control_add(UserRecord *user) {
+    uint32_t index;
+    if (header == NULL) {
+        return false;
+    }
+    if (free_count > 0) {
+        index = free_records[--free_count];
+    } else {
+        index = header->count;
+        size_t needed = file_size(index + 1);
+        if (needed > map_size) {
+            uint32_t capacity = index < CONTROL_MIN_RECORDS ? CONTROL_MIN_RECORDS : index * 2;
+            if (ftruncate(control_fd, file_size(capacity)) == -1 || !map_file(file_size(capacity))) {
+                return false;
+            }
+        }
+        __atomic_store_n(&header->count, index + 1, __ATOMIC_RELEASE);  // After the file has grown
+    }
+    user->record = index;
+    if (!write_record(index, user, true)) {
+        write_record(index, NULL, false);
+        push_free(index);
+        return false;
+    }
+    return true;
+}
+
+// Sync for changes the admin made; PIDs are only written through
+bool control_update(const UserRecord *user, bool sync) {
+    if (header == NULL || user->record >= header->count) {
+        return false;
+    }
+    return write_record(user->record, user, sync);
+}
+
+bool control_remove(uint32_t index) {
+    if (header == NULL || index == 0 || index >= header->count) {
+        return false;
+    }
+    UserRecord old;
+    if (!control_read(index, &old)) {
+        return false;
+    }
+    if (!write_record(index, NULL, true)) {
+        write_record(index, &old, false);
+        return false;
+    }
+    push_free(index);
+    return true;
+}
@@ -0,0 +1,61 @@
+// control.h
+// Control file: the user table on disk, as a header and fixed-width
+// records that the request server maps and updates in place. A change
+// touches one record, and syncs only the pages it is on. Each record has
+// its own sequence counter, odd while the record is being written, so
+// another process reading the file while the server writes it (a dump,
+// say) sees either the old record or the new one.
+//
+// The header's checksum is the XOR of a hash of every record in use, so
+// it is updated with the record instead of recomputed; a mismatch on
+// opening means a write was cut short.
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "userdir.h"
+
+#define CONTROL_MAGIC 0x4C544344u  // "DCTL"
+#define CONTROL_VERSION 1
+#define CONTROL_DOC_MAX 40
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;      // sizeof(ControlRecord) when written
+    uint32_t count;            // Records in the file, in use or free
+    uint32_t pad;
+    uint64_t checksum;         // XOR of record_hash() of the records in use
+    char document[CONTROL_DOC_MAX];  // Document the users have access to
+} ControlHeader;
+
+typedef struct {
+    _Atomic uint32_t seq;      // Odd while the record is being written
+    uint32_t used;             // 0 for a free record, reused by the next add
+    char name[USERDIR_NAME_MAX];
+    char pad[2];
+    int32_t priority;
+    int32_t access_type;
+    int32_t pid;               // Not in the checksum: it changes at every login
+} ControlRecord;
+
+// Whole files, for the owner and tools
+bool control_create(const char *path, const char *document, const UserRecord *users, size_t count);
+UserRecord *control_parse_text(const char *text_path, size_t *count);
+bool control_dump(const char *path, FILE *out);
+
+// In place, for the request server only. The record index of each user
+// is kept in its UserRecord.
+bool control_open(const char *path);
+void control_close(void);
+uint32_t control_count(void);
+bool control_read(uint32_t index, UserRecord *user);
+bool control_add(UserRecord *user);
+bool control_update(const UserRecord *user, bool sync);
+bool control_remove(uint32_t index);
+
+#endif // CONTROL_H
@@ -0,0 +1,271 @@
+// crdt.c
+// RGA sequence. Elements sit in an array linked in document order, with
+// a hash from id to array index so remote operations find their element
+// in O(1). Positions are found by walking the list, which is linear in
+// the document but touches only a compact array.
+//
+// Concurrent inserts after the same element are ordered by id, larger
+// first: an insert skips every following element with a larger id. Those
+// include everything typed after them, since a later insert always gets a
+// larger clock, so each replica ends up with the same order.
+
+#include "crdt.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define CRDT_INITIAL 1024
+
+static bool id_equal(CrdtId a, CrdtId b) {
+    return a.site == b.site && a.clock == b.clock;
+}
+
+static bool id_greater(CrdtId a, CrdtId b) {
+    return a.clock > b.clock || (a.clock == b.clock && a.site > b.site);
+}
+
+static uint32_t id_hash(CrdtId id, uint32_t mask) {
+    uint64_t key = ((uint64_t)id.site << 32) | id.clock;
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+static int32_t lookup(const Crdt *crdt, CrdtId id) {
+    for (uint32_t h = id_hash(id, crdt->slot_mask); crdt->slots[h] >= 0; h = (h + 1) & crdt->slot_mask) {
+        if (id_equal(crdt->elems[crdt->slots[h]].id, id)) {
+            return crdt->slots[h];
+        }
+    }
+    return -1;
+}
+
+static void index_elem(Crdt *crdt, int32_t e) {
+    uint32_t h = id_hash(crdt->elems[e].id, crdt->slot_mask);
+    while (crdt->slots[h] >= 0) {
+        h = (h + 1) & crdt->slot_mask;
+    }
+    crdt->slots[h] = e;
+}
+
+// Room for one more element, keeping the hash at most half full
+static bool reserve(Crdt *crdt) {
+    if (crdt->count < crdt->capacity) {
+        return true;
+    }
+    uint32_t capacity = crdt->capacity * 2;
+    CrdtElem *elems = realloc(crdt->elems, capacity * sizeof(CrdtElem));
+    int32_t *slots = malloc(capacity * 2 * sizeof(int32_t));
+    if (elems == NULL || slots == NULL) {
+        if (elems != NULL) {
+            crdt->elems = elems;
+        }
+        free(slots);
+        return false;
+    }
+    crdt->elems = elems;
+    crdt->capacity = capacity;
+    free(crdt->slots);
+    crdt->slots = slots;
+    crdt->slot_mask = capacity * 2 - 1;
+    memset(slots, 0xff, capacity * 2 * sizeof(int32_t));
+    for (uint32_t e = 0; e < crdt->count; e++) {
+        index_elem(crdt, e);
+    }
+    return true;
+}
+
+void crdt_init(Crdt *crdt, uint32_t site) {
+    crdt->capacity = CRDT_INITIAL;
+    crdt->elems = malloc(crdt->capacity * sizeof(CrdtElem));
+    crdt->slots = malloc(crdt->capacity * 2 * sizeof(int32_t));
+    crdt->slot_mask = crdt->capacity * 2 - 1;
+    if (crdt->elems == NULL || crdt->slots == NULL) {
+        free(crdt->elems);
+        free(crdt->slots);
+        crdt->elems = NULL;
+        crdt->slots = NULL;
+        crdt->capacity = 0;
+        crdt->count = 0;
+        return;
+    }
+    memset(crdt->slots, 0xff, crdt->capacity * 2 * sizeof(int32_t));
+
+    crdt->elems[0] = (CrdtElem){ { CRDT_HEAD_SITE, 0 }, -1, 0, true };
+    crdt->count = 1;
+    index_elem(crdt, 0);
+    crdt->site = site;
+    crdt->clock = 0;
+    crdt->length = 0;
+}
+
+void crdt_free(Crdt *crdt) {
+    free(crdt->elems);
+    free(crdt->slots);
+    crdt->elems = NULL;
+    crdt->slots = NULL;
+    crdt->count = crdt->capacity = 0;
+    crdt->length = 0;
+}
+
+// Link a new element in after ref, past any concurrent inserts after ref
+// that win over it. Returns its index, or -1 when out of memory.
+static int32_t integrate(Crdt *crdt, int32_t ref, CrdtId id, char ch) {
+    if (!reserve(crdt)) {
+        return -1;
+    }
+    int32_t prev = ref;
+    int32_t next = crdt->elems[prev].next;
+    while (next >= 0 && id_greater(crdt->elems[next].id, id)) {
+        prev = next;
+        next = crdt->elems[next].next;
+    }
+
+    int32_t e = crdt->count++;
+    crdt->elems[e] = (CrdtElem){ id, next, ch, false };
+    crdt->elems[prev].next = e;
+    index_elem(crdt, e);
+    crdt->length++;
+    if (id.clock > crdt->clock) {
+        crdt->clock = id.clock;
+    }
+    return e;
+}
+
+// Element holding the visible character at pos; pos == -1 gives the head
+static int32_t elem_at(const Crdt *crdt, long pos) {
+    int32_t e = 0;
+    for (long seen = -1; seen < pos; ) {
+        e = crdt->elems[e].next;
+        if (e < 0) {
+            return -1;
+        }
+        if (!crdt->elems[e].deleted) {
+            seen++;
+        }
+    }
+    return e;
+}
+
+// Number of visible characters before element e
+static size_t visible_pos(const Crdt *crdt, int32_t e) {
+    size_t pos = 0;
+    for (int32_t i = crdt->elems[0].next; i >= 0 && i != e; i = crdt->elems[i].next) {
+        if (!crdt->elems[i].deleted) {
+            pos++;
+        }
+    }
+    return pos;
+}
+
+bool crdt_insert_after(Crdt *crdt, CrdtId ref, char ch, CrdtOp *op) {
+    int32_t r = lookup(crdt, ref);
+    if (r < 0) {
+        return false;
+    }
+    CrdtId id = { crdt->site, crdt->clock + 1 };
+    if (integrate(crdt, r, id, ch) < 0) {
+        return false;
+    }
+    *op = (CrdtOp){ .kind = CRDT_INSERT, .id = id, .ref = ref, .ch = ch };
+    return true;
+}
+
+// Insert ch so that it becomes the visible character at pos
+bool crdt_local_insert(Crdt *crdt, size_t pos, char ch, CrdtOp *op) {
+    if (pos > crdt->length) {
+        return false;
+    }
+    int32_t r = elem_at(crdt, (long)pos - 1);
+    return crdt_insert_after(crdt, crdt->elems[r].id, ch, op);
+}
+
+bool crdt_delete_id(Crdt *crdt, CrdtId id, CrdtOp *op) {
+    int32_t e = lookup(crdt, id);
+    if (e <= 0 || crdt->elems[e].deleted) {
+        return false;
+    }
+    crdt->elems[e].deleted = true;
+    crdt->length--;
+    *op = (CrdtOp){ .kind = CRDT_DELETE, .id = id };
+    return true;
+}
+
+bool crdt_local_delete(Crdt *crdt, size_t pos, CrdtOp *op) {
+    if (pos >= crdt->length) {
+        return false;
+    }
+    return crdt_delete_id(crdt, crdt->elems[elem_at(crdt, (long)pos)].id, op);
+}
+
+// Apply an operation from another replica. Returns the visible position
+// it changed, or -1 if the text did not change (a repeated operation, a
+// delete of a tombstone or an insert whose ref is unknown).
+long crdt_apply(Crdt *crdt, const CrdtOp *op) {
+    if (op->kind == CRDT_INSERT) {
+        if (lookup(crdt, op->id) >= 0) {
+            return -1;
+        }
+        int32_t r = lookup(crdt, op->ref);
+        if (r < 0) {
+            return -1;
+        }
+        int32_t e = integrate(crdt, r, op->id, op->ch);
+        return e < 0 ? -1 : (long)visible_pos(crdt, e);
+    }
+    if (op->kind == CRDT_DELETE) {
+        int32_t e = lookup(crdt, op->id);
+        if (e <= 0 || crdt->elems[e].deleted) {
+            return -1;
+        }
+        long pos = (long)visible_pos(crdt, e);
+        crdt->elems[e].deleted = true;
+        crdt->length--;
+        return pos;
+    }
+    return -1;
+}
+
+// The visible text, and with ids the id of each of its characters
+char *crdt_text(const Crdt *crdt, size_t *len, CrdtId **ids) {
+    char *text = malloc(crdt->length + 1);
+    CrdtId *id_list = ids ? malloc((crdt->length + 1) * sizeof(CrdtId)) : NULL;
+    if (text == NULL || (ids && id_list == NULL)) {
+        free(text);
+        free(id_list);
+        return NULL;
+    }
+    size_t n = 0;
+    for (int32_t e = crdt->elems[0].next; e >= 0; e = crdt->elems[e].next) {
+        if (!crdt->elems[e].deleted) {
+            if (id_list) {
+                id_list[n] = crdt->elems[e].id;
+            }
+            text[n++] = crdt->elems[e].ch;
+        }
+    }
+    text[n] = '\0';
+    *len = n;
+    if (ids) {
+        *ids = id_list;
+    }
+    return text;
+}
+
+// Operations that rebuild this replica from an empty one, tombstones
+// included so that later operations can refer to them
+CrdtOp *crdt_snapshot(const Crdt *crdt, size_t *count) {
+    CrdtOp *ops = malloc(2 * crdt->count * sizeof(CrdtOp));
+    if (ops == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    CrdtId prev = crdt->elems[0].id;
+    for (int32_t e = crdt->elems[0].next; e >= 0; e = crdt->elems[e].next) {
+        const CrdtElem *elem = &crdt->elems[e];
+        ops[n++] = (CrdtOp){ .kind = CRDT_INSERT, .id = elem->id, .ref = prev, .ch = elem->ch };
+        if (elem->deleted) {
+            ops[n++] = (CrdtOp){ .kind = CRDT_DELETE, .id = elem->id };
+        }
+        prev = elem->id;
+    }
+    *count = n;
+    return ops;
+}
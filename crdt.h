@@ -0,0 +1,66 @@
+// crdt.h
+// Replicated Growable Array (RGA): a sequence CRDT for live editing.
+// Every character gets a unique id (site, clock) and is inserted after
+// the character it was typed behind; deleted characters stay behind as
+// tombstones so later inserts can still refer to them. Replicas that have
+// applied the same operations hold the same text, whatever order the
+// concurrent ones arrived in.
+
+#ifndef CRDT_H
+#define CRDT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Operation kinds
+#define CRDT_INSERT 1   // ch goes in after ref with the given id
+#define CRDT_DELETE 2   // The element with the given id becomes a tombstone
+#define CRDT_WELCOME 3  // Hub to client: snapshot complete, id.site is the client's site
+
+#define CRDT_HEAD_SITE 0  // Site of the head element inserts at the start refer to
+#define CRDT_HUB_SITE 1   // Site of edits made by the hub itself
+
+typedef struct {
+    uint32_t site;   // Replica that created the element
+    uint32_t clock;  // Lamport clock of its creation
+} CrdtId;
+
+// Fixed-size operation, sent as-is over the hub's socket
+typedef struct {
+    uint32_t kind;
+    CrdtId id;
+    CrdtId ref;
+    char ch;
+    char pad[3];
+} CrdtOp;
+
+typedef struct {
+    CrdtId id;
+    int32_t next;    // Next element in document order, -1 at the end
+    char ch;
+    bool deleted;
+} CrdtElem;
+
+typedef struct {
+    CrdtElem *elems;   // elems[0] is the head; never shrinks (tombstones stay)
+    uint32_t count;
+    uint32_t capacity;
+    int32_t *slots;    // Open-addressing hash from element id to index, -1 if empty
+    uint32_t slot_mask;
+    uint32_t site;
+    uint32_t clock;    // Highest clock seen
+    size_t length;     // Visible characters
+} Crdt;
+
+void crdt_init(Crdt *crdt, uint32_t site);
+void crdt_free(Crdt *crdt);
+bool crdt_local_insert(Crdt *crdt, size_t pos, char ch, CrdtOp *op);
+bool crdt_local_delete(Crdt *crdt, size_t pos, CrdtOp *op);
+bool crdt_insert_after(Crdt *crdt, CrdtId ref, char ch, CrdtOp *op);
+bool crdt_delete_id(Crdt *crdt, CrdtId id, CrdtOp *op);
+long crdt_apply(Crdt *crdt, const CrdtOp *op);
+char *crdt_text(const Crdt *crdt, size_t *len, CrdtId **ids);
+CrdtOp *crdt_snapshot(const Crdt *crdt, size_t *count);
+
+#endif // CRDT_H
@@ -0,0 +1,234 @@
+// fuzz_crdt.c
+// Convergence fuzzer for the RGA CRDT. Several sites type and delete at
+// random on whatever text they have seen so far and send their operations
+// to a hub, which applies them and relays them to every other site in
+// the order they arrived, as the live editing hub does. Sites send and
+// catch up at random times, so most edits are concurrent with others.
+//
+// Every few hundred steps all sites are brought up to date and checked:
+// each site must hold the hub's text, and that text must match a plain
+// string edited at the positions crdt_apply() reported. At the end of a
+// run a replica rebuilt from the hub's snapshot must match too.
+//
+// Build: gcc -O2 -std=gnu11 -o fuzz_crdt fuzz_crdt.c crdt.c
+// Usage: fuzz_crdt [runs] [steps per run] [sites]
+
+#include "crdt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FUZZ_CHECK_EVERY 500   // Steps between convergence checks
+
+typedef struct {
+    CrdtOp op;
+    int from;            // Sending site, which already has the operation
+} Relayed;
+
+typedef struct {
+    Crdt crdt;
+    char *model;         // The text as the site's edits and crdt_apply() say it is
+    size_t model_len;
+    CrdtOp *outbox;      // Operations not yet sent to the hub
+    size_t sent;
+    size_t queued;
+    size_t delivered;    // Hub log entries seen
+} Site;
+
+static Crdt hub;
+static Relayed *hub_log;
+static size_t hub_log_len;
+static Site *sites;
+static int site_count;
+
+static void model_insert(Site *site, size_t pos, char ch) {
+    memmove(site->model + pos + 1, site->model + pos, site->model_len - pos);
+    site->model[pos] = ch;
+    site->model_len++;
+}
+
+static void model_delete(Site *site, size_t pos) {
+    memmove(site->model + pos, site->model + pos + 1, site->model_len - pos - 1);
+    site->model_len--;
+}
+
+// A random insert or delete at a random place in the site's text
+static bool local_edit(Site *site) {
+    CrdtOp op;
+    if (site->crdt.length == 0 || rand() % 3 != 0) {
+        size_t pos = rand() % (site->crdt.length + 1);
+        char ch = 'a' + rand() % 26;
+        if (!crdt_local_insert(&site->crdt, pos, ch, &op)) {
+            return false;
+        }
+        model_insert(site, pos, ch);
+    } else {
+        size_t pos = rand() % site->crdt.length;
+        if (!crdt_local_delete(&site->crdt, pos, &op)) {
+            return false;
+        }
+        model_delete(site, pos);
+    }
+    site->outbox[site->queued++] = op;
+    return true;
+}
+
+// Hand the site's oldest unsent operation to the hub
+static void send_one(int s) {
+    Site *site = &sites[s];
+    if (site->sent < site->queued) {
+        CrdtOp *op = &site->outbox[site->sent++];
+        crdt_apply(&hub, op);
+        hub_log[hub_log_len++] = (Relayed){ *op, s };
+    }
+}
+
+// Apply what the hub has relayed since the site last looked
+static void catch_up(int s) {
+    Site *site = &sites[s];
+    while (site->delivered < hub_log_len) {
+        const Relayed *relayed = &hub_log[site->delivered++];
+        if (relayed->from == s) {
+            continue;
+        }
+        long pos = crdt_apply(&site->crdt, &relayed->op);
+        if (pos < 0) {
+            continue;
+        }
+        if (relayed->op.kind == CRDT_INSERT) {
+            model_insert(site, pos, relayed->op.ch);
+        } else {
+            model_delete(site, pos);
+        }
+    }
+}
+
+// Bring every site up to date and compare them all with the hub; with
+// rebuild, also a replica that starts from the hub's snapshot
+static bool converged(bool rebuild) {
+    for (int s = 0; s < site_count; s++) {
+        while (sites[s].sent < sites[s].queued) {
+            send_one(s);
+        }
+    }
+    size_t hub_len;
+    char *hub_text = crdt_text(&hub, &hub_len, NULL);
+    bool ok = hub_text != NULL;
+    for (int s = 0; ok && s < site_count; s++) {
+        catch_up(s);
+        size_t len;
+        char *text = crdt_text(&sites[s].crdt, &len, NULL);
+        if (text == NULL || len != hub_len || memcmp(text, hub_text, len) != 0) {
+            printf("site %d does not match the hub\n", s);
+            ok = false;
+        } else if (sites[s].model_len != len || memcmp(sites[s].model, text, len) != 0) {
+            printf("site %d: positions reported by crdt_apply() do not match its text\n", s);
+            ok = false;
+        }
+        free(text);
+    }
+
+    // A client joining now starts from the hub's snapshot
+    size_t count;
+    CrdtOp *ops = ok && rebuild ? crdt_snapshot(&hub, &count) : NULL;
+    if (ok && ops != NULL) {
+        Crdt joined;
+        crdt_init(&joined, site_count + 2);
+        for (size_t i = 0; i < count; i++) {
+            crdt_apply(&joined, &ops[i]);
+        }
+        size_t len;
+        char *text = crdt_text(&joined, &len, NULL);
+        if (text == NULL || len != hub_len || memcmp(text, hub_text, len) != 0) {
+            printf("a replica rebuilt from the snapshot does not match the hub\n");
+            ok = false;
+        }
+        free(text);
+        crdt_free(&joined);
+    }
+    free(ops);
+    free(hub_text);
+    return ok;
+}
+
+static bool run(unsigned seed, int steps) {
+    srand(seed);
+    crdt_init(&hub, CRDT_HUB_SITE);
+    hub_log_len = 0;
+    for (int s = 0; s < site_count; s++) {
+        Site *site = &sites[s];
+        crdt_init(&site->crdt, CRDT_HUB_SITE + 1 + s);
+        site->model_len = site->sent = site->queued = site->delivered = 0;
+    }
+
+    bool ok = true;
+    for (int step = 1; ok && step <= steps; step++) {
+        int s = rand() % site_count;
+        int action = rand() % 10;
+        if (action < 5) {
+            ok = local_edit(&sites[s]);
+            if (!ok) {
+                printf("site %d: local edit failed\n", s);
+            }
+        } else if (action < 8) {
+            send_one(s);
+        } else {
+            catch_up(s);
+        }
+        if (ok && (step % FUZZ_CHECK_EVERY == 0 || step == steps)) {
+            ok = converged(step == steps);
+        }
+    }
+    if (ok) {
+        printf("seed %u: %zu characters, %u elements, %zu operations relayed\n",
+               seed, hub.length, hub.count, hub_log_len);
+    } else {
+        printf("seed %u: FAILED\n", seed);
+    }
+
+    crdt_free(&hub);
+    for (int s = 0; s < site_count; s++) {
+        crdt_free(&sites[s].crdt);
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    int runs = argc > 1 ? atoi(argv[1]) : 20;
+    int steps = argc > 2 ? atoi(argv[2]) : 20000;
+    site_count = argc > 3 ? atoi(argv[3]) : 5;
+    if (runs <= 0 || steps <= 0 || site_count <= 0) {
+        printf("Usage: %s [runs] [steps per run] [sites]\n", argv[0]);
+        return 1;
+    }
+
+    // Each step adds at most one operation and one character anywhere
+    hub_log = malloc(steps * sizeof(Relayed));
+    sites = calloc(site_count, sizeof(Site));
+    if (hub_log == NULL || sites == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (int s = 0; s < site_count; s++) {
+        sites[s].model = malloc(steps);
+        sites[s].outbox = malloc(steps * sizeof(CrdtOp));
+        if (sites[s].model == NULL || sites[s].outbox == NULL) {
+            perror("malloc");
+            return 1;
+        }
+    }
+
+    int failed = 0;
+    for (int r = 0; r < runs; r++) {
+        failed += !run(r + 1, steps);
+    }
+    printf("%d of %d runs converged\n", runs - failed, runs);
+
+    for (int s = 0; s < site_count; s++) {
+        free(sites[s].model);
+        free(sites[s].outbox);
+    }
+    free(sites);
+    free(hub_log);
+    return failed ? 1 : 0;
+}
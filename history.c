@@ -0,0 +1,1033 @@
+// history.c
+// Indexed, append-only history store. A push appends one payload to
+// HISTORY_DATA and one HistoryEntry to HISTORY_INDEX; a pop restores the
+// last snapshot and truncates both files, so neither ever rewrites the
+// history that came before. Most payloads are deltas against the previous
+// snapshot, so a push costs disk space in proportion to what changed.
+
+#include "history.h"
+#include "codec.h"
+#include "commit.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Delta operations. Lengths and offsets are stored as native uint64_t,
+// like the index records.
+#define DELTA_COPY 'C'    // offset, length: bytes taken from the previous snapshot
+#define DELTA_INSERT 'I'  // length, then that many new bytes
+
+// Content-defined chunking (FastCDC with normalized chunking): chunk
+// boundaries depend only on nearby bytes, so an edit changes the chunks
+// around it and every other chunk is shared with earlier keyframes
+#define CHUNK_MIN 2048
+#define CHUNK_AVG 8192
+#define CHUNK_MAX 65536
+#define CHUNK_MASK_S 0x0000d9f003530000ULL  // 15 bits: cuts are rarer before CHUNK_AVG
+#define CHUNK_MASK_L 0x0000d90003530000ULL  // 11 bits: and likelier after it
+
+// Chunks compressed by the background pass carry this suffix
+#define COMPRESSED_SUFFIX ".lz"
+
+// One manifest record: a chunk is named by its 128-bit hash
+typedef struct {
+    uint64_t hash[2];
+    uint64_t length;
+} ChunkRef;
+
+// Snapshots other than deltas can be rebuilt without their predecessor
+#define IS_BASE(kind) ((kind) != HISTORY_DELTA)
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} Buffer;
+
+// Files of the selected document's history, by HISTORY_DATA etc.
+static const char *history_suffixes[] = { ".history.dat", ".history.idx", ".history.txt", ".history.chunks" };
+static char history_files[4][128];  // Document names are shorter than DOC_PATH_MAX
+
+// Read-only mapping of HISTORY_DATA, kept until the file changes
+static char *data_map = NULL;
+static size_t data_map_len = 0;
+
+// Last snapshot rebuilt, so walking the history forward applies one
+// delta per step and a push finds its base without any rebuilding
+static Buffer cache = {NULL, 0, 0};
+static long cache_index = -1;
+
+static uint64_t fnv1a(const char *data, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Second, independent hash so chunk names are 128 bits wide
+static uint64_t mix_hash(const char *data, size_t len) {
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ len;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+// Make room for len more bytes after buf->len
+static bool buf_reserve(Buffer *buf, size_t len) {
+    if (buf->len + len > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 256;
+        while (capacity < buf->len + len) {
+            capacity *= 2;
+        }
+        char *grown = realloc(buf->data, capacity);
+        if (grown == NULL) {
+            perror("Failed to allocate history buffer");
+            return false;
+        }
+        buf->data = grown;
+        buf->capacity = capacity;
+    }
+    return true;
+}
+
+static bool buf_append(Buffer *buf, const void *data, size_t len) {
+    if (!buf_reserve(buf, len)) {
+        return false;
+    }
+    if (len > 0) {
+        memcpy(buf->data + buf->len, data, len);
+    }
+    buf->len += len;
+    return true;
+}
+
+static bool buf_append_op(Buffer *buf, char op, uint64_t a, const uint64_t *b) {
+    return buf_append(buf, &op, 1) && buf_append(buf, &a, sizeof(a)) &&
+           (b == NULL || buf_append(buf, b, sizeof(*b)));
+}
+
+static bool write_all(int fd, const char *data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// rsync-style weak checksum of one block; rolls in O(1) per byte
+static uint32_t block_checksum(const unsigned char *p, size_t n, uint32_t *a, uint32_t *b) {
+    *a = 0;
+    *b = 0;
+    for (size_t i = 0; i < n; i++) {
+        *a += p[i];
+        *b += (uint32_t)(n - i) * p[i];
+    }
+    return (*a & 0xFFFF) | (*b << 16);
+}
+
+static bool emit_insert(Buffer *delta, const char *data, size_t len) {
+    return len == 0 || (buf_append_op(delta, DELTA_INSERT, len, NULL) && buf_append(delta, data, len));
+}
+
+// Encode cur as copies from prev plus inserted bytes. Blocks of prev are
+// indexed by weak checksum; cur is scanned with a rolling checksum and
+// every confirmed match is grown in both directions.
+static bool encode_delta(const char *prev, size_t prev_len, const char *cur, size_t cur_len,
+                         Buffer *delta) {
+    const size_t B = HISTORY_DELTA_BLOCK;
+    const unsigned char *p = (const unsigned char *)prev;
+    const unsigned char *c = (const unsigned char *)cur;
+    size_t blocks = prev_len / B;
+    size_t slots = 16;
+    while (slots < blocks * 2) {
+        slots *= 2;
+    }
+
+    // Open-addressed table from checksum to block number + 1
+    uint32_t *table_sum = calloc(slots, sizeof(uint32_t));
+    size_t *table_block = calloc(slots, sizeof(size_t));
+    if (table_sum == NULL || table_block == NULL) {
+        free(table_sum);
+        free(table_block);
+        perror("Failed to allocate delta table");
+        return false;
+    }
+
+    for (size_t k = 0; k < blocks; k++) {
+        uint32_t a, b;
+        uint32_t sum = block_checksum(p + k * B, B, &a, &b);
+        size_t slot = sum & (slots - 1);
+        while (table_block[slot] != 0 && table_sum[slot] != sum) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        if (table_block[slot] == 0) {
+            table_sum[slot] = sum;
+            table_block[slot] = k + 1;
+        }
+    }
+
+    bool ok = true;
+    size_t literal = 0;
+    size_t i = 0;
+    uint32_t a = 0, b = 0, sum = 0;
+    if (blocks > 0 && cur_len >= B) {
+        sum = block_checksum(c, B, &a, &b);
+    }
+
+    while (ok && blocks > 0 && i + B <= cur_len) {
+        size_t slot = sum & (slots - 1);
+        while (table_block[slot] != 0 && table_sum[slot] != sum) {
+            slot = (slot + 1) & (slots - 1);
+        }
+
+        size_t po = table_block[slot] ? (table_block[slot] - 1) * B : 0;
+        if (table_block[slot] != 0 && memcmp(p + po, c + i, B) == 0) {
+            size_t ci = i;
+            while (ci > literal && po > 0 && p[po - 1] == c[ci - 1]) {
+                po--;
+                ci--;
+            }
+            size_t len = i + B - ci;
+            while (ci + len < cur_len && po + len < prev_len && p[po + len] == c[ci + len]) {
+                len++;
+            }
+
+            uint64_t copy_len = len;
+            ok = emit_insert(delta, cur + literal, ci - literal) &&
+                 buf_append_op(delta, DELTA_COPY, po, &copy_len);
+            i = ci + len;
+            literal = i;
+            if (i + B <= cur_len) {
+                sum = block_checksum(c + i, B, &a, &b);
+            }
+            continue;
+        }
+
+        // Slide the window one byte
+        if (i + B < cur_len) {
+            a = a - c[i] + c[i + B];
+            b = b - (uint32_t)B * c[i] + a;
+            sum = (a & 0xFFFF) | (b << 16);
+        }
+        i++;
+    }
+
+    free(table_sum);
+    free(table_block);
+    return ok && emit_insert(delta, cur + literal, cur_len - literal);
+}
+
+// Rebuild a snapshot from its predecessor and a delta payload
+static bool apply_delta(const char *prev, size_t prev_len, const char *delta, size_t delta_len,
+                        Buffer *out) {
+    size_t pos = 0;
+    out->len = 0;
+
+    while (pos < delta_len) {
+        char op = delta[pos++];
+        uint64_t a, b;
+        if (pos + sizeof(a) > delta_len) {
+            return false;
+        }
+        memcpy(&a, delta + pos, sizeof(a));
+        pos += sizeof(a);
+
+        if (op == DELTA_COPY) {
+            if (pos + sizeof(b) > delta_len) {
+                return false;
+            }
+            memcpy(&b, delta + pos, sizeof(b));
+            pos += sizeof(b);
+            if (a > prev_len || b > prev_len - a || !buf_append(out, prev + a, b)) {
+                return false;
+            }
+        } else if (op == DELTA_INSERT) {
+            if (a > delta_len - pos || !buf_append(out, delta + pos, a)) {
+                return false;
+            }
+            pos += a;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint64_t gear[256];
+static bool gear_ready = false;
+
+// Length of the next chunk at the start of p
+static size_t chunk_cut(const unsigned char *p, size_t n) {
+    if (!gear_ready) {
+        // Fixed pseudo-random table (splitmix64) so cut points never change
+        uint64_t x = 0;
+        for (int i = 0; i < 256; i++) {
+            uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            gear[i] = z ^ (z >> 31);
+        }
+        gear_ready = true;
+    }
+
+    if (n <= CHUNK_MIN) {
+        return n;
+    }
+
+    size_t normal = n < CHUNK_AVG ? n : CHUNK_AVG;
+    size_t limit = n < CHUNK_MAX ? n : CHUNK_MAX;
+    uint64_t hash = 0;
+    size_t i = CHUNK_MIN;
+
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear[p[i]];
+        if (!(hash & CHUNK_MASK_S)) {
+            return i + 1;
+        }
+    }
+    for (; i < limit; i++) {
+        hash = (hash << 1) + gear[p[i]];
+        if (!(hash & CHUNK_MASK_L)) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+static void chunk_path(const uint64_t hash[2], char *path, size_t size) {
+    snprintf(path, size, "%s/%016llx%016llx", history_path(HISTORY_CHUNKS),
+             (unsigned long long)hash[0], (unsigned long long)hash[1]);
+}
+
+// Read a whole small file into a fresh malloc'd buffer
+static char *read_file(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fd, &st) == 0 && (data = malloc(st.st_size ? st.st_size : 1)) != NULL &&
+        pread(fd, data, st.st_size, 0) != st.st_size) {
+        free(data);
+        data = NULL;
+    }
+    close(fd);
+    *len = data ? (size_t)st.st_size : 0;
+    return data;
+}
+
+// Uncompressed length of the chunk at path (raw or compressed form)
+static bool stored_chunk_length(const char *path, uint64_t *length) {
+    struct stat st;
+    char lz_path[300], header[CODEC_HEADER_SIZE];
+
+    if (stat(path, &st) == 0) {
+        *length = st.st_size;
+        return true;
+    }
+
+    snprintf(lz_path, sizeof(lz_path), "%s%s", path, COMPRESSED_SUFFIX);
+    int fd = open(lz_path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    size_t raw_len = 0;
+    bool ok = pread(fd, header, sizeof(header), 0) == sizeof(header) &&
+              codec_raw_length(header, sizeof(header), &raw_len);
+    close(fd);
+    *length = raw_len;
+    return ok;
+}
+
+// Write a chunk unless the store already has it. New chunks are written
+// under a temporary name and renamed, so a chunk file is always complete.
+static bool store_chunk(const char *data, const ChunkRef *ref) {
+    char path[256], tmp[300];
+    uint64_t stored_length;
+
+    chunk_path(ref->hash, path, sizeof(path));
+    if (stored_chunk_length(path, &stored_length)) {
+        if (stored_length != ref->length) {
+            fprintf(stderr, "Error: Chunk %s has the wrong size (hash collision?).\n", path);
+            return false;
+        }
+        return true;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        fprintf(stderr, "Error: Could not create chunk %s\n", tmp);
+        return false;
+    }
+    bool ok = write_all(fd, data, ref->length, 0);
+    close(fd);
+    if (!ok || rename(tmp, path) == -1) {
+        perror("Error writing history chunk");
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+// Split doc into chunks, store the ones not seen before and describe the
+// whole document as a manifest
+static bool store_chunks(const char *doc, size_t len, Buffer *manifest) {
+    if (mkdir(history_path(HISTORY_CHUNKS), 0777) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error: Could not create %s\n", history_path(HISTORY_CHUNKS));
+        return false;
+    }
+
+    size_t pos = 0;
+    while (pos < len) {
+        ChunkRef ref;
+        ref.length = chunk_cut((const unsigned char *)doc + pos, len - pos);
+        ref.hash[0] = fnv1a(doc + pos, ref.length);
+        ref.hash[1] = mix_hash(doc + pos, ref.length);
+
+        if (!store_chunk(doc + pos, &ref) || !buf_append(manifest, &ref, sizeof(ref))) {
+            return false;
+        }
+        pos += ref.length;
+    }
+    return true;
+}
+
+// Rebuild a snapshot by concatenating the chunks its manifest lists
+static bool load_chunks(const char *manifest, size_t manifest_len, Buffer *out) {
+    out->len = 0;
+
+    for (size_t pos = 0; pos + sizeof(ChunkRef) <= manifest_len; pos += sizeof(ChunkRef)) {
+        ChunkRef ref;
+        char path[256];
+        memcpy(&ref, manifest + pos, sizeof(ref));
+        chunk_path(ref.hash, path, sizeof(path));
+
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            // Compressed by the background pass: decompress just this block
+            char lz_path[300];
+            size_t block_len;
+            snprintf(lz_path, sizeof(lz_path), "%s%s", path, COMPRESSED_SUFFIX);
+            char *block = read_file(lz_path, &block_len);
+            bool ok = block != NULL && buf_reserve(out, ref.length) &&
+                      codec_decompress(block, block_len, out->data + out->len, ref.length);
+            free(block);
+            if (!ok) {
+                fprintf(stderr, "Error: Missing or damaged history chunk %s\n", path);
+                return false;
+            }
+            out->len += ref.length;
+            continue;
+        }
+
+        // Read the chunk straight into the end of the buffer
+        ssize_t n = -1;
+        if (buf_reserve(out, ref.length)) {
+            n = pread(fd, out->data + out->len, ref.length, 0);
+        }
+        close(fd);
+        if (n != (ssize_t)ref.length) {
+            fprintf(stderr, "Error: Could not read history chunk %s\n", path);
+            return false;
+        }
+        out->len += ref.length;
+    }
+    return true;
+}
+
+static void unmap_data(void) {
+    if (data_map != NULL) {
+        munmap(data_map, data_map_len);
+        data_map = NULL;
+        data_map_len = 0;
+    }
+}
+
+// Map the stored payload of entry
+static const char *map_payload(const HistoryEntry *entry) {
+    if (entry->length == 0) {
+        return "";
+    }
+
+    if (data_map == NULL || entry->offset + entry->length > data_map_len) {
+        unmap_data();
+
+        int fd = open(history_path(HISTORY_DATA), O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "Error: Could not open %s for reading.\n", history_path(HISTORY_DATA));
+            return NULL;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1 || (uint64_t)st.st_size < entry->offset + entry->length) {
+            fprintf(stderr, "Error: %s is shorter than its index.\n", history_path(HISTORY_DATA));
+            close(fd);
+            return NULL;
+        }
+        data_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data_map == MAP_FAILED) {
+            perror("mmap");
+            data_map = NULL;
+            return NULL;
+        }
+        data_map_len = st.st_size;
+    }
+
+    return data_map + entry->offset;
+}
+
+// Add one snapshot after the last indexed one. The payload is written
+// first and the index record last, so an interrupted push leaves only
+// unreferenced bytes that the next push overwrites.
+static bool add_snapshot(const char *doc, size_t len, time_t timestamp) {
+    HistoryEntry entry;
+    Buffer delta = {NULL, 0, 0};
+    long count = history_count();
+
+    memset(&entry, 0, sizeof(entry));
+    entry.size = len;
+    entry.timestamp = timestamp;
+    entry.hash = fnv1a(doc, len);
+    entry.kind = HISTORY_KEYFRAME;
+
+    if (count > 0) {
+        HistoryEntry last;
+        if (!history_entry(count - 1, &last)) {
+            return false;
+        }
+        entry.offset = last.offset + last.length;
+
+        // Store a delta unless a keyframe is due or the delta saves nothing
+        size_t prev_len;
+        const char *prev;
+        if (count % HISTORY_KEYFRAME_INTERVAL != 0 &&
+            (prev = history_snapshot(count - 1, &prev_len)) != NULL &&
+            encode_delta(prev, prev_len, doc, len, &delta) && delta.len < len) {
+            entry.kind = HISTORY_DELTA;
+        }
+    }
+
+    // Keyframes go to the chunk store; only their manifest goes in the log
+    if (entry.kind != HISTORY_DELTA) {
+        delta.len = 0;
+        if (!store_chunks(doc, len, &delta)) {
+            free(delta.data);
+            return false;
+        }
+        entry.kind = HISTORY_MANIFEST;
+    }
+
+    const char *payload = delta.data;
+    entry.length = delta.len;
+
+    int data_fd = open(history_path(HISTORY_DATA), O_RDWR | O_CREAT, 0666);
+    if (data_fd == -1) {
+        fprintf(stderr, "Error: Could not open %s for appending.\n", history_path(HISTORY_DATA));
+        free(delta.data);
+        return false;
+    }
+    bool ok = write_all(data_fd, payload, entry.length, entry.offset) &&
+              ftruncate(data_fd, entry.offset + entry.length) == 0;
+    close(data_fd);
+    free(delta.data);
+    if (!ok) {
+        perror("Error writing history data");
+        return false;
+    }
+
+    int index_fd = open(history_path(HISTORY_INDEX), O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (index_fd == -1) {
+        fprintf(stderr, "Error: Could not open %s for appending.\n", history_path(HISTORY_INDEX));
+        return false;
+    }
+    ok = write(index_fd, &entry, sizeof(entry)) == sizeof(entry);
+    close(index_fd);
+    if (!ok) {
+        perror("Error writing history index");
+        return false;
+    }
+
+    // The new snapshot is the base for the next push
+    unmap_data();
+    cache.len = 0;
+    cache_index = buf_append(&cache, doc, len) ? count : -1;
+    return true;
+}
+
+// Convert a history.txt written by older versions into the indexed store
+static void import_legacy_history(void) {
+    FILE *legacy = fopen(history_path(HISTORY_LEGACY), "r");
+    if (legacy == NULL) {
+        return;
+    }
+
+    char line[1024];
+    Buffer snapshot = {NULL, 0, 0};
+    bool copying = false;
+    time_t timestamp = 0;
+    long imported = 0;
+
+    while (fgets(line, sizeof(line), legacy)) {
+        char *tag = line;
+
+        // Older pops could leave "</end><start ...>" on a single line
+        if (strncmp(tag, "</end>", 6) == 0) {
+            if (copying && add_snapshot(snapshot.data, snapshot.len, timestamp)) {
+                imported++;
+            }
+            copying = false;
+            tag += 6;
+        }
+
+        if (strncmp(tag, "<start", 6) == 0) {
+            struct tm tm;
+            memset(&tm, 0, sizeof(tm));
+            if (sscanf(tag, "<start timestamp=\"%d-%d-%d %d:%d:%d\"", &tm.tm_year, &tm.tm_mon,
+                       &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6) {
+                tm.tm_year -= 1900;
+                tm.tm_mon -= 1;
+                tm.tm_isdst = -1;
+                timestamp = mktime(&tm);
+            } else {
+                timestamp = time(NULL);
+            }
+            copying = true;
+            snapshot.len = 0;
+            continue;
+        }
+        if (copying && tag == line && !buf_append(&snapshot, line, strlen(line))) {
+            break;
+        }
+    }
+
+    free(snapshot.data);
+    fclose(legacy);
+
+    // Keep the old file around, but never import it twice
+    char imported_path[PATH_MAX];
+    snprintf(imported_path, sizeof(imported_path), "%s.imported", history_path(HISTORY_LEGACY));
+    rename(history_path(HISTORY_LEGACY), imported_path);
+    printf("Imported %ld snapshots from %s.\n", imported, history_path(HISTORY_LEGACY));
+}
+
+static void prepare_history(void) {
+    if (access(history_path(HISTORY_INDEX), F_OK) == -1 && access(history_path(HISTORY_LEGACY), F_OK) == 0) {
+        import_legacy_history();
+    }
+}
+
+long history_count(void) {
+    struct stat st;
+
+    if (stat(history_path(HISTORY_INDEX), &st) == -1) {
+        return 0;
+    }
+    return st.st_size / sizeof(HistoryEntry);
+}
+
+bool history_entry(long index, HistoryEntry *entry) {
+    int fd = open(history_path(HISTORY_INDEX), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    ssize_t n = pread(fd, entry, sizeof(*entry), (off_t)index * sizeof(*entry));
+    close(fd);
+    return n == sizeof(*entry);
+}
+
+// Snapshot the document. Reads the document once; what gets written is
+// proportional to how much it changed since the last push.
+bool history_push(const char *doc_path) {
+    prepare_history();
+
+    int fd = open(doc_path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Error: Could not open document file %s\n", doc_path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return false;
+    }
+
+    const char *doc = "";
+    if (st.st_size > 0) {
+        doc = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (doc == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return false;
+        }
+    }
+
+    bool ok = add_snapshot(doc, st.st_size, time(NULL));
+
+    if (st.st_size > 0) {
+        munmap((void *)doc, st.st_size);
+    }
+    close(fd);
+    return ok;
+}
+
+// Restore the newest snapshot into the document and drop it. Only the
+// last index record and the tail of the data file are touched.
+bool history_pop(const char *doc_path) {
+    prepare_history();
+
+    long count = history_count();
+    if (count == 0) {
+        fprintf(stderr, "Error: No snapshots in history.\n");
+        return false;
+    }
+
+    HistoryEntry entry;
+    size_t len;
+    const char *snapshot = history_snapshot(count - 1, &len);
+    if (snapshot == NULL || !history_entry(count - 1, &entry)) {
+        return false;
+    }
+
+    // Readers see the old document or the restored one, never a mix
+    if (!commit_file(doc_path, snapshot, len)) {
+        fprintf(stderr, "Error: Could not restore snapshot into %s.\n", doc_path);
+        return false;
+    }
+
+    // Drop the index record first: a payload without one is just unused space
+    unmap_data();
+    cache_index = -1;
+    if (truncate(history_path(HISTORY_INDEX), (off_t)(count - 1) * sizeof(HistoryEntry)) == -1 ||
+        truncate(history_path(HISTORY_DATA), entry.offset) == -1) {
+        perror("Error truncating history");
+        return false;
+    }
+
+    // Only manifests hold chunks, so only popping one can orphan any
+    if (entry.kind == HISTORY_MANIFEST) {
+        history_gc();
+    }
+    return true;
+}
+
+static int compare_refs(const void *a, const void *b) {
+    const uint64_t *x = a, *y = b;
+    if (x[0] != y[0]) {
+        return x[0] < y[0] ? -1 : 1;
+    }
+    return x[1] < y[1] ? -1 : (x[1] > y[1]);
+}
+
+// Delete chunks no manifest refers to any more, along with temporary
+// files left by interrupted pushes. Returns the number of files removed.
+long history_gc(void) {
+    Buffer live = {NULL, 0, 0};
+    long count = history_count();
+
+    // Collect the hash of every chunk any manifest still uses
+    for (long i = 0; i < count; i++) {
+        HistoryEntry entry;
+        if (!history_entry(i, &entry)) {
+            free(live.data);
+            return 0;
+        }
+        if (entry.kind != HISTORY_MANIFEST) {
+            continue;
+        }
+        const char *manifest = map_payload(&entry);
+        if (manifest == NULL) {
+            // Never delete anything on the strength of an unreadable index
+            free(live.data);
+            return 0;
+        }
+        for (size_t pos = 0; pos + sizeof(ChunkRef) <= entry.length; pos += sizeof(ChunkRef)) {
+            ChunkRef ref;
+            memcpy(&ref, manifest + pos, sizeof(ref));
+            if (!buf_append(&live, ref.hash, sizeof(ref.hash))) {
+                free(live.data);
+                return 0;
+            }
+        }
+    }
+
+    size_t live_count = live.len / sizeof(uint64_t[2]);
+    if (live_count > 0) {
+        qsort(live.data, live_count, sizeof(uint64_t[2]), compare_refs);
+    }
+
+    DIR *dir = opendir(history_path(HISTORY_CHUNKS));
+    if (dir == NULL) {
+        free(live.data);
+        return 0;
+    }
+
+    long removed = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        unsigned long long hi, lo;
+        char path[512];
+        int used = 0;
+
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        size_t name_len = strlen(de->d_name);
+        bool keep = (name_len == 32 ||
+                     (name_len == 32 + strlen(COMPRESSED_SUFFIX) &&
+                      strcmp(de->d_name + 32, COMPRESSED_SUFFIX) == 0)) &&
+                    sscanf(de->d_name, "%16llx%16llx%n", &hi, &lo, &used) == 2 && used == 32;
+        if (keep) {
+            uint64_t key[2] = {hi, lo};
+            keep = live_count > 0 &&
+                   bsearch(key, live.data, live_count, sizeof(uint64_t[2]), compare_refs) != NULL;
+        }
+        if (!keep) {
+            snprintf(path, sizeof(path), "%s/%s", history_path(HISTORY_CHUNKS), de->d_name);
+            if (unlink(path) == 0) {
+                removed++;
+            }
+        }
+    }
+    closedir(dir);
+    free(live.data);
+    return removed;
+}
+
+// Contents of snapshot index, rebuilt by applying deltas forward from the
+// nearest keyframe (or from the last snapshot rebuilt, when that is
+// closer). Payloads are read through a mapping of the data file. The
+// pointer stays valid until the next call into this module.
+const char *history_snapshot(long index, size_t *len) {
+    HistoryEntry entry;
+    long count = history_count();
+
+    if (index < 0 || index >= count || !history_entry(index, &entry)) {
+        fprintf(stderr, "Error: No snapshot %ld in history.\n", index);
+        return NULL;
+    }
+
+    if (cache_index != index) {
+        // Find where to start: a keyframe, or the cached snapshot
+        long base = (cache_index >= 0 && cache_index < index) ? cache_index : -1;
+        long start = index;
+        HistoryEntry step = entry;
+        while (!IS_BASE(step.kind) && start > base + 1) {
+            if (start == 0 || !history_entry(start - 1, &step)) {
+                fprintf(stderr, "Error: Snapshot %ld has no keyframe.\n", index);
+                return NULL;
+            }
+            start--;
+        }
+        if (!IS_BASE(step.kind)) {
+            start = base + 1;  // Continue from the cached snapshot
+        }
+
+        Buffer next = {NULL, 0, 0};
+        for (long i = start; i <= index; i++) {
+            if (!history_entry(i, &step)) {
+                free(next.data);
+                cache_index = -1;
+                return NULL;
+            }
+            const char *payload = map_payload(&step);
+            bool ok = payload != NULL;
+            if (ok && step.kind == HISTORY_KEYFRAME) {
+                next.len = 0;
+                ok = buf_append(&next, payload, step.length);
+            } else if (ok && step.kind == HISTORY_MANIFEST) {
+                ok = load_chunks(payload, step.length, &next);
+            } else if (ok) {
+                ok = apply_delta(cache.data, cache.len, payload, step.length, &next);
+            }
+            if (!ok) {
+                fprintf(stderr, "Error: Snapshot %ld is corrupt.\n", i);
+                free(next.data);
+                cache_index = -1;
+                return NULL;
+            }
+
+            Buffer swap = cache;
+            cache = next;
+            next = swap;
+            cache_index = i;
+        }
+        free(next.data);
+    }
+
+    if (cache.len != entry.size || fnv1a(cache.data, cache.len) != entry.hash) {
+        fprintf(stderr, "Error: Snapshot %ld is corrupt (hash mismatch).\n", index);
+        cache_index = -1;
+        return NULL;
+    }
+
+    *len = cache.len;
+    return cache.len > 0 ? cache.data : "";
+}
+
+// Work on the history of this document from now on
+void history_select(const char *doc_path) {
+    history_release();
+    for (int i = 0; i < 4; i++) {
+        snprintf(history_files[i], sizeof(history_files[i]), "%s%s", doc_path, history_suffixes[i]);
+    }
+}
+
+const char *history_path(int file) {
+    return history_files[file];
+}
+
+void history_release(void) {
+    unmap_data();
+    free(cache.data);
+    cache.data = NULL;
+    cache.len = cache.capacity = 0;
+    cache_index = -1;
+}
+
+// Print every snapshot oldest first, walking the index a block at a time.
+// Each snapshot is rebuilt from the one before it with a single delta.
+void history_print(FILE *out) {
+    prepare_history();
+
+    int fd = open(history_path(HISTORY_INDEX), O_RDONLY);
+    if (fd == -1 || history_count() == 0) {
+        fprintf(out, "No history found.\n");
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    fprintf(out, "----- Document History -----\n");
+
+    HistoryEntry block[64];
+    long index = 0;
+    ssize_t n;
+    while ((n = read(fd, block, sizeof(block))) >= (ssize_t)sizeof(HistoryEntry)) {
+        for (size_t i = 0; i < n / sizeof(HistoryEntry); i++, index++) {
+            size_t len;
+            const char *snapshot = history_snapshot(index, &len);
+            if (snapshot == NULL) {
+                continue;
+            }
+
+            char timestamp[30];
+            time_t when = block[i].timestamp;
+            strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&when));
+
+            fprintf(out, "<start timestamp=\"%s\">\n", timestamp);
+            fwrite(snapshot, 1, len, out);
+            if (len > 0 && snapshot[len - 1] != '\n') {
+                fputc('\n', out);
+            }
+            fprintf(out, "</end>\n\n");
+        }
+    }
+    close(fd);
+
+    fprintf(out, "----- End of History -----\n");
+}
+
+// Compress raw chunks last modified more than min_age seconds ago until
+// the process has used cpu_budget_ms of CPU time. A chunk is replaced by
+// writing NAME.lz and only then removing NAME, so readers always find one
+// of the two.
+static void compress_old_chunks(int min_age, int cpu_budget_ms) {
+    DIR *dir = opendir(history_path(HISTORY_CHUNKS));
+    if (dir == NULL) {
+        return;
+    }
+
+    time_t cutoff = time(NULL) - min_age;
+    struct timespec start, now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+        long used_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (used_ms >= cpu_budget_ms) {
+            break;  // The rest waits for the next pass
+        }
+
+        char path[512], lz_path[600], tmp[700];
+        struct stat st;
+        if (strlen(de->d_name) != 32) {
+            continue;  // Already compressed, or not a chunk
+        }
+        snprintf(path, sizeof(path), "%s/%s", history_path(HISTORY_CHUNKS), de->d_name);
+        if (stat(path, &st) == -1 || st.st_mtime > cutoff) {
+            continue;
+        }
+
+        size_t len;
+        char *raw = read_file(path, &len);
+        if (raw == NULL) {
+            continue;
+        }
+        size_t capacity = codec_bound(len);
+        char *block = malloc(capacity);
+        size_t block_len = block ? codec_compress(raw, len, block, capacity) : 0;
+        free(raw);
+
+        snprintf(lz_path, sizeof(lz_path), "%s%s", path, COMPRESSED_SUFFIX);
+        snprintf(tmp, sizeof(tmp), "%s.tmp", lz_path);
+        int fd = block_len ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+        if (fd != -1) {
+            bool ok = write_all(fd, block, block_len, 0);
+            close(fd);
+            if (ok && rename(tmp, lz_path) == 0) {
+                unlink(path);
+            } else {
+                unlink(tmp);
+            }
+        }
+        free(block);
+    }
+    closedir(dir);
+}
+
+// Compress old chunks in a detached, lowest-priority process so the
+// caller never waits for it. The intermediate child exits at once and is
+// reaped here; the worker is inherited by init.
+void history_compress_background(int min_age, int cpu_budget_ms) {
+    fflush(NULL);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (fork() == 0) {
+            setpriority(PRIO_PROCESS, 0, 19);
+            compress_old_chunks(min_age, cpu_budget_ms);
+        }
+        _exit(0);
+    } else if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    }
+}
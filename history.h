@@ -0,0 +1,60 @@
+// history.h
+// Append-only document history: snapshot payloads (keyframes or deltas)
+// live back to back in HISTORY_DATA and HISTORY_INDEX holds one
+// fixed-size record per snapshot
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Each document has its own history, in files named after it; pass these
+// to history_path() for the selected document's
+#define HISTORY_DATA 0      // <doc>.history.dat
+#define HISTORY_INDEX 1     // <doc>.history.idx
+#define HISTORY_LEGACY 2    // <doc>.history.txt: old <start>/</end> text format, imported once
+#define HISTORY_CHUNKS 3    // <doc>.history.chunks: content-addressed chunks of keyframe snapshots
+
+// Chunks untouched for this many seconds are compressed in the background,
+// using at most HISTORY_COMPRESS_BUDGET_MS of CPU time per pass
+#define HISTORY_COMPRESS_AGE (24 * 60 * 60)
+#define HISTORY_COMPRESS_BUDGET_MS 200
+
+// Every HISTORY_KEYFRAME_INTERVAL-th snapshot is stored whole, as a
+// manifest of deduplicated chunks; the rest are deltas against the
+// snapshot before them
+#define HISTORY_KEYFRAME_INTERVAL 16
+// Block size used to find unchanged runs of the previous snapshot
+#define HISTORY_DELTA_BLOCK 64
+
+// How a snapshot's payload is stored
+#define HISTORY_KEYFRAME 0   // The snapshot itself
+#define HISTORY_DELTA 1      // Copy/insert operations against the previous snapshot
+#define HISTORY_MANIFEST 2   // List of chunks in HISTORY_CHUNKS making up the snapshot
+
+typedef struct {
+    uint64_t offset;     // Where the payload starts in HISTORY_DATA
+    uint64_t length;     // Payload size in bytes
+    uint64_t size;       // Size of the rebuilt snapshot
+    int64_t timestamp;   // When it was pushed (time_t)
+    uint64_t hash;       // FNV-1a of the rebuilt snapshot, checked on read
+    uint32_t kind;       // HISTORY_KEYFRAME or HISTORY_DELTA
+    uint32_t reserved;
+} HistoryEntry;
+
+void history_select(const char *doc_path);
+const char *history_path(int file);
+long history_count(void);
+bool history_entry(long index, HistoryEntry *entry);
+bool history_push(const char *doc_path);
+bool history_pop(const char *doc_path);
+const char *history_snapshot(long index, size_t *len);
+void history_release(void);
+void history_print(FILE *out);
+long history_gc(void);
+void history_compress_background(int min_age, int cpu_budget_ms);
+
+#endif // HISTORY_H
@@ -3,10 +3,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "commit.h"
+#include "crdt.h"
+#include "ot.h"
 
 #define MAX_USERS 10
 #define MAX_USERNAME 20
-#define MAX_TEXT 10000
+#define GAP_INITIAL 4096
+#define LINE_INDEX_INITIAL 256
+#define RUN_LIST_INITIAL 64
+
+// Damage flags: which parts of the screen must be repainted
+#define DIRTY_SCREEN  0x01  // stdscr was cleared by a dialog
+#define DIRTY_STATUS  0x02
+#define DIRTY_FORMAT  0x04
+#define DIRTY_TEXT    0x08  // whole text area
+#define DIRTY_COMMAND 0x10
+#define DIRTY_ALL     0x1f
 #define MAX_LINE 100
 #define MAX_FILENAME 50
 
@@ -16,9 +36,61 @@ typedef struct {
     int isWriter;
 } User;
 
+// Growable gap buffer: the text lives in buf[0..gap_start) and
+// buf[gap_end..capacity), with the unused gap kept at the edit point so
+// inserts and deletes at the cursor are amortized O(1).
+typedef struct {
+    char *buf;
+    size_t gap_start;
+    size_t gap_end;
+    size_t capacity;
+} GapBuffer;
+
+// Offsets of the first character of every line, kept sorted and updated
+// on each edit so line lookups are a binary search instead of a rescan.
+// Like the text, the entries have a gap, kept after the line last edited:
+// lines before it hold their offset from the start of the document and
+// lines after it their distance from the end, so an edit at the gap moves
+// no entry and moving the gap costs only the lines it passes.
 typedef struct {
-    char text[MAX_TEXT];
-    int cursor_pos;
+    size_t *starts;
+    size_t gap_start;
+    size_t gap_end;
+    size_t capacity;
+    size_t length;     // Document length, which later lines count back from
+} LineIndex;
+
+// One entry of the formatting run list. Text runs are stretches drawn
+// with the same attributes; code runs (code != 0) are the hidden \b \i
+// \u \cN \sN markers between them and carry the state after the code.
+// Runs are sorted and cover the document without gaps.
+typedef struct {
+    size_t offset;
+    size_t length;
+    int attr;        // A_BOLD / A_ITALIC / A_UNDERLINE mask
+    int color_pair;
+    char code;       // 0 for text, otherwise the code letter
+    char arg;        // Digit of \cN and \sN
+} FormatRun;
+
+// Runs from shift_from on are still to be moved by shift bytes: their
+// offsets are only brought up to date as far as the next edit reaches,
+// so typing in one place does not touch every run after it. rl_offset()
+// gives the real offset.
+typedef struct {
+    FormatRun *runs;
+    size_t count;
+    size_t capacity;
+    size_t shift_from;
+    size_t shift;
+} RunList;
+
+typedef struct {
+    GapBuffer text;
+    LineIndex lines;
+    RunList runs;
+    size_t top_line;   // First line shown in the text area (scroll offset)
+    size_t cursor_pos;
     int current_color;
     int is_bold;
     int is_italic;
@@ -33,6 +105,35 @@ int user_count = 0;
 int current_user = -1;
 Document doc;
 
+// Damage tracking state
+int dirty = DIRTY_ALL;
+size_t dirty_from = SIZE_MAX;  // First text line needing a repaint
+size_t dirty_to = 0;           // Last one, SIZE_MAX for "to the bottom"
+int text_width = 1;            // Wrap width of the text area
+
+// Live editing (--collab): connection to the owner's hub and this
+// process's replica of the shared text
+int collab_fd = -1;
+Crdt collab;
+int collab_remote = 0;         // Applying hub operations, which are not sent back
+// The receive buffer and collab_send() count records in CrdtOp sizes in
+// both of the hub's modes
+_Static_assert(sizeof(OtOp) == sizeof(CrdtOp), "CRDT and OT records must be the same size");
+char collab_in[64 * sizeof(CrdtOp)];
+size_t collab_in_len = 0;
+
+// The same when the hub merges by operational transformation
+int collab_ot = 0;
+uint32_t ot_site;
+uint32_t ot_revision;          // Hub changes seen, ours included
+OtChange ot_outstanding;       // Sent, waiting for OT_ACK
+OtChange ot_buffer;            // Made since, sent once the outstanding one is acknowledged
+OtChange ot_incoming;          // Hub change being received, up to its OT_COMMIT
+char *ot_initial;              // Text sent on joining, until collab_load()
+size_t ot_initial_len;
+struct timespec ot_sent_at;
+long ot_latency_ms = -1;       // Keystroke to acknowledgement, for the status bar
+
 // Function prototypes
 void init_colors();
 void draw_status_bar(WINDOW *win);
@@ -46,9 +147,60 @@ void select_user();
 int is_owner();
 int is_writer();
 void init_document();
+void free_document();
 void apply_formatting(int ch);
+void mark_lines_dirty(size_t from, size_t to);
+
+// Gap buffer operations
+void gb_init(GapBuffer *gb, size_t capacity);
+void gb_free(GapBuffer *gb);
+size_t gb_length(const GapBuffer *gb);
+char gb_char_at(const GapBuffer *gb, size_t pos);
+void gb_insert(GapBuffer *gb, size_t pos, const char *src, size_t n);
+void gb_delete(GapBuffer *gb, size_t pos, size_t n);
+bool gb_save(const GapBuffer *gb, const char *path);
+
+// Line index operations
+void li_init(LineIndex *li);
+void li_free(LineIndex *li);
+size_t li_count(const LineIndex *li);
+size_t li_start(const LineIndex *li, size_t line);
+size_t li_line_of(const LineIndex *li, size_t pos);
+void li_on_insert(LineIndex *li, size_t pos, const char *src, size_t n);
+void li_on_delete(LineIndex *li, size_t pos, size_t n);
+
+// Formatting run list operations
+void rl_init(RunList *rl);
+void rl_free(RunList *rl);
+size_t rl_offset(const RunList *rl, size_t r);
+size_t rl_find(const RunList *rl, size_t pos);
+
+// Document edits (keep the text and its line index in sync)
+void doc_insert(size_t pos, const char *src, size_t n);
+void doc_delete(size_t pos, size_t n);
 
-int main() {
+// Live editing
+int collab_connect(const char *path);
+void collab_load();
+int collab_wait_input();
+void collab_receive();
+void collab_send_insert(size_t pos, const char *src, size_t n);
+void collab_send_delete(size_t pos, size_t n);
+void collab_disconnect();
+
+int main(int argc, char *argv[]) {
+    // myapp --collab <socket> <user>: join a live editing session
+    const char *collab_user = NULL;
+    if (argc == 4 && strcmp(argv[1], "--collab") == 0) {
+        if (!collab_connect(argv[2])) {
+            return 1;
+        }
+        collab_user = argv[3];
+    } else if (argc != 1) {
+        printf("Usage: %s [--collab <socket> <user>]\n", argv[0]);
+        return 1;
+    }
+    
     // Initialize ncurses
     initscr();
     start_color();
@@ -73,6 +225,13 @@ int main() {
     user_count = 1;
     current_user = 0;
     
+    // A live session has one writer per process: the joining user
+    if (collab_user != NULL) {
+        snprintf(users[0].username, MAX_USERNAME, "%s", collab_user);
+        users[0].isOwner = 0;
+        collab_load();
+    }
+    
     // Create windows
     int max_y, max_x;
     getmaxyx(stdscr, max_y, max_x);
@@ -83,35 +242,50 @@ int main() {
     WINDOW *command_bar = newwin(1, max_x, max_y-1, 0);
     
     keypad(text_area, TRUE);
+    text_width = getmaxx(text_area) - 2;
     
     // Main loop
     int ch;
     int running = 1;
     
     while (running) {
-        // Draw windows
-        werase(status_bar);
-        werase(format_bar);
-        werase(text_area);
-        werase(command_bar);
-        
-        draw_status_bar(status_bar);
-        if (is_writer()) {
-            draw_format_bar(format_bar);
+        // Repaint only what changed since the last key, then push all
+        // windows to the terminal in a single doupdate()
+        if (dirty & DIRTY_SCREEN) {
+            wnoutrefresh(stdscr);
+        }
+        if (dirty & DIRTY_STATUS) {
+            werase(status_bar);
+            draw_status_bar(status_bar);
+            wnoutrefresh(status_bar);
+        }
+        if (dirty & DIRTY_FORMAT) {
+            werase(format_bar);
+            if (is_writer()) {
+                draw_format_bar(format_bar);
+            }
+            wnoutrefresh(format_bar);
+        }
+        if (dirty & DIRTY_COMMAND) {
+            // Command bar instructions
+            werase(command_bar);
+            mvwprintw(command_bar, 0, 0, "Commands: s-Save | x-Exit | a-Add User | r-Remove User | u-Select User");
+            wnoutrefresh(command_bar);
         }
-        draw_text_area(text_area);
         
-        // Command bar instructions
-        mvwprintw(command_bar, 0, 0, "Commands: s-Save | x-Exit | a-Add User | r-Remove User | u-Select User");
+        // The text area goes last so the terminal cursor ends up in it
+        draw_text_area(text_area);
+        wnoutrefresh(text_area);
+        doupdate();
+        dirty = 0;
         
-        // Refresh windows
-        wrefresh(status_bar);
-        wrefresh(format_bar);
-        wrefresh(text_area);
-        wrefresh(command_bar);
+        // Operations from the hub arrive while waiting for a key
+        if (collab_fd >= 0 && !collab_wait_input()) {
+            continue;
+        }
         
-        // Get input
-        ch = getch();
+        // Get input (from the text area so stdscr is not refreshed over it)
+        ch = wgetch(text_area);
         
         // Process control keys
         if (ch == 's' && is_writer()) { // Save
@@ -120,22 +294,30 @@ int main() {
             running = 0;
         } else if (ch == 'a' && is_owner()) { // Add user
             add_user();
+            dirty = DIRTY_ALL;
         } else if (ch == 'r' && is_owner()) { // Remove user
             remove_user();
+            dirty = DIRTY_ALL;
         } else if (ch == 'u') { // Select user
             select_user();
+            dirty = DIRTY_ALL;
         } else if (is_writer()) {
             // Process text formatting and editing
             if (ch == KEY_F(1)) { // Bold
                 doc.is_bold = !doc.is_bold;
+                dirty |= DIRTY_FORMAT;
             } else if (ch == KEY_F(2)) { // Italic
                 doc.is_italic = !doc.is_italic;
+                dirty |= DIRTY_FORMAT;
             } else if (ch == KEY_F(3)) { // Underline
                 doc.is_underline = !doc.is_underline;
+                dirty |= DIRTY_FORMAT;
             } else if (ch == KEY_F(4)) { // Cycle text size
                 doc.text_size = (doc.text_size % 3) + 1;
+                dirty |= DIRTY_FORMAT;
             } else if (ch == KEY_F(5)) { // Cycle colors
                 doc.current_color = (doc.current_color % 7) + 1;
+                dirty |= DIRTY_FORMAT;
             } else {
                 process_key(ch);
             }
@@ -149,6 +331,9 @@ int main() {
     delwin(command_bar);
     endwin();
     
+    collab_disconnect();
+    free_document();
+    
     return 0;
 }
 
@@ -163,8 +348,600 @@ void init_colors() {
     init_pair(7, COLOR_MAGENTA, COLOR_BLACK); // Magenta
 }
 
+void gb_init(GapBuffer *gb, size_t capacity) {
+    gb->buf = malloc(capacity);
+    if (gb->buf == NULL) {
+        endwin();
+        perror("Failed to allocate document buffer");
+        exit(EXIT_FAILURE);
+    }
+    gb->gap_start = 0;
+    gb->gap_end = capacity;
+    gb->capacity = capacity;
+}
+
+void gb_free(GapBuffer *gb) {
+    free(gb->buf);
+    gb->buf = NULL;
+    gb->gap_start = gb->gap_end = gb->capacity = 0;
+}
+
+size_t gb_length(const GapBuffer *gb) {
+    return gb->capacity - (gb->gap_end - gb->gap_start);
+}
+
+char gb_char_at(const GapBuffer *gb, size_t pos) {
+    if (pos < gb->gap_start) {
+        return gb->buf[pos];
+    }
+    return gb->buf[pos + (gb->gap_end - gb->gap_start)];
+}
+
+// Move the gap so that it starts at logical position pos.
+// Cost is proportional to the distance moved, which is small for
+// consecutive edits around the cursor.
+static void gb_move_gap(GapBuffer *gb, size_t pos) {
+    if (pos < gb->gap_start) {
+        size_t n = gb->gap_start - pos;
+        memmove(&gb->buf[gb->gap_end - n], &gb->buf[pos], n);
+        gb->gap_start -= n;
+        gb->gap_end -= n;
+    } else if (pos > gb->gap_start) {
+        size_t n = pos - gb->gap_start;
+        memmove(&gb->buf[gb->gap_start], &gb->buf[gb->gap_end], n);
+        gb->gap_start += n;
+        gb->gap_end += n;
+    }
+}
+
+// Make sure the gap can hold at least n more bytes, doubling capacity
+// so that growth is amortized O(1) per inserted byte.
+static void gb_reserve(GapBuffer *gb, size_t n) {
+    size_t gap = gb->gap_end - gb->gap_start;
+    if (gap >= n) return;
+    
+    size_t length = gb_length(gb);
+    size_t new_capacity = gb->capacity ? gb->capacity * 2 : GAP_INITIAL;
+    while (new_capacity - length < n) {
+        new_capacity *= 2;
+    }
+    
+    char *new_buf = realloc(gb->buf, new_capacity);
+    if (new_buf == NULL) {
+        endwin();
+        perror("Failed to grow document buffer");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Slide the text after the gap to the end of the new allocation
+    size_t tail = gb->capacity - gb->gap_end;
+    memmove(&new_buf[new_capacity - tail], &new_buf[gb->gap_end], tail);
+    gb->buf = new_buf;
+    gb->gap_end = new_capacity - tail;
+    gb->capacity = new_capacity;
+}
+
+void gb_insert(GapBuffer *gb, size_t pos, const char *src, size_t n) {
+    gb_reserve(gb, n);
+    gb_move_gap(gb, pos);
+    memcpy(&gb->buf[gb->gap_start], src, n);
+    gb->gap_start += n;
+}
+
+void gb_delete(GapBuffer *gb, size_t pos, size_t n) {
+    gb_move_gap(gb, pos);
+    gb->gap_end += n;
+}
+
+// Save the document without materializing it: the text before and
+// after the gap go out as two iovecs of one atomic commit.
+bool gb_save(const GapBuffer *gb, const char *path) {
+    struct iovec iov[2] = {
+        { gb->buf, gb->gap_start },
+        { &gb->buf[gb->gap_end], gb->capacity - gb->gap_end },
+    };
+    return commit_filev(path, iov, 2);
+}
+
+void li_init(LineIndex *li) {
+    li->starts = malloc(LINE_INDEX_INITIAL * sizeof(size_t));
+    if (li->starts == NULL) {
+        endwin();
+        perror("Failed to allocate line index");
+        exit(EXIT_FAILURE);
+    }
+    li->starts[0] = 0;
+    li->gap_start = 1;
+    li->gap_end = LINE_INDEX_INITIAL;
+    li->capacity = LINE_INDEX_INITIAL;
+    li->length = 0;
+}
+
+void li_free(LineIndex *li) {
+    free(li->starts);
+    li->starts = NULL;
+    li->gap_start = li->gap_end = li->capacity = li->length = 0;
+}
+
+size_t li_count(const LineIndex *li) {
+    return li->capacity - (li->gap_end - li->gap_start);
+}
+
+// Offset of the first character of line
+size_t li_start(const LineIndex *li, size_t line) {
+    if (line < li->gap_start) {
+        return li->starts[line];
+    }
+    return li->length - li->starts[line + (li->gap_end - li->gap_start)];
+}
+
+// Binary search for the line containing logical position pos
+size_t li_line_of(const LineIndex *li, size_t pos) {
+    size_t lo = 0;
+    size_t hi = li_count(li) - 1;
+    
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo + 1) / 2;
+        if (li_start(li, mid) <= pos) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// Move the gap to just before line, converting the entries it passes
+static void li_move_gap(LineIndex *li, size_t line) {
+    while (li->gap_start > line) {
+        li->gap_start--;
+        li->gap_end--;
+        li->starts[li->gap_end] = li->length - li->starts[li->gap_start];
+    }
+    while (li->gap_start < line) {
+        li->starts[li->gap_start] = li->length - li->starts[li->gap_end];
+        li->gap_start++;
+        li->gap_end++;
+    }
+}
+
+// Make room in the gap for n more lines, doubling the capacity
+static void li_reserve(LineIndex *li, size_t n) {
+    if (li->gap_end - li->gap_start >= n) return;
+    
+    size_t count = li_count(li);
+    size_t new_capacity = li->capacity * 2;
+    while (new_capacity - count < n) {
+        new_capacity *= 2;
+    }
+    
+    size_t *new_starts = realloc(li->starts, new_capacity * sizeof(size_t));
+    if (new_starts == NULL) {
+        endwin();
+        perror("Failed to grow line index");
+        exit(EXIT_FAILURE);
+    }
+    
+    size_t tail = li->capacity - li->gap_end;
+    memmove(&new_starts[new_capacity - tail], &new_starts[li->gap_end], tail * sizeof(size_t));
+    li->starts = new_starts;
+    li->gap_end = new_capacity - tail;
+    li->capacity = new_capacity;
+}
+
+// Update the index after n bytes from src were inserted at pos.
+// Only offsets are adjusted; the document text is not rescanned.
+void li_on_insert(LineIndex *li, size_t pos, const char *src, size_t n) {
+    size_t newlines = 0;
+    for (size_t k = 0; k < n; k++) {
+        newlines += src[k] == '\n';
+    }
+    
+    // Later lines count back from the end, so they need no change
+    li_move_gap(li, li_line_of(li, pos) + 1);
+    li_reserve(li, newlines);
+    li->length += n;
+    
+    // Every inserted newline starts a new line right after it
+    for (size_t k = 0; k < n; k++) {
+        if (src[k] == '\n') {
+            li->starts[li->gap_start++] = pos + k + 1;
+        }
+    }
+}
+
+// Update the index after n bytes were deleted at pos
+void li_on_delete(LineIndex *li, size_t pos, size_t n) {
+    li_move_gap(li, li_line_of(li, pos) + 1);
+    
+    // Lines starting inside the deleted range lost their newline
+    while (li->gap_end < li->capacity && li->length - li->starts[li->gap_end] <= pos + n) {
+        li->gap_end++;
+    }
+    li->length -= n;
+}
+
+void rl_init(RunList *rl) {
+    rl->runs = malloc(RUN_LIST_INITIAL * sizeof(FormatRun));
+    if (rl->runs == NULL) {
+        endwin();
+        perror("Failed to allocate formatting runs");
+        exit(EXIT_FAILURE);
+    }
+    rl->count = 0;
+    rl->capacity = RUN_LIST_INITIAL;
+    rl->shift_from = 0;
+    rl->shift = 0;
+}
+
+void rl_free(RunList *rl) {
+    free(rl->runs);
+    rl->runs = NULL;
+    rl->count = rl->capacity = rl->shift_from = rl->shift = 0;
+}
+
+size_t rl_offset(const RunList *rl, size_t r) {
+    return rl->runs[r].offset + (r >= rl->shift_from ? rl->shift : 0);
+}
+
+// Binary search for the run containing pos (the last run if pos is the
+// end of the document). Returns 0 for an empty list.
+size_t rl_find(const RunList *rl, size_t pos) {
+    size_t lo = 0;
+    size_t hi = rl->count ? rl->count - 1 : 0;
+    
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo + 1) / 2;
+        if (rl_offset(rl, mid) <= pos) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+static void rl_shift(RunList *rl, size_t first, long delta);
+
+// Replace runs [at, at+remove) with the n runs in src
+static void rl_splice(RunList *rl, size_t at, size_t remove, const FormatRun *src, size_t n) {
+    // Runs from at on, the new ones included, are stored less the pending shift
+    rl_shift(rl, at, 0);
+
+    if (rl->count - remove + n > rl->capacity) {
+        size_t new_capacity = rl->capacity * 2;
+        while (new_capacity < rl->count - remove + n) {
+            new_capacity *= 2;
+        }
+        FormatRun *new_runs = realloc(rl->runs, new_capacity * sizeof(FormatRun));
+        if (new_runs == NULL) {
+            endwin();
+            perror("Failed to grow formatting runs");
+            exit(EXIT_FAILURE);
+        }
+        rl->runs = new_runs;
+        rl->capacity = new_capacity;
+    }
+    memmove(&rl->runs[at + n], &rl->runs[at + remove],
+            (rl->count - at - remove) * sizeof(FormatRun));
+    for (size_t k = 0; k < n; k++) {
+        rl->runs[at + k] = src[k];
+        rl->runs[at + k].offset -= rl->shift;
+    }
+    rl->count = rl->count - remove + n;
+}
+
+// Shift the offsets of runs from index first onwards by delta bytes. The
+// pending shift is moved to start at first, which only updates the runs
+// between there and where it started.
+static void rl_shift(RunList *rl, size_t first, long delta) {
+    if (rl->shift == 0) {
+        rl->shift_from = first;
+    }
+    for (; rl->shift_from < first && rl->shift_from < rl->count; rl->shift_from++) {
+        rl->runs[rl->shift_from].offset += rl->shift;
+    }
+    for (; rl->shift_from > first; rl->shift_from--) {
+        rl->runs[rl->shift_from - 1].offset -= rl->shift;
+    }
+    rl->shift_from = first;
+    rl->shift += delta;
+}
+
+// Length of the formatting code (\b \i \u \cN \sN) starting at pos,
+// or 0 if the character at pos is ordinary text
+static size_t format_code_len(size_t pos, size_t len) {
+    if (gb_char_at(&doc.text, pos) != '\\' || pos + 1 >= len) return 0;
+    
+    char code = gb_char_at(&doc.text, pos + 1);
+    if (code == 'b' || code == 'i' || code == 'u') return 2;
+    if ((code == 'c' || code == 's') && pos + 2 < len &&
+        isdigit(gb_char_at(&doc.text, pos + 2))) return 3;
+    return 0;
+}
+
+// Apply a formatting code to the current attribute state
+static void apply_format_code(char code, char arg, int *attr, int *color_pair) {
+    switch (code) {
+        case 'b': // Bold toggle
+            *attr ^= A_BOLD;
+            break;
+        case 'i': // Italic toggle
+            *attr ^= A_ITALIC;
+            break;
+        case 'u': // Underline toggle
+            *attr ^= A_UNDERLINE;
+            break;
+        case 'c': // Color change
+            *color_pair = arg - '0';
+            if (*color_pair < 1 || *color_pair > 7)
+                *color_pair = 1;
+            break;
+        case 's': // Size is just a marker, actual rendering would depend on terminal
+            break;
+    }
+}
+
+// Formatting state in effect just before run r
+static void state_before_run(size_t r, int *attr, int *color_pair) {
+    if (r == 0) {
+        *attr = 0;
+        *color_pair = 1;
+    } else {
+        *attr = doc.runs.runs[r - 1].attr;
+        *color_pair = doc.runs.runs[r - 1].color_pair;
+    }
+}
+
+// Recompute the attributes of runs from index first onwards from the
+// codes in the list itself; the document text is not read.
+static void rl_restate(size_t first) {
+    int attr, color_pair;
+    state_before_run(first, &attr, &color_pair);
+    
+    for (size_t r = first; r < doc.runs.count; r++) {
+        FormatRun *run = &doc.runs.runs[r];
+        if (run->code) {
+            apply_format_code(run->code, run->arg, &attr, &color_pair);
+        }
+        run->attr = attr;
+        run->color_pair = color_pair;
+    }
+}
+
+// Tokenize document text [from, to) into runs, appending them to out.
+// Returns the number of runs produced.
+static size_t tokenize_runs(size_t from, size_t to, FormatRun *out) {
+    size_t len = gb_length(&doc.text);
+    size_t n = 0;
+    size_t text_start = from;
+    size_t i = from;
+    
+    while (i < to) {
+        size_t code = format_code_len(i, len);
+        if (!code) {
+            i++;
+            continue;
+        }
+        if (i > text_start) {
+            out[n++] = (FormatRun){ text_start, i - text_start, 0, 1, 0, 0 };
+        }
+        out[n++] = (FormatRun){ i, code, 0, 1, gb_char_at(&doc.text, i + 1),
+                                code == 3 ? gb_char_at(&doc.text, i + 2) : 0 };
+        i += code;
+        text_start = i;
+    }
+    if (i > text_start) {
+        out[n++] = (FormatRun){ text_start, i - text_start, 0, 1, 0, 0 };
+    }
+    return n;
+}
+
+// Merge neighbouring text runs in [first, last] (no code between them)
+static void rl_merge_text(size_t first, size_t last) {
+    RunList *rl = &doc.runs;
+    size_t r = first;
+    
+    while (r < last && r + 1 < rl->count) {
+        if (!rl->runs[r].code && !rl->runs[r + 1].code) {
+            rl->runs[r].length += rl->runs[r + 1].length;
+            rl_splice(rl, r + 1, 1, NULL, 0);
+            last--;
+        } else {
+            r++;
+        }
+    }
+}
+
+// Re-tokenize around an edit that may create or destroy formatting codes.
+// Old (pre-edit) bytes [lo, hi) are affected and the text length changed
+// by delta; only that window is rescanned, runs after it are shifted and
+// their attributes recomputed from the run list.
+static void runs_retokenize(size_t lo, size_t hi, long delta) {
+    RunList *rl = &doc.runs;
+    FormatRun left = { 0 }, right = { 0 };
+    int has_left = 0, has_right = 0;
+    size_t a = 0, b = 0;
+    size_t region_start = lo;
+    size_t region_end = hi;
+    
+    if (rl->count > 0) {
+        // Widen the window to whole code runs, and keep the untouched
+        // parts of text runs it cuts through
+        a = rl_find(rl, lo);
+        b = rl_find(rl, hi - 1);
+        size_t a_offset = rl_offset(rl, a);
+        if (rl->runs[a].code || a_offset == lo) {
+            region_start = a_offset;
+        } else {
+            left = rl->runs[a];
+            left.offset = a_offset;
+            left.length = lo - a_offset;
+            has_left = 1;
+        }
+        size_t b_end = rl_offset(rl, b) + rl->runs[b].length;
+        if (rl->runs[b].code || b_end <= hi) {
+            region_end = b_end;
+        } else {
+            right = rl->runs[b];
+            right.length = b_end - hi;
+            has_right = 1;
+        }
+        b++;
+    }
+    
+    // Scan the edited window of the new text
+    size_t new_end = region_end + delta;
+    FormatRun *mid = malloc((new_end - region_start + 2) * sizeof(FormatRun));
+    if (mid == NULL) {
+        endwin();
+        perror("Failed to allocate formatting runs");
+        exit(EXIT_FAILURE);
+    }
+    size_t n = 0;
+    if (has_left) {
+        mid[n++] = left;
+    }
+    n += tokenize_runs(region_start, new_end, &mid[n]);
+    if (has_right) {
+        right.offset = new_end;
+        mid[n++] = right;
+    }
+    
+    rl_splice(rl, a, b - a, mid, n);
+    free(mid);
+    rl_shift(rl, a + n, delta);
+    rl_merge_text(a > 0 ? a - 1 : 0, a + n);
+    rl_restate(a > 0 ? a - 1 : 0);
+}
+
+// Update the run list after n plain bytes (no codes involved) were
+// inserted at pos: the run there grows and later runs shift.
+static void runs_on_plain_insert(size_t pos, size_t n) {
+    RunList *rl = &doc.runs;
+    
+    if (rl->count == 0) {
+        FormatRun run = { 0, n, 0, 1, 0, 0 };
+        rl_splice(rl, 0, 0, &run, 1);
+        return;
+    }
+    
+    size_t r = rl_find(rl, pos);
+    FormatRun *run = &rl->runs[r];
+    size_t offset = rl_offset(rl, r);
+    if (!run->code) {
+        run->length += n;
+    } else if (pos == offset && r > 0 && !rl->runs[r - 1].code) {
+        // Typed just before a code: extends the text run before it
+        rl->runs[r - 1].length += n;
+        r--;
+    } else {
+        // Before a code with no text run ahead of it, or after the last code
+        FormatRun text = { pos, n, 0, 1, 0, 0 };
+        if (pos != offset) {
+            r++;
+        }
+        state_before_run(r, &text.attr, &text.color_pair);
+        rl_splice(rl, r, 0, &text, 1);
+    }
+    rl_shift(rl, r + 1, n);
+}
+
+// Update the run list after n plain bytes were deleted at pos
+static void runs_on_plain_delete(size_t pos, size_t n) {
+    RunList *rl = &doc.runs;
+    size_t r = rl_find(rl, pos);
+    
+    rl->runs[r].length -= n;
+    if (rl->runs[r].length == 0) {
+        rl_splice(rl, r, 1, NULL, 0);
+    } else {
+        r++;
+    }
+    rl_shift(rl, r, -(long)n);
+}
+
+static int line_rows(size_t line, int width);
+
+// True if an edit at pos could join or split a formatting code
+static int near_format_code(size_t pos) {
+    return (pos >= 1 && gb_char_at(&doc.text, pos - 1) == '\\') ||
+           (pos >= 2 && gb_char_at(&doc.text, pos - 2) == '\\');
+}
+
+// Record the damage caused by editing line. Plain edits repaint just that
+// line; anything that changes line breaks, wrapping or formatting codes
+// repaints everything below it as well.
+static void mark_edit_dirty(size_t line, int rows_before, int structural) {
+    if (structural || line_rows(line, text_width) != rows_before) {
+        mark_lines_dirty(line, SIZE_MAX);
+    } else {
+        mark_lines_dirty(line, line);
+    }
+}
+
+void doc_insert(size_t pos, const char *src, size_t n) {
+    size_t line = li_line_of(&doc.lines, pos);
+    int rows_before = line_rows(line, text_width);
+    int touches_code = memchr(src, '\\', n) || near_format_code(pos);
+    int structural = touches_code || memchr(src, '\n', n);
+    
+    gb_insert(&doc.text, pos, src, n);
+    li_on_insert(&doc.lines, pos, src, n);
+    if (touches_code) {
+        size_t old_len = gb_length(&doc.text) - n;
+        size_t lo = pos >= 2 ? pos - 2 : 0;
+        size_t hi = pos + 2 < old_len ? pos + 2 : old_len;
+        runs_retokenize(lo, hi > lo ? hi : lo, n);
+    } else {
+        runs_on_plain_insert(pos, n);
+    }
+    mark_edit_dirty(line, rows_before, structural);
+    
+    if (collab_fd >= 0 && !collab_remote) {
+        collab_send_insert(pos, src, n);
+    }
+}
+
+void doc_delete(size_t pos, size_t n) {
+    size_t line = li_line_of(&doc.lines, pos);
+    int rows_before = line_rows(line, text_width);
+    int touches_code = near_format_code(pos);
+    int structural = touches_code;
+    
+    if (collab_fd >= 0 && !collab_remote) {
+        collab_send_delete(pos, n);
+    }
+    
+    for (size_t i = pos; i < pos + n; i++) {
+        char c = gb_char_at(&doc.text, i);
+        if (c == '\\') touches_code = 1;
+        if (c == '\n' || c == '\\') structural = 1;
+    }
+    
+    size_t old_len = gb_length(&doc.text);
+    gb_delete(&doc.text, pos, n);
+    li_on_delete(&doc.lines, pos, n);
+    if (touches_code) {
+        size_t lo = pos >= 2 ? pos - 2 : 0;
+        size_t hi = pos + n + 2 < old_len ? pos + n + 2 : old_len;
+        runs_retokenize(lo, hi, -(long)n);
+    } else {
+        runs_on_plain_delete(pos, n);
+    }
+    mark_edit_dirty(line, rows_before, structural);
+}
+
+void mark_lines_dirty(size_t from, size_t to) {
+    if (from < dirty_from) dirty_from = from;
+    if (to > dirty_to) dirty_to = to;
+}
+
 void init_document() {
-    memset(doc.text, 0, MAX_TEXT);
+    gb_init(&doc.text, GAP_INITIAL);
+    li_init(&doc.lines);
+    rl_init(&doc.runs);
+    doc.top_line = 0;
     doc.cursor_pos = 0;
     doc.current_color = 1;
     doc.is_bold = 0;
@@ -174,12 +951,23 @@ void init_document() {
     strcpy(doc.filename, "document.txt");
 }
 
+void free_document() {
+    gb_free(&doc.text);
+    li_free(&doc.lines);
+    rl_free(&doc.runs);
+}
+
 void draw_status_bar(WINDOW *win) {
     wattron(win, A_REVERSE);
     mvwprintw(win, 0, 0, "Docs-like App | User: %s | %s | %s", 
               users[current_user].username,
               is_owner() ? "Owner" : "Viewer",
               is_writer() ? "Writer" : "Reader");
+    if (collab_fd >= 0 && collab_ot && ot_latency_ms >= 0) {
+        wprintw(win, " | Live (OT, %ld ms)", ot_latency_ms);
+    } else if (collab_fd >= 0) {
+        wprintw(win, " | Live");
+    }
     
     int max_x = getmaxx(win);
     for (int i = getcurx(win); i < max_x; i++) {
@@ -221,120 +1009,149 @@ void draw_format_bar(WINDOW *win) {
     wattroff(win, A_REVERSE);
 }
 
-void draw_text_area(WINDOW *win) {
-    box(win, 0, 0);
+// End of a line (position of its newline, or end of document)
+static size_t line_end(size_t line) {
+    if (line + 1 < li_count(&doc.lines)) {
+        return li_start(&doc.lines, line + 1) - 1;
+    }
+    return gb_length(&doc.text);
+}
+
+// Number of visible characters between start and pos, counted from the
+// text runs that overlap the range
+static size_t visible_columns(size_t start, size_t pos) {
+    size_t cols = 0;
     
-    // Parse and display the document with formatting
-    int y = 1;
-    int x = 1;
-    int max_y = getmaxy(win) - 2;
-    int max_x = getmaxx(win) - 2;
+    for (size_t r = rl_find(&doc.runs, start); r < doc.runs.count; r++) {
+        const FormatRun *run = &doc.runs.runs[r];
+        size_t offset = rl_offset(&doc.runs, r);
+        if (offset >= pos) break;
+        if (run->code) continue;
+        
+        size_t from = offset > start ? offset : start;
+        size_t to = offset + run->length < pos ? offset + run->length : pos;
+        if (to > from) {
+            cols += to - from;
+        }
+    }
+    return cols;
+}
+
+// Screen rows a line occupies once wrapped to width
+static int line_rows(size_t line, int width) {
+    size_t cols = visible_columns(li_start(&doc.lines, line), line_end(line));
+    return cols == 0 ? 1 : (int)((cols - 1) / width) + 1;
+}
+
+// Adjust the scroll offset so the cursor's row is inside the viewport.
+// Only the lines between the top of the viewport and the cursor are
+// measured, so the cost does not depend on the document size.
+static void scroll_to_cursor(int rows, int width) {
+    size_t cursor_line = li_line_of(&doc.lines, doc.cursor_pos);
     
-    // Track current formatting state
-    int current_attr = 0;
-    int current_color_pair = 1;
+    if (cursor_line < doc.top_line) {
+        doc.top_line = cursor_line;
+    } else if (cursor_line - doc.top_line >= (size_t)rows) {
+        doc.top_line = cursor_line - rows + 1;
+    }
     
-    wattron(win, current_attr | COLOR_PAIR(current_color_pair));
+    int cursor_row = visible_columns(li_start(&doc.lines, cursor_line), doc.cursor_pos) / width;
+    int used = cursor_row;
+    for (size_t l = doc.top_line; l < cursor_line; l++) {
+        used += line_rows(l, width);
+    }
+    while (used >= rows && doc.top_line < cursor_line) {
+        used -= line_rows(doc.top_line, width);
+        doc.top_line++;
+    }
+}
+
+// Repaint text lines from..to (to == SIZE_MAX: down to the bottom of the
+// viewport). Rows of lines above from are only measured, not drawn.
+static void paint_text_lines(WINDOW *win, size_t from, size_t to, int rows, int max_x) {
+    size_t line = doc.top_line;
+    int y = 1;
     
-    for (int i = 0; i < strlen(doc.text); i++) {
-        // Special formatting tokens (simplified for this example)
-        if (doc.text[i] == '\n') {
-            y++;
-            x = 1;
-            if (y >= max_y) break;
-            continue;
-        }
+    if (from < doc.top_line) from = doc.top_line;
+    for (; line < from && line < li_count(&doc.lines) && y <= rows; line++) {
+        y += line_rows(line, max_x);
+    }
+    
+    for (; line < li_count(&doc.lines) && line <= to && y <= rows; line++) {
+        size_t start = li_start(&doc.lines, line);
+        size_t end = line_end(line);
+        int x = 1;
         
-        // Check if we need to parse formatting codes
-        if (doc.text[i] == '\\' && i+1 < strlen(doc.text)) {
-            switch (doc.text[i+1]) {
-                case 'b': // Bold toggle
-                    i++;
-                    if (current_attr & A_BOLD)
-                        current_attr &= ~A_BOLD;
-                    else
-                        current_attr |= A_BOLD;
-                    
-                    wattrset(win, current_attr | COLOR_PAIR(current_color_pair));
-                    continue;
-                case 'i': // Italic toggle
-                    i++;
-                    if (current_attr & A_ITALIC)
-                        current_attr &= ~A_ITALIC;
-                    else
-                        current_attr |= A_ITALIC;
-                    
-                    wattrset(win, current_attr | COLOR_PAIR(current_color_pair));
-                    continue;
-                case 'u': // Underline toggle
-                    i++;
-                    if (current_attr & A_UNDERLINE)
-                        current_attr &= ~A_UNDERLINE;
-                    else
-                        current_attr |= A_UNDERLINE;
-                    
-                    wattrset(win, current_attr | COLOR_PAIR(current_color_pair));
-                    continue;
-                case 'c': // Color change
-                    if (i+2 < strlen(doc.text) && isdigit(doc.text[i+2])) {
-                        current_color_pair = doc.text[i+2] - '0';
-                        if (current_color_pair < 1 || current_color_pair > 7)
-                            current_color_pair = 1;
-                        i += 2;
-                        wattrset(win, current_attr | COLOR_PAIR(current_color_pair));
-                        continue;
-                    }
-                    break;
-                case 's': // Size change
-                    if (i+2 < strlen(doc.text) && isdigit(doc.text[i+2])) {
-                        // Size is just a marker, actual rendering would depend on terminal
-                        i += 2;
-                        continue;
-                    }
-                    break;
-            }
-        }
+        wattrset(win, 0);
+        mvwhline(win, y, 1, ' ', max_x);
         
-        // Display regular character
-        if (x <= max_x) {
-            mvwaddch(win, y, x, doc.text[i]);
-            x++;
-        } else {
-            y++;
-            x = 1;
-            if (y >= max_y) break;
-            mvwaddch(win, y, x, doc.text[i]);
-            x++;
-        }
-    }
-    
-    // Position cursor at insertion point
-    int cursor_y = 1;
-    int cursor_x = 1;
-    int count = 0;
-    
-    for (int i = 0; i < doc.cursor_pos && i < strlen(doc.text); i++) {
-        if (doc.text[i] == '\n') {
-            cursor_y++;
-            cursor_x = 1;
-        } else if (doc.text[i] == '\\' && i+1 < strlen(doc.text)) {
-            // Skip formatting codes
-            if (strchr("biucs", doc.text[i+1])) {
-                i++;
-                if (strchr("cs", doc.text[i]) && i+1 < strlen(doc.text))
-                    i++;
-            } else {
-                cursor_x++;
+        // Draw the text runs overlapping this line with their attributes
+        for (size_t r = rl_find(&doc.runs, start); r < doc.runs.count && y <= rows; r++) {
+            const FormatRun *run = &doc.runs.runs[r];
+            size_t offset = rl_offset(&doc.runs, r);
+            if (offset >= end) break;
+            if (run->code) continue;
+            
+            size_t i = offset > start ? offset : start;
+            size_t run_end = offset + run->length < end ? offset + run->length : end;
+            wattrset(win, run->attr | COLOR_PAIR(run->color_pair));
+            
+            for (; i < run_end; i++) {
+                // Wrap long lines
+                if (x > max_x) {
+                    y++;
+                    x = 1;
+                    if (y > rows) break;
+                    wattrset(win, 0);
+                    mvwhline(win, y, 1, ' ', max_x);
+                    wattrset(win, run->attr | COLOR_PAIR(run->color_pair));
+                }
+                mvwaddch(win, y, x, gb_char_at(&doc.text, i));
+                x++;
             }
-        } else {
-            cursor_x++;
         }
-        
-        if (cursor_x > max_x) {
-            cursor_y++;
-            cursor_x = 1;
+        y++;
+    }
+    
+    // Lines may have been removed or shortened: blank out what is left
+    wattrset(win, 0);
+    if (to == SIZE_MAX) {
+        for (; y <= rows; y++) {
+            mvwhline(win, y, 1, ' ', max_x);
         }
     }
+}
+
+void draw_text_area(WINDOW *win) {
+    // Usable area inside the border
+    int rows = getmaxy(win) - 2;
+    int max_x = getmaxx(win) - 2;
+    
+    size_t old_top = doc.top_line;
+    scroll_to_cursor(rows, max_x);
+    
+    // Scrolling moves every row, so it is a full repaint; otherwise only
+    // the lines damaged by edits since the last frame are drawn
+    if ((dirty & DIRTY_TEXT) || doc.top_line != old_top) {
+        werase(win);
+        box(win, 0, 0);
+        paint_text_lines(win, doc.top_line, SIZE_MAX, rows, max_x);
+    } else if (dirty_from <= dirty_to) {
+        paint_text_lines(win, dirty_from, dirty_to, rows, max_x);
+    }
+    dirty_from = SIZE_MAX;
+    dirty_to = 0;
+    
+    // Position cursor at insertion point: binary search for its line,
+    // then measure only within that line
+    size_t cursor_line = li_line_of(&doc.lines, doc.cursor_pos);
+    size_t cols = visible_columns(li_start(&doc.lines, cursor_line), doc.cursor_pos);
+    int cursor_y = 1 + cols / max_x;
+    int cursor_x = 1 + cols % max_x;
+    
+    for (size_t l = doc.top_line; l < cursor_line; l++) {
+        cursor_y += line_rows(l, max_x);
+    }
     
     // Move cursor to edit position if writer
     if (is_writer()) {
@@ -345,41 +1162,36 @@ void draw_text_area(WINDOW *win) {
 void process_key(int ch) {
     if (!is_writer()) return;
     
+    size_t len = gb_length(&doc.text);
+    
     if (ch == KEY_BACKSPACE || ch == 127) {
         if (doc.cursor_pos > 0) {
-            memmove(&doc.text[doc.cursor_pos-1], &doc.text[doc.cursor_pos], 
-                    strlen(doc.text) - doc.cursor_pos + 1);
+            doc_delete(doc.cursor_pos-1, 1);
             doc.cursor_pos--;
         }
     } else if (ch == KEY_DC) { // Delete key
-        if (doc.cursor_pos < strlen(doc.text)) {
-            memmove(&doc.text[doc.cursor_pos], &doc.text[doc.cursor_pos+1], 
-                    strlen(doc.text) - doc.cursor_pos);
+        if (doc.cursor_pos < len) {
+            doc_delete(doc.cursor_pos, 1);
         }
     } else if (ch == KEY_LEFT) {
         if (doc.cursor_pos > 0) doc.cursor_pos--;
     } else if (ch == KEY_RIGHT) {
-        if (doc.cursor_pos < strlen(doc.text)) doc.cursor_pos++;
+        if (doc.cursor_pos < len) doc.cursor_pos++;
     } else if (ch == KEY_UP || ch == KEY_DOWN) {
         // Simplified cursor movement for this example
         // Would need more complex handling for proper line navigation
     } else if (ch == '\n' || ch == KEY_ENTER || ch == 10 || ch == 13) {
         // Insert newline
-        memmove(&doc.text[doc.cursor_pos+1], &doc.text[doc.cursor_pos], 
-                strlen(doc.text) - doc.cursor_pos + 1);
-        doc.text[doc.cursor_pos] = '\n';
+        doc_insert(doc.cursor_pos, "\n", 1);
         doc.cursor_pos++;
     } else if (ch == KEY_F(1) || ch == KEY_F(2) || ch == KEY_F(3) || 
                ch == KEY_F(4) || ch == KEY_F(5)) {
         // Formatting handled elsewhere
     } else if (isprint(ch)) {
         // Insert regular character
-        if (strlen(doc.text) < MAX_TEXT - 1) {
-            memmove(&doc.text[doc.cursor_pos+1], &doc.text[doc.cursor_pos], 
-                    strlen(doc.text) - doc.cursor_pos + 1);
-            doc.text[doc.cursor_pos] = ch;
-            doc.cursor_pos++;
-        }
+        char c = ch;
+        doc_insert(doc.cursor_pos, &c, 1);
+        doc.cursor_pos++;
     }
 }
 
@@ -406,25 +1218,15 @@ void apply_formatting(int ch) {
     }
     
     // Insert the format code at cursor position
-    if (format_code[0] && strlen(doc.text) + strlen(format_code) < MAX_TEXT) {
-        memmove(&doc.text[doc.cursor_pos + strlen(format_code)], 
-                &doc.text[doc.cursor_pos], 
-                strlen(doc.text) - doc.cursor_pos + 1);
-        
-        for (int i = 0; i < strlen(format_code); i++) {
-            doc.text[doc.cursor_pos + i] = format_code[i];
-        }
-        
-        doc.cursor_pos += strlen(format_code);
+    if (format_code[0]) {
+        size_t code_len = strlen(format_code);
+        doc_insert(doc.cursor_pos, format_code, code_len);
+        doc.cursor_pos += code_len;
     }
 }
 
 void save_document() {
-    FILE *fp = fopen(doc.filename, "w");
-    if (fp) {
-        fprintf(fp, "%s", doc.text);
-        fclose(fp);
-    }
+    gb_save(&doc.text, doc.filename);
 }
 
 void add_user() {
@@ -547,4 +1349,272 @@ int is_writer() {
         return users[current_user].isWriter;
     }
     return 0;
-}
\ No newline at end of file
+}
+// Read exactly n bytes from the hub while joining
+static int collab_read_full(void *buf, size_t n) {
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = read(collab_fd, (char *)buf + got, n - got);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) continue;
+            return 0;
+        }
+        got += r;
+    }
+    return 1;
+}
+
+// Connect to the live editing hub and take the session's current state.
+// A CRDT hub sends a snapshot of its replica and then a welcome with
+// this process's site; an OT hub starts with its welcome (site and
+// revision) followed by the text. Runs before ncurses starts, so errors
+// go to the terminal as usual.
+int collab_connect(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    collab_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (collab_fd < 0 || connect(collab_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("Cannot reach the live editing session (is the owner running?)");
+        collab_disconnect();
+        return 0;
+    }
+    
+    union {
+        CrdtOp crdt;
+        OtOp ot;
+    } record;
+    if (!collab_read_full(&record, sizeof(record))) {
+        printf("Live editing session closed while joining\n");
+        collab_disconnect();
+        return 0;
+    }
+    
+    if (record.ot.kind == OT_WELCOME) {
+        collab_ot = 1;
+        ot_site = record.ot.site;
+        ot_revision = record.ot.revision;
+        ot_initial_len = record.ot.pos;
+        ot_initial = malloc(ot_initial_len + 1);
+        if (ot_initial == NULL || !collab_read_full(ot_initial, ot_initial_len)) {
+            printf("Live editing session closed while joining\n");
+            collab_disconnect();
+            return 0;
+        }
+        return 1;
+    }
+    
+    crdt_init(&collab, 0);
+    while (record.crdt.kind != CRDT_WELCOME) {
+        crdt_apply(&collab, &record.crdt);
+        if (!collab_read_full(&record, sizeof(record))) {
+            printf("Live editing session closed while joining\n");
+            collab_disconnect();
+            return 0;
+        }
+    }
+    collab.site = record.crdt.id.site;
+    if (record.crdt.id.clock > collab.clock) {
+        collab.clock = record.crdt.id.clock;
+    }
+    return 1;
+}
+
+// Put the session's text in the (empty) document
+void collab_load() {
+    size_t len = ot_initial_len;
+    char *text = collab_ot ? ot_initial : crdt_text(&collab, &len, NULL);
+    if (text != NULL) {
+        collab_remote = 1;
+        doc_insert(0, text, len);
+        collab_remote = 0;
+        free(text);
+    }
+    ot_initial = NULL;
+}
+
+// Wait for a key or for operations from the hub. Returns 1 when a key
+// is ready, 0 after applying operations (the screen needs a repaint).
+int collab_wait_input() {
+    struct pollfd fds[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = collab_fd, .events = POLLIN },
+    };
+    if (poll(fds, 2, -1) < 0) {
+        return 0;
+    }
+    if (fds[1].revents) {
+        collab_receive();
+        return 0;
+    }
+    return 1;
+}
+
+// An edit from another writer, moving the cursor with the text around it
+static void collab_apply_remote(int insert, size_t pos, char ch) {
+    if (insert) {
+        doc_insert(pos, &ch, 1);
+        if (pos < doc.cursor_pos) doc.cursor_pos++;
+    } else {
+        doc_delete(pos, 1);
+        if (pos < doc.cursor_pos) doc.cursor_pos--;
+    }
+}
+
+static void collab_send(const void *records, size_t count) {
+    const char *p = records;
+    size_t left = count * sizeof(CrdtOp);
+    while (left > 0) {
+        ssize_t n = send(collab_fd, p, left, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            collab_disconnect();
+            return;
+        }
+        p += n;
+        left -= n;
+    }
+}
+
+// OT: send the outstanding change, made against the last revision seen
+static void ot_send_outstanding() {
+    OtOp commit = { .kind = OT_COMMIT, .revision = ot_revision };
+    clock_gettime(CLOCK_MONOTONIC, &ot_sent_at);
+    collab_send(ot_outstanding.ops, ot_outstanding.count);
+    if (collab_fd >= 0) collab_send(&commit, 1);
+}
+
+// OT: one change is in flight at a time; edits made meanwhile wait in
+// the buffer and go out as the next change once it is acknowledged
+static void ot_local(const OtOp *op) {
+    if (ot_outstanding.count > 0) {
+        ot_change_push(&ot_buffer, op);
+        return;
+    }
+    if (ot_change_push(&ot_outstanding, op)) {
+        ot_send_outstanding();
+    }
+}
+
+// OT: a change from the hub was made without ours in flight and in the
+// buffer; transform it past them before applying it here, and them past
+// it for when the hub commits them
+static void ot_receive(const OtOp *op) {
+    if (op->kind == OT_ACK) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ot_latency_ms = (now.tv_sec - ot_sent_at.tv_sec) * 1000 +
+                        (now.tv_nsec - ot_sent_at.tv_nsec) / 1000000;
+        dirty |= DIRTY_STATUS;
+        
+        ot_revision++;
+        ot_change_free(&ot_outstanding);
+        ot_outstanding = ot_buffer;
+        ot_buffer = (OtChange){ 0 };
+        if (ot_outstanding.count > 0) {
+            ot_send_outstanding();
+        }
+    } else if (op->kind == OT_COMMIT) {
+        ot_revision++;
+        ot_transform(ot_outstanding.ops, ot_outstanding.count, ot_incoming.ops, ot_incoming.count);
+        ot_transform(ot_buffer.ops, ot_buffer.count, ot_incoming.ops, ot_incoming.count);
+        for (size_t i = 0; i < ot_incoming.count; i++) {
+            const OtOp *in = &ot_incoming.ops[i];
+            if (in->kind != OT_NOOP) {
+                collab_apply_remote(in->kind == OT_INSERT, in->pos, in->ch);
+            }
+        }
+        ot_incoming.count = 0;
+    } else {
+        ot_change_push(&ot_incoming, op);
+    }
+}
+
+// Apply the operations the hub has sent
+void collab_receive() {
+    ssize_t n = read(collab_fd, collab_in + collab_in_len, sizeof(collab_in) - collab_in_len);
+    if (n <= 0) {
+        if (n < 0 && errno == EINTR) return;
+        collab_disconnect();
+        return;
+    }
+    collab_in_len += n;
+    
+    size_t count = collab_in_len / sizeof(CrdtOp);
+    collab_remote = 1;
+    for (size_t i = 0; i < count; i++) {
+        if (collab_ot) {
+            OtOp op;
+            memcpy(&op, collab_in + i * sizeof(OtOp), sizeof(op));
+            ot_receive(&op);
+            continue;
+        }
+        CrdtOp op;
+        memcpy(&op, collab_in + i * sizeof(CrdtOp), sizeof(op));
+        long pos = crdt_apply(&collab, &op);
+        if (pos >= 0) {
+            collab_apply_remote(op.kind == CRDT_INSERT, pos, op.ch);
+        }
+    }
+    collab_remote = 0;
+    collab_in_len -= count * sizeof(CrdtOp);
+    memmove(collab_in, collab_in + count * sizeof(CrdtOp), collab_in_len);
+}
+
+// Local edits are applied here at once and sent to the hub; nothing
+// waits for the other writers
+void collab_send_insert(size_t pos, const char *src, size_t n) {
+    if (collab_ot) {
+        for (size_t i = 0; i < n; i++) {
+            OtOp op = { .kind = OT_INSERT, .site = ot_site, .pos = pos + i, .ch = src[i] };
+            ot_local(&op);
+        }
+        return;
+    }
+    CrdtOp *ops = malloc(n * sizeof(CrdtOp));
+    if (ops == NULL) return;
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (crdt_local_insert(&collab, pos + i, src[i], &ops[count])) {
+            count++;
+        }
+    }
+    collab_send(ops, count);
+    free(ops);
+}
+
+void collab_send_delete(size_t pos, size_t n) {
+    if (collab_ot) {
+        for (size_t i = 0; i < n; i++) {
+            OtOp op = { .kind = OT_DELETE, .site = ot_site, .pos = pos };
+            ot_local(&op);
+        }
+        return;
+    }
+    CrdtOp *ops = malloc(n * sizeof(CrdtOp));
+    if (ops == NULL) return;
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (crdt_local_delete(&collab, pos, &ops[count])) {
+            count++;
+        }
+    }
+    collab_send(ops, count);
+    free(ops);
+}
+
+// Leave the session; the text stays in the editor and can still be saved
+void collab_disconnect() {
+    if (collab_fd < 0) return;
+    close(collab_fd);
+    collab_fd = -1;
+    if (collab_ot) {
+        ot_change_free(&ot_outstanding);
+        ot_change_free(&ot_buffer);
+        ot_change_free(&ot_incoming);
+        free(ot_initial);
+        ot_initial = NULL;
+    } else {
+        crdt_free(&collab);
+    }
+    dirty |= DIRTY_STATUS;
+}
@@ -0,0 +1,542 @@
+// oplog.c
+// Operation log for the shared document. An edit session appends at most
+// one delete and one insert record, synced with a single fdatasync, so a
+// save costs disk writes in proportion to the change rather than the
+// document. Every record carries a checksum; a torn record at the end of
+// the log (crash mid-append) is ignored by readers and cut off by
+// oplog_recover().
+//
+// A checkpoint folds the log into the document file:
+//   1. append an OPLOG_CHECKPOINT record naming the new contents
+//   2. commit the new contents over the document (commit_file)
+//   3. truncate the log
+// After a crash between 2 and 3 the document already matches the
+// checkpoint record, so the operations before it are skipped instead of
+// being applied twice.
+
+#include "oplog.h"
+#include "commit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#define LOG_PATH_MAX 256
+
+static uint64_t fnv1a(uint64_t hash, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+#define FNV_BASIS 14695981039346656037ULL
+
+static void log_path(const char *doc_path, char *path) {
+    snprintf(path, LOG_PATH_MAX, "%s%s", doc_path, OPLOG_SUFFIX);
+}
+
+static uint64_t record_checksum(const OpRecord *rec, const char *payload, size_t payload_len) {
+    OpRecord copy = *rec;
+    copy.checksum = 0;
+    uint64_t hash = fnv1a(FNV_BASIS, (const char *)&copy, sizeof(copy));
+    return fnv1a(hash, payload, payload_len);
+}
+
+static void fill_record(OpRecord *rec, uint32_t kind, uint64_t offset, uint64_t length,
+                        const char *user, const char *payload, size_t payload_len) {
+    memset(rec, 0, sizeof(*rec));
+    rec->magic = OPLOG_MAGIC;
+    rec->kind = kind;
+    rec->offset = offset;
+    rec->length = length;
+    rec->timestamp = time(NULL);
+    snprintf(rec->user, sizeof(rec->user), "%s", user ? user : "");
+    rec->checksum = record_checksum(rec, payload, payload_len);
+}
+
+static size_t payload_length(const OpRecord *rec) {
+    return rec->kind == OPLOG_INSERT ? rec->length : 0;
+}
+
+// Read the next intact record at log[pos]; false at the end of the log or
+// at a damaged record
+static bool next_record(const char *log, size_t len, size_t pos, OpRecord *rec) {
+    if (len - pos < sizeof(*rec)) {
+        return false;
+    }
+    memcpy(rec, log + pos, sizeof(*rec));
+    if (rec->magic != OPLOG_MAGIC || rec->kind < OPLOG_INSERT || rec->kind > OPLOG_CHECKPOINT) {
+        return false;
+    }
+    size_t payload = payload_length(rec);
+    if (payload > len - pos - sizeof(*rec)) {
+        return false;
+    }
+    return rec->checksum == record_checksum(rec, log + pos + sizeof(*rec), payload);
+}
+
+// Length of the leading run of intact records
+static size_t valid_prefix(const char *log, size_t len) {
+    OpRecord rec;
+    size_t pos = 0;
+    while (next_record(log, len, pos, &rec)) {
+        pos += sizeof(rec) + payload_length(&rec);
+    }
+    return pos;
+}
+
+static char *read_fd(int fd, size_t *len) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return NULL;
+    }
+    char *data = malloc(st.st_size ? st.st_size : 1);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    size_t done = 0;
+    while (done < (size_t)st.st_size) {
+        ssize_t n = pread(fd, data + done, st.st_size - done, done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(data);
+            return NULL;
+        }
+        done += n;
+    }
+    *len = done;
+    return data;
+}
+
+static bool write_at(int fd, const char *data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// Piece list editing
+
+static bool reserve_pieces(OpView *view, int extra) {
+    if (view->count + extra <= view->capacity) {
+        return true;
+    }
+    int capacity = view->capacity ? view->capacity * 2 : 16;
+    while (capacity < view->count + extra) {
+        capacity *= 2;
+    }
+    struct iovec *pieces = realloc(view->pieces, capacity * sizeof(*pieces));
+    if (pieces == NULL) {
+        return false;
+    }
+    view->pieces = pieces;
+    view->capacity = capacity;
+    return true;
+}
+
+// Index of the piece starting at pos, splitting a piece if pos falls
+// inside it (-1 on allocation failure)
+static int split_at(OpView *view, size_t pos) {
+    size_t at = 0;
+    for (int i = 0; i < view->count; i++) {
+        size_t len = view->pieces[i].iov_len;
+        if (pos == at) {
+            return i;
+        }
+        if (pos < at + len) {
+            if (!reserve_pieces(view, 1)) {
+                return -1;
+            }
+            memmove(&view->pieces[i + 2], &view->pieces[i + 1],
+                    (view->count - i - 1) * sizeof(struct iovec));
+            view->pieces[i + 1].iov_base = (char *)view->pieces[i].iov_base + (pos - at);
+            view->pieces[i + 1].iov_len = len - (pos - at);
+            view->pieces[i].iov_len = pos - at;
+            view->count++;
+            return i + 1;
+        }
+        at += len;
+    }
+    return view->count;
+}
+
+static void reset_pieces(OpView *view, const char *base, size_t base_len) {
+    view->count = 0;
+    view->length = base_len;
+    view->ops = 0;
+    if (base_len > 0) {
+        view->pieces[0].iov_base = (void *)base;
+        view->pieces[0].iov_len = base_len;
+        view->count = 1;
+    }
+}
+
+static bool apply_record(OpView *view, const OpRecord *rec, const char *payload) {
+    if (rec->offset > view->length) {
+        return false;
+    }
+
+    if (rec->kind == OPLOG_INSERT) {
+        if (rec->length == 0) {
+            return true;
+        }
+        int at = split_at(view, rec->offset);
+        if (at < 0 || !reserve_pieces(view, 1)) {
+            return false;
+        }
+        memmove(&view->pieces[at + 1], &view->pieces[at], (view->count - at) * sizeof(struct iovec));
+        view->pieces[at].iov_base = (void *)payload;
+        view->pieces[at].iov_len = rec->length;
+        view->count++;
+        view->length += rec->length;
+    } else {
+        if (rec->length > view->length - rec->offset) {
+            return false;
+        }
+        int first = split_at(view, rec->offset);
+        int last = first < 0 ? -1 : split_at(view, rec->offset + rec->length);
+        if (last < 0) {
+            return false;
+        }
+        memmove(&view->pieces[first], &view->pieces[last], (view->count - last) * sizeof(struct iovec));
+        view->count -= last - first;
+        view->length -= rec->length;
+    }
+    view->ops++;
+    return true;
+}
+
+// Apply the intact records of log (which the view takes over) to base
+static bool build_view(char *log, size_t log_len, const char *base, size_t base_len, OpView *view) {
+    memset(view, 0, sizeof(*view));
+    view->log = log;
+    if (!reserve_pieces(view, 1)) {
+        return false;
+    }
+    reset_pieces(view, base, base_len);
+
+    bool base_hashed = false;
+    uint64_t base_hash = 0;
+    OpRecord rec;
+    size_t pos = 0;
+    while (next_record(log, log_len, pos, &rec)) {
+        const char *payload = log + pos + sizeof(rec);
+        pos += sizeof(rec) + payload_length(&rec);
+
+        if (rec.kind == OPLOG_CHECKPOINT) {
+            // Hashing is only needed after a crash left the log untruncated
+            if (!base_hashed) {
+                base_hash = fnv1a(FNV_BASIS, base, base_len);
+                base_hashed = true;
+            }
+            if (rec.offset == base_len && rec.length == base_hash) {
+                reset_pieces(view, base, base_len);
+            }
+            continue;
+        }
+        if (!apply_record(view, &rec, payload)) {
+            fprintf(stderr, "Error: Operation log does not match the document; ignoring its tail.\n");
+            break;
+        }
+    }
+    return true;
+}
+
+// Hold doc_path's log shared, so no checkpoint can replace the document
+// file and empty the log between reading the one and the other. *log_fd
+// is -1 if there is no log yet. Released with oplog_unlock().
+bool oplog_lock_shared(const char *doc_path, int *log_fd) {
+    char path[LOG_PATH_MAX];
+    log_path(doc_path, path);
+    *log_fd = open(path, O_RDONLY);
+    if (*log_fd == -1) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        perror("Error opening operation log");
+        return false;
+    }
+    flock(*log_fd, LOCK_SH);
+    return true;
+}
+
+void oplog_unlock(int log_fd) {
+    if (log_fd != -1) {
+        flock(log_fd, LOCK_UN);
+        close(log_fd);
+    }
+}
+
+// The current document: base (the checkpoint's contents, typically a
+// mapping of the document file) with the tail of the log on log_fd
+// applied. Both must be read under the same oplog_lock_shared().
+bool oplog_view(int log_fd, const char *base, size_t base_len, OpView *view) {
+    char *log = NULL;
+    size_t log_len = 0;
+    if (log_fd != -1 && (log = read_fd(log_fd, &log_len)) == NULL) {
+        perror("Error reading operation log");
+        return false;
+    }
+
+    if (!build_view(log, log_len, base, base_len, view)) {
+        oplog_view_free(view);
+        return false;
+    }
+    return true;
+}
+
+// The current document in one malloc'd buffer. The checkpoint and the log
+// are read under the log lock, so a concurrent checkpoint cannot pair an
+// old checkpoint with a newer log.
+char *oplog_read_document(const char *doc_path, size_t *len) {
+    int fd;
+    if (!oplog_lock_shared(doc_path, &fd)) {
+        return NULL;
+    }
+
+    size_t base_len = 0, log_len = 0;
+    char *base = NULL, *log = NULL;
+    int doc_fd = open(doc_path, O_RDONLY);
+    if (doc_fd != -1) {
+        base = read_fd(doc_fd, &base_len);
+        close(doc_fd);
+    }
+    if (fd != -1) {
+        log = read_fd(fd, &log_len);
+    }
+    oplog_unlock(fd);
+
+    char *doc = NULL;
+    OpView view;
+    if (base != NULL && (fd == -1 || log != NULL)) {
+        if (build_view(log, log_len, base, base_len, &view)) {
+            doc = oplog_view_flatten(&view);
+            *len = view.length;
+        }
+        oplog_view_free(&view);
+    } else {
+        free(log);
+    }
+    free(base);
+    return doc;
+}
+
+// Copy the view into one malloc'd buffer of view->length bytes
+char *oplog_view_flatten(const OpView *view) {
+    char *doc = malloc(view->length ? view->length : 1);
+    if (doc == NULL) {
+        return NULL;
+    }
+    size_t at = 0;
+    for (int i = 0; i < view->count; i++) {
+        memcpy(doc + at, view->pieces[i].iov_base, view->pieces[i].iov_len);
+        at += view->pieces[i].iov_len;
+    }
+    return doc;
+}
+
+void oplog_view_free(OpView *view) {
+    free(view->pieces);
+    free(view->log);
+    memset(view, 0, sizeof(*view));
+}
+
+// Record the change from old_doc to new_doc. Only the span between their
+// common prefix and common suffix is logged.
+bool oplog_append_edit(const char *doc_path, const char *old_doc, size_t old_len,
+                       const char *new_doc, size_t new_len, const char *user) {
+    return oplog_append_replace(doc_path, 0, old_doc, old_len, new_doc, new_len, user);
+}
+
+// Record that old_text, found at offset in the document, became new_text
+bool oplog_append_replace(const char *doc_path, uint64_t offset, const char *old_text, size_t old_len,
+                          const char *new_text, size_t new_len, const char *user) {
+    size_t prefix = 0;
+    size_t limit = old_len < new_len ? old_len : new_len;
+    while (prefix < limit && old_text[prefix] == new_text[prefix]) {
+        prefix++;
+    }
+    size_t suffix = 0;
+    while (suffix < limit - prefix &&
+           old_text[old_len - 1 - suffix] == new_text[new_len - 1 - suffix]) {
+        suffix++;
+    }
+
+    size_t deleted = old_len - prefix - suffix;
+    size_t inserted = new_len - prefix - suffix;
+    if (deleted == 0 && inserted == 0) {
+        return true;
+    }
+
+    OpRecord del, ins;
+    struct iovec iov[3];
+    int iovcnt = 0;
+    if (deleted > 0) {
+        fill_record(&del, OPLOG_DELETE, offset + prefix, deleted, user, NULL, 0);
+        iov[iovcnt++] = (struct iovec){ &del, sizeof(del) };
+    }
+    if (inserted > 0) {
+        fill_record(&ins, OPLOG_INSERT, offset + prefix, inserted, user, new_text + prefix, inserted);
+        iov[iovcnt++] = (struct iovec){ &ins, sizeof(ins) };
+        iov[iovcnt++] = (struct iovec){ (void *)(new_text + prefix), inserted };
+    }
+
+    char path[LOG_PATH_MAX];
+    log_path(doc_path, path);
+    int fd = open(path, O_WRONLY | O_CREAT, 0666);
+    if (fd == -1) {
+        perror("Error opening operation log");
+        return false;
+    }
+
+    flock(fd, LOCK_EX);
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    off_t start = ok ? st.st_size : 0;
+    off_t end = start;
+    for (int i = 0; ok && i < iovcnt; i++) {
+        ok = write_at(fd, iov[i].iov_base, iov[i].iov_len, end);
+        end += iov[i].iov_len;
+    }
+    if (ok) {
+        ok = fdatasync(fd) == 0;
+    } else if (end > start) {
+        // Drop the partial record rather than leave it for readers to skip
+        if (ftruncate(fd, start) == -1) {
+            perror("Error trimming operation log");
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    if (!ok) {
+        perror("Error appending to operation log");
+        return false;
+    }
+    if (end >= OPLOG_CHECKPOINT_BYTES) {
+        return oplog_checkpoint(doc_path);
+    }
+    return true;
+}
+
+// Fold the log open on fd (locked exclusively) into doc_path and empty
+// it. *ops is set to the number of operations that were not yet in the
+// document file.
+static bool fold_log(int fd, const char *doc_path, long *ops) {
+    bool ok = false;
+    size_t log_len = 0, base_len = 0;
+    char *log = read_fd(fd, &log_len);
+    char *base = NULL;
+    int doc_fd = open(doc_path, O_RDONLY);
+    if (doc_fd != -1) {
+        base = read_fd(doc_fd, &base_len);
+        close(doc_fd);
+    }
+
+    *ops = 0;
+    OpView view;
+    if (log == NULL || base == NULL) {
+        perror("Error reading document for checkpoint");
+        free(log);
+    } else if (log_len == 0) {
+        ok = true;
+        free(log);
+    } else if (build_view(log, log_len, base, base_len, &view)) {
+        ok = true;
+        *ops = view.ops;
+        if (view.ops > 0) {
+            char *doc = oplog_view_flatten(&view);
+            OpRecord mark;
+            fill_record(&mark, OPLOG_CHECKPOINT, view.length,
+                        doc ? fnv1a(FNV_BASIS, doc, view.length) : 0, NULL, NULL, 0);
+            ok = doc != NULL &&
+                 write_at(fd, (const char *)&mark, sizeof(mark), valid_prefix(log, log_len)) &&
+                 fdatasync(fd) == 0 &&
+                 commit_file(doc_path, doc, view.length);
+            free(doc);
+        }
+        if (ok && (ftruncate(fd, 0) == -1 || fdatasync(fd) == -1)) {
+            perror("Error truncating operation log");
+            ok = false;
+        }
+        oplog_view_free(&view);
+    }
+
+    free(base);
+    if (!ok) {
+        fprintf(stderr, "Error: Checkpoint of %s failed; the operation log is kept.\n", doc_path);
+    }
+    return ok;
+}
+
+// Fold the log into doc_path and empty it
+bool oplog_checkpoint(const char *doc_path) {
+    char path[LOG_PATH_MAX];
+    log_path(doc_path, path);
+    int fd = open(path, O_RDWR);
+    if (fd == -1) {
+        return errno == ENOENT;
+    }
+
+    long ops;
+    flock(fd, LOCK_EX);
+    bool ok = fold_log(fd, doc_path, &ops);
+    flock(fd, LOCK_UN);
+    close(fd);
+    return ok;
+}
+
+// Startup recovery: cut off a torn record left by a crash, then replay
+// the log into the document. Returns the number of operations replayed,
+// or -1 on error.
+long oplog_recover(const char *doc_path) {
+    char path[LOG_PATH_MAX];
+    log_path(doc_path, path);
+    int fd = open(path, O_RDWR);
+    if (fd == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    flock(fd, LOCK_EX);
+    long ops = -1;
+    size_t log_len = 0;
+    char *log = read_fd(fd, &log_len);
+    if (log == NULL) {
+        perror("Error reading operation log");
+    } else {
+        size_t valid = valid_prefix(log, log_len);
+        free(log);
+        if (valid < log_len) {
+            fprintf(stderr, "Warning: Discarding %zu bytes of incomplete operation log.\n",
+                    log_len - valid);
+            if (ftruncate(fd, valid) == -1 || fdatasync(fd) == -1) {
+                perror("Error trimming operation log");
+            }
+        }
+        if (!fold_log(fd, doc_path, &ops)) {
+            ops = -1;
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    return ops;
+}
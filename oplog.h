@@ -0,0 +1,62 @@
+// oplog.h
+// Write-ahead operation log for the shared document. Edits are appended
+// to DOC OPLOG_SUFFIX as insert/delete records; the document file itself
+// is only a checkpoint, rewritten when the log grows past
+// OPLOG_CHECKPOINT_BYTES. The current document is the checkpoint with the
+// log tail applied on top.
+
+#ifndef OPLOG_H
+#define OPLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define OPLOG_SUFFIX ".oplog"
+#define OPLOG_CHECKPOINT_BYTES (256 * 1024)
+
+#define OPLOG_MAGIC 0x504F4C47  // "GLOP" on disk, marks the start of a record
+
+// Record kinds
+#define OPLOG_INSERT 1      // length bytes follow the record and go in at offset
+#define OPLOG_DELETE 2      // length bytes at offset are removed
+#define OPLOG_CHECKPOINT 3  // offset: size of the new checkpoint, length: its FNV-1a hash
+
+#define OPLOG_USER_MAX 32
+
+typedef struct {
+    uint32_t magic;
+    uint32_t kind;
+    uint64_t offset;
+    uint64_t length;
+    int64_t timestamp;
+    uint64_t checksum;   // FNV-1a of the record (with checksum 0) and its payload
+    char user[OPLOG_USER_MAX];
+} OpRecord;
+
+// The document as a list of pieces pointing into the checkpoint mapping
+// and the log, ready to be handed to writev()
+typedef struct {
+    struct iovec *pieces;
+    int count;
+    int capacity;
+    size_t length;   // Total document length
+    char *log;       // Log contents the insert pieces point into
+    long ops;        // Operations applied on top of the checkpoint
+} OpView;
+
+bool oplog_append_edit(const char *doc_path, const char *old_doc, size_t old_len,
+                       const char *new_doc, size_t new_len, const char *user);
+bool oplog_append_replace(const char *doc_path, uint64_t offset, const char *old_text, size_t old_len,
+                          const char *new_text, size_t new_len, const char *user);
+char *oplog_read_document(const char *doc_path, size_t *len);
+bool oplog_lock_shared(const char *doc_path, int *log_fd);
+void oplog_unlock(int log_fd);
+bool oplog_view(int log_fd, const char *base, size_t base_len, OpView *view);
+char *oplog_view_flatten(const OpView *view);
+void oplog_view_free(OpView *view);
+bool oplog_checkpoint(const char *doc_path);
+long oplog_recover(const char *doc_path);
+
+#endif // OPLOG_H
@@ -0,0 +1,103 @@
+// ot.c
+// Pairwise transforms of inserts and deletes, extended to changes by
+// transforming every operation of one against every operation of the
+// other in order. Concurrent inserts at the same position go in site
+// order, so the hub and every client pick the same one first.
+
+#include "ot.h"
+#include <stdlib.h>
+#include <string.h>
+
+bool ot_change_push(OtChange *change, const OtOp *op) {
+    if (change->count == change->capacity) {
+        size_t capacity = change->capacity ? change->capacity * 2 : 64;
+        OtOp *ops = realloc(change->ops, capacity * sizeof(OtOp));
+        if (ops == NULL) {
+            return false;
+        }
+        change->ops = ops;
+        change->capacity = capacity;
+    }
+    change->ops[change->count++] = *op;
+    return true;
+}
+
+void ot_change_free(OtChange *change) {
+    free(change->ops);
+    change->ops = NULL;
+    change->count = change->capacity = 0;
+}
+
+// a and b were made against the same text. Afterwards a applies after b
+// and b after a, and both orders give the same text.
+static void transform_pair(OtOp *a, OtOp *b) {
+    if (a->kind == OT_NOOP || b->kind == OT_NOOP) {
+        return;
+    }
+    if (a->kind == OT_INSERT && b->kind == OT_INSERT) {
+        if (a->pos < b->pos || (a->pos == b->pos && a->site < b->site)) {
+            b->pos++;
+        } else {
+            a->pos++;
+        }
+    } else if (a->kind == OT_INSERT) {
+        if (a->pos <= b->pos) {
+            b->pos++;
+        } else {
+            a->pos--;
+        }
+    } else if (b->kind == OT_INSERT) {
+        if (b->pos <= a->pos) {
+            a->pos++;
+        } else {
+            b->pos--;
+        }
+    } else if (a->pos < b->pos) {
+        b->pos--;
+    } else if (a->pos > b->pos) {
+        a->pos--;
+    } else {
+        a->kind = b->kind = OT_NOOP;
+    }
+}
+
+// Transform change a against change b, both made against the same text:
+// a becomes the change to apply after b, b the one to apply after a
+void ot_transform(OtOp *a, size_t a_count, OtOp *b, size_t b_count) {
+    for (size_t i = 0; i < a_count; i++) {
+        for (size_t j = 0; j < b_count; j++) {
+            transform_pair(&a[i], &b[j]);
+        }
+    }
+}
+
+// Apply op to text; false if it does not fit the text
+bool ot_apply(OtText *text, const OtOp *op) {
+    if (op->kind == OT_NOOP) {
+        return true;
+    }
+    if (op->kind == OT_DELETE) {
+        if (op->pos >= text->len) {
+            return false;
+        }
+        memmove(text->buf + op->pos, text->buf + op->pos + 1, text->len - op->pos - 1);
+        text->len--;
+        return true;
+    }
+    if (op->kind != OT_INSERT || op->pos > text->len) {
+        return false;
+    }
+    if (text->len == text->capacity) {
+        size_t capacity = text->capacity ? text->capacity * 2 : 4096;
+        char *buf = realloc(text->buf, capacity);
+        if (buf == NULL) {
+            return false;
+        }
+        text->buf = buf;
+        text->capacity = capacity;
+    }
+    memmove(text->buf + op->pos + 1, text->buf + op->pos, text->len - op->pos);
+    text->buf[op->pos] = op->ch;
+    text->len++;
+    return true;
+}
@@ -0,0 +1,51 @@
+// ot.h
+// Operational transformation of single-character edits, for the live
+// editing hub's OT mode. A change is a list of inserts and deletes made
+// against one revision of the hub's text; the hub commits changes one at
+// a time, transforming each against the changes committed since the
+// revision it was made against.
+
+#ifndef OT_H
+#define OT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Operation kinds; distinct from the CRDT_* kinds, so a client can tell
+// from the hub's first message which protocol it speaks
+#define OT_INSERT 16    // ch goes in at pos
+#define OT_DELETE 17    // The character at pos is removed
+#define OT_NOOP 18      // Cancelled by a transform (both sides deleted the character)
+#define OT_COMMIT 19    // Ends a change; revision it was made against (client) or origin site (hub)
+#define OT_ACK 20       // Hub to client: the client's change is committed
+#define OT_WELCOME 21   // Hub to client: site, revision, then pos bytes of text
+
+// Fixed-size operation, the same size as a CrdtOp on the wire
+typedef struct {
+    uint32_t kind;
+    uint32_t site;      // Orders concurrent inserts at the same position
+    uint32_t pos;
+    uint32_t revision;
+    char ch;
+    char pad[7];
+} OtOp;
+
+typedef struct {
+    OtOp *ops;
+    size_t count;
+    size_t capacity;
+} OtChange;
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t capacity;
+} OtText;
+
+bool ot_change_push(OtChange *change, const OtOp *op);
+void ot_change_free(OtChange *change);
+void ot_transform(OtOp *a, size_t a_count, OtOp *b, size_t b_count);
+bool ot_apply(OtText *text, const OtOp *op);
+
+#endif // OT_H
@@ -14,24 +14,237 @@ void list_users();
 
 #include "shared.h"
 
-int read_control_file(User users[], int max_users);
-void write_control_file(User users[], int user_count);
 void view_document(User *user);
 void edit_document(User *user);
+void append_to_history();
+void pop_last_snapshot();
+void print_history();
+bool import_users(const char *path);
 
 // Global variable for current owner
 User owner_user;
-int main() {
-    int choice;
+
+// Connection to the selected document's request server, which keeps its
+// user table and history; one per document, by registry slot
+int server_fd = -1;
+static int server_fds[REGISTRY_MAX_DOCS];
+
+// Set up the document in this slot and start its request server, and its
+// live editing hub unless collab_mode is -1. The slot is left selected.
+static bool start_document(int slot, int collab_mode) {
+    if (!select_document(slot)) {
+        return false;
+    }
+    adopt_legacy_files();
     
     // Check if document exists, if not create it
     create_shared_doc_if_not_exists();
     
+    // Replay edits logged before a crash into the document
+    long replayed = oplog_recover(SHARED_DOC);
+    if (replayed > 0) {
+        printf("Recovered %ld logged edit(s) into %s.\n", replayed, SHARED_DOC);
+    }
+    
     // Initialize control file if needed
     initialize_control_file();
     
+    // Serve user requests, and this menu's own, from one place
+    if (!server_start()) {
+        return false;
+    }
+    server_fds[slot] = proto_connect(SERVER_SOCKET);
+    ProtoHeader reply;
+    if (server_fds[slot] < 0 ||
+        proto_call(server_fds[slot], PROTO_HELLO, "admin", strlen("admin"), &reply, NULL, NULL) != PROTO_OK) {
+        printf("Could not log in to the request server of %s.\n", SHARED_DOC);
+        if (server_fds[slot] >= 0) {
+            close(server_fds[slot]);
+        }
+        server_fds[slot] = -1;
+        server_stop();
+        return false;
+    }
+    
+    // Serve live editing sessions alongside the lock-based editors
+    if (collab_mode != -1) {
+        collab_hub_start(collab_mode);
+    }
+    return true;
+}
+
+static void stop_document(int slot) {
+    if (server_fds[slot] < 0) {
+        return;
+    }
+    select_document(slot);
+    collab_hub_stop();
+    close(server_fds[slot]);
+    server_fds[slot] = -1;
+    server_stop();
+}
+
+// Make the document in this slot the one the menu works on
+static void use_document(int slot) {
+    if (!select_document(slot)) {
+        return;
+    }
+    server_fd = server_fds[slot];
+    if (!userdir_attach(current_doc.users_shm)) {
+        printf("Cannot map the user directory of %s.\n", SHARED_DOC);
+    }
+}
+
+// owner --import: hand the file's changes to the request server of the
+// owner serving the document, as menu option 10 does. Only while no owner
+// or user is running does this process serve the document itself for the
+// import; shared state in use is never set up afresh.
+static bool import_mode(const char *path, const char *document) {
+    if (!valid_document_name(document)) {
+        fprintf(stderr, "Invalid document name '%s'.\n", document);
+        return false;
+    }
+    char socket_path[DOC_FILE_MAX];
+    snprintf(socket_path, sizeof(socket_path), "%s.control.sock", document);
+    server_fd = proto_connect(socket_path);
+    if (server_fd >= 0) {
+        ProtoHeader reply;
+        int status = proto_call(server_fd, PROTO_HELLO, "admin", strlen("admin"), &reply, NULL, NULL);
+        bool ok = status == PROTO_OK;
+        if (ok) {
+            ok = import_users(path);
+        } else {
+            fprintf(stderr, "The owner serving %s refused the import: %s.\n", document, proto_error(status));
+        }
+        close(server_fd);
+        server_fd = -1;
+        return ok;
+    }
+    if (owner_running()) {
+        fprintf(stderr, "An owner is running but does not serve %s; add the document from its menu "
+                "and import there.\n", document);
+        return false;
+    }
+    
+    initialize_synchronization(true);
+    for (int slot = 0; slot < REGISTRY_MAX_DOCS; slot++) {
+        server_fds[slot] = -1;
+    }
+    int slot = registry_add(document);
+    bool ok = slot >= 0 && start_document(slot, -1);
+    if (ok) {
+        server_fd = server_fds[slot];
+        ok = import_users(path);
+        server_fd = -1;
+        stop_document(slot);
+    } else {
+        printf("Cannot serve document '%s'.\n", document);
+    }
+    cleanup_synchronization(true);
+    return ok;
+}
+
+static void stop_all_documents(void) {
+    userdir_detach();
+    for (int slot = 0; slot < REGISTRY_MAX_DOCS; slot++) {
+        stop_document(slot);
+    }
+}
+
+// List the documents served, then switch to the one named, adding and
+// starting it if it is new
+static void switch_document(int collab_mode) {
+    int count;
+    int *slots = registry_list(&count);
+    printf("Documents:\n");
+    for (int i = 0; i < count; i++) {
+        if (server_fds[slots[i]] >= 0) {
+            printf("%s %s\n", slots[i] == current_doc.slot ? "*" : " ", registry->docs[slots[i]].path);
+        }
+    }
+    free(slots);
+    char path[MAX_LINE];
+    printf("Enter document name (a new name adds it): ");
+    if (scanf("%255s", path) != 1) {
+        return;
+    }
+    getchar(); // Clear newline
+    
+    int previous = current_doc.slot;
+    int slot = registry_find(path);
+    if (slot < 0) {
+        slot = registry_add(path);
+        if (slot < 0) {
+            printf("Cannot add '%s': invalid name, or no room for another document.\n", path);
+            return;
+        }
+        if (!start_document(slot, collab_mode)) {
+            printf("Could not start %s.\n", path);
+            use_document(previous);
+            return;
+        }
+        if (!registry_save()) {
+            perror("Error saving " REGISTRY_FILE);
+        }
+    }
+    use_document(slot);
+    printf("Now working on %s.\n", SHARED_DOC);
+}
+
+int main(int argc, char *argv[]) {
+    int choice;
+    
+    // owner --ot: live sessions merge edits by operational transformation
+    int collab_mode = COLLAB_CRDT;
+    if (argc == 2 && strcmp(argv[1], "--ot") == 0) {
+        collab_mode = COLLAB_OT;
+    } else if ((argc == 3 || argc == 4) && strcmp(argv[1], "--import") == 0) {
+        // owner --import users.csv [document]: apply the file's user
+        // changes, all or none, and exit; "-" reads them from stdin
+        return import_mode(argv[2], argc == 4 ? argv[3] : DEFAULT_DOC) ? 0 : 1;
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "--dump-users") == 0) {
+        // owner --dump-users [document]: print the control file as text,
+        // even while another owner is running
+        char control_file[DOC_FILE_MAX];
+        snprintf(control_file, sizeof(control_file), "%s.control.db", argc == 3 ? argv[2] : DEFAULT_DOC);
+        if (!control_dump(control_file, stdout)) {
+            fprintf(stderr, "Cannot read %s\n", control_file);
+            return 1;
+        }
+        return 0;
+    } else if (argc != 1) {
+        printf("Usage: %s [--ot | --dump-users [document] | --import users.csv [document]]\n", argv[0]);
+        return 1;
+    }
+    
     // Initialize synchronization mechanisms
     initialize_synchronization(true);  // true means owner
+    for (int slot = 0; slot < REGISTRY_MAX_DOCS; slot++) {
+        server_fds[slot] = -1;
+    }
+    
+    // Serve every document in the registry
+    if (registry_load() == 0) {
+        printf("No document to serve.\n");
+        cleanup_synchronization(true);
+        exit(EXIT_FAILURE);
+    }
+    int count, first = -1;
+    int *slots = registry_list(&count);
+    for (int i = 0; i < count; i++) {
+        if (start_document(slots[i], collab_mode)) {
+            first = first < 0 ? slots[i] : first;
+        } else {
+            printf("Could not start %s.\n", registry->docs[slots[i]].path);
+        }
+    }
+    free(slots);
+    if (first < 0) {
+        stop_all_documents();
+        cleanup_synchronization(true);
+        exit(EXIT_FAILURE);
+    }
+    use_document(first);
     
     // Create the current user object (owner)
     strcpy(owner_user.name, "admin");
@@ -75,8 +288,21 @@ int main() {
             case 9:
                  print_history(); 
                 break;
-            case 10:
+            case 10: {
+                char path[MAX_LINE];
+                printf("Enter file to import (add/update/remove lines): ");
+                if (scanf("%255s", path) == 1) {
+                    import_users(path);
+                }
+                getchar(); // Clear newline
+                break;
+            }
+            case 11:
+                switch_document(collab_mode);
+                break;
+            case 12:
                 printf("Exiting owner program.\n");
+                stop_all_documents();
                 cleanup_synchronization(true);  // true means owner
                 exit(0);
             default:
@@ -88,7 +314,7 @@ int main() {
 }
 
 void display_menu() {
-    printf("\n=== Document Sharing System (Owner/Admin) ===\n");
+    printf("\n=== Document Sharing System (Owner/Admin): %s ===\n", SHARED_DOC);
     printf("1. View document (read)\n");
     printf("2. Edit document (write)\n");
     printf("3. Add user\n");
@@ -98,7 +324,9 @@ void display_menu() {
     printf("7. Push History\n"); 
     printf("8. POP History\n");
     printf("9. View History Log\n");
-    printf("10. Exit\n");
+    printf("10. Import users from file\n");
+    printf("11. Switch or add document\n");
+    printf("12. Exit\n");
     
     printf("Enter your choice: ");
 }
@@ -114,94 +342,25 @@ void create_shared_doc_if_not_exists() {
 }
 
 void initialize_control_file() {
-    FILE *file = fopen(CONTROL_FILE, "r");
-    
-    if (file == NULL) {
-        // Control file doesn't exist, create it
-        file = fopen(CONTROL_FILE, "w");
-        if (file == NULL) {
-            perror("Error creating control file");
-            exit(EXIT_FAILURE);
-        }
-        
-        // Add admin user
-        fprintf(file, "%s\n", SHARED_DOC);
-        fprintf(file, "admin %d %d %d\n", PRIORITY_OWNER, ACCESS_BOTH, getpid());
-        fprintf(file, "0\n"); // No additional users initially
-        
-        printf("Control file initialized with admin user.\n");
-    } else {
-        fclose(file);
-        
-        // Update admin's PID in the control file
-        User users[MAX_USERS];
-        int user_count = read_control_file(users, MAX_USERS);
-        users[0].pid = getpid();  // Update admin PID
-        write_control_file(users, user_count);
-    }
-}
-
-int read_control_file(User users[], int max_users) {
-    FILE *file = fopen(CONTROL_FILE, "r");
-    if (file == NULL) {
-        perror("Error opening control file");
-        exit(EXIT_FAILURE);
-    }
-    
-    char line[MAX_LINE];
-    // Read and ignore first line (document path)
-    fgets(line, MAX_LINE, file);
-    
-    // Read admin info
-    fgets(line, MAX_LINE, file);
-    sscanf(line, "%s %d %d %d", users[0].name, &users[0].priority, &users[0].access_type, &users[0].pid);
-    
-    // Make sure admin has owner priority
-    users[0].priority = PRIORITY_OWNER;
-    
-    // Read number of additional users
-    int user_count;
-    fgets(line, MAX_LINE, file);
-    sscanf(line, "%d", &user_count);
-    
-    if (user_count > max_users - 1) {
-        user_count = max_users - 1;
-    }
-    
-    // Read remaining users
-    for (int i = 0; i < user_count; i++) {
-        if (fgets(line, MAX_LINE, file) != NULL) {
-            sscanf(line, "%s %d %d %d", users[i+1].name, &users[i+1].priority, &users[i+1].access_type, &users[i+1].pid);
-        }
+    if (access(CONTROL_FILE, F_OK) == 0) {
+        return;
     }
     
-    fclose(file);
-    return user_count + 1; // Include admin
-}
-
-void write_control_file(User users[], int user_count) {
-    FILE *file = fopen(CONTROL_FILE, "w");
-    if (file == NULL) {
-        perror("Error opening control file for writing");
+    // Control file doesn't exist: convert the text one if there is one,
+    // or start with the admin user only
+    size_t count = 0;
+    UserRecord *users = control_parse_text(CONTROL_TEXT, &count);
+    UserRecord admin = { .name = "admin", .priority = PRIORITY_OWNER, .access_type = ACCESS_BOTH };
+    if (!control_create(CONTROL_FILE, SHARED_DOC, users ? users : &admin, users ? count : 1)) {
+        perror("Error creating control file");
         exit(EXIT_FAILURE);
     }
-    
-    // Write document path
-    fprintf(file, "%s\n", SHARED_DOC);
-    
-    // Write admin info (always ensure admin has owner priority)
-    users[0].priority = PRIORITY_OWNER;  // Ensure owner priority
-    fprintf(file, "%s %d %d %d\n", users[0].name, users[0].priority, users[0].access_type, users[0].pid);
-    
-    // Write number of additional users
-    fprintf(file, "%d\n", user_count - 1);
-    
-    // Write remaining users
-    for (int i = 1; i < user_count; i++) {
-        fprintf(file, "%s %d %d %d\n", users[i].name, users[i].priority, users[i].access_type, users[i].pid);
+    if (users != NULL) {
+        printf("Control file converted from %s with %zu user(s).\n", CONTROL_TEXT, count);
+        free(users);
+    } else {
+        printf("Control file initialized with admin user.\n");
     }
-    
-    fclose(file);
 }
 
 // Function to check if a process with given PID exists
@@ -223,43 +382,38 @@ void send_priority_signal(pid_t pid) {
 
 void view_document(User *user) {
     // Tell the system owner is waiting for access
-    lock_info->owner_waiting = true;
+    set_owner_waiting(true);
     
     int fd = open(SHARED_DOC, O_RDONLY);
     if (fd == -1) {
         perror("Error opening document for reading");
-        lock_info->owner_waiting = false;
+        set_owner_waiting(false);
         return;
     }
     
     // Check if another process holds the write lock
-    if (lock_info->lock_type == 2 && lock_info->holding_pid > 0) {
+    uint64_t state = lock_state();
+    if (LS_LOCK_TYPE(state) == 2 && LS_HOLDER(state) > 0) {
         printf("Document is currently locked by process %d, sending priority signal\n", 
-               lock_info->holding_pid);
-        send_priority_signal(lock_info->holding_pid);
+               LS_HOLDER(state));
+        uint32_t request = post_takeover_request();
+        send_priority_signal(LS_HOLDER(state));
         
-        // Short wait to allow the process to release lock
-        sleep(1);
+        // Give the process up to a second to release the lock
+        wait_takeover_ack(request, 1000);
     }
     
     if (!acquire_read_lock(fd, user)) {
         close(fd);
-        lock_info->owner_waiting = false;
+        set_owner_waiting(false);
         return;
     }
     
     // Owner no longer waiting once lock is acquired
-    lock_info->owner_waiting = false;
+    set_owner_waiting(false);
     
     printf("\n--- Document Content ---\n");
-    char buffer[1024];
-    ssize_t bytes_read;
-    
-    while ((bytes_read = read(fd, buffer, sizeof(buffer) - 1)) > 0) {
-        buffer[bytes_read] = '\0';
-        printf("%s", buffer);
-    }
-    
+    print_document();
     printf("\n--- End of Document ---\n");
     
     release_read_lock(fd, user);
@@ -268,36 +422,38 @@ void view_document(User *user) {
 
 void edit_document(User *user) {
     // Tell the system owner is waiting for access
-    lock_info->owner_waiting = true;
-    lock_info->forced_lock = true;  // Force lock acquisition
+    set_owner_waiting(true);
+    set_forced_lock(true);  // Force lock acquisition
    
     // Open the document with write access
     int fd = open(SHARED_DOC, O_RDWR);
     if (fd == -1) {
         perror("Error opening document for editing");
-        lock_info->owner_waiting = false;
-        lock_info->forced_lock = false;
+        set_owner_waiting(false);
+        set_forced_lock(false);
         return;
     }
    
     // Check if any process holds the lock and if time limiting is active
-    if ((lock_info->lock_type == 1 || lock_info->lock_type == 2) &&
-        lock_info->holding_pid > 0) {
+    uint64_t state = lock_state();
+    if (LS_LOCK_TYPE(state) != 0 && LS_HOLDER(state) > 0) {
+        
+        printf("Document is currently locked by process %d\n", LS_HOLDER(state));
         
-        printf("Document is currently locked by process %d\n", lock_info->holding_pid);
+        // The holder acknowledges by releasing the lock; the countdown is
+        // only an upper bound on how long we wait for that
+        uint32_t request = post_takeover_request();
+        bool released = false;
         
         // If time limiting is active, check remaining time
-        if (lock_info->time_limit_active) {
-            time_t current_time = time(NULL);
-            int elapsed_time = current_time - lock_info->edit_start_time;
-            int remaining_time = lock_info->time_allocation - elapsed_time;
-            
+        int remaining_time;
+        if (time_limit_remaining(&remaining_time)) {
             if (remaining_time > 5) {
                 printf("Current user has %d seconds remaining in their time allocation.\n", remaining_time);
                 printf("Starting 5-second countdown for owner priority access...\n");
             } else {
                 printf("Current user's time is almost up (%d seconds left). Waiting briefly...\n", remaining_time);
-                sleep(remaining_time > 0 ? remaining_time : 1);
+                released = wait_takeover_ack(request, (remaining_time > 0 ? remaining_time : 1) * 1000);
                 printf("Proceeding to take over document...\n");
             }
         } else {
@@ -305,89 +461,95 @@ void edit_document(User *user) {
         }
         
         // Set countdown flag in shared memory
-        lock_info->countdown_active = true;
-        lock_info->countdown_value = 5;
+        if (!released) {
+            start_countdown(5);
+        }
         
-        // Count down from 5 to 0
-        for (int i = 5; i >= 0; i--) {
-            lock_info->countdown_value = i;
+        // Count down from 5 to 0, stopping as soon as the holder lets go
+        for (int i = 5; i >= 0 && !released; i--) {
+            set_countdown(i);
             printf("Owner taking over in %d seconds...\n", i);
             
             // If there's an active editor process, we can directly signal it
-            if (lock_info->editor_pid > 0) {
+            pid_t editor_pid = atomic_load(&lock_info->editor_pid);
+            if (editor_pid > 0) {
                 // Send forceful termination at countdown = 0
                 if (i == 0) {
                     printf("Forcing editor to close and taking control...\n");
-                    kill(lock_info->editor_pid, SIGTERM);
+                    kill(editor_pid, SIGTERM);
                 } else if (i <= 2) {
                     // Send save signal when countdown reaches 2
                     printf("Sending save signal to editor...\n");
-                    kill(lock_info->editor_pid, SIGUSR1);
+                    kill(editor_pid, SIGUSR1);
                 }
             }
             
-            sleep(1);
+            released = wait_takeover_ack(request, 1000);
         }
         
         // Reset countdown flag
-        lock_info->countdown_active = false;
+        stop_countdown();
         
-        // Force release of lock by setting holding_pid to 0
-        // This is a forceful approach that bypasses normal release procedures
-        sem_wait(access_sem);
-        lock_info->holding_pid = 0;
-        lock_info->lock_type = 0;
-        sem_post(access_sem);
+        if (released) {
+            printf("Lock holder released the document.\n");
+        }
         
-        // Short wait to ensure cleanup
-        sleep(1);
+        // acquire_write_lock waits for a holder that is still closing its
+        // editor, and reclaims the lock if the holder died instead
     }
    
     // Acquire exclusive write lock - now it should succeed since we forced release
     if (!acquire_write_lock(fd, user)) {
         close(fd);
-        lock_info->owner_waiting = false;
-        lock_info->forced_lock = false;
+        set_owner_waiting(false);
+        set_forced_lock(false);
         return;
     }
    
     // Owner no longer waiting once lock is acquired
-    lock_info->owner_waiting = false;
+    set_owner_waiting(false);
    
     // Set time allocation for owner (30 seconds)
     int time_allocation = 30;
-    lock_info->edit_start_time = time(NULL);
-    lock_info->time_allocation = time_allocation;
-    lock_info->time_limit_active = true;
+    start_time_limit(time_allocation);
     
     printf("Opening editor for owner (Time allocation: %d seconds)...\n", time_allocation);
    
     // Fork and exec to open nano editor
+    EditorSupervisor supervisor;
+    if (!begin_edit_copy() || !editor_supervisor_init(&supervisor)) {
+        stop_time_limit();
+        release_write_lock(fd, user);
+        set_forced_lock(false);
+        close(fd);
+        return;
+    }
     pid_t pid = fork();
    
     if (pid == 0) {
         // Child process
-        execlp("nano", "nano", "-B", SHARED_DOC, NULL);
+        editor_supervisor_child(&supervisor);
+        execlp("nano", "nano", "-B", EDIT_COPY, NULL);
         perror("Failed to open editor");
         exit(EXIT_FAILURE);
     } else if (pid > 0) {
         // Store editor PID
-        lock_info->editor_pid = pid;
+        atomic_store(&lock_info->editor_pid, pid);
         
-        // Parent process - wait for editor to close or time expiration
+        // Parent process - sleep until the editor exits or time expires
         int status;
-        pid_t result;
-        time_t start_time = time(NULL);
-        int elapsed_time = 0;
-        int time_remaining = time_allocation;
+        bool expired = false;
+        editor_supervisor_attach(&supervisor, pid, time_allocation);
         
-        while ((result = waitpid(pid, &status, WNOHANG)) == 0) {
-            // Update elapsed time
-            elapsed_time = time(NULL) - start_time;
-            time_remaining = time_allocation - elapsed_time;
+        for (;;) {
+            EditorEvent event = editor_supervisor_wait(&supervisor, &status);
+            
+            if (event == EDITOR_EXITED) {
+                break;
+            }
             
             // Check if time allocation is exceeded
-            if (time_remaining <= 0) {
+            if (event == EDITOR_TIME_EXPIRED) {
                 printf("\n[!] Time allocation (%d seconds) has expired.\n", time_allocation);
                 printf("Saving and closing editor...\n");
                 
@@ -399,101 +561,90 @@ void edit_document(User *user) {
                 // Terminate editor
                 kill(pid, SIGTERM);
                 waitpid(pid, &status, 0);
+                expired = true;
                 break;
             }
-            
-            // Display time remaining every second
-            static int last_displayed_time = -1;
-            // if (time_remaining != last_displayed_time) {
-            //     //printf("\rTime remaining: %d seconds  ", time_remaining);
-            //     fflush(stdout);
-            //     last_displayed_time = time_remaining;
-            // }
-            
-            usleep(100000);  // 100ms sleep
         }
+        editor_supervisor_close(&supervisor);
+        
+        // Publish whatever the editor saved, in one atomic step
+        commit_edit_copy(user->name);
         
         // Clear editor PID
-        lock_info->editor_pid = 0;
-        lock_info->time_limit_active = false;
+        atomic_store(&lock_info->editor_pid, 0);
+        stop_time_limit();
         
-        if (result > 0 && time_remaining > 0) {
+        if (!expired) {
             printf("\nDocument editing completed by owner.\n");
         } else {
             printf("\nEditor closed due to time limit expiration.\n");
         }
     } else {
         perror("Fork failed");
+        editor_supervisor_close(&supervisor);
     }
    
     // Release the lock
     release_write_lock(fd, user);
-    lock_info->forced_lock = false;  // Reset forced lock flag
+    set_forced_lock(false);  // Reset forced lock flag
     close(fd);
 }
 
-void add_user() {
-    User users[MAX_USERS];
-    int user_count = read_control_file(users, MAX_USERS);
-    
-    if (user_count >= MAX_USERS) {
-        printf("Maximum number of users reached.\n");
-        return;
+// Send a request to the server; prints why if it failed
+static bool server_request(int type, const void *payload, size_t len, ProtoHeader *reply, char **reply_payload) {
+    int status = proto_call(server_fd, type, payload, len, reply, reply_payload, NULL);
+    if (status != PROTO_OK) {
+        printf("Error: %s.\n", proto_error(status));
+        return false;
     }
-    
-    User new_user;
+    return true;
+}
+
+void add_user() {
+    ProtoUser new_user = { 0 };
+    int priority, access_type;
     
     printf("Enter new user name: ");
-    scanf("%s", new_user.name);
+    scanf("%49s", new_user.name);
     getchar(); // Clear newline
     
-    // Check if user already exists
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i].name, new_user.name) == 0) {
-            printf("User '%s' already exists.\n", new_user.name);
-            return;
-        }
-    }
-    
     printf("Enter priority (0 for high, 1 for low): ");
-    scanf("%d", &new_user.priority);
+    scanf("%d", &priority);
     getchar(); // Clear newline
     
     // Ensure priority is valid (only 0 or 1 for regular users)
-    if (new_user.priority != PRIORITY_HIGH && new_user.priority != PRIORITY_LOW) {
+    if (priority != PRIORITY_HIGH && priority != PRIORITY_LOW) {
         printf("Invalid priority. Setting to default (low priority).\n");
-        new_user.priority = PRIORITY_LOW;
+        priority = PRIORITY_LOW;
     }
     
     printf("Enter access type (1: read-only, 2: write-only, 3: both): ");
-    scanf("%d", &new_user.access_type);
+    scanf("%d", &access_type);
     getchar(); // Clear newline
     
     // Verify access type is valid
-    if (new_user.access_type < ACCESS_READ_ONLY || new_user.access_type > ACCESS_BOTH) {
+    if (access_type < ACCESS_READ_ONLY || access_type > ACCESS_BOTH) {
         printf("Invalid access type. Setting to default (read-only).\n");
-        new_user.access_type = ACCESS_READ_ONLY;
+        access_type = ACCESS_READ_ONLY;
+    }
+    new_user.priority = priority;
+    new_user.access_type = access_type;
+    
+    ProtoHeader reply;
+    int status = proto_call(server_fd, PROTO_USER_ADD, &new_user, sizeof(new_user), &reply, NULL, NULL);
+    if (status == PROTO_ERR_EXISTS) {
+        printf("User '%s' already exists.\n", new_user.name);
+    } else if (status != PROTO_OK) {
+        printf("Error: %s.\n", proto_error(status));
+    } else {
+        printf("User '%s' added successfully.\n", new_user.name);
     }
-    
-    // Generate a placeholder PID since the user isn't running yet
-    new_user.pid = 0;
-    
-    // Add new user to the array
-    users[user_count] = new_user;
-    
-    // Update control file
-    write_control_file(users, user_count + 1);
-    
-    printf("User '%s' added successfully.\n", new_user.name);
 }
 
 void remove_user() {
-    User users[MAX_USERS];
-    int user_count = read_control_file(users, MAX_USERS);
-    
-    char name[50];
+    char name[PROTO_NAME_MAX];
     printf("Enter user name to remove: ");
-    scanf("%s", name);
+    scanf("%49s", name);
     getchar(); // Clear newline
     
     // Cannot remove admin
@@ -502,115 +653,97 @@ void remove_user() {
         return;
     }
     
-    int found = -1;
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i].name, name) == 0) {
-            found = i;
-            break;
-        }
-    }
-    
-    if (found != -1) {
-        // If the user process is currently running, send it a signal
-        if (process_exists(users[found].pid)) {
-            printf("User '%s' is currently running (PID: %d). Sending termination signal.\n", 
-                   name, users[found].pid);
-            kill(users[found].pid, SIGTERM);
-        }
-        
-        // Shift users to remove the found user
-        for (int i = found; i < user_count - 1; i++) {
-            users[i] = users[i + 1];
+    // The server closes the user's open sessions
+    ProtoHeader reply;
+    int status = proto_call(server_fd, PROTO_USER_REMOVE, name, strlen(name), &reply, NULL, NULL);
+    if (status == PROTO_ERR_NO_USER) {
+        printf("User '%s' not found.\n", name);
+    } else if (status != PROTO_OK) {
+        printf("Error: %s.\n", proto_error(status));
+    } else {
+        if (reply.arg > 0) {
+            printf("User '%s' was logged in; closed %d session(s).\n", name, reply.arg);
         }
-        
-        // Update control file
-        write_control_file(users, user_count - 1);
         printf("User '%s' removed successfully.\n", name);
-    } else {
-        printf("User '%s' not found.\n", name);
     }
 }
 
 void update_user() {
-    User users[MAX_USERS];
-    int user_count = read_control_file(users, MAX_USERS);
-    
-    char name[50];
+    ProtoUser user = { 0 };
     printf("Enter user name to update: ");
-    scanf("%s", name);
+    scanf("%49s", user.name);
     getchar(); // Clear newline
     
     // Cannot update admin's properties
-    if (strcmp(name, "admin") == 0) {
+    if (strcmp(user.name, "admin") == 0) {
         printf("Cannot modify admin user's properties.\n");
         return;
     }
     
-    int found = -1;
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i].name, name) == 0) {
-            found = i;
-            break;
-        }
+    // The owner shares the server's user directory and reads it directly
+    UserRecord found;
+    if (!userdir_lookup(user.name, &found)) {
+        printf("User '%s' not found.\n", user.name);
+        return;
     }
+    printf("Current priority: %d, access type: %d\n", found.priority, found.access_type);
     
-    if (found != -1) {
-        printf("Current priority: %d, access type: %d\n", 
-               users[found].priority, users[found].access_type);
-        
-        printf("Enter new priority (0 for high, 1 for low): ");
-        scanf("%d", &users[found].priority);
-        getchar(); // Clear newline
-        
-        // Validate priority
-        if (users[found].priority != PRIORITY_HIGH && users[found].priority != PRIORITY_LOW) {
-            printf("Invalid priority. Setting to default (low priority).\n");
-            users[found].priority = PRIORITY_LOW;
-        }
-        
-        printf("Enter new access type (1: read-only, 2: write-only, 3: both): ");
-        scanf("%d", &users[found].access_type);
-        getchar(); // Clear newline
-        
-        // Validate access type
-        if (users[found].access_type < ACCESS_READ_ONLY || users[found].access_type > ACCESS_BOTH) {
-            printf("Invalid access type. Setting to default (read-only).\n");
-            users[found].access_type = ACCESS_READ_ONLY;
-        }
-        
-        // If the user is currently running, notify of changes
-        if (process_exists(users[found].pid)) {
-            printf("User '%s' is currently running (PID: %d). Changes will take effect on next login.\n", 
-                   name, users[found].pid);
+    int priority, access_type;
+    printf("Enter new priority (0 for high, 1 for low): ");
+    scanf("%d", &priority);
+    getchar(); // Clear newline
+    
+    // Validate priority
+    if (priority != PRIORITY_HIGH && priority != PRIORITY_LOW) {
+        printf("Invalid priority. Setting to default (low priority).\n");
+        priority = PRIORITY_LOW;
+    }
+    
+    printf("Enter new access type (1: read-only, 2: write-only, 3: both): ");
+    scanf("%d", &access_type);
+    getchar(); // Clear newline
+    
+    // Validate access type
+    if (access_type < ACCESS_READ_ONLY || access_type > ACCESS_BOTH) {
+        printf("Invalid access type. Setting to default (read-only).\n");
+        access_type = ACCESS_READ_ONLY;
+    }
+    user.priority = priority;
+    user.access_type = access_type;
+    
+    // Sessions the user has open get the new access at once
+    ProtoHeader reply;
+    if (server_request(PROTO_USER_UPDATE, &user, sizeof(user), &reply, NULL)) {
+        if (reply.arg > 0) {
+            printf("User '%s' is logged in; %d session(s) updated.\n", user.name, reply.arg);
         }
-        
-        // Update control file
-        write_control_file(users, user_count);
-        printf("User '%s' updated successfully.\n", name);
-    } else {
-        printf("User '%s' not found.\n", name);
+        printf("User '%s' updated successfully.\n", user.name);
     }
 }
 
 void list_users() {
-    User users[MAX_USERS];
-    int user_count = read_control_file(users, MAX_USERS);
+    ProtoHeader reply;
+    char *list = NULL;
+    if (!server_request(PROTO_USER_LIST, NULL, 0, &reply, &list)) {
+        return;
+    }
     
     printf("\n--- User List ---\n");
     printf("%-20s %-10s %-15s %-10s %-10s\n", "Name", "Priority", "Access Type", "PID", "Status");
     printf("----------------------------------------------------------------\n");
     
-    for (int i = 0; i < user_count; i++) {
+    for (size_t i = 0; i < reply.len / sizeof(ProtoUser); i++) {
+        const ProtoUser *user = (const ProtoUser *)list + i;
         const char *priority;
-        if (users[i].priority == PRIORITY_OWNER)
+        if (user->priority == PRIORITY_OWNER)
             priority = "Owner";
-        else if (users[i].priority == PRIORITY_HIGH)
+        else if (user->priority == PRIORITY_HIGH)
             priority = "High";
         else
             priority = "Low";
             
         const char *access;
-        switch (users[i].access_type) {
+        switch (user->access_type) {
             case ACCESS_READ_ONLY:
                 access = "Read-only";
                 break;
@@ -624,11 +757,189 @@ void list_users() {
                 access = "Unknown";
         }
         
-        const char *status = (users[i].pid > 0 && process_exists(users[i].pid)) ? "Active" : "Inactive";
+        const char *status = user->active ? "Active" : "Inactive";
         
         printf("%-20s %-10s %-15s %-10d %-10s\n", 
-               users[i].name, priority, access, users[i].pid, status);
+               user->name, priority, access, user->pid, status);
     }
     
     printf("--- End of User List ---\n");
-}
\ No newline at end of file
+    free(list);
+}
+
+// Parse one line of an import file: "add,name,priority,access",
+// "update,name,priority,access" or "remove,name". Returns NULL if it is
+// valid, else why not. Blanks around a field are ignored.
+static const char *parse_import_line(char *line, ProtoUserOp *op) {
+    char *fields[4];
+    int count = 0;  // Every field, so extra ones are caught
+    for (char *field = line; field != NULL; count++) {
+        char *comma = strchr(field, ',');
+        if (comma != NULL) {
+            *comma = '\0';
+        }
+        if (count < 4) {
+            field += strspn(field, " \t");
+            size_t len = strlen(field);
+            while (len > 0 && (field[len - 1] == ' ' || field[len - 1] == '\t')) {
+                field[--len] = '\0';
+            }
+            fields[count] = field;
+        }
+        field = comma != NULL ? comma + 1 : NULL;
+    }
+    memset(op, 0, sizeof(*op));
+    if (strcmp(fields[0], "add") == 0) {
+        op->op = PROTO_OP_ADD;
+    } else if (strcmp(fields[0], "update") == 0) {
+        op->op = PROTO_OP_UPDATE;
+    } else if (strcmp(fields[0], "remove") == 0) {
+        op->op = PROTO_OP_REMOVE;
+    } else {
+        return "unknown operation (add, update or remove)";
+    }
+    if (count != (op->op == PROTO_OP_REMOVE ? 2 : 4)) {
+        return op->op == PROTO_OP_REMOVE ? "expected remove,name" : "expected op,name,priority,access";
+    }
+    if (fields[1][0] == '\0' || strlen(fields[1]) >= PROTO_NAME_MAX) {
+        return "invalid user name";
+    }
+    if (fields[1][strcspn(fields[1], " \t")] != '\0') {
+        return "user names cannot contain spaces";
+    }
+    strcpy(op->user.name, fields[1]);
+    if (op->op == PROTO_OP_REMOVE) {
+        return NULL;
+    }
+    char *end;
+    long priority = strtol(fields[2], &end, 10);
+    if (*end != '\0' || (priority != PRIORITY_HIGH && priority != PRIORITY_LOW)) {
+        return "priority must be 0 or 1";
+    }
+    long access_type = strtol(fields[3], &end, 10);
+    if (*end != '\0' || access_type < ACCESS_READ_ONLY || access_type > ACCESS_BOTH) {
+        return "access type must be 1, 2 or 3";
+    }
+    op->user.priority = priority;
+    op->user.access_type = access_type;
+    return NULL;
+}
+
+// Batch mode: check every line first, then send them all to the server as
+// one batch, which applies them all or none and writes the control file once
+bool import_users(const char *path) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    ProtoUserOp *ops = NULL;
+    int *lines = NULL;  // Line of each operation, for errors
+    size_t count = 0, cap = 0;
+    int errors = 0, line_no = 0;
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), file)) {
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *text = line + strspn(line, " \t");
+        if (text[0] == '\0' || text[0] == '#' || (line_no == 1 && strncmp(text, "op,", 3) == 0)) {
+            continue;  // Blank lines, comments and a header row
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            ProtoUserOp *grown_ops = realloc(ops, cap * sizeof(ProtoUserOp));
+            int *grown_lines = grown_ops ? realloc(lines, cap * sizeof(int)) : NULL;
+            if (grown_ops != NULL) {
+                ops = grown_ops;
+            }
+            if (grown_lines == NULL) {
+                perror("import");
+                errors++;
+                break;
+            }
+            lines = grown_lines;
+        }
+        const char *problem = parse_import_line(text, &ops[count]);
+        if (problem != NULL) {
+            fprintf(stderr, "%s:%d: %s\n", path, line_no, problem);
+            errors++;
+            continue;
+        }
+        lines[count++] = line_no;
+    }
+    if (file != stdin) {
+        fclose(file);
+    }
+    if (errors > 0 || count == 0) {
+        fprintf(stderr, errors ? "%d invalid line(s); nothing imported.\n" : "Nothing to import.\n", errors);
+        free(ops);
+        free(lines);
+        return errors == 0;
+    }
+    
+    ProtoHeader reply;
+    char *payload = NULL;
+    int status = proto_call(server_fd, PROTO_USER_BATCH, ops, count * sizeof(ProtoUserOp),
+                            &reply, &payload, NULL);
+    ProtoBatchResult result = { 0 };
+    if (payload != NULL && reply.len == sizeof(result)) {
+        memcpy(&result, payload, sizeof(result));
+    }
+    free(payload);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    bool ok = status == PROTO_OK;
+    if (!ok) {
+        if (result.failed_at < count) {
+            fprintf(stderr, "%s:%d: %s: %s.\n", path, lines[result.failed_at],
+                    ops[result.failed_at].user.name, proto_error(status));
+        } else {
+            fprintf(stderr, "Import failed: %s.\n", proto_error(status));
+        }
+        fprintf(stderr, "Rolled back; nothing imported.\n");
+    } else {
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("Imported %zu operation(s): %u added, %u updated, %u removed, in one commit.\n",
+               count, result.added, result.updated, result.removed);
+        printf("%.1f ms, %.0f operations/s.\n", seconds * 1000, count / (seconds > 0 ? seconds : 1e-9));
+    }
+    free(ops);
+    free(lines);
+    return ok;
+}
+
+void append_to_history() {
+    ProtoHeader reply;
+    char *count = NULL;
+    int status = proto_call(server_fd, PROTO_HISTORY_PUSH, NULL, 0, &reply, &count, NULL);
+    if (status != PROTO_OK) {
+        fprintf(stderr, "Error: Could not append document to history: %s.\n", proto_error(status));
+        return;
+    }
+    int64_t snapshots = 0;
+    if (reply.len == sizeof(snapshots)) {
+        memcpy(&snapshots, count, sizeof(snapshots));
+    }
+    printf("Document successfully appended to history (%lld snapshots).\n", (long long)snapshots);
+    free(count);
+}
+
+void pop_last_snapshot() {
+    // The restored snapshot replaces the document and everything logged
+    ProtoHeader reply;
+    if (server_request(PROTO_HISTORY_POP, NULL, 0, &reply, NULL)) {
+        printf("Snapshot popped and restored into %s\n", SHARED_DOC);
+    }
+}
+
+void print_history() {
+    ProtoHeader reply;
+    char *text = NULL;
+    if (server_request(PROTO_HISTORY_LIST, NULL, 0, &reply, &text)) {
+        fwrite(text, 1, reply.len, stdout);
+        free(text);
+    }
+}
@@ -11,14 +11,16 @@
 void display_menu();
 void create_shared_doc_if_not_exists();
 void initialize_control_file();
-int read_control_file(User users[], int max_users);
-void write_control_file(User users[], int user_count);
 void add_user();
 void remove_user();
 void update_user();
 void list_users();
+bool import_users(const char *path);
 void view_document(User *user);
 void edit_document(User *user);
+void append_to_history();
+void pop_last_snapshot();
+void print_history();
 void signal_owner_priority();
 
 #endif // OWNER_H
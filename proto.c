@@ -0,0 +1,134 @@
+// proto.c
+// Client side of the request server's protocol: blocking calls that send
+// one request and wait for its reply.
+
+#include "proto.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+int proto_connect(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool read_full(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// Header and payload go out in one writev
+bool proto_send(int fd, int type, int status, int arg, const void *payload, size_t len) {
+    ProtoHeader header = { .type = type, .status = status, .arg = arg, .len = len };
+    struct iovec iov[2] = {
+        { &header, sizeof(header) },
+        { (void *)payload, len },
+    };
+    struct iovec *next = iov;
+    int left = len > 0 ? 2 : 1;
+    while (left > 0) {
+        ssize_t n = writev(fd, next, left);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        // Skip what was written, resuming mid-piece after a short write
+        while (left > 0 && (size_t)n >= next->iov_len) {
+            n -= next->iov_len;
+            next++;
+            left--;
+        }
+        if (left > 0) {
+            next->iov_base = (char *)next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+// Read one message. The payload is malloc'd and NUL-terminated (NULL if
+// there is none); the caller frees it.
+bool proto_recv(int fd, ProtoHeader *header, char **payload) {
+    *payload = NULL;
+    if (!read_full(fd, header, sizeof(*header)) || header->len > PROTO_PAYLOAD_MAX) {
+        return false;
+    }
+    if (header->len == 0) {
+        return true;
+    }
+    *payload = malloc(header->len + 1);
+    if (*payload == NULL || !read_full(fd, *payload, header->len)) {
+        free(*payload);
+        *payload = NULL;
+        return false;
+    }
+    (*payload)[header->len] = '\0';
+    return true;
+}
+
+// Send a request and wait for its reply, passing events that arrive in
+// between to on_event. Returns the reply status, or -1 if the server has
+// gone. reply_payload may be NULL when the payload is not wanted.
+int proto_call(int fd, int type, const void *payload, size_t len, ProtoHeader *reply,
+               char **reply_payload, ProtoEventHandler on_event) {
+    if (!proto_send(fd, type, PROTO_OK, 0, payload, len)) {
+        return -1;
+    }
+    for (;;) {
+        char *data;
+        if (!proto_recv(fd, reply, &data)) {
+            return -1;
+        }
+        if (reply->type == type) {
+            if (reply_payload != NULL) {
+                *reply_payload = data;
+            } else {
+                free(data);
+            }
+            return reply->status;
+        }
+        if (on_event != NULL) {
+            on_event(reply, data);
+        }
+        free(data);
+    }
+}
+
+const char *proto_error(int status) {
+    switch (status) {
+        case PROTO_OK: return "Success";
+        case PROTO_ERR_INVALID: return "Invalid request";
+        case PROTO_ERR_NO_USER: return "No such user";
+        case PROTO_ERR_ACCESS: return "Permission denied";
+        case PROTO_ERR_BUSY: return "Document is busy, try again later";
+        case PROTO_ERR_STATE: return "Request out of order";
+        case PROTO_ERR_EXISTS: return "User already exists";
+        case PROTO_ERR_FULL: return "The user table cannot grow";
+        case PROTO_ERR_FAILED: return "Server could not access its files";
+        default: return "Connection to the owner lost";
+    }
+}
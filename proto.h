@@ -0,0 +1,91 @@
+// proto.h
+// Binary protocol of the owner's request server (server.h). Every message
+// is a ProtoHeader followed by len bytes of payload. The server answers
+// each request with a message of the same type, in order, whose status
+// says how it went; it may also send an event (PROTO_EVT_*) at any time.
+
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Requests
+#define PROTO_HELLO 1           // Log in; payload: user name. Reply: ProtoUser
+#define PROTO_VIEW 2            // Reply: the document
+#define PROTO_EDIT_BEGIN 3      // Wait for the document's write lock. Reply: the document
+#define PROTO_EDIT_COMMIT 4     // Payload: the edited document; logs the edit and releases the lock
+#define PROTO_EDIT_ABORT 5      // Releases the write lock, document unchanged
+#define PROTO_USER_LIST 6       // Reply: ProtoUser records
+#define PROTO_USER_ADD 7        // Payload: ProtoUser
+#define PROTO_USER_REMOVE 8     // Payload: user name. Reply arg: sessions closed
+#define PROTO_USER_UPDATE 9     // Payload: ProtoUser. Reply arg: sessions told
+#define PROTO_HISTORY_PUSH 10   // Reply: int64_t snapshot count
+#define PROTO_HISTORY_POP 11
+#define PROTO_HISTORY_LIST 12   // Reply: the history log as text
+#define PROTO_USER_BATCH 13     // Payload: ProtoUserOp records, applied all or none. Reply: ProtoBatchResult
+
+// Events, server to client
+#define PROTO_EVT_USER 32       // Payload: ProtoUser; the session's user was updated
+#define PROTO_EVT_REMOVED 33    // The session's user was removed; the server closes it
+
+// Reply status
+#define PROTO_OK 0
+#define PROTO_ERR_INVALID 1     // Malformed or unknown request
+#define PROTO_ERR_NO_USER 2     // No such user
+#define PROTO_ERR_ACCESS 3      // Not allowed for this user, or not logged in
+#define PROTO_ERR_BUSY 4        // The owner is waiting for the document, or it is locked
+#define PROTO_ERR_STATE 5       // Out of order, e.g. a commit without the write lock
+#define PROTO_ERR_EXISTS 6      // The user already exists
+#define PROTO_ERR_FULL 7        // The user table could not grow
+#define PROTO_ERR_FAILED 8      // The server could not read or write a file
+
+#define PROTO_NAME_MAX 50
+#define PROTO_PAYLOAD_MAX (64 * 1024 * 1024)
+
+typedef struct {
+    uint8_t type;       // PROTO_* request or event
+    uint8_t status;     // PROTO_OK or PROTO_ERR_* in replies
+    uint16_t arg;       // Small request-specific value
+    uint32_t len;       // Payload bytes that follow
+} ProtoHeader;
+
+typedef struct {
+    char name[PROTO_NAME_MAX];
+    int8_t priority;
+    uint8_t access_type;
+    uint8_t active;     // Has a session open (lists only)
+    uint8_t pad;
+    int32_t pid;        // Process of that session
+} ProtoUser;
+
+// Operations of a PROTO_USER_BATCH
+#define PROTO_OP_ADD 1
+#define PROTO_OP_UPDATE 2
+#define PROTO_OP_REMOVE 3          // Only the name is used
+
+typedef struct {
+    uint8_t op;         // PROTO_OP_*
+    uint8_t pad[3];
+    ProtoUser user;
+} ProtoUserOp;
+
+typedef struct {
+    uint32_t added;
+    uint32_t updated;
+    uint32_t removed;
+    uint32_t failed_at; // On error: the operation that failed, or the count if the commit did
+} ProtoBatchResult;
+
+// Called for each event that arrives while waiting for a reply
+typedef void (*ProtoEventHandler)(const ProtoHeader *event, const char *payload);
+
+int proto_connect(const char *path);
+bool proto_send(int fd, int type, int status, int arg, const void *payload, size_t len);
+bool proto_recv(int fd, ProtoHeader *header, char **payload);
+int proto_call(int fd, int type, const void *payload, size_t len, ProtoHeader *reply,
+               char **reply_payload, ProtoEventHandler on_event);
+const char *proto_error(int status);
+
+#endif // PROTO_H
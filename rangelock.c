@@ -0,0 +1,373 @@
+// rangelock.c
+// Byte-range lock table. All operations run under a small futex mutex in
+// the table; a process waiting for a conflicting range sleeps on the
+// table's seq word, which every release bumps.
+
+#include "rangelock.h"
+#include <stdio.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// How often an owner waiting for a range checks for dead holders
+#define RANGE_POLL_MS 100
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t expected, int timeout_ms) {
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    syscall(SYS_futex, addr, FUTEX_WAIT, expected, timeout_ms >= 0 ? &ts : NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+void range_table_lock(RangeTable *table) {
+    uint32_t c = 0;
+    if (atomic_compare_exchange_strong(&table->mutex, &c, 1)) {
+        return;
+    }
+    if (c != 2) {
+        c = atomic_exchange(&table->mutex, 2);
+    }
+    while (c != 0) {
+        futex_wait(&table->mutex, 2, -1);
+        c = atomic_exchange(&table->mutex, 2);
+    }
+}
+
+void range_table_unlock(RangeTable *table) {
+    if (atomic_fetch_sub(&table->mutex, 1) != 1) {
+        atomic_store(&table->mutex, 0);
+        futex_wake(&table->mutex, 1);
+    }
+}
+
+// Tell processes waiting for a range to look again
+static void wake_waiters(RangeTable *table) {
+    atomic_fetch_add(&table->seq, 1);
+    futex_wake(&table->seq, INT_MAX);
+}
+
+void range_table_init(RangeTable *table) {
+    atomic_store(&table->mutex, 0);
+    atomic_store(&table->seq, 0);
+    atomic_store(&table->owner_waiting, 0);
+    atomic_store(&table->active, 0);
+    table->root = -1;
+    table->rng = 2463534242U;
+    for (int i = 0; i < RANGE_LOCK_MAX; i++) {
+        table->nodes[i].type = 0;
+        table->nodes[i].left = i + 1 < RANGE_LOCK_MAX ? i + 1 : -1;
+    }
+    table->free_list = 0;
+}
+
+// An empty range [off, off) stands for text about to be put at off, so
+// for conflicts it covers that byte
+static uint64_t covered_end(uint64_t start, uint64_t end) {
+    return end > start ? end : start + 1;
+}
+
+// Treap maintenance. Nodes are referred to by index, since the table is
+// mapped at different addresses in different processes.
+
+static void update(RangeTable *table, int n) {
+    RangeNode *node = &table->nodes[n];
+    node->max_end = covered_end(node->start, node->end);
+    if (node->left >= 0 && table->nodes[node->left].max_end > node->max_end) {
+        node->max_end = table->nodes[node->left].max_end;
+    }
+    if (node->right >= 0 && table->nodes[node->right].max_end > node->max_end) {
+        node->max_end = table->nodes[node->right].max_end;
+    }
+}
+
+static int rotate_right(RangeTable *table, int n) {
+    int l = table->nodes[n].left;
+    table->nodes[n].left = table->nodes[l].right;
+    table->nodes[l].right = n;
+    update(table, n);
+    update(table, l);
+    return l;
+}
+
+static int rotate_left(RangeTable *table, int n) {
+    int r = table->nodes[n].right;
+    table->nodes[n].right = table->nodes[r].left;
+    table->nodes[r].left = n;
+    update(table, n);
+    update(table, r);
+    return r;
+}
+
+// Tree order: by start, ties broken by node index
+static bool before(const RangeTable *table, int a, int b) {
+    uint64_t sa = table->nodes[a].start, sb = table->nodes[b].start;
+    return sa < sb || (sa == sb && a < b);
+}
+
+static int insert(RangeTable *table, int root, int n) {
+    if (root < 0) {
+        update(table, n);
+        return n;
+    }
+    RangeNode *node = &table->nodes[root];
+    if (before(table, n, root)) {
+        node->left = insert(table, node->left, n);
+        if (table->nodes[node->left].heap > node->heap) {
+            return rotate_right(table, root);
+        }
+    } else {
+        node->right = insert(table, node->right, n);
+        if (table->nodes[node->right].heap > node->heap) {
+            return rotate_left(table, root);
+        }
+    }
+    update(table, root);
+    return root;
+}
+
+static int erase(RangeTable *table, int root, int n) {
+    if (root < 0) {
+        return -1;
+    }
+    RangeNode *node = &table->nodes[root];
+    if (root == n) {
+        if (node->left < 0) {
+            return node->right;
+        }
+        if (node->right < 0) {
+            return node->left;
+        }
+        // Rotate the node down below its higher-priority child
+        if (table->nodes[node->left].heap > table->nodes[node->right].heap) {
+            root = rotate_right(table, n);
+            table->nodes[root].right = erase(table, table->nodes[root].right, n);
+        } else {
+            root = rotate_left(table, n);
+            table->nodes[root].left = erase(table, table->nodes[root].left, n);
+        }
+    } else if (before(table, n, root)) {
+        node->left = erase(table, node->left, n);
+    } else {
+        node->right = erase(table, node->right, n);
+    }
+    update(table, root);
+    return root;
+}
+
+static int alloc_node(RangeTable *table) {
+    int n = table->free_list;
+    if (n >= 0) {
+        table->free_list = table->nodes[n].left;
+    }
+    return n;
+}
+
+// Ranges other than the whole document are counted in table->active by
+// their taker; the count is given back here when one is dropped
+static void remove_node(RangeTable *table, int n) {
+    if (table->nodes[n].start != 0 || table->nodes[n].end != RANGE_ALL) {
+        atomic_fetch_sub(&table->active, 1);
+    }
+    table->root = erase(table, table->root, n);
+    table->nodes[n].type = 0;
+    table->nodes[n].left = table->free_list;
+    table->free_list = n;
+}
+
+static bool conflicts(const RangeNode *node, uint64_t start, uint64_t end, int type, pid_t pid) {
+    return node->pid != pid && (type == RANGE_WRITE || node->type == RANGE_WRITE) &&
+           node->start < covered_end(start, end) && start < covered_end(node->start, node->end);
+}
+
+// Count the held ranges that conflict with [start, end). Subtrees whose
+// ranges all end at or before start are skipped, as are right subtrees
+// starting at or after end. With signum, each conflicting holder is sent
+// that signal.
+static int find_conflicts(RangeTable *table, int n, uint64_t start, uint64_t end,
+                          int type, pid_t pid, int signum) {
+    if (n < 0 || table->nodes[n].max_end <= start) {
+        return 0;
+    }
+    RangeNode *node = &table->nodes[n];
+    int found = find_conflicts(table, node->left, start, end, type, pid, signum);
+    if (conflicts(node, start, end, type, pid)) {
+        found++;
+        if (signum) {
+            kill(node->pid, signum);
+        }
+    }
+    if (node->start < covered_end(start, end)) {
+        found += find_conflicts(table, node->right, start, end, type, pid, signum);
+    }
+    return found;
+}
+
+static int remaining_ms(const struct timespec *deadline, int timeout_ms) {
+    if (timeout_ms < 0) {
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+              (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms : 0;
+}
+
+// Lock [start, end) for pid. Returns a handle for range_unlock(), or -1
+// if the lock could not be had: the table is full, timeout_ms passed, or
+// (for a non-owner) the owner is waiting for a range. The owner sends
+// preempt_signal to the holders of conflicting ranges and clears out
+// ranges of processes that have died.
+int range_lock(RangeTable *table, pid_t pid, uint64_t start, uint64_t end, int type,
+               bool is_owner, int preempt_signal, int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if (timeout_ms > 0) {
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    if (is_owner) {
+        range_set_owner_waiting(table, true);
+    }
+
+    int handle = -1;
+    bool signalled = false;
+    for (;;) {
+        if (!is_owner && atomic_load(&table->owner_waiting)) {
+            break;
+        }
+
+        range_table_lock(table);
+        uint32_t seq = atomic_load(&table->seq);
+        int signum = is_owner && !signalled ? preempt_signal : 0;
+        if (find_conflicts(table, table->root, start, end, type, pid, signum) == 0) {
+            handle = alloc_node(table);
+            if (handle >= 0) {
+                RangeNode *node = &table->nodes[handle];
+                node->start = start;
+                node->end = end;
+                node->pid = pid;
+                node->type = type;
+                node->left = node->right = -1;
+                table->rng ^= table->rng << 13;
+                table->rng ^= table->rng >> 17;
+                table->rng ^= table->rng << 5;
+                node->heap = table->rng;
+                table->root = insert(table, table->root, handle);
+            } else {
+                fprintf(stderr, "Error: Range lock table is full.\n");
+            }
+            range_table_unlock(table);
+            break;
+        }
+        range_table_unlock(table);
+
+        if (is_owner) {
+            signalled = true;
+            range_reclaim_dead(table);
+        }
+
+        int ms = remaining_ms(&deadline, timeout_ms);
+        if (ms == 0) {
+            break;
+        }
+        if (is_owner && (ms < 0 || ms > RANGE_POLL_MS)) {
+            ms = RANGE_POLL_MS;
+        }
+        futex_wait(&table->seq, seq, ms);
+    }
+
+    if (is_owner) {
+        range_set_owner_waiting(table, false);
+    }
+    return handle;
+}
+
+void range_unlock(RangeTable *table, int handle) {
+    if (handle < 0 || handle >= RANGE_LOCK_MAX) {
+        return;
+    }
+    range_table_lock(table);
+    if (table->nodes[handle].type != 0) {
+        remove_node(table, handle);
+    }
+    range_table_unlock(table);
+    wake_waiters(table);
+}
+
+// While the owner is waiting, non-owners give up on ranges they are
+// waiting for and take no new ones
+void range_set_owner_waiting(RangeTable *table, bool waiting) {
+    atomic_store(&table->owner_waiting, waiting ? 1 : 0);
+    wake_waiters(table);
+}
+
+// Drop the ranges of processes that exited without releasing them.
+// Returns how many were dropped.
+int range_reclaim_dead(RangeTable *table) {
+    int reclaimed = 0;
+    range_table_lock(table);
+    for (int i = 0; i < RANGE_LOCK_MAX; i++) {
+        RangeNode *node = &table->nodes[i];
+        if (node->type != 0 && kill(node->pid, 0) == -1 && errno == ESRCH) {
+            remove_node(table, i);
+            reclaimed++;
+        }
+    }
+    range_table_unlock(table);
+    if (reclaimed > 0) {
+        wake_waiters(table);
+    }
+    return reclaimed;
+}
+
+bool range_get_locked(RangeTable *table, int handle, uint64_t *start, uint64_t *end) {
+    if (handle < 0 || handle >= RANGE_LOCK_MAX || table->nodes[handle].type == 0) {
+        return false;
+    }
+    *start = table->nodes[handle].start;
+    *end = table->nodes[handle].end;
+    return true;
+}
+
+// The text in a held range was replaced by new_len bytes: resize the
+// range and move every range after it, so all of them keep covering the
+// same text. Whole-document ranges stay where they are.
+void range_resize_locked(RangeTable *table, int handle, uint64_t new_len) {
+    RangeNode *held = &table->nodes[handle];
+    uint64_t old_end = held->end;
+    uint64_t new_end = held->start + new_len;
+    held->end = new_end;
+
+    for (int i = 0; i < RANGE_LOCK_MAX; i++) {
+        RangeNode *node = &table->nodes[i];
+        if (i == handle || node->type == 0 || node->start < old_end || node->end == RANGE_ALL) {
+            continue;
+        }
+        node->start = node->start - old_end + new_end;
+        node->end = node->end - old_end + new_end;
+    }
+
+    // Starts moved, so rebuild the tree rather than patch it
+    table->root = -1;
+    for (int i = 0; i < RANGE_LOCK_MAX; i++) {
+        if (table->nodes[i].type != 0) {
+            table->nodes[i].left = table->nodes[i].right = -1;
+            table->root = insert(table, table->root, i);
+        }
+    }
+}
@@ -0,0 +1,58 @@
+// rangelock.h
+// Byte-range locks on the shared document, kept in shared memory as an
+// interval tree (a treap ordered by range start, each node also holding
+// the largest range end below it). Overlapping ranges conflict unless both
+// are read locks or both belong to the same process.
+
+#ifndef RANGELOCK_H
+#define RANGELOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define RANGE_LOCK_MAX 256        // Ranges that can be held at once
+#define RANGE_ALL UINT64_MAX      // End of a range covering the whole document
+
+#define RANGE_READ 1
+#define RANGE_WRITE 2
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;        // Exclusive; RANGE_ALL for "to the end"
+    uint64_t max_end;    // Largest end in this node's subtree (start + 1 for an empty range)
+    pid_t pid;           // Holder
+    int32_t type;        // RANGE_READ or RANGE_WRITE, 0 when the node is free
+    int32_t left;        // Child nodes (free list link for free nodes), -1 for none
+    int32_t right;
+    uint32_t heap;       // Random treap priority, keeps the tree balanced
+} RangeNode;
+
+typedef struct {
+    _Atomic uint32_t mutex;          // Futex: 0 free, 1 locked, 2 locked with waiters
+    _Atomic uint32_t seq;            // Futex word, bumped whenever a range is released
+    _Atomic uint32_t owner_waiting;  // Non-owners take no new ranges while set
+    _Atomic uint32_t active;         // Byte ranges held or being taken, whole-document ones aside;
+                                     // while 0 the document lock alone covers the whole document
+    int32_t root;
+    int32_t free_list;
+    uint32_t rng;
+    RangeNode nodes[RANGE_LOCK_MAX];
+} RangeTable;
+
+void range_table_init(RangeTable *table);
+int range_lock(RangeTable *table, pid_t pid, uint64_t start, uint64_t end, int type,
+               bool is_owner, int preempt_signal, int timeout_ms);
+void range_unlock(RangeTable *table, int handle);
+void range_set_owner_waiting(RangeTable *table, bool waiting);
+int range_reclaim_dead(RangeTable *table);
+
+// For updating a held range together with the document: take the table
+// lock, read the range, resize it (which moves every later range by the
+// same amount) and drop the lock
+void range_table_lock(RangeTable *table);
+void range_table_unlock(RangeTable *table);
+bool range_get_locked(RangeTable *table, int handle, uint64_t *start, uint64_t *end);
+void range_resize_locked(RangeTable *table, int handle, uint64_t new_len);
+
+#endif // RANGELOCK_H
@@ -0,0 +1,243 @@
+// registry.c
+// Document registry. The owner adds each document it serves to a slot of
+// the registry segment, the lock table, and initializes the slot's lock
+// and the document's range and section tables before marking it active;
+// users find their document's slot by hashing its name. A process works
+// on one document at a time: select_document() points lock_info,
+// doc_tables and the file names in current_doc at it.
+
+#include "shared.h"
+
+Document current_doc = { .slot = -1 };
+
+static uint32_t hash_path(const char *path) {
+    uint32_t hash = 2166136261u;  // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+static void tables_name(int slot, char *name, size_t size) {
+    snprintf(name, size, "/shared_doc_tables.%d", slot);
+}
+
+// Create the document's range and section tables, all free
+static bool create_tables(int slot) {
+    char name[DOC_FILE_MAX];
+    tables_name(slot, name, sizeof(name));
+    shm_unlink(name);  // Left behind by an owner that crashed
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        perror("Failed to create lock tables");
+        return false;
+    }
+    fchmod(fd, 0666);  // Users lock ranges too, whatever the umask
+    DocTables *tables = MAP_FAILED;
+    if (ftruncate(fd, sizeof(DocTables)) == 0) {
+        tables = mmap(NULL, sizeof(DocTables), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (tables == MAP_FAILED) {
+        perror("Failed to map lock tables");
+        shm_unlink(name);
+        return false;
+    }
+    range_table_init(&tables->ranges);
+    munmap(tables, sizeof(DocTables));
+    return true;
+}
+
+// Document names become file names in the current directory, with the
+// suffixes below appended
+bool valid_document_name(const char *path) {
+    size_t len = strlen(path);
+    return len > 0 && len < DOC_PATH_MAX && strchr(path, '/') == NULL && path[0] != '.' &&
+           path[strcspn(path, " \t\r\n")] == '\0';
+}
+
+// Slot of the document, or of the free slot that ends its probe if there
+// is no such document, or -1 if the table is full
+static int probe(const char *path, uint32_t hash) {
+    uint32_t mask = REGISTRY_MAX_DOCS - 1;
+    uint32_t slot = hash & mask;
+    for (uint32_t i = 0; i < REGISTRY_MAX_DOCS; i++, slot = (slot + 1) & mask) {
+        DocSlot *doc = &registry->docs[slot];
+        if (!atomic_load_explicit(&doc->active, memory_order_acquire) ||
+            (doc->hash == hash && strcmp(doc->path, path) == 0)) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+int registry_find(const char *path) {
+    if (strlen(path) >= DOC_PATH_MAX) {
+        return -1;
+    }
+    int slot = probe(path, hash_path(path));
+    return slot >= 0 && atomic_load_explicit(&registry->docs[slot].active, memory_order_acquire) ? slot : -1;
+}
+
+// Owner only. Returns the document's slot, or -1 if the name is invalid
+// or every slot is taken.
+int registry_add(const char *path) {
+    if (!valid_document_name(path)) {
+        return -1;
+    }
+    uint32_t hash = hash_path(path);
+    int slot = probe(path, hash);
+    if (slot < 0 || atomic_load(&registry->docs[slot].active)) {
+        return slot;
+    }
+    if (!create_tables(slot)) {
+        return -1;
+    }
+    DocSlot *doc = &registry->docs[slot];
+    snprintf(doc->path, sizeof(doc->path), "%s", path);
+    doc->hash = hash;
+    doc->order = registry->count++;
+    lock_info_init(&doc->lock);
+    atomic_store_explicit(&doc->active, 1, memory_order_release);
+    return slot;
+}
+
+// Owner only, on exit: remove every document's tables
+void registry_release(void) {
+    for (int slot = 0; slot < REGISTRY_MAX_DOCS; slot++) {
+        if (atomic_load(&registry->docs[slot].active)) {
+            char name[DOC_FILE_MAX];
+            tables_name(slot, name, sizeof(name));
+            shm_unlink(name);
+        }
+    }
+}
+
+static int compare_order(const void *a, const void *b) {
+    uint32_t x = registry->docs[*(const int *)a].order, y = registry->docs[*(const int *)b].order;
+    return (x > y) - (x < y);
+}
+
+// Slots of the active documents, in the order they were added; the
+// caller frees the array
+int *registry_list(int *count) {
+    int *slots = malloc((registry->count + 1) * sizeof(int));
+    if (slots == NULL) {
+        *count = 0;
+        return NULL;
+    }
+    int n = 0;
+    for (int slot = 0; slot < REGISTRY_MAX_DOCS; slot++) {
+        if (atomic_load(&registry->docs[slot].active)) {
+            slots[n++] = slot;
+        }
+    }
+    qsort(slots, n, sizeof(int), compare_order);
+    *count = n;
+    return slots;
+}
+
+// Add the documents listed in REGISTRY_FILE, or DEFAULT_DOC if there is
+// none. Returns how many were added.
+int registry_load(void) {
+    FILE *file = fopen(REGISTRY_FILE, "r");
+    if (file == NULL) {
+        return registry_add(DEFAULT_DOC) >= 0 ? 1 : 0;
+    }
+    char line[MAX_LINE];
+    int count = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+        if (registry_add(line) >= 0) {
+            count++;
+        } else {
+            fprintf(stderr, "Skipping document '%s' in %s\n", line, REGISTRY_FILE);
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+bool registry_save(void) {
+    int count;
+    int *slots = registry_list(&count);
+    char *data = NULL;
+    size_t len = 0;
+    FILE *out = slots ? open_memstream(&data, &len) : NULL;
+    if (out == NULL) {
+        free(slots);
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "%s\n", registry->docs[slots[i]].path);
+    }
+    free(slots);
+    fclose(out);
+    bool ok = commit_file(REGISTRY_FILE, data, len);
+    free(data);
+    return ok;
+}
+
+// Work on the document in this slot from now on. Caches of the previous
+// document are dropped; no lock of it may still be held. Returns false if
+// the document's tables cannot be mapped.
+bool select_document(int slot) {
+    if (slot == current_doc.slot) {
+        return true;
+    }
+    char name[DOC_FILE_MAX];
+    tables_name(slot, name, sizeof(name));
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    DocTables *tables = fd == -1 ? MAP_FAILED
+                                 : mmap(NULL, sizeof(DocTables), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd != -1) {
+        close(fd);
+    }
+    if (tables == MAP_FAILED) {
+        perror("Failed to map lock tables");
+        return false;
+    }
+    if (doc_tables != NULL) {
+        munmap(doc_tables, sizeof(DocTables));
+    }
+    doc_tables = tables;
+    unmap_document();
+    const char *path = registry->docs[slot].path;
+    current_doc.slot = slot;
+    snprintf(current_doc.path, sizeof(current_doc.path), "%s", path);
+    snprintf(current_doc.edit_copy, sizeof(current_doc.edit_copy), "%s.edit", path);
+    snprintf(current_doc.collab_socket, sizeof(current_doc.collab_socket), "%s.sock", path);
+    snprintf(current_doc.server_socket, sizeof(current_doc.server_socket), "%s.control.sock", path);
+    snprintf(current_doc.control_file, sizeof(current_doc.control_file), "%s.control.db", path);
+    snprintf(current_doc.control_text, sizeof(current_doc.control_text), "%s.control.txt", path);
+    snprintf(current_doc.users_shm, sizeof(current_doc.users_shm), "/shared_doc_users.%d", slot);
+    lock_info = &registry->docs[slot].lock;
+    history_select(path);
+    return true;
+}
+
+// Before documents had their own files, the default document's control
+// file and history had fixed names; move them to its own names once
+void adopt_legacy_files(void) {
+    if (strcmp(SHARED_DOC, DEFAULT_DOC) != 0) {
+        return;
+    }
+    const char *legacy[][2] = {
+        { "shared_doc_control.db", CONTROL_FILE },
+        { "shared_doc_control.txt", CONTROL_TEXT },
+        { "history.dat", history_path(HISTORY_DATA) },
+        { "history.idx", history_path(HISTORY_INDEX) },
+        { "history.chunks", history_path(HISTORY_CHUNKS) },
+        { "history.txt", history_path(HISTORY_LEGACY) },
+    };
+    for (size_t i = 0; i < sizeof(legacy) / sizeof(legacy[0]); i++) {
+        if (access(legacy[i][0], F_OK) == 0 && access(legacy[i][1], F_OK) == -1) {
+            if (rename(legacy[i][0], legacy[i][1]) == 0) {
+                printf("Moved %s to %s\n", legacy[i][0], legacy[i][1]);
+            }
+        }
+    }
+}
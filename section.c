@@ -0,0 +1,114 @@
+// section.c
+// Section scanning. Titles identify sections, so repeated headings get a
+// " (2)", " (3)", ... suffix to keep them unique.
+
+#include "section.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+static size_t line_end(const char *doc, size_t len, size_t pos) {
+    const char *nl = memchr(doc + pos, '\n', len - pos);
+    return nl ? (size_t)(nl - doc) + 1 : len;
+}
+
+static bool is_heading(const char *doc, size_t len, size_t pos) {
+    return pos < len && doc[pos] == '#';
+}
+
+static bool is_blank(const char *doc, size_t pos, size_t end) {
+    for (size_t i = pos; i < end; i++) {
+        if (doc[i] != ' ' && doc[i] != '\t' && doc[i] != '\r' && doc[i] != '\n') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Heading text without the leading '#'s, surrounding blanks and newline
+static void heading_title(const char *doc, size_t pos, size_t end, char *title) {
+    while (pos < end && (doc[pos] == '#' || doc[pos] == ' ' || doc[pos] == '\t')) {
+        pos++;
+    }
+    while (end > pos && (doc[end - 1] == '\n' || doc[end - 1] == '\r' ||
+                         doc[end - 1] == ' ' || doc[end - 1] == '\t')) {
+        end--;
+    }
+    size_t n = end - pos < SECTION_TITLE_MAX - 8 ? end - pos : SECTION_TITLE_MAX - 8;
+    memcpy(title, doc + pos, n);
+    title[n] = '\0';
+    if (n == 0) {
+        strcpy(title, "(untitled)");
+    }
+}
+
+int section_find(const SectionSpan *spans, int count, const char *title) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(spans[i].title, title) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Start a new section at pos, making its title unique
+static int add_span(SectionSpan *spans, int count, int max, size_t pos, const char *title) {
+    if (count == max) {
+        return count;  // Later text stays in the last section
+    }
+    if (count > 0) {
+        spans[count - 1].length = pos - spans[count - 1].offset;
+    }
+
+    SectionSpan *span = &spans[count];
+    span->offset = pos;
+    span->length = 0;
+    snprintf(span->title, sizeof(span->title), "%s", title);
+    for (int copy = 2; section_find(spans, count, span->title) >= 0; copy++) {
+        snprintf(span->title, sizeof(span->title), "%.*s (%d)", SECTION_TITLE_MAX - 16, title, copy);
+    }
+    return count + 1;
+}
+
+// Fill spans with the document's sections, in order; they cover the
+// whole document. Returns the number of sections (at least 1).
+int section_scan(const char *doc, size_t len, SectionSpan *spans, int max) {
+    bool headings = false;
+    for (size_t pos = 0; pos < len && !headings; pos = line_end(doc, len, pos)) {
+        headings = is_heading(doc, len, pos);
+    }
+
+    int count = 0;
+    char title[SECTION_TITLE_MAX];
+    if (headings) {
+        if (!is_heading(doc, len, 0)) {
+            count = add_span(spans, count, max, 0, SECTION_TOP_TITLE);
+        }
+        for (size_t pos = 0; pos < len; pos = line_end(doc, len, pos)) {
+            if (is_heading(doc, len, pos)) {
+                heading_title(doc, pos, line_end(doc, len, pos), title);
+                count = add_span(spans, count, max, pos, title);
+            }
+        }
+    } else {
+        // A paragraph starts at a non-blank line after a blank one and
+        // keeps the blank lines that follow it
+        bool after_blank = true;
+        for (size_t pos = 0; pos < len; ) {
+            size_t end = line_end(doc, len, pos);
+            bool blank = is_blank(doc, pos, end);
+            if (!blank && after_blank && count < max) {
+                snprintf(title, sizeof(title), "Paragraph %d", count + 1);
+                count = add_span(spans, count, max, count == 0 ? 0 : pos, title);
+            }
+            after_blank = blank;
+            pos = end;
+        }
+    }
+
+    if (count == 0) {
+        count = add_span(spans, 0, max, 0, SECTION_TOP_TITLE);
+    }
+    spans[count - 1].length = len - spans[count - 1].offset;
+    return count;
+}
@@ -0,0 +1,25 @@
+// section.h
+// Splits the document into sections: one per heading line (a line
+// starting with '#'), plus any text before the first heading. A document
+// without headings is split into paragraphs at blank lines instead.
+
+#ifndef SECTION_H
+#define SECTION_H
+
+#include <stddef.h>
+
+#define SECTION_MAX 128
+#define SECTION_TITLE_MAX 64
+
+#define SECTION_TOP_TITLE "(top)"  // Text before the first heading
+
+typedef struct {
+    size_t offset;
+    size_t length;
+    char title[SECTION_TITLE_MAX];  // Unique within the document
+} SectionSpan;
+
+int section_scan(const char *doc, size_t len, SectionSpan *spans, int max);
+int section_find(const SectionSpan *spans, int count, const char *title);
+
+#endif // SECTION_H
@@ -0,0 +1,956 @@
+// server.c
+// Request server. Sessions are slots in a fixed array, registered with
+// epoll under their index. Each round handles every ready socket, then
+// schedules the requests queued for the document lock, then drops the
+// sessions that failed, so no slot is reused while its events are still
+// being handled.
+//
+// A request that needs the lock is queued and the session reads nothing
+// more until it is answered; clients wait for each reply anyway. While
+// anything is queued the loop wakes every SERVER_RETRY_MS to try the lock
+// again, without ever blocking on it.
+
+#define _GNU_SOURCE  // accept4, pipe2, SO_PEERCRED
+#include "shared.h"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// epoll data of the fds that are not sessions
+#define EV_STOP SERVER_MAX_CLIENTS
+#define EV_LISTEN (SERVER_MAX_CLIENTS + 1)
+
+typedef struct {
+    int fd;                  // -1 for a free slot
+    pid_t pid;               // Client process, from SO_PEERCRED
+    uid_t uid;               // Its user, likewise
+    char user[PROTO_NAME_MAX];  // Name logged in as, empty until PROTO_HELLO
+    char *in;                // Partial message read so far
+    size_t in_len;
+    size_t in_cap;
+    char *out;               // Replies the socket would not take yet
+    size_t out_len;
+    size_t out_cap;
+    bool polling_out;        // EPOLLOUT is registered
+    int queued;              // Request waiting for the document lock, 0 if none
+    unsigned long queued_at; // Order of arrival among queued requests
+    bool editing;            // The server holds the write lock for this session
+    int range;               // Byte-range lock that goes with it
+    bool failed;             // Dropped at the end of the round
+} Session;
+
+// Owner side: one server per document, by registry slot
+static pid_t server_pids[REGISTRY_MAX_DOCS];
+static int server_stop_fds[REGISTRY_MAX_DOCS];  // Owner's end of each stop pipe
+
+static Session sessions[SERVER_MAX_CLIENTS];
+static unsigned long queue_seq = 0;
+static int epoll_fd = -1;
+
+// Load the user directory from the control file, once. The file stays
+// mapped, and each change to a user is written to its record.
+static bool load_users(void) {
+    if (!control_open(CONTROL_FILE)) {
+        fprintf(stderr, "Request server: cannot open %s: %s\n", CONTROL_FILE, strerror(errno));
+        return false;
+    }
+    for (uint32_t i = 0; i < control_count(); i++) {
+        UserRecord user;
+        if (control_read(i, &user)) {
+            user.pid = 0;  // Left by sessions of an earlier run
+            if (!userdir_put(&user)) {
+                fprintf(stderr, "Request server: no room for user '%s'\n", user.name);
+            }
+        }
+    }
+    return true;
+}
+
+static ProtoUser proto_user(const UserRecord *user) {
+    ProtoUser record = { .priority = user->priority, .access_type = user->access_type,
+                         .pid = user->pid };
+    snprintf(record.name, sizeof(record.name), "%s", user->name);
+    record.active = user->pid > 0;
+    return record;
+}
+
+// Names go into the control file's text dump as one word
+static bool valid_user(const ProtoUser *record) {
+    if (memchr(record->name, '\0', sizeof(record->name)) == NULL || record->name[0] == '\0' ||
+        record->name[strcspn(record->name, " \t\r\n")] != '\0') {
+        return false;
+    }
+    return (record->priority == PRIORITY_HIGH || record->priority == PRIORITY_LOW) &&
+           record->access_type >= ACCESS_READ_ONLY && record->access_type <= ACCESS_BOTH;
+}
+
+static bool can_read(const UserRecord *user) {
+    return user->access_type == ACCESS_READ_ONLY || user->access_type == ACCESS_BOTH;
+}
+
+static bool can_write(const UserRecord *user) {
+    return user->access_type == ACCESS_WRITE_ONLY || user->access_type == ACCESS_BOTH;
+}
+
+// Send what the socket takes now and keep the rest for EPOLLOUT
+static bool flush_session(Session *session) {
+    size_t sent = 0;
+    while (sent < session->out_len) {
+        ssize_t n = send(session->fd, session->out + sent, session->out_len - sent,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        sent += n;
+    }
+    memmove(session->out, session->out + sent, session->out_len - sent);
+    session->out_len -= sent;
+    return true;
+}
+
+static bool queue_bytes(Session *session, const void *data, size_t bytes) {
+    if (session->out_len + bytes > session->out_cap) {
+        size_t cap = session->out_cap ? session->out_cap : 4096;
+        while (cap < session->out_len + bytes) {
+            cap *= 2;
+        }
+        char *out = realloc(session->out, cap);
+        if (out == NULL) {
+            return false;
+        }
+        session->out = out;
+        session->out_cap = cap;
+    }
+    memcpy(session->out + session->out_len, data, bytes);
+    session->out_len += bytes;
+    return true;
+}
+
+static void send_message(Session *session, int type, int status, int arg, const void *payload, size_t len) {
+    ProtoHeader header = { .type = type, .status = status, .arg = arg, .len = len };
+    if (!queue_bytes(session, &header, sizeof(header)) ||
+        (len > 0 && !queue_bytes(session, payload, len)) || !flush_session(session)) {
+        session->failed = true;
+    }
+}
+
+// Take the document lock for the server itself, without waiting, as a
+// user without priority. *range gets the byte-range handle (-1 if none
+// was needed) for release_document_lock().
+static bool try_document_lock(int type, int *range) {
+    bool locked = type == RANGE_WRITE ? rwlock_write_lock(&lock_info->rwlock, false, 0)
+                                      : rwlock_read_lock(&lock_info->rwlock, false, 0);
+    if (!locked) {
+        return false;
+    }
+    if (!lock_document_range(type, false, 0, range)) {
+        if (type == RANGE_WRITE) {
+            rwlock_write_unlock(&lock_info->rwlock);
+        } else {
+            rwlock_read_unlock(&lock_info->rwlock);
+        }
+        return false;
+    }
+    return true;
+}
+
+static void release_document_lock(int type, int range) {
+    range_unlock(&doc_tables->ranges, range);
+    if (type == RANGE_WRITE) {
+        atomic_fetch_add(&lock_info->doc_version, 1);
+        rwlock_write_unlock(&lock_info->rwlock);
+    } else {
+        rwlock_read_unlock(&lock_info->rwlock);
+    }
+    acknowledge_takeover();
+}
+
+// Give up the write lock held for a session. If the session's process
+// died and the owner reclaimed the lock first, only the range is left.
+static void release_edit(Session *session) {
+    atomic_fetch_add(&lock_info->doc_version, 1);
+    if (release_holder(session->pid) == 2) {
+        rwlock_write_unlock(&lock_info->rwlock);
+    }
+    range_unlock(&doc_tables->ranges, session->range);
+    acknowledge_takeover();
+    session->editing = false;
+    session->range = -1;
+}
+
+static void grant_edit(Session *session) {
+    int range;
+    if (!try_document_lock(RANGE_WRITE, &range)) {
+        return;
+    }
+    size_t len;
+    char *doc = read_document(&len);
+    if (doc == NULL) {
+        release_document_lock(RANGE_WRITE, range);
+        send_message(session, PROTO_EDIT_BEGIN, PROTO_ERR_FAILED, 0, NULL, 0);
+    } else {
+        // The lock is now the session's: the owner's takeover signals go to
+        // its process and a dead one is reclaimed like any other holder
+        claim_holder(session->pid, 2, false);
+        session->editing = true;
+        session->range = range;
+        send_message(session, PROTO_EDIT_BEGIN, PROTO_OK, 0, doc, len);
+        free(doc);
+    }
+    session->queued = 0;
+}
+
+// Answer the requests waiting for the document lock
+static void schedule(void) {
+    bool views = false, edits = false, editing = false;
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        Session *session = &sessions[i];
+        if (session->fd < 0 || session->failed) {
+            continue;
+        }
+        views |= session->queued == PROTO_VIEW;
+        edits |= session->queued == PROTO_EDIT_BEGIN;
+        editing |= session->editing;
+    }
+
+    // One read of the document answers every waiting view
+    int range;
+    if (views && try_document_lock(RANGE_READ, &range)) {
+        size_t len;
+        char *doc = read_document(&len);
+        release_document_lock(RANGE_READ, range);
+        for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+            Session *session = &sessions[i];
+            if (session->fd >= 0 && !session->failed && session->queued == PROTO_VIEW) {
+                send_message(session, PROTO_VIEW, doc ? PROTO_OK : PROTO_ERR_FAILED, 0, doc, doc ? len : 0);
+                session->queued = 0;
+            }
+        }
+        free(doc);
+    }
+
+    if (!edits || editing) {
+        return;
+    }
+    // Users give way to the owner, as they do taking the lock themselves
+    if (owner_is_waiting()) {
+        for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+            Session *session = &sessions[i];
+            if (session->fd >= 0 && !session->failed && session->queued == PROTO_EDIT_BEGIN) {
+                send_message(session, PROTO_EDIT_BEGIN, PROTO_ERR_BUSY, 0, NULL, 0);
+                session->queued = 0;
+            }
+        }
+        return;
+    }
+    // Highest priority first (lowest number), then in order of arrival
+    Session *next = NULL;
+    int next_priority = 0;
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        Session *session = &sessions[i];
+        UserRecord user;
+        if (session->fd < 0 || session->failed || session->queued != PROTO_EDIT_BEGIN ||
+            !userdir_lookup(session->user, &user)) {
+            continue;
+        }
+        if (next == NULL || user.priority < next_priority ||
+            (user.priority == next_priority && session->queued_at < next->queued_at)) {
+            next = session;
+            next_priority = user.priority;
+        }
+    }
+    if (next != NULL) {
+        grant_edit(next);
+    }
+}
+
+static bool any_queued(void) {
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (sessions[i].fd >= 0 && sessions[i].queued) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The user's PID in the directory follows its sessions
+static void update_user_pid(const char *name) {
+    UserRecord user;
+    if (!userdir_lookup(name, &user)) {
+        return;
+    }
+    user.pid = 0;
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (sessions[i].fd >= 0 && !sessions[i].failed && strcmp(sessions[i].user, name) == 0) {
+            user.pid = sessions[i].pid;
+        }
+    }
+    userdir_put(&user);
+    control_update(&user, false);
+}
+
+static void drop_session(int i) {
+    Session *session = &sessions[i];
+    if (session->editing) {
+        release_edit(session);
+    }
+    close(session->fd);
+    free(session->in);
+    free(session->out);
+    char user[PROTO_NAME_MAX];
+    strcpy(user, session->user);
+    memset(session, 0, sizeof(*session));
+    session->fd = -1;
+    if (user[0] != '\0') {
+        update_user_pid(user);
+    }
+}
+
+static void handle_hello(Session *session, const char *name, size_t len) {
+    if (session->user[0] != '\0') {
+        send_message(session, PROTO_HELLO, PROTO_ERR_STATE, 0, NULL, 0);
+        return;
+    }
+    UserRecord user;
+    if (len >= PROTO_NAME_MAX || !userdir_lookup(name, &user)) {
+        send_message(session, PROTO_HELLO, PROTO_ERR_NO_USER, 0, NULL, 0);
+        return;
+    }
+    // Only the owner's own process logs in as the admin, and other
+    // processes of the owner's account (owner --import), which are not
+    // recorded as the admin's process
+    bool owner_process = session->pid == getppid();
+    if (user.priority == PRIORITY_OWNER && !owner_process && session->uid != getuid()) {
+        send_message(session, PROTO_HELLO, PROTO_ERR_ACCESS, 0, NULL, 0);
+        return;
+    }
+    strcpy(session->user, user.name);
+    if (user.priority != PRIORITY_OWNER || owner_process) {
+        user.pid = session->pid;
+        userdir_put(&user);
+        control_update(&user, false);
+    }
+    ProtoUser record = proto_user(&user);
+    send_message(session, PROTO_HELLO, PROTO_OK, 0, &record, sizeof(record));
+}
+
+static void handle_user_add(Session *session, const ProtoUser *record) {
+    UserRecord user = { .priority = record->priority, .access_type = record->access_type };
+    int status = PROTO_OK;
+    if (!valid_user(record)) {
+        status = PROTO_ERR_INVALID;
+    } else if (userdir_lookup(record->name, &user)) {
+        status = PROTO_ERR_EXISTS;
+    } else {
+        strcpy(user.name, record->name);
+        if (!control_add(&user)) {
+            status = PROTO_ERR_FAILED;
+        } else if (!userdir_put(&user)) {
+            control_remove(user.record);
+            status = PROTO_ERR_FULL;
+        }
+    }
+    send_message(session, PROTO_USER_ADD, status, 0, NULL, 0);
+}
+
+// Tell the sessions of a removed user, and close them. Returns how many.
+static int close_user_sessions(const char *name) {
+    int closed = 0;
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        Session *other = &sessions[i];
+        if (other->fd >= 0 && strcmp(other->user, name) == 0) {
+            send_message(other, PROTO_EVT_REMOVED, PROTO_OK, 0, NULL, 0);
+            other->user[0] = '\0';
+            other->failed = true;
+            closed++;
+        }
+    }
+    return closed;
+}
+
+// Send the user's new record to its open sessions. Returns how many.
+static int tell_user_sessions(const UserRecord *user) {
+    ProtoUser updated = proto_user(user);
+    int told = 0;
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (sessions[i].fd >= 0 && !sessions[i].failed && strcmp(sessions[i].user, user->name) == 0) {
+            send_message(&sessions[i], PROTO_EVT_USER, PROTO_OK, 0, &updated, sizeof(updated));
+            told++;
+        }
+    }
+    return told;
+}
+
+// The removed user's sessions are told and closed
+static void handle_user_remove(Session *session, const char *name, size_t len) {
+    UserRecord removed;
+    if (len >= PROTO_NAME_MAX || !userdir_lookup(name, &removed)) {
+        send_message(session, PROTO_USER_REMOVE, PROTO_ERR_NO_USER, 0, NULL, 0);
+        return;
+    }
+    if (removed.priority == PRIORITY_OWNER) {
+        send_message(session, PROTO_USER_REMOVE, PROTO_ERR_ACCESS, 0, NULL, 0);
+        return;
+    }
+    if (!control_remove(removed.record)) {
+        send_message(session, PROTO_USER_REMOVE, PROTO_ERR_FAILED, 0, NULL, 0);
+        return;
+    }
+    userdir_remove(name);
+    send_message(session, PROTO_USER_REMOVE, PROTO_OK, close_user_sessions(name), NULL, 0);
+}
+
+// Open sessions of the user get the new record at once
+static void handle_user_update(Session *session, const ProtoUser *record) {
+    UserRecord old;
+    if (!valid_user(record) || !userdir_lookup(record->name, &old)) {
+        send_message(session, PROTO_USER_UPDATE, PROTO_ERR_NO_USER, 0, NULL, 0);
+        return;
+    }
+    if (old.priority == PRIORITY_OWNER) {
+        send_message(session, PROTO_USER_UPDATE, PROTO_ERR_ACCESS, 0, NULL, 0);
+        return;
+    }
+    UserRecord user = old;
+    user.priority = record->priority;
+    user.access_type = record->access_type;
+    if (!control_update(&user, true)) {
+        control_update(&old, false);
+        send_message(session, PROTO_USER_UPDATE, PROTO_ERR_FAILED, 0, NULL, 0);
+        return;
+    }
+    userdir_put(&user);
+    send_message(session, PROTO_USER_UPDATE, PROTO_OK, tell_user_sessions(&user), NULL, 0);
+}
+
+static void handle_user_list(Session *session) {
+    size_t count;
+    UserRecord *users = userdir_list(&count);
+    ProtoUser *list = users ? malloc((count + 1) * sizeof(ProtoUser)) : NULL;
+    if (list == NULL) {
+        free(users);
+        send_message(session, PROTO_USER_LIST, PROTO_ERR_FAILED, 0, NULL, 0);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        list[i] = proto_user(&users[i]);
+    }
+    send_message(session, PROTO_USER_LIST, PROTO_OK, 0, list, count * sizeof(ProtoUser));
+    free(list);
+    free(users);
+}
+
+// What a batch operation replaced, to put back if the batch fails
+typedef struct {
+    char name[PROTO_NAME_MAX];
+    bool existed;
+    UserRecord before;
+} UserUndo;
+
+static int apply_user_op(const ProtoUserOp *op, UserUndo *undo, ProtoBatchResult *result) {
+    if (memchr(op->user.name, '\0', sizeof(op->user.name)) == NULL) {
+        return PROTO_ERR_INVALID;
+    }
+    strcpy(undo->name, op->user.name);
+    undo->existed = userdir_lookup(op->user.name, &undo->before);
+    UserRecord user = undo->before;
+    switch (op->op) {
+        case PROTO_OP_ADD:
+            if (!valid_user(&op->user)) {
+                return PROTO_ERR_INVALID;
+            }
+            if (undo->existed) {
+                return PROTO_ERR_EXISTS;
+            }
+            memset(&user, 0, sizeof(user));
+            strcpy(user.name, op->user.name);
+            user.priority = op->user.priority;
+            user.access_type = op->user.access_type;
+            if (!userdir_put(&user)) {
+                return PROTO_ERR_FULL;
+            }
+            result->added++;
+            return PROTO_OK;
+        case PROTO_OP_UPDATE:
+            if (!valid_user(&op->user)) {
+                return PROTO_ERR_INVALID;
+            }
+            if (!undo->existed) {
+                return PROTO_ERR_NO_USER;
+            }
+            if (user.priority == PRIORITY_OWNER) {
+                return PROTO_ERR_ACCESS;
+            }
+            user.priority = op->user.priority;
+            user.access_type = op->user.access_type;
+            userdir_put(&user);
+            result->updated++;
+            return PROTO_OK;
+        case PROTO_OP_REMOVE:
+            if (!undo->existed) {
+                return PROTO_ERR_NO_USER;
+            }
+            if (user.priority == PRIORITY_OWNER) {
+                return PROTO_ERR_ACCESS;
+            }
+            userdir_remove(op->user.name);
+            result->removed++;
+            return PROTO_OK;
+        default:
+            return PROTO_ERR_INVALID;
+    }
+}
+
+// Write the whole directory as a new control file, in one commit, and map
+// that in place of the old one
+static bool commit_users(void) {
+    size_t count;
+    UserRecord *users = userdir_list(&count);
+    if (users == NULL || !control_create(CONTROL_FILE, SHARED_DOC, users, count)) {
+        free(users);
+        return false;
+    }
+    control_close();
+    if (!control_open(CONTROL_FILE)) {
+        fprintf(stderr, "Request server: cannot reopen %s: %s\n", CONTROL_FILE, strerror(errno));
+    }
+    for (size_t i = 0; i < count; i++) {
+        users[i].record = i;
+        userdir_put(&users[i]);
+    }
+    free(users);
+    return true;
+}
+
+// Apply every operation to the user directory, then commit the control
+// file once. If an operation or the commit fails, the operations already
+// applied are undone in reverse and nothing is written.
+static void handle_user_batch(Session *session, const char *payload, size_t len) {
+    ProtoBatchResult result = { 0 };
+    size_t count = len / sizeof(ProtoUserOp);
+    UserUndo *undo = malloc((count + 1) * sizeof(UserUndo));
+    if (len % sizeof(ProtoUserOp) != 0 || undo == NULL) {
+        free(undo);
+        send_message(session, PROTO_USER_BATCH, undo ? PROTO_ERR_INVALID : PROTO_ERR_FAILED,
+                     0, &result, sizeof(result));
+        return;
+    }
+    int status = PROTO_OK;
+    size_t applied = 0;
+    while (applied < count) {
+        ProtoUserOp op;
+        memcpy(&op, payload + applied * sizeof(op), sizeof(op));
+        status = apply_user_op(&op, &undo[applied], &result);
+        if (status != PROTO_OK) {
+            break;
+        }
+        applied++;
+    }
+    if (status == PROTO_OK && !commit_users()) {
+        status = PROTO_ERR_FAILED;
+    }
+    if (status != PROTO_OK) {
+        for (size_t i = applied; i-- > 0;) {
+            if (undo[i].existed) {
+                userdir_put(&undo[i].before);
+            } else {
+                userdir_remove(undo[i].name);
+            }
+        }
+        free(undo);
+        ProtoBatchResult failed = { .failed_at = applied };
+        send_message(session, PROTO_USER_BATCH, status, 0, &failed, sizeof(failed));
+        return;
+    }
+
+    // Sessions hear of the change only once it is committed
+    for (size_t i = 0; i < count; i++) {
+        UserRecord user;
+        if (!userdir_lookup(undo[i].name, &user)) {
+            close_user_sessions(undo[i].name);
+        } else if (undo[i].existed) {
+            tell_user_sessions(&user);
+        }
+    }
+    free(undo);
+    result.failed_at = count;
+    send_message(session, PROTO_USER_BATCH, PROTO_OK, 0, &result, sizeof(result));
+}
+
+// Pushes and pops change the document files, so they need the document
+// to themselves; the owner is told to try again while a user edits
+static void handle_history(Session *session, int type) {
+    if (type == PROTO_HISTORY_LIST) {
+        char *text = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&text, &len);
+        if (out == NULL) {
+            send_message(session, type, PROTO_ERR_FAILED, 0, NULL, 0);
+            return;
+        }
+        history_print(out);
+        fclose(out);
+        send_message(session, type, PROTO_OK, 0, text, len);
+        free(text);
+        return;
+    }
+
+    int range;
+    if (!try_document_lock(RANGE_WRITE, &range)) {
+        send_message(session, type, PROTO_ERR_BUSY, 0, NULL, 0);
+        return;
+    }
+    // History snapshots the document file, so fold the log into it first
+    bool ok = oplog_checkpoint(SHARED_DOC);
+    if (type == PROTO_HISTORY_PUSH) {
+        ok = ok && history_push(SHARED_DOC);
+    } else {
+        ok = ok && history_pop(SHARED_DOC);
+    }
+    release_document_lock(RANGE_WRITE, range);
+
+    if (!ok) {
+        send_message(session, type, PROTO_ERR_FAILED, 0, NULL, 0);
+    } else if (type == PROTO_HISTORY_PUSH) {
+        int64_t count = history_count();
+        send_message(session, type, PROTO_OK, 0, &count, sizeof(count));
+        // Older history is compressed off the critical path
+        history_compress_background(HISTORY_COMPRESS_AGE, HISTORY_COMPRESS_BUDGET_MS);
+    } else {
+        send_message(session, type, PROTO_OK, 0, NULL, 0);
+    }
+}
+
+static void handle_edit_commit(Session *session, const char *text, size_t len) {
+    size_t doc_len;
+    char *doc = read_document(&doc_len);
+    bool ok = doc != NULL && oplog_append_edit(SHARED_DOC, doc, doc_len, text, len, session->user);
+    free(doc);
+    release_edit(session);
+    send_message(session, PROTO_EDIT_COMMIT, ok ? PROTO_OK : PROTO_ERR_FAILED, 0, NULL, 0);
+}
+
+static void handle_request(Session *session, const ProtoHeader *header, const char *payload) {
+    int type = header->type;
+    if (type == PROTO_HELLO) {
+        handle_hello(session, payload, header->len);
+        return;
+    }
+    UserRecord record;
+    const UserRecord *user = session->user[0] && userdir_lookup(session->user, &record) ? &record : NULL;
+    bool owner = user != NULL && user->priority == PRIORITY_OWNER;
+    int status = PROTO_OK;
+
+    switch (type) {
+        case PROTO_VIEW:
+        case PROTO_EDIT_BEGIN:
+            if (user == NULL || !(type == PROTO_VIEW ? can_read(user) : can_write(user))) {
+                status = PROTO_ERR_ACCESS;
+            } else if (session->editing) {
+                status = PROTO_ERR_STATE;
+            } else {
+                session->queued = type;
+                session->queued_at = ++queue_seq;
+                return;
+            }
+            break;
+        case PROTO_EDIT_COMMIT:
+        case PROTO_EDIT_ABORT:
+            if (!session->editing) {
+                status = PROTO_ERR_STATE;
+            } else if (type == PROTO_EDIT_COMMIT) {
+                handle_edit_commit(session, payload, header->len);
+                return;
+            } else {
+                release_edit(session);
+            }
+            break;
+        case PROTO_USER_LIST:
+        case PROTO_USER_ADD:
+        case PROTO_USER_REMOVE:
+        case PROTO_USER_UPDATE:
+        case PROTO_HISTORY_PUSH:
+        case PROTO_HISTORY_POP:
+        case PROTO_HISTORY_LIST:
+        case PROTO_USER_BATCH:
+            if (!owner) {
+                status = PROTO_ERR_ACCESS;
+            } else if ((type == PROTO_USER_ADD || type == PROTO_USER_UPDATE) &&
+                       header->len != sizeof(ProtoUser)) {
+                status = PROTO_ERR_INVALID;
+            } else if (type == PROTO_USER_LIST) {
+                handle_user_list(session);
+                return;
+            } else if (type == PROTO_USER_ADD) {
+                handle_user_add(session, (const ProtoUser *)payload);
+                return;
+            } else if (type == PROTO_USER_REMOVE) {
+                handle_user_remove(session, payload, header->len);
+                return;
+            } else if (type == PROTO_USER_UPDATE) {
+                handle_user_update(session, (const ProtoUser *)payload);
+                return;
+            } else if (type == PROTO_USER_BATCH) {
+                handle_user_batch(session, payload, header->len);
+                return;
+            } else {
+                handle_history(session, type);
+                return;
+            }
+            break;
+        default:
+            status = PROTO_ERR_INVALID;
+    }
+    send_message(session, type, status, 0, NULL, 0);
+}
+
+// Handle the complete messages read so far, stopping at a queued request
+static void process_input(Session *session) {
+    size_t used = 0;
+    while (!session->queued && !session->failed && session->in_len - used >= sizeof(ProtoHeader)) {
+        ProtoHeader header;
+        memcpy(&header, session->in + used, sizeof(header));
+        if (session->in_len - used - sizeof(header) < header.len) {
+            break;
+        }
+        // Payloads are handed on NUL-terminated, in place of the next
+        // message's first byte, which is put back afterwards
+        char *payload = session->in + used + sizeof(header);
+        char saved = payload[header.len];
+        payload[header.len] = '\0';
+        handle_request(session, &header, payload);
+        payload[header.len] = saved;
+        used += sizeof(header) + header.len;
+    }
+    memmove(session->in, session->in + used, session->in_len - used);
+    session->in_len -= used;
+}
+
+// Returns false when the client has gone or sent something invalid
+static bool read_session(Session *session) {
+    // Room for the whole message being read, and the byte after it
+    size_t need = session->in_len + 4096;
+    if (session->in_len >= sizeof(ProtoHeader)) {
+        ProtoHeader header;
+        memcpy(&header, session->in, sizeof(header));
+        if (header.len > PROTO_PAYLOAD_MAX) {
+            return false;
+        }
+        if (sizeof(header) + header.len + 1 > need) {
+            need = sizeof(header) + header.len + 1;
+        }
+    }
+    if (need > session->in_cap) {
+        char *in = realloc(session->in, need);
+        if (in == NULL) {
+            return false;
+        }
+        session->in = in;
+        session->in_cap = need;
+    }
+    ssize_t n = read(session->fd, session->in + session->in_len, session->in_cap - session->in_len - 1);
+    if (n <= 0) {
+        return n < 0 && (errno == EINTR || errno == EAGAIN);
+    }
+    session->in_len += n;
+    process_input(session);
+    return true;
+}
+
+static void accept_session(int listen_fd) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) {
+        return;
+    }
+    int i = 0;
+    while (i < SERVER_MAX_CLIENTS && sessions[i].fd >= 0) {
+        i++;
+    }
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = i };
+    if (i == SERVER_MAX_CLIENTS || getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        close(fd);
+        return;
+    }
+    sessions[i].fd = fd;
+    sessions[i].pid = cred.pid;
+    sessions[i].uid = cred.uid;
+}
+
+static void server_main(int listen_fd, int stop_fd) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event stop_event = { .events = EPOLLIN, .data.u32 = EV_STOP };
+    struct epoll_event listen_event = { .events = EPOLLIN, .data.u32 = EV_LISTEN };
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &stop_event) == -1 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event) == -1) {
+        perror("Request server: epoll");
+        return;
+    }
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        sessions[i].fd = -1;
+    }
+    if (!load_users()) {
+        return;
+    }
+
+    bool stop = false;
+    while (!stop) {
+        struct epoll_event events[SERVER_MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, any_queued() ? SERVER_RETRY_MS : -1);
+        if (n < 0 && errno != EINTR) {
+            perror("Request server: epoll_wait");
+            break;
+        }
+        for (int k = 0; k < n; k++) {
+            uint32_t id = events[k].data.u32;
+            if (id == EV_STOP) {
+                stop = true;  // The owner closed its end of the pipe, or exited
+            } else if (id == EV_LISTEN) {
+                accept_session(listen_fd);
+            } else if (sessions[id].fd >= 0 && !sessions[id].failed) {
+                Session *session = &sessions[id];
+                if ((events[k].events & EPOLLOUT) && !flush_session(session)) {
+                    session->failed = true;
+                } else if ((events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !read_session(session)) {
+                    session->failed = true;
+                }
+            }
+        }
+
+        // Answering a queued request lets its session go on to the next,
+        // and a session dropped while editing hands the lock on at once
+        bool released;
+        do {
+            schedule();
+            for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+                if (sessions[i].fd >= 0 && !sessions[i].queued && !sessions[i].failed) {
+                    process_input(&sessions[i]);
+                }
+            }
+            released = false;
+            for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+                if (sessions[i].fd >= 0 && sessions[i].failed) {
+                    released |= sessions[i].editing;
+                    drop_session(i);
+                }
+            }
+        } while (released);
+
+        for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+            Session *session = &sessions[i];
+            bool want_out = session->out_len > 0;
+            if (session->fd >= 0 && want_out != session->polling_out) {
+                struct epoll_event event = { .events = EPOLLIN | (want_out ? EPOLLOUT : 0),
+                                             .data.u32 = i };
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->fd, &event);
+                session->polling_out = want_out;
+            }
+        }
+    }
+
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (sessions[i].fd >= 0) {
+            drop_session(i);
+        }
+    }
+    control_close();
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(SERVER_SOCKET);
+}
+
+// Fork the selected document's server. The socket is listening before
+// this returns, so the owner can connect to it straight away. It serves
+// until server_stop(), or until the owner exits and the stop pipe closes
+// with it.
+bool server_start(void) {
+    int slot = current_doc.slot;
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", SERVER_SOCKET);
+    unlink(SERVER_SOCKET);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, SERVER_MAX_CLIENTS) == -1) {
+        fprintf(stderr, "Request server: cannot listen on %s: %s\n", SERVER_SOCKET, strerror(errno));
+        if (listen_fd >= 0) {
+            close(listen_fd);
+        }
+        return false;
+    }
+    chmod(SERVER_SOCKET, 0666);
+
+    // Created before the fork, so it exists once the owner can log in and
+    // the owner can attach to it to look users up itself
+    if (!userdir_create(current_doc.users_shm)) {
+        close(listen_fd);
+        return false;
+    }
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        perror("Failed to create request server pipe");
+        close(listen_fd);
+        userdir_detach();
+        shm_unlink(current_doc.users_shm);
+        return false;
+    }
+
+    fflush(NULL);  // Or the server would repeat the owner's buffered output
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Failed to start request server");
+        close(listen_fd);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        userdir_detach();
+        shm_unlink(current_doc.users_shm);
+        return false;
+    }
+    if (pid == 0) {
+        close(pipe_fds[1]);
+        // Other documents' servers must see their pipes close with the owner
+        for (int i = 0; i < REGISTRY_MAX_DOCS; i++) {
+            if (server_pids[i] > 0) {
+                close(server_stop_fds[i]);
+            }
+        }
+        // Takeover signals are for the user process the lock is held for
+        signal(PRIORITY_SIGNAL, SIG_IGN);
+        signal(LOCK_STATE_SIGNAL, SIG_IGN);
+        signal(SIGINT, SIG_IGN);
+        server_main(listen_fd, pipe_fds[0]);
+        fflush(NULL);
+        _exit(0);
+    }
+
+    close(listen_fd);
+    close(pipe_fds[0]);
+    userdir_detach();
+    server_pids[slot] = pid;
+    server_stop_fds[slot] = pipe_fds[1];
+    printf("Request server for %s started with PID: %d\n", SHARED_DOC, pid);
+    return true;
+}
+
+// Close every session of the selected document's server and wait for it
+// to exit. Later children hold the pipe open too, so a byte tells it to stop.
+void server_stop(void) {
+    int slot = current_doc.slot;
+    if (server_pids[slot] <= 0) {
+        return;
+    }
+    if (write(server_stop_fds[slot], "", 1) == -1) {
+        perror("Request server: stop");
+    }
+    close(server_stop_fds[slot]);
+    waitpid(server_pids[slot], NULL, 0);
+    shm_unlink(current_doc.users_shm);
+    server_pids[slot] = 0;
+}
@@ -0,0 +1,29 @@
+// server.h
+// Request server. The owner forks it at startup; it listens on
+// SERVER_SOCKET and serves logins, document views, whole-document edits,
+// user management and history to the user programs and to the owner's
+// own menu, over the protocol in proto.h. It loads the user table into
+// the user directory (userdir.h) once, and writes each change to the
+// user's record in CONTROL_FILE (control.h).
+//
+// One epoll loop serves every client, so requests that need the document
+// lock are scheduled in one place: views waiting for the read lock are
+// all answered from a single read of the document, and edit requests get
+// the write lock in priority order. The server holds the write lock on
+// behalf of the user editing, recorded under that user's PID so the
+// owner's takeover reaches the user's editor as before.
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+
+#define SERVER_MAX_CLIENTS 64
+#define SERVER_MAX_EVENTS 64
+// How often queued requests try the document lock again
+#define SERVER_RETRY_MS 100
+
+bool server_start(void);
+void server_stop(void);
+
+#endif // SERVER_H
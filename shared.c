@@ -1,474 +1,667 @@
 #include "shared.h"
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
 
 // Global variables for synchronization
-sem_t *access_sem = NULL;
-sem_t *owner_sem = NULL;
+DocRegistry *registry = NULL;
 LockInfo *lock_info = NULL;
+DocTables *doc_tables = NULL;
 int lock_info_shm_id = -1;
 
+// Reader-side mapping of the shared document, reused across views until
+// a writer bumps lock_info->doc_version
+static const char *doc_map = NULL;
+static size_t doc_map_len = 0;
+static unsigned long doc_map_version = 0;
+static ino_t doc_map_ino = 0;
+
+// Range that goes with this process's whole-document read or write lock
+static int doc_range = -1;
+
+// This process's entry in the reader table while it holds a read lock
+static int reader_entry = -1;
+
 // Signal handler for priority override
 void handle_priority_signal(int signum) {
     if (signum == PRIORITY_SIGNAL) {
         printf("Received priority signal. Owner needs access.\n");
-        // We don't need to do anything here - the checking for owner_waiting
-        // is done in the lock acquisition and holding code
+        // We don't need to do anything here - the owner override bit in the
+        // lock state is checked in the lock acquisition and holding code
     }
 }
 
 
-void append_to_history() {
-    FILE *history_file;
-    FILE *doc_file;
-    time_t current_time;
-    struct tm *time_info;
-    char timestamp[30];
-    char buffer[1024];  // Buffer to read file content in chunks
-
-    // Get current time
-    time(&current_time);
-    time_info = localtime(&current_time);
-
-    // Format timestamp
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", time_info);
+// Only needs to exist so LOCK_STATE_SIGNAL is queued rather than
+// discarded or fatal; supervisors read it from a signalfd
+static void handle_lock_state_signal(int signum) {
+    (void)signum;
+}
 
-    // Open history file in append mode
-    history_file = fopen("history.txt", "a");
-    if (history_file == NULL) {
-        fprintf(stderr, "Error: Could not open history.txt for appending.\n");
-        return;
+void initialize_synchronization(bool is_owner) {
+    // Set up signal handler for priority override
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_priority_signal;
+    sigaction(PRIORITY_SIGNAL, &sa, NULL);
+    
+    sa.sa_handler = handle_lock_state_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(LOCK_STATE_SIGNAL, &sa, NULL);
+    
+    key_t key = ftok("/tmp", 'R');
+    if (key == -1) {
+        perror("ftok");
+        exit(EXIT_FAILURE);
     }
-
-    // Write start tag with timestamp
-    fprintf(history_file, "<start timestamp=\"%s\">\n", timestamp);
-
-    // Open the actual document file to read its contents
-    if (SHARED_DOC != NULL) {
-        doc_file = fopen(SHARED_DOC, "r");
-        if (doc_file != NULL) {
-            // Read from the document file and write into history.txt
-            while (fgets(buffer, sizeof(buffer), doc_file) != NULL) {
-                fputs(buffer, history_file);
+    
+    if (is_owner) {
+        // Set up shared memory for the document registry, which holds the
+        // lock of every document in a slot of its own
+        lock_info_shm_id = shmget(key, sizeof(DocRegistry), IPC_CREAT | 0666);
+        if (lock_info_shm_id < 0 && errno == EINVAL) {
+            // A segment left over from an older build has the wrong size
+            int stale_id = shmget(key, 0, 0666);
+            if (stale_id >= 0) {
+                shmctl(stale_id, IPC_RMID, NULL);
             }
-            fclose(doc_file);
-        } else {
-            fprintf(history_file, "[Error: Could not open document file %s]\n", SHARED_DOC);
+            lock_info_shm_id = shmget(key, sizeof(DocRegistry), IPC_CREAT | 0666);
+        }
+        if (lock_info_shm_id < 0) {
+            perror("Failed to create lock info shared memory");
+            exit(EXIT_FAILURE);
+        }
+        
+        // Attach to shared memory
+        registry = (DocRegistry*) shmat(lock_info_shm_id, NULL, 0);
+        if (registry == (DocRegistry*) -1) {
+            perror("Failed to attach to lock info shared memory");
+            exit(EXIT_FAILURE);
         }
+        
+        // No documents until the owner adds them
+        memset(registry, 0, sizeof(DocRegistry));
+        
+        printf("Synchronization mechanisms initialized by owner.\n");
     } else {
-        fprintf(history_file, "[Empty document]\n");
+        // Get existing shared memory for lock info (created by admin program)
+        lock_info_shm_id = shmget(key, sizeof(DocRegistry), 0666);
+        if (lock_info_shm_id < 0) {
+            perror("Failed to get lock info shared memory segment - make sure admin is running first");
+            exit(EXIT_FAILURE);
+        }
+        
+        // Attach to shared memory
+        registry = (DocRegistry*) shmat(lock_info_shm_id, NULL, 0);
+        if (registry == (DocRegistry*) -1) {
+            perror("Failed to attach to lock info shared memory");
+            exit(EXIT_FAILURE);
+        }
+        
+        printf("Synchronization mechanisms initialized by user.\n");
     }
+}
 
-    // Write end tag
-    fprintf(history_file, "</end>\n\n");
-
-    // Close the history file
-    fclose(history_file);
+// True if the owner, a process it started or a user has the document
+// registry attached, so the shared state is in use and must not be set up
+// afresh
+bool owner_running(void) {
+    key_t key = ftok("/tmp", 'R');
+    int id = key == -1 ? -1 : shmget(key, 0, 0);
+    struct shmid_ds ds;
+    return id >= 0 && shmctl(id, IPC_STAT, &ds) == 0 && ds.shm_nattch > 0;
+}
 
-    printf("Document successfully appended to history.txt\n");
+void lock_info_init(LockInfo *info) {
+    rwlock_init(&info->rwlock);
+    atomic_store(&info->state, 0);
+    atomic_store(&info->editor_pid, 0);
+    atomic_store(&info->edit_start_time, 0);
+    atomic_store(&info->time_allocation, 0);
+    atomic_store(&info->doc_version, 1);
+    atomic_store(&info->takeover_seq, 0);
+    atomic_store(&info->takeover_ack, 0);
 }
-void pop_last_snapshot() {
-    FILE *history_file;
-    FILE *temp_file;
-    FILE *doc_file;
-    long last_start_pos = -1;
-    long copy_start_pos = -1;
-    char line[1024];
-    int copying = 0;
 
-    // Open history.txt for reading
-    history_file = fopen("history.txt", "r");
-    if (history_file == NULL) {
-        fprintf(stderr, "Error: Could not open history.txt for reading.\n");
-        return;
+void cleanup_synchronization(bool is_owner) {
+    unmap_document();
+    history_release();
+    
+    if (doc_tables != NULL) {
+        munmap(doc_tables, sizeof(DocTables));
+        doc_tables = NULL;
     }
-
-    // Find the last <start> position
-    while (fgets(line, sizeof(line), history_file)) {
-        if (strncmp(line, "<start", 6) == 0) {
-            last_start_pos = ftell(history_file) - strlen(line);  // Go back to beginning of this <start> line
+    
+    // Detach from shared memory
+    if (registry != NULL) {
+        if (is_owner) {
+            registry_release();
         }
+        shmdt(registry);
+        registry = NULL;
+        lock_info = NULL;
     }
+    
+    if (is_owner) {
+        // Remove shared memory
+        shmctl(lock_info_shm_id, IPC_RMID, NULL);
+        
+        printf("Synchronization resources cleaned up by owner.\n");
+    } else {
+        printf("Synchronization resources cleaned up by user.\n");
+    }
+}
 
-    if (last_start_pos == -1) {
-        fprintf(stderr, "Error: No <start> tag found in history.txt.\n");
-        fclose(history_file);
-        return;
+static int futex_wait(_Atomic uint32_t *addr, uint32_t expected, int timeout_ms) {
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    
+    // Not FUTEX_PRIVATE_FLAG: waiters and wakers are different processes
+    return syscall(SYS_futex, addr, FUTEX_WAIT, expected,
+                   timeout_ms >= 0 ? &ts : NULL, NULL, 0);
+}
+
+static void futex_wake_all(_Atomic uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Milliseconds left until deadline, or -1 when waiting indefinitely
+static int remaining_ms(const struct timespec *deadline, int timeout_ms) {
+    if (timeout_ms < 0) {
+        return -1;
     }
+    
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+              (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms : 0;
+}
 
-    // Open document file to write restored content
-    if (SHARED_DOC == NULL) {
-        fprintf(stderr, "Error: SHARED_DOC filename is NULL.\n");
-        fclose(history_file);
-        return;
+static void start_deadline(struct timespec *deadline, int timeout_ms) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    if (timeout_ms > 0) {
+        deadline->tv_sec += timeout_ms / 1000;
+        deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline->tv_nsec >= 1000000000L) {
+            deadline->tv_sec++;
+            deadline->tv_nsec -= 1000000000L;
+        }
     }
+}
 
-    doc_file = fopen(SHARED_DOC, "w");
-    if (doc_file == NULL) {
-        fprintf(stderr, "Error: Could not open %s for writing.\n", SHARED_DOC);
-        fclose(history_file);
-        return;
+// Tell sleeping waiters to re-check the lock state
+static void rwlock_wake(RwLock *lock) {
+    atomic_fetch_add(&lock->seq, 1);
+    futex_wake_all(&lock->seq);
+}
+
+// Sleep until the lock state may have changed. The waiter is registered
+// (waiting bit added) before seq is sampled, so a release that happens
+// after the caller's last state check always changes seq and wakes it.
+static bool rwlock_sleep(RwLock *lock, uint64_t wait_bit, uint64_t blocked_mask,
+                         const struct timespec *deadline, int timeout_ms) {
+    atomic_fetch_add(&lock->state, wait_bit);
+    uint32_t seq = atomic_load(&lock->seq);
+    
+    if (atomic_load(&lock->state) & blocked_mask) {
+        int ms = remaining_ms(deadline, timeout_ms);
+        if (ms == 0) {
+            atomic_fetch_sub(&lock->state, wait_bit);
+            return false;
+        }
+        futex_wait(&lock->seq, seq, ms);
     }
+    
+    atomic_fetch_sub(&lock->state, wait_bit);
+    return true;
+}
 
-    // Rewind and start reading again to restore
-    rewind(history_file);
-    fseek(history_file, last_start_pos, SEEK_SET);
+void rwlock_init(RwLock *lock) {
+    atomic_store(&lock->state, 0);
+    atomic_store(&lock->seq, 0);
+}
 
-    // Start copying content into document (stop at </end>)
-    while (fgets(line, sizeof(line), history_file)) {
-        if (strncmp(line, "<start", 6) == 0) {
-            copying = 1; // Start copying after <start> tag
-            continue;    // Skip writing <start> line
+// Take the lock shared. Readers give way to waiting writers (writer
+// preference) and, unless they are the owner, to a waiting owner: in
+// that case false is returned. The uncontended path is a single CAS.
+bool rwlock_read_lock(RwLock *lock, bool is_owner, int timeout_ms) {
+    uint64_t blocked_mask = is_owner ? RW_WRITER : (RW_WRITER | RW_WWAIT_MASK | RW_OWNER);
+    struct timespec deadline;
+    bool waited = false;  // The deadline is only read from the clock once we have to wait
+    
+    for (;;) {
+        uint64_t state = atomic_load(&lock->state);
+        
+        if (!is_owner && (state & RW_OWNER)) {
+            return false;
         }
-        if (strncmp(line, "</end>", 6) == 0) {
-            break;       // Stop copying before writing </end>
+        
+        if (!(state & blocked_mask)) {
+            uint64_t next = state + RW_READER;
+            if (is_owner) {
+                next &= ~RW_OWNER;
+            }
+            if (atomic_compare_exchange_weak(&lock->state, &state, next)) {
+                return true;
+            }
+            continue;
+        }
+        
+        if (!waited) {
+            start_deadline(&deadline, timeout_ms);
+            waited = true;
         }
-        if (copying) {
-            fputs(line, doc_file);
+        if (!rwlock_sleep(lock, RW_RWAIT, blocked_mask, &deadline, timeout_ms)) {
+            return false;
         }
     }
+}
 
-    fclose(doc_file);
-    fclose(history_file);
+// Take the lock exclusively. A non-owner gives up (returns false) as soon
+// as the owner asks for the lock; the owner clears its override bit when
+// it gets the lock. The uncontended path is a single CAS.
+bool rwlock_write_lock(RwLock *lock, bool is_owner, int timeout_ms) {
+    uint64_t blocked_mask = RW_WRITER | RW_READER_MASK;
+    struct timespec deadline;
+    bool waited = false;
+    
+    for (;;) {
+        uint64_t state = atomic_load(&lock->state);
+        
+        if (!is_owner && (state & RW_OWNER)) {
+            return false;
+        }
+        
+        if (!(state & blocked_mask)) {
+            uint64_t next = state | RW_WRITER;
+            if (is_owner) {
+                next &= ~RW_OWNER;
+            }
+            if (atomic_compare_exchange_weak(&lock->state, &state, next)) {
+                return true;
+            }
+            continue;
+        }
+        
+        // Waiting writers hold off new readers while they sleep
+        if (!waited) {
+            start_deadline(&deadline, timeout_ms);
+            waited = true;
+        }
+        if (!rwlock_sleep(lock, RW_WWAIT, is_owner ? blocked_mask : blocked_mask | RW_OWNER,
+                          &deadline, timeout_ms)) {
+            return false;
+        }
+    }
+}
 
-    // Now, remove the popped snapshot from history.txt
-    // Open history.txt again
-    history_file = fopen("history.txt", "r");
-    if (history_file == NULL) {
-        fprintf(stderr, "Error: Could not re-open history.txt for removal.\n");
-        return;
+// Release a shared hold; returns true if this was the last reader
+bool rwlock_read_unlock(RwLock *lock) {
+    uint64_t state = atomic_fetch_sub(&lock->state, RW_READER);
+    
+    if (state & (RW_WWAIT_MASK | RW_RWAIT_MASK)) {
+        rwlock_wake(lock);
     }
+    return (state & RW_READER_MASK) == 1;
+}
 
-    temp_file = fopen("temp.txt", "w");
-    if (temp_file == NULL) {
-        fprintf(stderr, "Error: Could not open temp.txt for writing.\n");
-        fclose(history_file);
-        return;
+void rwlock_write_unlock(RwLock *lock) {
+    uint64_t state = atomic_fetch_and(&lock->state, ~RW_WRITER);
+    
+    if (state & (RW_WWAIT_MASK | RW_RWAIT_MASK)) {
+        rwlock_wake(lock);
     }
+}
 
-    int skip = 0;
-    rewind(history_file);
-    while (fgets(line, sizeof(line), history_file)) {
-        if (strncmp(line, "<start", 6) == 0) {
-            if (ftell(history_file) - strlen(line) - 1 == last_start_pos) {
-                skip = 1;  // Start skipping lines
-            }
-        }
-        if (!skip) {
-            fputs(line, temp_file);
+bool owner_is_waiting(void) {
+    return (atomic_load(&lock_info->rwlock.state) & RW_OWNER) != 0;
+}
+
+void set_owner_waiting(bool waiting) {
+    if (waiting) {
+        atomic_fetch_or(&lock_info->rwlock.state, RW_OWNER);
+    } else {
+        atomic_fetch_and(&lock_info->rwlock.state, ~RW_OWNER);
+    }
+    
+    // Waiting users re-check the override bit and back off
+    rwlock_wake(&lock_info->rwlock);
+    range_set_owner_waiting(&doc_tables->ranges, waiting);
+}
+
+// Snapshot of the lock control word
+uint64_t lock_state(void) {
+    return atomic_load_explicit(&lock_info->state, memory_order_acquire);
+}
+
+// Clear and set bits of the control word in one CAS; returns the new value
+static uint64_t lock_state_update(uint64_t clear, uint64_t set) {
+    uint64_t state = atomic_load_explicit(&lock_info->state, memory_order_relaxed);
+    uint64_t next;
+    
+    do {
+        next = (state & ~clear) | set;
+    } while (!atomic_compare_exchange_weak_explicit(&lock_info->state, &state, next,
+                                                    memory_order_acq_rel,
+                                                    memory_order_relaxed));
+    return next;
+}
+
+// Record pid as the lock holder. With only_if_free the record is left
+// alone when another process is already recorded (shared holders).
+void claim_holder(pid_t pid, int type, bool only_if_free) {
+    uint64_t state = atomic_load_explicit(&lock_info->state, memory_order_relaxed);
+    uint64_t next;
+    
+    do {
+        if (only_if_free && LS_LOCK_TYPE(state) != 0) {
+            return;
         }
-        if (skip && strncmp(line, "</end>", 6) == 0) {
-            skip = 0;  // Done skipping after </end>
+        next = (state & ~(LS_PID_MASK | LS_TYPE_MASK)) |
+               (uint32_t)pid | ((uint64_t)type << LS_TYPE_SHIFT);
+    } while (!atomic_compare_exchange_weak_explicit(&lock_info->state, &state, next,
+                                                    memory_order_acq_rel,
+                                                    memory_order_relaxed));
+}
+
+// Clear the holder record if, and only if, pid is still the recorded
+// holder. Returns the lock type that was recorded, or 0 if pid was not
+// the holder.
+int release_holder(pid_t pid) {
+    uint64_t state = atomic_load_explicit(&lock_info->state, memory_order_relaxed);
+    
+    do {
+        if (LS_HOLDER(state) != pid || LS_LOCK_TYPE(state) == 0) {
+            return 0;
         }
+    } while (!atomic_compare_exchange_weak_explicit(&lock_info->state, &state,
+                                                    state & ~(LS_PID_MASK | LS_TYPE_MASK),
+                                                    memory_order_acq_rel,
+                                                    memory_order_relaxed));
+    return LS_LOCK_TYPE(state);
+}
+
+// Wake the lock holder's editor supervisor after a takeover state change
+static void notify_holder(uint64_t state) {
+    pid_t holder = LS_HOLDER(state);
+    
+    if (holder > 0 && holder != getpid()) {
+        kill(holder, LOCK_STATE_SIGNAL);
     }
+}
 
-    fclose(history_file);
-    fclose(temp_file);
+void set_forced_lock(bool forced) {
+    if (forced) {
+        notify_holder(lock_state_update(0, LS_FORCED));
+    } else {
+        notify_holder(lock_state_update(LS_FORCED, 0));
+    }
+}
 
-    // Replace history.txt with temp.txt
-    remove("history.txt");
-    rename("temp.txt", "history.txt");
+void start_countdown(int value) {
+    notify_holder(lock_state_update(LS_COUNT_MASK, LS_COUNTDOWN | ((uint64_t)value << LS_COUNT_SHIFT)));
+}
 
-    printf("Snapshot popped and restored into %s\n", SHARED_DOC);
+void set_countdown(int value) {
+    notify_holder(lock_state_update(LS_COUNT_MASK, (uint64_t)value << LS_COUNT_SHIFT));
 }
-void print_history() {
-    FILE *history_file;
-    char line[1024];
 
-    history_file = fopen("history.txt", "r");
-    if (history_file == NULL) {
-        printf("No history found.\n");
-        return;
-    }
+void stop_countdown(void) {
+    notify_holder(lock_state_update(LS_COUNTDOWN | LS_COUNT_MASK, 0));
+}
 
-    printf("----- Document History -----\n");
+// The start time and allocation are published before the flag, so a
+// process that sees LS_TIME_LIMIT also sees the values that go with it
+void start_time_limit(int allocation) {
+    atomic_store_explicit(&lock_info->edit_start_time, time(NULL), memory_order_relaxed);
+    atomic_store_explicit(&lock_info->time_allocation, allocation, memory_order_relaxed);
+    lock_state_update(0, LS_TIME_LIMIT);
+}
 
-    while (fgets(line, sizeof(line), history_file)) {
-        printf("%s", line); // Simply print line by line
-    }
+void stop_time_limit(void) {
+    lock_state_update(LS_TIME_LIMIT, 0);
+}
 
-    printf("----- End of History -----\n");
+// Seconds left in the current editor's allocation, if one is running
+bool time_limit_remaining(int *remaining) {
+    if (!(lock_state() & LS_TIME_LIMIT)) {
+        return false;
+    }
+    
+    int64_t start = atomic_load_explicit(&lock_info->edit_start_time, memory_order_relaxed);
+    int allocation = atomic_load_explicit(&lock_info->time_allocation, memory_order_relaxed);
+    *remaining = allocation - (int)(time(NULL) - start);
+    return true;
+}
 
-    fclose(history_file);
+// Owner side of the takeover handshake: returns the request number that
+// wait_takeover_ack() waits for
+uint32_t post_takeover_request(void) {
+    return atomic_fetch_add(&lock_info->takeover_seq, 1) + 1;
 }
 
+// Holder side: answer every request posted so far. Called whenever a lock
+// is released, so the owner learns of the handoff the moment it happens.
+void acknowledge_takeover(void) {
+    uint32_t seq = atomic_load(&lock_info->takeover_seq);
+    
+    if (atomic_load(&lock_info->takeover_ack) != seq) {
+        atomic_store(&lock_info->takeover_ack, seq);
+        futex_wake_all(&lock_info->takeover_ack);
+    }
+}
 
-void initialize_synchronization(bool is_owner) {
-    // Set up signal handler for priority override
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = handle_priority_signal;
-    sigaction(PRIORITY_SIGNAL, &sa, NULL);
+// Wait until the holder has answered request or nobody holds the lock any
+// more. Returns false if timeout_ms passes first.
+bool wait_takeover_ack(uint32_t request, int timeout_ms) {
+    struct timespec deadline;
+    start_deadline(&deadline, timeout_ms);
     
-    if (is_owner) {
-        // Create or open semaphores
-        access_sem = sem_open(ACCESS_SEMAPHORE, O_CREAT, 0644, 1);
-        if (access_sem == SEM_FAILED) {
-            perror("Failed to create access semaphore");
-            exit(EXIT_FAILURE);
-        }
-        
-        owner_sem = sem_open(OWNER_SEMAPHORE, O_CREAT, 0644, 1);
-        if (owner_sem == SEM_FAILED) {
-            perror("Failed to create owner semaphore");
-            sem_close(access_sem);
-            exit(EXIT_FAILURE);
-        }
-        
-        // Set up shared memory for lock info
-        
-        key_t key = ftok("/tmp", 'R');
-        if (key == -1) {
-        perror("ftok");
-        exit(EXIT_FAILURE);
-        }
-        lock_info_shm_id = shmget(key, sizeof(LockInfo), IPC_CREAT | 0666);
-        if (lock_info_shm_id < 0) {
-            perror("Failed to create lock info shared memory");
-            sem_close(access_sem);
-            sem_close(owner_sem);
-            exit(EXIT_FAILURE);
+    for (;;) {
+        uint32_t ack = atomic_load(&lock_info->takeover_ack);
+        if ((int32_t)(ack - request) >= 0 || LS_LOCK_TYPE(lock_state()) == 0) {
+            return true;
         }
         
-        // Attach to shared memory
-        lock_info = (LockInfo*) shmat(lock_info_shm_id, NULL, 0);
-        if (lock_info == (LockInfo*) -1) {
-            perror("Failed to attach to lock info shared memory");
-            sem_close(access_sem);
-            sem_close(owner_sem);
-            exit(EXIT_FAILURE);
-        }
-        
-        // Initialize lock info
-        lock_info->holding_pid = 0;
-        lock_info->lock_type = 0;
-        lock_info->owner_waiting = false;
-        lock_info->reader_count = 0;
-        lock_info->countdown_active = false;
-        lock_info->countdown_value = 0;
-        lock_info->forced_lock = false;
-        lock_info->editor_pid = 0;
-        lock_info->edit_start_time = 0;
-        lock_info->time_allocation = 0;
-        lock_info->time_limit_active = false;
-        
-        printf("Synchronization mechanisms initialized by owner.\n");
-    } else {
-        // Open existing semaphores (should be created by admin program)
-        access_sem = sem_open(ACCESS_SEMAPHORE, 0);
-        if (access_sem == SEM_FAILED) {
-            perror("Failed to open access semaphore - make sure admin is running first");
-            exit(EXIT_FAILURE);
-        }
-        
-        owner_sem = sem_open(OWNER_SEMAPHORE, 0);
-        if (owner_sem == SEM_FAILED) {
-            perror("Failed to open owner semaphore");
-            sem_close(access_sem);
-            exit(EXIT_FAILURE);
-        }
-        
-        // Get existing shared memory for lock info
-        key_t key = ftok("/tmp", 'R');
-        if (key == -1) {
-            perror("ftok");
-            exit(EXIT_FAILURE);
-        }
-        lock_info_shm_id = shmget(key, sizeof(LockInfo), IPC_CREAT | 0666);
-        if (lock_info_shm_id < 0) {
-            perror("Failed to get lock info shared memory segment");
-            sem_close(access_sem);
-            sem_close(owner_sem);
-            exit(EXIT_FAILURE);
+        int ms = remaining_ms(&deadline, timeout_ms);
+        if (ms == 0) {
+            return false;
         }
-        
-        // Attach to shared memory
-        lock_info = (LockInfo*) shmat(lock_info_shm_id, NULL, 0);
-        if (lock_info == (LockInfo*) -1) {
-            perror("Failed to attach to lock info shared memory");
-            sem_close(access_sem);
-            sem_close(owner_sem);
-            exit(EXIT_FAILURE);
+        futex_wait(&lock_info->takeover_ack, ack, ms);
+    }
+}
+
+void signal_owner_priority(void) {
+    // Set the owner override bit; this also wakes any waiting users
+    set_owner_waiting(true);
+    
+    // If someone holds the lock, send them a signal
+    pid_t holder = LS_HOLDER(lock_state());
+    if (holder > 0 && holder != getpid()) {
+        printf("Owner signaling process %d to release lock\n", holder);
+        kill(holder, PRIORITY_SIGNAL);
+    }
+}
+
+static bool process_gone(pid_t pid) {
+    return pid > 0 && pid != getpid() && kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+// Enter this process in a reader table. Returns its entry, or -1 if the
+// table is full.
+static int add_reader(ReaderTable *readers) {
+    for (int i = 0; i < READER_MAX; i++) {
+        pid_t free_entry = 0;
+        if (atomic_compare_exchange_strong(&readers->pids[i], &free_entry, getpid())) {
+            return i;
         }
-        
-        printf("Synchronization mechanisms initialized by user.\n");
     }
+    return -1;
 }
 
-void cleanup_synchronization(bool is_owner) {
-    // Detach from shared memory
-    if (lock_info != NULL) {
-        shmdt(lock_info);
+static void remove_reader(ReaderTable *readers, int *entry) {
+    if (*entry >= 0) {
+        atomic_store(&readers->pids[*entry], 0);
+        *entry = -1;
     }
-    
-    if (is_owner) {
-        // Remove shared memory
-        shmctl(lock_info_shm_id, IPC_RMID, NULL);
-        
-        // Close and unlink semaphores
-        sem_close(access_sem);
-        sem_unlink(ACCESS_SEMAPHORE);
-        
-        sem_close(owner_sem);
-        sem_unlink(OWNER_SEMAPHORE);
-        
-        printf("Synchronization resources cleaned up by owner.\n");
-    } else {
-        // Close semaphores (but don't unlink - admin manages them)
-        sem_close(access_sem);
-        sem_close(owner_sem);
-        
-        printf("Synchronization resources cleaned up by user.\n");
+}
+
+// Release the shared holds on lock of the readers in the table that have
+// exited. Returns how many there were.
+static int reclaim_dead_readers(ReaderTable *readers, RwLock *lock, const char *what) {
+    int reclaimed = 0;
+    for (int i = 0; i < READER_MAX; i++) {
+        pid_t reader = atomic_load(&readers->pids[i]);
+        if (process_gone(reader) && atomic_compare_exchange_strong(&readers->pids[i], &reader, 0)) {
+            printf("%s %d has exited, reclaiming its lock.\n", what, reader);
+            rwlock_read_unlock(lock);
+            reclaimed++;
+        }
     }
+    return reclaimed;
 }
 
-void wait_for_owner_priority(User *user) {
-    // Owner never waits - skip if owner
-    if (user->priority == PRIORITY_OWNER) {
-        return;
+// If the writer or any reader has died without releasing, release its
+// hold on its behalf so the owner is not blocked forever
+static void reclaim_dead_holder(void) {
+    pid_t holder = LS_HOLDER(lock_state());
+    
+    // Only the process whose CAS clears the record releases the hold. A
+    // reader's hold is released through its reader table entry below.
+    if (process_gone(holder)) {
+        int type = release_holder(holder);
+        if (type != 0) {
+            printf("Lock holder %d has exited, reclaiming its lock.\n", holder);
+        }
+        if (type == 2) {
+            rwlock_write_unlock(&lock_info->rwlock);
+        }
+        acknowledge_takeover();
     }
     
-    // Wait on owner semaphore
-    sem_wait(owner_sem);
+    reclaim_dead_readers(&doc_tables->readers, &lock_info->rwlock, "Reader");
     
-    // Release semaphore for next user
-    sem_post(owner_sem);
+    range_reclaim_dead(&doc_tables->ranges);
 }
 
-void signal_owner_priority(void) {
-    // Set the owner_waiting flag to true
-    lock_info->owner_waiting = true;
+// A holder of the document lock also locks the whole document in the
+// range table, to wait for the holders of byte ranges, but only while
+// there are any: with no range held or being taken the document lock is
+// all it needs, and *range is set to -1. Returns false if the range could
+// not be had; the caller still holds the document lock.
+bool lock_document_range(int type, bool is_owner, int timeout_ms, int *range) {
+    *range = -1;
+    if (atomic_load(&doc_tables->ranges.active) == 0) {
+        return true;
+    }
+    *range = range_lock(&doc_tables->ranges, getpid(), 0, RANGE_ALL, type, is_owner,
+                        is_owner ? PRIORITY_SIGNAL : 0, timeout_ms);
+    return *range >= 0;
+}
+
+// Wait out the holders of the document lock that a byte range of this
+// type conflicts with (the writer for a read range, anyone for a write
+// range) by taking the lock and dropping it again. A user gives up if
+// the owner starts waiting; the owner asks a conflicting holder to finish.
+static bool wait_document_holders(int type, bool is_owner) {
+    RwLock *lock = &lock_info->rwlock;
     
-    // If someone holds the lock, send them a signal
-    if (lock_info->holding_pid > 0 && lock_info->holding_pid != getpid()) {
-        printf("Owner signaling process %d to release lock\n", lock_info->holding_pid);
-        kill(lock_info->holding_pid, PRIORITY_SIGNAL);
+    if (is_owner) {
+        uint64_t state = lock_state();
+        pid_t holder = LS_HOLDER(state);
+        if (holder > 0 && holder != getpid() && (type == RANGE_WRITE || LS_LOCK_TYPE(state) == 2)) {
+            kill(holder, PRIORITY_SIGNAL);
+        }
+        while (!(type == RANGE_WRITE ? rwlock_write_lock(lock, true, OWNER_POLL_MS)
+                                     : rwlock_read_lock(lock, true, OWNER_POLL_MS))) {
+            reclaim_dead_holder();
+        }
+    } else if (!(type == RANGE_WRITE ? rwlock_write_lock(lock, false, -1)
+                                     : rwlock_read_lock(lock, false, -1))) {
+        return false;
     }
     
-    // Release all semaphores to unblock any waiting users
-    sem_post(owner_sem);
-    sem_post(access_sem);
+    if (type == RANGE_WRITE) {
+        rwlock_write_unlock(lock);
+    } else {
+        rwlock_read_unlock(lock);
+    }
+    return true;
 }
+
 bool acquire_read_lock(int fd, User *user) {
-    struct flock lock;
+    (void)fd;  // The lock lives in shared memory, not on the file
     
-    // If owner, gain immediate access
+    // If owner, gain access ahead of any waiting users
     if (user->priority == PRIORITY_OWNER) {
-        // First check if there's an existing lock
-        lock.l_type = F_WRLCK;  // Check for any conflicting locks
-        lock.l_whence = SEEK_SET;
-        lock.l_start = 0;
-        lock.l_len = 0;
-        
-        // Check if there's a conflicting lock without blocking
-        if (fcntl(fd, F_GETLK, &lock) != -1 && lock.l_type != F_UNLCK) {
-            // Someone holds a lock - send them a signal first
-            printf("OWNER detected lock held by PID %d, sending priority signal...\n", 
-                   lock.l_pid);
-            
-            // Store the PID to send signal to
-            pid_t holder_pid = lock.l_pid;
-            
-            // Send signal to the lock holder
-            if (holder_pid > 0) {
-                handle_priority_signal(holder_pid);
-                // Wait a bit for the signal to be processed
-                usleep(100000);  // 100ms
-            }
-        }
-        
-        // Now try to acquire the read lock
-        lock.l_type = F_RDLCK;
-        lock.l_whence = SEEK_SET;
-        lock.l_start = 0;
-        lock.l_len = 0;
-        
         printf("OWNER attempting to acquire read lock...\n");
         
-        // Use non-blocking attempt first
-        if (fcntl(fd, F_SETLK, &lock) == -1) {
-            if (errno == EACCES || errno == EAGAIN) {
-                // Lock still held, try one more time with blocking
-                printf("OWNER waiting for lock release...\n");
-                
-                // Set a timeout using alarm
-                alarm(5);  // 5 second timeout
-                
-                if (fcntl(fd, F_SETLKW, &lock) == -1) {
-                    if (errno != EINTR) {
-                        perror("Error acquiring owner read lock");
-                        alarm(0);  // Cancel alarm
-                        return false;
-                    }
-                    printf("OWNER lock acquisition timed out\n");
-                    alarm(0);  // Cancel alarm
-                    return false;
-                }
-                
-                alarm(0);  // Cancel alarm if successful
-            } else {
-                perror("Error acquiring owner read lock");
+        struct timespec deadline;
+        start_deadline(&deadline, OWNER_READ_TIMEOUT_MS);
+        while (!rwlock_read_lock(&lock_info->rwlock, true, OWNER_POLL_MS)) {
+            reclaim_dead_holder();
+            if (remaining_ms(&deadline, OWNER_READ_TIMEOUT_MS) == 0) {
+                printf("OWNER lock acquisition timed out\n");
                 return false;
             }
         }
+        if ((reader_entry = add_reader(&doc_tables->readers)) < 0) {
+            rwlock_read_unlock(&lock_info->rwlock);
+            printf("Too many readers, OWNER cannot acquire read lock.\n");
+            return false;
+        }
+        
+        // Writers of byte ranges are asked to finish, like the lock holder
+        if (!lock_document_range(RANGE_READ, true, remaining_ms(&deadline, OWNER_READ_TIMEOUT_MS),
+                                 &doc_range)) {
+            remove_reader(&doc_tables->readers, &reader_entry);
+            rwlock_read_unlock(&lock_info->rwlock);
+            printf("OWNER lock acquisition timed out\n");
+            return false;
+        }
         
         // Update lock info
-        lock_info->holding_pid = getpid();
-        lock_info->lock_type = 1; // read lock
-        lock_info->owner_waiting = false;
+        claim_holder(getpid(), 1, false);
         
         printf("OWNER read lock acquired successfully.\n");
         return true;
     }
     
-    // For non-owner users, follow priority protocol
-    wait_for_owner_priority(user);
-    
     // Check if owner is waiting before proceeding
-    if (lock_info->owner_waiting) {
+    if (owner_is_waiting()) {
         printf("Owner is waiting, user %s cannot acquire read lock.\n", user->name);
         return false;
     }
     
-    // Acquire access semaphore
-    sem_wait(access_sem);
-    
-    // Check again if owner is waiting
-    if (lock_info->owner_waiting) {
+    if (!rwlock_read_lock(&lock_info->rwlock, false, -1)) {
         printf("Owner became waiting, user %s cannot acquire read lock.\n", user->name);
-        sem_post(access_sem);
         return false;
     }
-    
-    // Increment reader count
-    lock_info->reader_count++;
-    
-    // If this is the first reader, acquire write lock on file
-    // to prevent any writers from accessing
-    if (lock_info->reader_count == 1) {
-        lock.l_type = F_WRLCK;
-        lock.l_whence = SEEK_SET;
-        lock.l_start = 0;
-        lock.l_len = 0;
-        
-        if (fcntl(fd, F_SETLKW, &lock) == -1) {
-            perror("Error acquiring initial write lock for readers");
-            lock_info->reader_count--;
-            sem_post(access_sem);
-            return false;
-        }
-        
-        // Update lock info
-        lock_info->holding_pid = getpid();
-        lock_info->lock_type = 1; // read lock
+    if ((reader_entry = add_reader(&doc_tables->readers)) < 0) {
+        rwlock_read_unlock(&lock_info->rwlock);
+        printf("Too many readers, user %s cannot acquire read lock.\n", user->name);
+        return false;
     }
     
-    // Release access semaphore
-    sem_post(access_sem);
+    // Wait for writers of byte ranges to finish
+    if (!lock_document_range(RANGE_READ, false, -1, &doc_range)) {
+        remove_reader(&doc_tables->readers, &reader_entry);
+        rwlock_read_unlock(&lock_info->rwlock);
+        printf("Owner became waiting, user %s cannot acquire read lock.\n", user->name);
+        return false;
+    }
     
-    // Set up read lock for this specific reader
-    lock.l_type = F_RDLCK;
-    lock.l_whence = SEEK_SET;
-    lock.l_start = 0;
-    lock.l_len = 0;
+    // Record the first reader as the holder
+    claim_holder(getpid(), 1, true);
     
     printf("User '%s' (priority %d) acquired read lock.\n", 
            user->name, user->priority);
@@ -477,174 +670,794 @@ bool acquire_read_lock(int fd, User *user) {
 }
 
 bool acquire_write_lock(int fd, User *user) {
-    struct flock lock;
+    (void)fd;  // The lock lives in shared memory, not on the file
     
-    // If owner, gain immediate access
+    // If owner, gain access ahead of any waiting users
     if (user->priority == PRIORITY_OWNER) {
         signal_owner_priority();  // Signal to give owner priority
         
-        lock.l_type = F_WRLCK;
-        lock.l_whence = SEEK_SET;
-        lock.l_start = 0;
-        lock.l_len = 0; // Lock the entire file
-        
         printf("OWNER attempting to acquire write lock...\n");
         
-        // Wait for lock to be available
-        while (fcntl(fd, F_SETLKW, &lock) == -1) {
-            if (errno != EINTR) {
-                perror("Error acquiring owner write lock");
-                return false;
-            }
-            // If interrupted by signal, retry
-            printf("OWNER write lock acquisition interrupted, retrying...\n");
-            lock.l_type = F_WRLCK;
+        // Wait for the current holder to release, checking periodically
+        // that it is still alive
+        while (!rwlock_write_lock(&lock_info->rwlock, true, OWNER_POLL_MS)) {
+            reclaim_dead_holder();
+        }
+        
+        // Holders of byte ranges are asked to finish, like the lock holder
+        if (!lock_document_range(RANGE_WRITE, true, -1, &doc_range)) {
+            rwlock_write_unlock(&lock_info->rwlock);
+            return false;
         }
         
         // Update lock info
-        lock_info->holding_pid = getpid();
-        lock_info->lock_type = 2; // write lock
-        lock_info->owner_waiting = false;
+        claim_holder(getpid(), 2, false);
         
         printf("OWNER write lock acquired successfully.\n");
         return true;
     }
     
-    // For non-owner users, follow priority protocol
-    wait_for_owner_priority(user);
-    
     // Check if owner is waiting before proceeding
-    if (lock_info->owner_waiting) {
+    if (owner_is_waiting()) {
         printf("Owner is waiting, user %s cannot acquire write lock.\n", user->name);
         return false;
     }
     
-    // Acquire access semaphore (exclusive access for writers)
-    sem_wait(access_sem);
+    printf("User '%s' (priority %d) attempting to acquire write lock...\n", 
+           user->name, user->priority);
+    
+    if (!rwlock_write_lock(&lock_info->rwlock, false, -1)) {
+        printf("Owner is now waiting, write lock acquisition aborted.\n");
+        return false;
+    }
     
-    // Check again if owner is waiting
-    if (lock_info->owner_waiting) {
-        printf("Owner became waiting, user %s cannot acquire write lock.\n", user->name);
-        sem_post(access_sem);
+    // Wait for holders of byte ranges to finish
+    if (!lock_document_range(RANGE_WRITE, false, -1, &doc_range)) {
+        rwlock_write_unlock(&lock_info->rwlock);
+        printf("Owner is now waiting, write lock acquisition aborted.\n");
         return false;
     }
     
-    lock.l_type = F_WRLCK;
-    lock.l_whence = SEEK_SET;
-    lock.l_start = 0;
-    lock.l_len = 0;
+    // Update lock info
+    claim_holder(getpid(), 2, false);
     
-    printf("User '%s' (priority %d) attempting to acquire write lock...\n", 
+    printf("User '%s' (priority %d) acquired write lock.\n", 
            user->name, user->priority);
     
-    // Try to acquire the lock but be responsive to signals
-    while (fcntl(fd, F_SETLKW, &lock) == -1) {
-        if (errno != EINTR) {
-            perror("Error acquiring write lock");
-            sem_post(access_sem);
-            return false;
+    return true;
+}
+
+void release_read_lock(int fd, User *user) {
+    (void)fd;
+    
+    // Drop the holder record before the hold itself, so a reclaim never
+    // sees a record for a hold that is already gone
+    release_holder(getpid());
+    range_unlock(&doc_tables->ranges, doc_range);
+    doc_range = -1;
+    remove_reader(&doc_tables->readers, &reader_entry);
+    bool last = rwlock_read_unlock(&lock_info->rwlock);
+    acknowledge_takeover();
+    
+    if (user->priority == PRIORITY_OWNER) {
+        printf("OWNER read lock released.\n");
+        return;
+    }
+    
+    if (last) {
+        printf("Last reader lock released.\n");
+    }
+    printf("User '%s' released read lock.\n", user->name);
+}
+
+void release_write_lock(int fd, User *user) {
+    (void)fd;
+    
+    // Update lock info; the writer may have changed the document
+    atomic_fetch_add(&lock_info->doc_version, 1);
+    release_holder(getpid());
+    range_unlock(&doc_tables->ranges, doc_range);
+    doc_range = -1;
+    
+    rwlock_write_unlock(&lock_info->rwlock);
+    acknowledge_takeover();
+    
+    printf("User '%s' released write lock.\n", user->name);
+}
+
+// Lock len bytes at off for reading or writing (RANGE_READ/RANGE_WRITE)
+// alongside other processes working on other parts of the document.
+// Returns a handle for release_range_lock(), or -1. A user gives up as
+// soon as the owner is waiting; the owner makes holders of overlapping
+// ranges finish, as it does with the whole-document lock.
+int acquire_range_lock(int fd, User *user, size_t off, size_t len, int type) {
+    (void)fd;  // The lock lives in shared memory, not on the file
+    bool is_owner = user->priority == PRIORITY_OWNER;
+    
+    if (!is_owner && owner_is_waiting()) {
+        printf("Owner is waiting, user %s cannot lock bytes %zu-%zu.\n", user->name, off, off + len);
+        return -1;
+    }
+    
+    // Count the range in before looking at the document lock. A holder
+    // of the document lock that took it without seeing the count is
+    // waited out here; any later one sees the count and locks the whole
+    // document in the range table too, where it meets this range.
+    atomic_fetch_add(&doc_tables->ranges.active, 1);
+    if (!wait_document_holders(type, is_owner)) {
+        atomic_fetch_sub(&doc_tables->ranges.active, 1);
+        printf("Owner is waiting, user %s cannot lock bytes %zu-%zu.\n", user->name, off, off + len);
+        return -1;
+    }
+    
+    int handle = range_lock(&doc_tables->ranges, getpid(), off, off + len, type, is_owner,
+                            PRIORITY_SIGNAL, -1);
+    if (handle < 0) {
+        atomic_fetch_sub(&doc_tables->ranges.active, 1);
+        printf("Range lock for user %s aborted.\n", user->name);
+        return -1;
+    }
+    
+    printf("User '%s' locked bytes %zu-%zu for %s.\n", user->name, off, off + len,
+           type == RANGE_WRITE ? "writing" : "reading");
+    return handle;
+}
+
+void release_range_lock(int fd, User *user, int handle) {
+    (void)fd;
+    
+    range_unlock(&doc_tables->ranges, handle);
+    acknowledge_takeover();
+    
+    printf("User '%s' released range lock.\n", user->name);
+}
+
+// Finds a span of the document; false if it is not there
+typedef bool (*SpanLocator)(const char *doc, size_t len, const void *arg, size_t *off, size_t *span);
+
+typedef struct {
+    int first_line;  // 1-based
+    int count;
+} LineSpan;
+
+// Byte span of count lines starting at first_line. Lines past the end of
+// the document are an empty span at the end.
+static bool locate_lines(const char *doc, size_t len, const void *arg, size_t *off, size_t *span) {
+    const LineSpan *lines = arg;
+    size_t pos = 0;
+    for (int line = 1; line < lines->first_line && pos < len; line++) {
+        const char *nl = memchr(doc + pos, '\n', len - pos);
+        pos = nl ? (size_t)(nl - doc) + 1 : len;
+    }
+    
+    size_t end = pos;
+    for (int i = 0; i < lines->count && end < len; i++) {
+        const char *nl = memchr(doc + end, '\n', len - end);
+        end = nl ? (size_t)(nl - doc) + 1 : len;
+    }
+    *off = pos;
+    *span = end - pos;
+    return true;
+}
+
+static bool locate_section(const char *doc, size_t len, const void *arg, size_t *off, size_t *span) {
+    SectionSpan spans[SECTION_MAX];
+    int count = section_scan(doc, len, spans, SECTION_MAX);
+    int i = section_find(spans, count, arg);
+    if (i < 0) {
+        return false;
+    }
+    *off = spans[i].offset;
+    *span = spans[i].length;
+    return true;
+}
+
+// Lock the span locate() finds and return its text in *text (malloc'd).
+// Other writers may commit between finding the span and getting the
+// lock, so it is looked up again once the lock is held.
+static int lock_located_span(int fd, User *user, int type, SpanLocator locate, const void *arg,
+                             char **text, size_t *text_len) {
+    for (int attempt = 0; attempt < 3; attempt++) {
+        size_t len, off, span;
+        char *doc = read_document(&len);
+        if (doc == NULL) {
+            perror("Error reading document");
+            return -1;
+        }
+        bool found = locate(doc, len, arg, &off, &span);
+        free(doc);
+        if (!found) {
+            return -1;
         }
         
-        // If interrupted by signal, check if owner is waiting
-        if (lock_info->owner_waiting) {
-            printf("Owner is now waiting, write lock acquisition aborted.\n");
-            sem_post(access_sem);
-            return false;
+        int handle = acquire_range_lock(fd, user, off, span, type);
+        if (handle < 0) {
+            return -1;
         }
         
-        // Try again
-        lock.l_type = F_WRLCK;
+        size_t locked_off, locked_span;
+        doc = read_document(&len);
+        if (doc != NULL) {
+            if (locate(doc, len, arg, &locked_off, &locked_span) &&
+                locked_off == off && locked_span == span && (*text = malloc(span ? span : 1)) != NULL) {
+                memcpy(*text, doc + off, span);
+                *text_len = span;
+                free(doc);
+                return handle;
+            }
+            free(doc);
+        }
+        release_range_lock(fd, user, handle);
     }
     
-    // Update lock info
-    lock_info->holding_pid = getpid();
-    lock_info->lock_type = 2; // write lock
+    printf("The text kept moving while locking it; please try again.\n");
+    return -1;
+}
+
+// Lock lines for writing and return their text in *section (malloc'd)
+int acquire_line_lock(int fd, User *user, int first_line, int count, char **section, size_t *section_len) {
+    LineSpan lines = { first_line, count };
+    return lock_located_span(fd, user, RANGE_WRITE, locate_lines, &lines, section, section_len);
+}
+
+// Publish an edited section held under a range lock. The table stays
+// locked while the edit is logged, so the section's offset cannot move
+// under us and every range after it is moved by the size change before
+// anyone else commits.
+bool commit_range_edit(int handle, const char *old_text, size_t old_len, const char *copy_path,
+                       const char *user_name) {
+    size_t len;
+    char *copy = read_whole_file(copy_path, &len);
+    if (copy == NULL) {
+        perror("Error reading editor working copy");
+        return false;
+    }
     
-    printf("User '%s' (priority %d) acquired write lock.\n", 
-           user->name, user->priority);
+    uint64_t start, end;
+    range_table_lock(&doc_tables->ranges);
+    bool ok = range_get_locked(&doc_tables->ranges, handle, &start, &end) &&
+              oplog_append_replace(SHARED_DOC, start, old_text, old_len, copy, len, user_name);
+    if (ok) {
+        range_resize_locked(&doc_tables->ranges, handle, len);
+    }
+    range_table_unlock(&doc_tables->ranges);
+    free(copy);
     
-    // Note: We keep the access_sem held during the entire write operation
-    // It will be released when releasing the lock
+    if (ok) {
+        atomic_fetch_add(&lock_info->doc_version, 1);
+        unlink(copy_path);
+    } else {
+        printf("Could not save changes; they remain in %s\n", copy_path);
+    }
+    return ok;
+}
+
+// Map the document file at path (caller holds at least a read lock, and
+// the log's shared lock, so no checkpoint replaces the file meanwhile).
+// The mapping is kept and handed out again as long as the document
+// version and the file at path are unchanged, so repeated views cost no
+// copying.
+const char *map_document(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror("Error opening document for reading");
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
     
-    return true;
+    if (doc_map != NULL && doc_map_version == atomic_load(&lock_info->doc_version) &&
+        doc_map_ino == st.st_ino && doc_map_len == (size_t)st.st_size) {
+        close(fd);
+        *len = doc_map_len;
+        return doc_map;
+    }
+    
+    unmap_document();
+    
+    *len = st.st_size;
+    if (*len == 0) {
+        close(fd);
+        return "";
+    }
+    
+    void *map = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error mapping document");
+        return NULL;
+    }
+    
+    doc_map = map;
+    doc_map_len = *len;
+    doc_map_version = atomic_load(&lock_info->doc_version);
+    doc_map_ino = st.st_ino;
+    return doc_map;
 }
 
-void release_read_lock(int fd, User *user) {
-    struct flock lock;
+void unmap_document(void) {
+    if (doc_map != NULL) {
+        munmap((void *)doc_map, doc_map_len);
+        doc_map = NULL;
+        doc_map_len = 0;
+    }
+}
+
+// Write the whole document to stdout: the checkpoint straight from the
+// mapping, with the operation log tail spliced in as separate pieces. The
+// checkpoint is mapped under the log's lock, so the two always match.
+bool print_document(void) {
+    int log_fd;
+    if (!oplog_lock_shared(SHARED_DOC, &log_fd)) {
+        return false;
+    }
+    size_t len;
+    OpView view;
+    const char *content = map_document(SHARED_DOC, &len);
+    bool viewed = content != NULL && oplog_view(log_fd, content, len, &view);
+    oplog_unlock(log_fd);
+    if (!viewed) {
+        return false;
+    }
     
-    // If owner, simply release the lock
-    if (user->priority == PRIORITY_OWNER) {
-        lock.l_type = F_UNLCK;
-        lock.l_whence = SEEK_SET;
-        lock.l_start = 0;
-        lock.l_len = 0;
-        
-        if (fcntl(fd, F_SETLK, &lock) == -1) {
-            perror("Error releasing owner read lock");
-        } else {
-            // Update lock info
-            if (lock_info->holding_pid == getpid()) {
-                lock_info->holding_pid = 0;
-                lock_info->lock_type = 0;
+    fflush(stdout);
+    bool ok = true;
+    int next = 0;
+    while (ok && next < view.count) {
+        int batch = view.count - next < UIO_MAXIOV ? view.count - next : UIO_MAXIOV;
+        ssize_t n = writev(STDOUT_FILENO, &view.pieces[next], batch);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("Error writing document");
+            ok = false;
+            break;
+        }
+        // Skip what was written, resuming mid-piece after a short write
+        while (next < view.count && (size_t)n >= view.pieces[next].iov_len) {
+            n -= view.pieces[next++].iov_len;
+        }
+        if (n > 0) {
+            view.pieces[next].iov_base = (char *)view.pieces[next].iov_base + n;
+            view.pieces[next].iov_len -= n;
+        }
+    }
+    oplog_view_free(&view);
+    return ok;
+}
+
+// Read a whole file into a malloc'd buffer (NULL on error)
+char *read_whole_file(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fd, &st) == 0 && (data = malloc(st.st_size ? st.st_size : 1)) != NULL) {
+        size_t done = 0;
+        while (done < (size_t)st.st_size) {
+            ssize_t n = read(fd, data + done, st.st_size - done);
+            if (n <= 0) {
+                break;
             }
-            printf("OWNER read lock released.\n");
+            done += n;
         }
-        
+        if (done != (size_t)st.st_size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    close(fd);
+    *len = data ? (size_t)st.st_size : 0;
+    return data;
+}
+
+// Small futex mutex for short critical sections in shared memory
+static void shm_mutex_lock(_Atomic uint32_t *mutex) {
+    uint32_t c = 0;
+    if (atomic_compare_exchange_strong(mutex, &c, 1)) {
         return;
     }
+    if (c != 2) {
+        c = atomic_exchange(mutex, 2);
+    }
+    while (c != 0) {
+        futex_wait(mutex, 2, -1);
+        c = atomic_exchange(mutex, 2);
+    }
+}
+
+static void shm_mutex_unlock(_Atomic uint32_t *mutex) {
+    if (atomic_fetch_sub(mutex, 1) != 1) {
+        atomic_store(mutex, 0);
+        futex_wake_all(mutex);
+    }
+}
+
+// The document's sections, in order
+int list_sections(SectionSpan *spans, int max) {
+    size_t len;
+    char *doc = read_document(&len);
+    if (doc == NULL) {
+        perror("Error reading document");
+        return 0;
+    }
+    int count = section_scan(doc, len, spans, max);
+    free(doc);
+    return count;
+}
+
+// Slot currently tracking title, or -1 (a snapshot, for display)
+int find_section_slot(const char *title) {
+    for (int i = 0; i < SECTION_MAX; i++) {
+        if (strcmp(doc_tables->sections.slots[i].title, title) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Find the slot tracking title, or take over an unused one, and count
+// this process as one of its users
+static int claim_section_slot(const char *title) {
+    SectionTable *table = &doc_tables->sections;
+    int found = -1, unused = -1;
     
-    // For regular users, decrement reader count
-    sem_wait(access_sem);
+    shm_mutex_lock(&table->mutex);
+    for (int i = 0; i < SECTION_MAX && found < 0; i++) {
+        if (strcmp(table->slots[i].title, title) == 0) {
+            found = i;
+        } else if (table->slots[i].users == 0 && (unused < 0 || table->slots[i].title[0] == '\0')) {
+            unused = i;
+        }
+    }
+    if (found < 0 && unused >= 0) {
+        SectionSlot *slot = &table->slots[unused];
+        rwlock_init(&slot->rwlock);
+        atomic_store(&slot->version, 0);
+        atomic_store(&slot->editor_pid, 0);
+        atomic_store(&slot->writer_pid, 0);
+        atomic_store(&slot->edit_start_time, 0);
+        atomic_store(&slot->time_allocation, 0);
+        snprintf(slot->title, sizeof(slot->title), "%s", title);
+        found = unused;
+    }
+    if (found >= 0) {
+        table->slots[found].users++;
+    }
+    shm_mutex_unlock(&table->mutex);
+    return found;
+}
+
+// Stop counting this process as a user of the slot. Readers of the slot
+// that died holding it are released here too, so their uses do not keep
+// the slot taken for good.
+static void drop_section_slot(int slot_index) {
+    SectionSlot *slot = &doc_tables->sections.slots[slot_index];
+    shm_mutex_lock(&doc_tables->sections.mutex);
+    slot->users -= 1 + reclaim_dead_readers(&slot->readers, &slot->rwlock, "Section reader");
+    shm_mutex_unlock(&doc_tables->sections.mutex);
+}
+
+// If the section's writer or any of its readers died without releasing,
+// release for them
+static void reclaim_dead_section_holders(SectionSlot *slot) {
+    pid_t writer = atomic_load(&slot->writer_pid);
+    if (process_gone(writer) && atomic_compare_exchange_strong(&slot->writer_pid, &writer, 0)) {
+        printf("Section writer %d has exited, reclaiming its lock.\n", writer);
+        atomic_store(&slot->editor_pid, 0);
+        rwlock_write_unlock(&slot->rwlock);
+        drop_section_slot(slot - doc_tables->sections.slots);
+        return;
+    }
     
-    lock_info->reader_count--;
+    shm_mutex_lock(&doc_tables->sections.mutex);
+    slot->users -= reclaim_dead_readers(&slot->readers, &slot->rwlock, "Section reader");
+    shm_mutex_unlock(&doc_tables->sections.mutex);
+}
+
+// Check out one section for reading or writing (RANGE_READ/RANGE_WRITE).
+// The section's own lock orders its readers and writers and carries the
+// owner override, as the document lock does; a byte-range lock on its
+// text keeps whole-document and line-range users out of it. Sections
+// other than this one stay free for other users.
+bool acquire_section_lock(int fd, User *user, const char *title, int type, SectionLock *lock) {
+    bool is_owner = user->priority == PRIORITY_OWNER;
     
-    // If this is the last reader, release the write lock
-    if (lock_info->reader_count == 0) {
-        lock.l_type = F_UNLCK;
-        lock.l_whence = SEEK_SET;
-        lock.l_start = 0;
-        lock.l_len = 0;
+    if (!is_owner && owner_is_waiting()) {
+        printf("Owner is waiting, user %s cannot lock section '%s'.\n", user->name, title);
+        return false;
+    }
+    
+    lock->slot = claim_section_slot(title);
+    if (lock->slot < 0) {
+        printf("Too many sections in use; try again later.\n");
+        return false;
+    }
+    SectionSlot *slot = &doc_tables->sections.slots[lock->slot];
+    
+    if (is_owner) {
+        // Turn users of the section away and ask its writer to finish
+        atomic_fetch_or(&slot->rwlock.state, RW_OWNER);
+        rwlock_wake(&slot->rwlock);
+        pid_t writer = atomic_load(&slot->writer_pid);
+        if (writer > 0 && writer != getpid()) {
+            kill(writer, PRIORITY_SIGNAL);
+        }
         
-        if (fcntl(fd, F_SETLK, &lock) == -1) {
-            perror("Error releasing last reader lock");
-        } else {
-            // Update lock info
-            if (lock_info->holding_pid == getpid()) {
-                lock_info->holding_pid = 0;
-                lock_info->lock_type = 0;
-            }
-            printf("Last reader lock released.\n");
+        while (!(type == RANGE_WRITE ? rwlock_write_lock(&slot->rwlock, true, OWNER_POLL_MS)
+                                     : rwlock_read_lock(&slot->rwlock, true, OWNER_POLL_MS))) {
+            reclaim_dead_section_holders(slot);
         }
+    } else if (!(type == RANGE_WRITE ? rwlock_write_lock(&slot->rwlock, false, -1)
+                                     : rwlock_read_lock(&slot->rwlock, false, -1))) {
+        printf("Owner is now waiting, user %s cannot lock section '%s'.\n", user->name, title);
+        drop_section_slot(lock->slot);
+        return false;
+    }
+    lock->type = type;
+    lock->reader = -1;
+    if (type == RANGE_WRITE) {
+        atomic_store(&slot->writer_pid, getpid());
+    } else if ((lock->reader = add_reader(&slot->readers)) < 0) {
+        rwlock_read_unlock(&slot->rwlock);
+        drop_section_slot(lock->slot);
+        printf("Too many readers, user %s cannot lock section '%s'.\n", user->name, title);
+        return false;
     }
     
-    sem_post(access_sem);
+    lock->range = lock_located_span(fd, user, type, locate_section, title, &lock->text, &lock->length);
+    if (lock->range < 0) {
+        printf("Section '%s' could not be locked.\n", title);
+        lock->text = NULL;
+        release_section_lock(fd, user, lock);
+        return false;
+    }
     
-    printf("User '%s' released read lock.\n", user->name);
+    printf("User '%s' checked out section '%s' (version %lu) for %s.\n", user->name, title,
+           atomic_load(&slot->version), type == RANGE_WRITE ? "writing" : "reading");
+    return true;
 }
 
-void release_write_lock(int fd, User *user) {
-    struct flock lock;
+void release_section_lock(int fd, User *user, SectionLock *lock) {
+    (void)fd;  // The lock lives in shared memory, not on the file
+    SectionSlot *slot = &doc_tables->sections.slots[lock->slot];
     
-    lock.l_type = F_UNLCK;
-    lock.l_whence = SEEK_SET;
-    lock.l_start = 0;
-    lock.l_len = 0;
+    if (lock->range >= 0) {
+        range_unlock(&doc_tables->ranges, lock->range);
+        lock->range = -1;
+    }
+    if (lock->type == RANGE_WRITE) {
+        atomic_store(&slot->writer_pid, 0);
+        rwlock_write_unlock(&slot->rwlock);
+    } else {
+        remove_reader(&slot->readers, &lock->reader);
+        rwlock_read_unlock(&slot->rwlock);
+    }
+    drop_section_slot(lock->slot);
     
-    if (fcntl(fd, F_SETLK, &lock) == -1) {
-        perror("Error releasing write lock");
-        return;
+    free(lock->text);
+    lock->text = NULL;
+    printf("User '%s' released section '%s'.\n", user->name, slot->title);
+}
+
+// Publish an edited section and bump its version
+bool commit_section_edit(SectionLock *lock, const char *copy_path, const char *user_name) {
+    if (!commit_range_edit(lock->range, lock->text, lock->length, copy_path, user_name)) {
+        return false;
+    }
+    atomic_fetch_add(&doc_tables->sections.slots[lock->slot].version, 1);
+    return true;
+}
+
+// Per-section counterparts of start_time_limit()/stop_time_limit()
+void start_section_edit(SectionLock *lock, int allocation) {
+    SectionSlot *slot = &doc_tables->sections.slots[lock->slot];
+    atomic_store(&slot->edit_start_time, time(NULL));
+    atomic_store(&slot->time_allocation, allocation);
+}
+
+void stop_section_edit(SectionLock *lock) {
+    SectionSlot *slot = &doc_tables->sections.slots[lock->slot];
+    atomic_store(&slot->editor_pid, 0);
+    atomic_store(&slot->time_allocation, 0);
+}
+
+// Seconds left for the editor of the section in slot, if one is running
+bool section_time_remaining(int slot_index, int *remaining) {
+    SectionSlot *slot = &doc_tables->sections.slots[slot_index];
+    if (atomic_load(&slot->editor_pid) == 0) {
+        return false;
+    }
+    *remaining = atomic_load(&slot->time_allocation) -
+                 (int)(time(NULL) - atomic_load(&slot->edit_start_time));
+    return true;
+}
+
+// The current document (checkpoint plus operation log) in one buffer
+char *read_document(size_t *len) {
+    return oplog_read_document(SHARED_DOC, len);
+}
+
+// The editor works on a private copy of the document, so readers never
+// see a half-written save; commit_edit_copy() publishes the result
+bool begin_edit_copy(void) {
+    size_t len;
+    char *doc = read_document(&len);
+    if (doc == NULL) {
+        perror("Error reading document for editing");
+        return false;
+    }
+
+    int fd = open(EDIT_COPY, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool ok = fd != -1 && write(fd, doc, len) == (ssize_t)len;
+    if (fd != -1) {
+        close(fd);
+    }
+    free(doc);
+    if (!ok) {
+        perror("Error creating editor working copy");
+    }
+    return ok;
+}
+
+// Log what changed between the document and the editor's working copy.
+// Only the changed span reaches the disk; the document file itself is
+// rewritten at the next checkpoint.
+bool commit_edit_copy(const char *user_name) {
+    size_t len, doc_len;
+    char *copy = read_whole_file(EDIT_COPY, &len);
+    if (copy == NULL) {
+        perror("Error reading editor working copy");
+        return false;
+    }
+    char *doc = read_document(&doc_len);
+    if (doc == NULL) {
+        perror("Error reading document");
+        free(copy);
+        return false;
+    }
+
+    bool ok = oplog_append_edit(SHARED_DOC, doc, doc_len, copy, len, user_name);
+    free(doc);
+    free(copy);
+    if (ok) {
+        unlink(EDIT_COPY);
+        // nano -B leaves the pre-edit version as a backup of the copy
+        char backup[DOC_FILE_MAX + 1], doc_backup[DOC_PATH_MAX + 1];
+        snprintf(backup, sizeof(backup), "%s~", EDIT_COPY);
+        snprintf(doc_backup, sizeof(doc_backup), "%s~", SHARED_DOC);
+        rename(backup, doc_backup);
+    } else {
+        printf("Could not save changes; they remain in %s\n", EDIT_COPY);
     }
+    return ok;
+}
+
+// Block the signals the supervisor waits on and open a signalfd for them.
+// Call before fork() so nothing sent in between is lost.
+bool editor_supervisor_init(EditorSupervisor *sup) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, PRIORITY_SIGNAL);
+    sigaddset(&mask, LOCK_STATE_SIGNAL);
+    sigaddset(&mask, SIGCHLD);
     
-    // Update lock info
-    if (lock_info->holding_pid == getpid()) {
-        lock_info->holding_pid = 0;
-        lock_info->lock_type = 0;
+    sup->pid = -1;
+    sup->pidfd = -1;
+    sup->timerfd = -1;
+    
+    if (sigprocmask(SIG_BLOCK, &mask, &sup->old_mask) == -1) {
+        perror("sigprocmask");
+        return false;
     }
     
-    printf("User '%s' released write lock.\n", user->name);
+    sup->sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sup->sigfd == -1) {
+        perror("signalfd");
+        sigprocmask(SIG_SETMASK, &sup->old_mask, NULL);
+        return false;
+    }
+    return true;
+}
+
+// In the forked child: give the editor the original signal mask back
+void editor_supervisor_child(EditorSupervisor *sup) {
+    sigprocmask(SIG_SETMASK, &sup->old_mask, NULL);
+}
+
+// Start watching the editor child and arm its time allocation
+bool editor_supervisor_attach(EditorSupervisor *sup, pid_t pid, int time_allocation) {
+    sup->pid = pid;
+    
+    // Without pidfd support the SIGCHLD in the signalfd covers exits
+    sup->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    
+    sup->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (sup->timerfd == -1) {
+        perror("timerfd_create");
+        return false;
+    }
     
-    // Release access semaphore for non-owner users
-    if (user->priority != PRIORITY_OWNER) {
-        sem_post(access_sem);
+    struct itimerspec expiry;
+    memset(&expiry, 0, sizeof(expiry));
+    expiry.it_value.tv_sec = time_allocation;
+    if (timerfd_settime(sup->timerfd, 0, &expiry, NULL) == -1) {
+        perror("timerfd_settime");
+        return false;
     }
+    return true;
+}
+
+// Sleep until something the editing session must react to happens
+EditorEvent editor_supervisor_wait(EditorSupervisor *sup, int *status) {
+    for (;;) {
+        // The editor may already be gone (e.g. exited before the pidfd opened)
+        if (waitpid(sup->pid, status, WNOHANG) == sup->pid) {
+            return EDITOR_EXITED;
+        }
+        
+        struct pollfd fds[3];
+        int nfds = 0;
+        fds[nfds].fd = sup->sigfd;
+        fds[nfds++].events = POLLIN;
+        if (sup->timerfd != -1) {
+            fds[nfds].fd = sup->timerfd;
+            fds[nfds++].events = POLLIN;
+        }
+        if (sup->pidfd != -1) {
+            fds[nfds].fd = sup->pidfd;
+            fds[nfds++].events = POLLIN;
+        }
+        
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            waitpid(sup->pid, status, 0);
+            return EDITOR_EXITED;
+        }
+        
+        // Report the first pending signal; others stay queued for the next call
+        if (fds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(sup->sigfd, &info, sizeof(info)) == sizeof(info)) {
+                if ((int)info.ssi_signo == PRIORITY_SIGNAL) {
+                    return EDITOR_PRIORITY;
+                }
+                if ((int)info.ssi_signo == LOCK_STATE_SIGNAL) {
+                    return EDITOR_STATE_CHANGED;
+                }
+                // SIGCHLD: checked by waitpid at the top of the loop
+            }
+        }
+        
+        if (sup->timerfd != -1 && nfds > 1 && (fds[1].revents & POLLIN)) {
+            uint64_t expirations;
+            if (read(sup->timerfd, &expirations, sizeof(expirations)) > 0) {
+                return EDITOR_TIME_EXPIRED;
+            }
+        }
+    }
+}
+
+// Close the descriptors and restore the signal mask. Any PRIORITY_SIGNAL
+// still pending is delivered to its handler as usual.
+void editor_supervisor_close(EditorSupervisor *sup) {
+    if (sup->pidfd != -1) {
+        close(sup->pidfd);
+    }
+    if (sup->timerfd != -1) {
+        close(sup->timerfd);
+    }
+    if (sup->sigfd != -1) {
+        close(sup->sigfd);
+    }
+    sup->pidfd = sup->timerfd = sup->sigfd = -1;
+    
+    sigprocmask(SIG_SETMASK, &sup->old_mask, NULL);
 }
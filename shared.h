@@ -17,16 +17,50 @@
 #include <signal.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
-#include <semaphore.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "history.h"
+#include "commit.h"
+#include "oplog.h"
+#include "rangelock.h"
+#include "section.h"
+#include "collab.h"
+#include "server.h"
+#include "userdir.h"
+#include "control.h"
+#include "proto.h"
 
 #define MAX_LINE 256
-#define MAX_USERS 20
-#define CONTROL_FILE "shared_doc_control.txt"
-#define SHARED_DOC "shared_docs.txt"
-#define ACCESS_SEMAPHORE "/doc_access_sem"
-#define OWNER_SEMAPHORE "/owner_priority_sem"
+#define DEFAULT_DOC "shared_docs.txt"
+#define REGISTRY_FILE "shared_docs.registry"  // Documents the owner serves, one per line
+#define REGISTRY_MAX_DOCS 16384  // Slots of the lock table; a power of two
+#define DOC_PATH_MAX 64
+#define DOC_FILE_MAX (DOC_PATH_MAX + 16)
+
+// Files of the document this process works on, set by select_document().
+// Each document's files are named after it.
+typedef struct {
+    int slot;                          // In registry->docs, -1 before one is selected
+    char path[DOC_PATH_MAX];           // The document itself
+    char edit_copy[DOC_FILE_MAX];      // Working copy the editor saves into
+    char collab_socket[DOC_FILE_MAX];  // Unix socket of the live editing hub
+    char server_socket[DOC_FILE_MAX];  // Unix socket of the owner's request server
+    char control_file[DOC_FILE_MAX];   // Users with access to the document
+    char control_text[DOC_FILE_MAX];   // Text form: older control files, and dumps
+    char users_shm[DOC_FILE_MAX];      // Shared memory object of its user directory
+} Document;
+
+extern Document current_doc;
+
+#define SHARED_DOC (current_doc.path)
+#define EDIT_COPY (current_doc.edit_copy)
+#define COLLAB_SOCKET (current_doc.collab_socket)
+#define SERVER_SOCKET (current_doc.server_socket)
+#define CONTROL_FILE (current_doc.control_file)
+#define CONTROL_TEXT (current_doc.control_text)
 #define LOCK_INFO_SHM_KEY 9876
 #define READER_COUNT_SHM_KEY 9877
 
@@ -42,25 +76,133 @@
 
 // Signal for priority override
 #define PRIORITY_SIGNAL SIGUSR1
+// Sent to the lock holder whenever the owner changes the takeover state
+// (forced flag, countdown) so its editor supervisor re-checks it at once
+#define LOCK_STATE_SIGNAL SIGUSR2
+
+// How long the owner waits for readers/writers before giving up on a read
+#define OWNER_READ_TIMEOUT_MS 5000
+// How often a waiting owner checks whether the lock holder is still alive
+#define OWNER_POLL_MS 100
+// How many processes can hold the whole document, or one section, for
+// reading at once
+#define READER_MAX 64
+
+// Reader-writer lock state word bits. Waiter counts live in the same word
+// so a release is one atomic operation that also reports whether anyone
+// needs waking.
+#define RW_READER       1ULL                    // Bits 0-19: active readers
+#define RW_READER_MASK  0xFFFFFULL
+#define RW_WWAIT        (1ULL << 20)            // Bits 20-39: waiting writers
+#define RW_WWAIT_MASK   (0xFFFFFULL << 20)
+#define RW_RWAIT        (1ULL << 40)            // Bits 40-59: waiting readers
+#define RW_RWAIT_MASK   (0xFFFFFULL << 40)
+#define RW_WRITER       (1ULL << 62)            // Held exclusively
+#define RW_OWNER        (1ULL << 63)            // Owner override: owner wants the lock
+
+// Process-shared reader-writer lock with writer preference and an owner
+// override bit, placed in a document's LockInfo
+typedef struct {
+    _Atomic uint64_t state;  // RW_* bits above
+    _Atomic uint32_t seq;    // Futex word, bumped when waiters must re-check state
+} RwLock;
 
-void append_to_history();
-void pop_last_snapshot();
-void print_history();
+// Lock control word bits. The lock holder and the takeover flags share
+// one word so that every transition is a single CAS and a process polling
+// them needs only one acquire-load.
+#define LS_PID_MASK     0xFFFFFFFFULL           // Bits 0-31: PID holding the lock
+#define LS_TYPE_SHIFT   32                      // Bits 32-33: 0=none, 1=shared/read, 2=exclusive/write
+#define LS_TYPE_MASK    (3ULL << LS_TYPE_SHIFT)
+#define LS_FORCED       (1ULL << 34)            // Owner is forcing lock takeover
+#define LS_COUNTDOWN    (1ULL << 35)            // Takeover countdown in progress
+#define LS_TIME_LIMIT   (1ULL << 36)            // Current editor runs under a time limit
+#define LS_COUNT_SHIFT  40                      // Bits 40-47: current countdown value
+#define LS_COUNT_MASK   (0xFFULL << LS_COUNT_SHIFT)
+
+#define LS_HOLDER(s)          ((pid_t)((s) & LS_PID_MASK))
+#define LS_LOCK_TYPE(s)       ((int)(((s) & LS_TYPE_MASK) >> LS_TYPE_SHIFT))
+#define LS_COUNTDOWN_VALUE(s) ((int)(((s) & LS_COUNT_MASK) >> LS_COUNT_SHIFT))
+
+// Processes holding a document or section lock shared. The lock word only
+// counts readers, so this is how the hold of a reader that died without
+// releasing is found and given back.
+typedef struct {
+    _Atomic pid_t pids[READER_MAX];      // 0 for a free entry
+} ReaderTable;
+
+// Lock and editing state of one document section. Slots are matched to
+// sections by title, so a section keeps its lock, version and editor while
+// edits elsewhere move it around the document.
+typedef struct {
+    _Alignas(64) RwLock rwlock;          // Readers and the writer of this section
+    _Atomic unsigned long version;       // Bumped whenever the section is edited
+    _Atomic pid_t editor_pid;            // Editor process working on the section
+    _Atomic pid_t writer_pid;            // Process holding the write lock
+    _Atomic int64_t edit_start_time;     // When the current editing session started
+    _Atomic int time_allocation;         // Time allocation in seconds for current editor
+    ReaderTable readers;                 // Processes holding the section for reading
+    int users;                           // Processes holding or waiting for the slot
+    char title[SECTION_TITLE_MAX];       // Empty for a free slot
+} SectionSlot;
+
+typedef struct {
+    _Atomic uint32_t mutex;              // Futex: guards slot lookup and users counts
+    SectionSlot slots[SECTION_MAX];
+} SectionTable;
 
+// Everything processes poll or wait on for one document, in one cache
+// line of its lock table slot
 typedef struct {
-    pid_t holding_pid;     // PID of process holding the lock
-    int lock_type;         // 0=none, 1=shared/read, 2=exclusive/write
-    bool owner_waiting;    // Flag indicating if owner is waiting for access
-    int reader_count;      // Number of concurrent readers
-    bool countdown_active; // Indicates if countdown is in progress
-    int countdown_value;   // Current countdown value (5 to 0)
-    bool forced_lock;      // Owner is forcing lock takeover
-    pid_t editor_pid;      // PID of the editor process currently editing
-    time_t edit_start_time; // When the current editing session started
-    int time_allocation;   // Time allocation in seconds for current editor
-    bool time_limit_active; // Whether time limiting is active
+    _Alignas(64) RwLock rwlock;          // Guards the shared document
+    _Atomic uint64_t state;              // LS_* bits above
+    _Atomic pid_t editor_pid;            // PID of the editor process currently editing
+    _Atomic int64_t edit_start_time;     // When the current editing session started
+    _Atomic int time_allocation;         // Time allocation in seconds for current editor
+    _Atomic unsigned long doc_version;   // Bumped whenever the document content changes
+    _Atomic uint32_t takeover_seq;       // Last takeover request posted by the owner
+    _Atomic uint32_t takeover_ack;       // Futex word: last request the holder answered
 } LockInfo;
 
+_Static_assert(sizeof(LockInfo) == 64, "LockInfo must fill exactly one cache line");
+
+// A document's larger lock tables, in a shared memory object of their own
+// that select_document() maps
+typedef struct {
+    RangeTable ranges;                   // Byte-range locks; while any are in use, whole-document
+                                         // holders also hold [0, RANGE_ALL)
+    SectionTable sections;               // Per-section locks, versions and editors
+    ReaderTable readers;                 // Whole-document readers
+} DocTables;
+
+// A section checked out with acquire_section_lock()
+typedef struct {
+    int slot;            // Index into doc_tables->sections.slots
+    int range;           // Byte-range lock on the section's text
+    int type;            // RANGE_READ or RANGE_WRITE
+    int reader;          // Entry in the slot's reader table, -1 for none
+    char *text;          // The section's text when it was locked
+    size_t length;
+} SectionLock;
+
+// Why editor_supervisor_wait() returned
+typedef enum {
+    EDITOR_EXITED,        // Editor process exited; status is filled in
+    EDITOR_TIME_EXPIRED,  // Time allocation ran out
+    EDITOR_PRIORITY,      // PRIORITY_SIGNAL arrived
+    EDITOR_STATE_CHANGED  // LOCK_STATE_SIGNAL arrived; re-read lock_state()
+} EditorEvent;
+
+// Waits on an editor child without polling: a pidfd for its exit, a
+// signalfd for priority and lock-state signals and a timerfd for the
+// time allocation, all in one poll()
+typedef struct {
+    pid_t pid;
+    int pidfd;            // -1 if pidfd_open is unavailable (SIGCHLD is used)
+    int sigfd;
+    int timerfd;
+    sigset_t old_mask;
+} EditorSupervisor;
+
 typedef struct {
     char name[50];
     int priority;  // -1 for owner, 0 for high, 1 for low
@@ -71,22 +213,99 @@ typedef struct {
 
 
 
+// Lock table slot of one document. The lock has the slot's first cache
+// line to itself, so documents never share a lock or a cache line; the
+// name it is found by follows.
+typedef struct {
+    LockInfo lock;
+    _Atomic uint32_t active;             // Set once the rest of the slot is ready
+    uint32_t hash;                       // Of path
+    uint32_t order;                      // When the document was added, for listing
+    char path[DOC_PATH_MAX];
+} DocSlot;
+
+// Open-addressing hash table of documents, probed linearly from the hash
+// of the name. The owner is its only writer and never removes a document
+// while it runs, so lookups take no lock.
+typedef struct {
+    uint32_t count;
+    DocSlot docs[REGISTRY_MAX_DOCS];
+} DocRegistry;
+
 // Global variables for synchronization
-extern sem_t *access_sem;
-extern sem_t *owner_sem;
-extern LockInfo *lock_info;
+extern DocRegistry *registry;
+extern LockInfo *lock_info;             // Lock of the selected document
+extern DocTables *doc_tables;           // Its range and section locks
 extern int lock_info_shm_id;
 
 // Function prototypes
 void initialize_synchronization(bool is_owner);
 void cleanup_synchronization(bool is_owner);
+bool owner_running(void);
+void lock_info_init(LockInfo *info);
+bool valid_document_name(const char *path);
+int registry_add(const char *path);
+int registry_find(const char *path);
+int registry_load(void);
+bool registry_save(void);
+bool select_document(int slot);
+int *registry_list(int *count);
+void registry_release(void);
+void adopt_legacy_files(void);
+bool lock_document_range(int type, bool is_owner, int timeout_ms, int *range);
 bool acquire_read_lock(int fd, User *user);
 bool acquire_write_lock(int fd, User *user);
 void release_read_lock(int fd, User *user);
 void release_write_lock(int fd, User *user);
-void wait_for_owner_priority(User *user);
+int acquire_range_lock(int fd, User *user, size_t off, size_t len, int type);
+void release_range_lock(int fd, User *user, int handle);
+int acquire_line_lock(int fd, User *user, int first_line, int count, char **section, size_t *section_len);
+bool commit_range_edit(int handle, const char *old_text, size_t old_len, const char *copy_path,
+                       const char *user_name);
+int list_sections(SectionSpan *spans, int max);
+bool acquire_section_lock(int fd, User *user, const char *title, int type, SectionLock *lock);
+void release_section_lock(int fd, User *user, SectionLock *lock);
+bool commit_section_edit(SectionLock *lock, const char *copy_path, const char *user_name);
+int find_section_slot(const char *title);
+void start_section_edit(SectionLock *lock, int allocation);
+void stop_section_edit(SectionLock *lock);
+bool section_time_remaining(int slot, int *remaining);
+bool owner_is_waiting(void);
+void set_owner_waiting(bool waiting);
 void signal_owner_priority(void);
 void handle_priority_signal(int signum);
+uint64_t lock_state(void);
+void claim_holder(pid_t pid, int type, bool only_if_free);
+int release_holder(pid_t pid);
+void set_forced_lock(bool forced);
+void start_countdown(int value);
+void set_countdown(int value);
+void stop_countdown(void);
+void start_time_limit(int allocation);
+void stop_time_limit(void);
+bool time_limit_remaining(int *remaining);
+uint32_t post_takeover_request(void);
+void acknowledge_takeover(void);
+bool wait_takeover_ack(uint32_t request, int timeout_ms);
+const char *map_document(const char *path, size_t *len);
+void unmap_document(void);
+bool print_document(void);
+char *read_document(size_t *len);
+char *read_whole_file(const char *path, size_t *len);
+bool begin_edit_copy(void);
+bool commit_edit_copy(const char *user_name);
+bool editor_supervisor_init(EditorSupervisor *sup);
+void editor_supervisor_child(EditorSupervisor *sup);
+bool editor_supervisor_attach(EditorSupervisor *sup, pid_t pid, int time_allocation);
+EditorEvent editor_supervisor_wait(EditorSupervisor *sup, int *status);
+void editor_supervisor_close(EditorSupervisor *sup);
+
+// Reader-writer lock primitives (timeout_ms < 0 waits indefinitely)
+void rwlock_init(RwLock *lock);
+bool rwlock_read_lock(RwLock *lock, bool is_owner, int timeout_ms);
+bool rwlock_write_lock(RwLock *lock, bool is_owner, int timeout_ms);
+bool rwlock_read_unlock(RwLock *lock);
+void rwlock_write_unlock(RwLock *lock);
 
 
 #endif // SHARED_LOCKS_H
\ No newline at end of file
@@ -0,0 +1,96 @@
+// test_rangelock.c
+// Checks of the byte-range lock table that need no running owner: which
+// ranges conflict, empty ranges (an insertion point, as locate_lines()
+// gives for lines past the end of the document) included, and how
+// range_resize_locked() moves the other ranges. Two live pids, this
+// process's and its parent's, stand in for two holders; the table is
+// only asked, never made to wait.
+//
+// Build: gcc -O2 -std=gnu11 -o test_rangelock test_rangelock.c rangelock.c
+// Usage: test_rangelock
+
+#include "rangelock.h"
+#include <stdio.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+static RangeTable table;
+static int failures;
+
+static void check(bool ok, const char *what) {
+    printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+    failures += !ok;
+}
+
+// Take a range as acquire_range_lock() does, counting it in table.active
+// unless it is the whole document; -1 if it conflicts
+static int take(pid_t pid, uint64_t start, uint64_t end, int type) {
+    bool whole = start == 0 && end == RANGE_ALL;
+    if (!whole) {
+        atomic_fetch_add(&table.active, 1);
+    }
+    int handle = range_lock(&table, pid, start, end, type, false, 0, 0);
+    if (handle < 0 && !whole) {
+        atomic_fetch_sub(&table.active, 1);
+    }
+    return handle;
+}
+
+// Whether a range could be had now; it is dropped again at once
+static bool can_take(pid_t pid, uint64_t start, uint64_t end, int type) {
+    int handle = take(pid, start, end, type);
+    range_unlock(&table, handle);
+    return handle >= 0;
+}
+
+static bool holds(int handle, uint64_t start, uint64_t end) {
+    uint64_t s, e;
+    return range_get_locked(&table, handle, &s, &e) && s == start && e == end;
+}
+
+static void resize(int handle, uint64_t new_len) {
+    range_table_lock(&table);
+    range_resize_locked(&table, handle, new_len);
+    range_table_unlock(&table);
+}
+
+int main(void) {
+    pid_t a = getpid(), b = getppid();
+    range_table_init(&table);
+
+    int whole = take(a, 0, RANGE_ALL, RANGE_READ);
+    check(!can_take(b, 0, 0, RANGE_WRITE), "an empty write range at 0 waits for a whole-document reader");
+    check(!can_take(b, 5, 5, RANGE_WRITE), "an empty write range inside the document waits for it too");
+    check(can_take(b, 5, 5, RANGE_READ), "an empty read range does not");
+    range_unlock(&table, whole);
+
+    int held = take(a, 3, 8, RANGE_WRITE);
+    check(!can_take(b, 3, 3, RANGE_WRITE), "an insertion point at a range's start conflicts with it");
+    check(!can_take(b, 7, 7, RANGE_WRITE), "an insertion point inside a range conflicts with it");
+    check(can_take(b, 8, 8, RANGE_WRITE), "an insertion point at a range's end does not");
+    range_unlock(&table, held);
+
+    held = take(a, 4, 4, RANGE_WRITE);
+    check(!can_take(b, 4, 4, RANGE_WRITE), "two insertion points at the same place conflict");
+    check(!can_take(b, 0, 10, RANGE_READ), "a held insertion point conflicts with a range around it");
+    check(can_take(b, 0, 4, RANGE_READ), "but not with a range ending there");
+    check(can_take(b, 5, 10, RANGE_READ), "nor with one starting after it");
+    range_unlock(&table, held);
+
+    // The same process may hold the whole document and a range in it
+    whole = take(a, 0, RANGE_ALL, RANGE_READ);
+    held = take(a, 0, 0, RANGE_WRITE);
+    int later = take(b, 10, 12, RANGE_READ);
+    check(whole >= 0 && held >= 0 && later >= 0, "a process's own ranges do not conflict");
+    resize(held, 5);
+    check(holds(held, 0, 5), "a resized range covers the new text");
+    check(holds(whole, 0, RANGE_ALL), "a whole-document range stays put when text is inserted");
+    check(holds(later, 15, 17), "a later range moves with the text");
+    range_unlock(&table, held);
+    range_unlock(&table, whole);
+    range_unlock(&table, later);
+    check(atomic_load(&table.active) == 0, "the count of byte ranges goes back to 0");
+
+    printf("%d failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -1,23 +1,35 @@
 #include "shared.h"
+#include <poll.h>
 
 // Add this at the top of your file with other global variables
 
 
 
 // Function prototypes for local functions
-bool find_user(const char *name, User *user);
+bool log_in(const char *name, User *user);
+bool wait_for_menu_input(void);
 void display_menu(User *user);
 void view_document(User *user);
 void edit_document(User *user);
+void edit_lines(User *user);
+void edit_live(User *user);
+bool choose_section(const char *action, char *title);
+void view_section(User *user, const char *title);
+void edit_section(User *user, const char *title);
 
 // Global to track if we need to exit due to priority
 volatile sig_atomic_t priority_exit_flag = 0;
 
+// Connection to the owner's request server, and who it has us logged in as
+int server_fd = -1;
+User current_user;
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <username>\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+        printf("Usage: %s <username> [document]\n", argv[0]);
         return 1;
     }
+    const char *document = argc == 3 ? argv[2] : DEFAULT_DOC;
     
     // Set up signal handler for priority override
     struct sigaction sa;
@@ -32,18 +44,32 @@ int main(int argc, char *argv[]) {
     // Initialize synchronization mechanisms
     initialize_synchronization(false);  // false = not owner
     
-    User current_user;
+    // Work on the named document, among those the owner serves
+    int slot = registry_find(document);
+    if (slot < 0) {
+        printf("The owner is not serving a document named '%s'.\n", document);
+        cleanup_synchronization(false);
+        return 1;
+    }
+    if (!select_document(slot)) {
+        cleanup_synchronization(false);
+        return 1;
+    }
+    
+    server_fd = proto_connect(SERVER_SOCKET);
+    if (server_fd < 0) {
+        perror("Failed to connect to the request server - make sure admin is running first");
+        cleanup_synchronization(false);
+        return 1;
+    }
     
-    // Look up user in control file
-    if (!find_user(argv[1], &current_user)) {
+    // The server looks the user up and tracks the session from now on
+    if (!log_in(argv[1], &current_user)) {
         printf("User '%s' not found or doesn't have access.\n", argv[1]);
         cleanup_synchronization(false);
         return 1;
     }
     
-    // Update PID in user record
-    current_user.pid = getpid();
-    
     const char *priority_str;
     if (current_user.priority == PRIORITY_OWNER)
         priority_str = "Owner (Highest)";
@@ -74,8 +100,16 @@ int main(int argc, char *argv[]) {
     int choice;
     while(1) {
         display_menu(&current_user);
-        scanf("%d", &choice);
-        getchar(); // Clear newline
+        fflush(stdout);
+        if (!wait_for_menu_input()) {
+            printf("\nThe owner has stopped the document server.\n");
+            cleanup_synchronization(false);
+            return 0;
+        }
+        if (scanf("%d", &choice) != 1) {
+            choice = 0;
+        }
+        while (getchar() != '\n');
         
         switch(choice) {
             case 1:
@@ -93,6 +127,20 @@ int main(int argc, char *argv[]) {
                 }
                 break;
             case 3:
+                if (current_user.access_type == ACCESS_WRITE_ONLY || current_user.access_type == ACCESS_BOTH) {
+                    edit_lines(&current_user);
+                } else {
+                    printf("You don't have write access to this document.\n");
+                }
+                break;
+            case 4:
+                if (current_user.access_type == ACCESS_WRITE_ONLY || current_user.access_type == ACCESS_BOTH) {
+                    edit_live(&current_user);
+                } else {
+                    printf("You don't have write access to this document.\n");
+                }
+                break;
+            case 5:
                 printf("Exiting program.\n");
                 cleanup_synchronization(false);
                 return 0;
@@ -105,66 +153,82 @@ int main(int argc, char *argv[]) {
 }
 
 
-bool find_user(const char *name, User *user) {
-    FILE *file = fopen(CONTROL_FILE, "r");
-    if (file == NULL) {
-        perror("Error opening control file");
-        exit(EXIT_FAILURE);
+// Events from the server: the owner changed or removed this user
+static void handle_server_event(const ProtoHeader *event, const char *payload) {
+    if (event->type == PROTO_EVT_USER && event->len == sizeof(ProtoUser)) {
+        const ProtoUser *record = (const ProtoUser *)payload;
+        current_user.priority = record->priority;
+        current_user.access_type = record->access_type;
+        printf("\n[!] The owner changed your access; the menu below reflects it.\n");
+    } else if (event->type == PROTO_EVT_REMOVED) {
+        printf("\n[!] The owner removed user '%s'. Exiting.\n", current_user.name);
+        cleanup_synchronization(false);
+        exit(0);
     }
-    
-    char line[MAX_LINE];
-    char doc_path[MAX_LINE];
-    
-    // Read document path
-    fgets(doc_path, MAX_LINE, file);
-    doc_path[strcspn(doc_path, "\n")] = 0; // Remove newline
-    
-    // Read admin info
-    User admin;
-    fgets(line, MAX_LINE, file);
-    sscanf(line, "%s %d %d %d", admin.name, &admin.priority, &admin.access_type, &admin.pid);
-    admin.priority = PRIORITY_OWNER;  // Ensure owner priority
-    
-    // Check if user is admin
-    if (strcmp(name, admin.name) == 0) {
-        *user = admin;
-        fclose(file);
-        return true;
+}
+
+// Send a request and wait for the reply; returns its status, or -1 if
+// the server has gone
+static int server_call(int type, const void *payload, size_t len, ProtoHeader *reply, char **reply_payload) {
+    return proto_call(server_fd, type, payload, len, reply, reply_payload, handle_server_event);
+}
+
+bool log_in(const char *name, User *user) {
+    ProtoHeader reply;
+    char *payload = NULL;
+    if (strlen(name) >= PROTO_NAME_MAX ||
+        server_call(PROTO_HELLO, name, strlen(name), &reply, &payload) != PROTO_OK ||
+        reply.len != sizeof(ProtoUser)) {
+        free(payload);
+        return false;
     }
-    
-    // Read number of additional users
-    int user_count;
-    fgets(line, MAX_LINE, file);
-    sscanf(line, "%d", &user_count);
-    
-    // Look for the user
-    bool found = false;
-    for (int i = 0; i < user_count; i++) {
-        if (fgets(line, MAX_LINE, file) != NULL) {
-            User current;
-            sscanf(line, "%s %d %d %d", current.name, &current.priority, &current.access_type, &current.pid);
-            
-            if (strcmp(name, current.name) == 0) {
-                *user = current;
-                found = true;
-                break;
+    const ProtoUser *record = (const ProtoUser *)payload;
+    strcpy(user->name, record->name);
+    user->priority = record->priority;
+    user->access_type = record->access_type;
+    user->pid = getpid();
+    user->is_owner = false;
+    free(payload);
+    return true;
+}
+
+// Wait for a menu choice, handling what the server sends meanwhile.
+// Returns false if the server has gone.
+bool wait_for_menu_input(void) {
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = STDIN_FILENO, .events = POLLIN },
+            { .fd = server_fd, .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return true;
+        }
+        if (fds[1].revents) {
+            ProtoHeader event;
+            char *payload;
+            if (!proto_recv(server_fd, &event, &payload)) {
+                return false;
             }
+            handle_server_event(&event, payload);
+            free(payload);
+            continue;
         }
+        return true;
     }
-    
-    fclose(file);
-    return found;
 }
 
 void display_menu(User *user) {
-    printf("\n=== Document Access Menu ===\n");
+    printf("\n=== Document Access Menu: %s ===\n", SHARED_DOC);
     if (user->access_type == ACCESS_READ_ONLY || user->access_type == ACCESS_BOTH) {
         printf("1. View document\n");
     }
     if (user->access_type == ACCESS_WRITE_ONLY || user->access_type == ACCESS_BOTH) {
         printf("2. Edit document\n");
+        printf("3. Edit lines\n");
+        printf("4. Edit live with others\n");
     }
-    printf("3. Exit\n");
+    printf("5. Exit\n");
     printf("Enter your choice: ");
 }
 
@@ -175,114 +239,88 @@ void view_document(User *user) {
             return;
         }
         
-    int fd = open(SHARED_DOC, O_RDWR);
-    if (fd == -1) {
-        perror("Error opening document for reading");
+    char title[SECTION_TITLE_MAX];
+    if (choose_section("view", title)) {
+        view_section(user, title);
         return;
     }
     
-    if (!acquire_read_lock(fd, user)) {
-        close(fd);
+    // The server reads the document under the read lock, once for every
+    // user waiting to view it
+    ProtoHeader reply;
+    char *doc = NULL;
+    int status = server_call(PROTO_VIEW, NULL, 0, &reply, &doc);
+    if (status != PROTO_OK) {
+        printf("Could not read the document: %s.\n", proto_error(status));
         return;
     }
     
     printf("\n--- Document Content ---\n");
-    char buffer[1024];
-    ssize_t bytes_read;
-    
-    // Simulate reading delay
     printf("User '%s' is reading the document...\n", user->name);
-    
-    // Read in chunks, checking for priority exit flag between chunks
-    while ((bytes_read = read(fd, buffer, sizeof(buffer) - 1)) > 0) {
-        if (priority_exit_flag) {
-            printf("\n[!] Owner requested priority access. Releasing read lock.\n");
-            break;
-        }
-        
-        buffer[bytes_read] = '\0';
-        printf("%s", buffer);
-        
-        // Small delay to allow for priority interruption
-        usleep(10000);  // 10ms delay
+    fflush(stdout);
+    if (write(STDOUT_FILENO, doc, reply.len) != (ssize_t)reply.len) {
+        perror("Error writing document");
     }
-    
     printf("\n--- End of Document ---\n");
-    release_read_lock(fd, user);
-    close(fd);
-    
-    // Reset exit flag after handling it
-    priority_exit_flag = 0;
+    free(doc);
 }
-void edit_document(User *user) {
-    // Check if owner is forcing a lock - if so, wait
-    if (lock_info->forced_lock) {
-        printf("Owner is currently taking over the document. Please wait.\n");
-        return;
-    }
 
-    // Open the document with write access
-    int fd = open(SHARED_DOC, O_RDWR);
-    if (fd == -1) {
-        perror("Error opening document for editing");
-        return;
-    }
-   
-    // Acquire exclusive write lock
-    if (!acquire_write_lock(fd, user)) {
-        close(fd);
-        return;
-    }
-   
-    // Set time allocation based on priority
-    int time_allocation;
+// Time allocation for an editing session, based on priority
+static int time_allocation_for(User *user) {
     if (user->priority == 2) {  // Assuming priority 2 is for owner
-        time_allocation = 30;   // Owner gets 30 seconds
+        return 30;              // Owner gets 30 seconds
     } else if (user->priority == 1) {
-        time_allocation = 10;   // High priority users get 10 seconds
-    } else {
-        time_allocation = 15;   // Regular users get 15 seconds
+        return 10;              // High priority users get 10 seconds
     }
-    
-    // Record start time and allocation
-    lock_info->edit_start_time = time(NULL);
-    lock_info->time_allocation = time_allocation;
-    lock_info->time_limit_active = true;
-    
-    printf("Opening editor for user '%s' (Time allocation: %d seconds)...\n", 
-           user->name, time_allocation);
-   
-   
+    return 15;                  // Regular users get 15 seconds
+}
+
+// Run nano on path until it exits, the time allocation runs out or the
+// owner takes over. The editor's PID is published in *editor_pid (the
+// document's or a section's) for the owner; editors of a few lines have
+// none and are reached through PRIORITY_SIGNAL. Returns false if the
+// editor could not be started.
+static bool run_editor(User *user, const char *path, int time_allocation, _Atomic pid_t *editor_pid) {
     // Fork and exec to open nano editor
+    EditorSupervisor supervisor;
+    if (!editor_supervisor_init(&supervisor)) {
+        return false;
+    }
     pid_t pid = fork();
    
     if (pid == 0) {
         // Child process - make sure it ignores priority signal
+        editor_supervisor_child(&supervisor);
         signal(PRIORITY_SIGNAL, SIG_IGN);
        
         // Redirect stdin, stdout to terminal for nano
-        execlp("nano", "nano", "-B", SHARED_DOC, NULL);
+        execlp("nano", "nano", "-B", path, NULL);
         perror("Failed to open editor");
         exit(EXIT_FAILURE);
     } else if (pid > 0) {
         // Store editor PID in shared memory so owner can interact with it directly
-        lock_info->editor_pid = pid;
+        if (editor_pid != NULL) {
+            atomic_store(editor_pid, pid);
+        }
         
-        // Parent process - wait for editor to close or priority signal
+        // Parent process - sleep until the editor exits, the time allocation
+        // runs out or the owner signals a takeover step
         int status;
-        pid_t result;
+        bool exited = false;
+        bool expired = false;
         bool save_triggered = false;
-        time_t start_time = time(NULL);
-        int elapsed_time = 0;
-        int time_remaining = time_allocation;
+        editor_supervisor_attach(&supervisor, pid, time_allocation);
        
-        while ((result = waitpid(pid, &status, WNOHANG)) == 0) {
-            // Update elapsed time
-            elapsed_time = time(NULL) - start_time;
-            time_remaining = time_allocation - elapsed_time;
+        for (;;) {
+            EditorEvent event = editor_supervisor_wait(&supervisor, &status);
+            
+            if (event == EDITOR_EXITED) {
+                exited = true;
+                break;
+            }
             
             // Check if time allocation is exceeded
-            if (time_remaining <= 0) {
+            if (event == EDITOR_TIME_EXPIRED) {
                 printf("\n[!] Time allocation (%d seconds) has expired.\n", time_allocation);
                 printf("Attempting to save your work...\n");
                 
@@ -294,15 +332,19 @@ void edit_document(User *user) {
                 // Then terminate the editor
                 kill(pid, SIGTERM);
                 waitpid(pid, &status, 0);
+                expired = true;
                 break;
             }
             
-            // Display time remaining every second
-            static int last_displayed_time = -1;
+            if (event == EDITOR_PRIORITY) {
+                priority_exit_flag = 1;
+            }
             
+            // One load covers the takeover flags and countdown below
+            uint64_t state = lock_state();
             
             // Check if owner is forcing lock takeover
-            if (lock_info->forced_lock) {
+            if (state & LS_FORCED) {
                 printf("\n[!] Owner is forcing document takeover.\n");
                 if (!save_triggered) {
                     printf("Attempting to save your work...\n");
@@ -310,7 +352,7 @@ void edit_document(User *user) {
                 }
                 
                 // Only terminate if countdown has reached zero
-                if (lock_info->countdown_active && lock_info->countdown_value <= 0) {
+                if ((state & LS_COUNTDOWN) && LS_COUNTDOWN_VALUE(state) <= 0) {
                     printf("Editor will now close.\n");
                     kill(pid, SIGTERM);
                     waitpid(pid, &status, 0);
@@ -319,10 +361,10 @@ void edit_document(User *user) {
             }
             
             // Check for countdown
-            if (lock_info->countdown_active) {
-                if (!save_triggered && lock_info->countdown_value <= 2) {
+            if (state & LS_COUNTDOWN) {
+                if (!save_triggered && LS_COUNTDOWN_VALUE(state) <= 2) {
                     printf("\n[!] Owner requesting priority access in %d seconds. Preparing to save...\n", 
-                           lock_info->countdown_value);
+                           LS_COUNTDOWN_VALUE(state));
                     // Only try to save when countdown gets to 2 or less
                     save_triggered = true;
                 }
@@ -344,34 +386,309 @@ void edit_document(User *user) {
                 waitpid(pid, &status, 0);  // Wait for the child to terminate
                 break;
             }
-            usleep(100000);  // 100ms sleep
         }
+        editor_supervisor_close(&supervisor);
        
         // Clear editor PID from shared memory
-        lock_info->editor_pid = 0;
-        lock_info->time_limit_active = false;
+        if (editor_pid != NULL) {
+            atomic_store(editor_pid, 0);
+        }
         
-        if (result > 0 && !priority_exit_flag && !lock_info->forced_lock && time_remaining > 0) {
+        if (exited && !priority_exit_flag && !(lock_state() & LS_FORCED)) {
             printf("\nDocument editing completed by '%s'.\n", user->name);
-        } else if (time_remaining <= 0) {
+        } else if (expired) {
             printf("\nEditor closed due to time limit expiration.\n");
         } else {
             printf("\nEditor closed due to owner priority request.\n");
         }
     } else {
         perror("Fork failed");
+        editor_supervisor_close(&supervisor);
+        return false;
+    }
+    return true;
+}
+
+void edit_document(User *user) {
+    // Check if owner is forcing a lock - if so, wait
+    if (lock_state() & LS_FORCED) {
+        printf("Owner is currently taking over the document. Please wait.\n");
+        return;
+    }
+    
+    // Checking out one section leaves the others free for other users
+    char title[SECTION_TITLE_MAX];
+    if (choose_section("edit", title)) {
+        edit_section(user, title);
+        return;
+    }
+
+    // The server queues us for the write lock, by priority, and holds it
+    // for us until we commit or abort
+    printf("User '%s' (priority %d) attempting to acquire write lock...\n", 
+           user->name, user->priority);
+    ProtoHeader reply;
+    char *doc = NULL;
+    int status = server_call(PROTO_EDIT_BEGIN, NULL, 0, &reply, &doc);
+    if (status == PROTO_ERR_BUSY) {
+        printf("Owner is waiting, user %s cannot acquire write lock.\n", user->name);
+        return;
+    } else if (status != PROTO_OK) {
+        printf("Could not lock the document: %s.\n", proto_error(status));
+        return;
+    }
+    
+    // The copy is our own: the owner's editor may use EDIT_COPY as soon as
+    // the server lets go of the lock
+    char copy_path[MAX_LINE];
+    snprintf(copy_path, sizeof(copy_path), "%s.%d", EDIT_COPY, (int)getpid());
+    
+    int copy_fd = open(copy_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool ready = copy_fd != -1 && write(copy_fd, doc, reply.len) == (ssize_t)reply.len;
+    if (copy_fd != -1) {
+        close(copy_fd);
     }
+    free(doc);
+    
+    // Record start time and allocation
+    int time_allocation = time_allocation_for(user);
+    start_time_limit(time_allocation);
+    
+    printf("Opening editor for user '%s' (Time allocation: %d seconds)...\n", 
+           user->name, time_allocation);
    
-    // Release the lock
-    release_write_lock(fd, user);
-    close(fd);
+    // The server logs whatever the editor saved and releases the lock
+    size_t len;
+    char *copy = NULL;
+    if (!ready) {
+        perror("Error creating editor working copy");
+    } else if (run_editor(user, copy_path, time_allocation, &lock_info->editor_pid) &&
+               (copy = read_whole_file(copy_path, &len)) == NULL) {
+        perror("Error reading editor working copy");
+    }
+    stop_time_limit();
+    
+    if (copy != NULL) {
+        status = server_call(PROTO_EDIT_COMMIT, copy, len, &reply, NULL);
+        free(copy);
+        if (status == PROTO_OK) {
+            unlink(copy_path);
+            // nano -B leaves the pre-edit version as a backup of the copy
+            char backup[MAX_LINE + 1];
+            snprintf(backup, sizeof(backup), "%s~", copy_path);
+            char doc_backup[DOC_FILE_MAX];
+            snprintf(doc_backup, sizeof(doc_backup), "%s~", SHARED_DOC);
+            rename(backup, doc_backup);
+        } else {
+            printf("Could not save changes (%s); they remain in %s\n", proto_error(status), copy_path);
+        }
+    } else {
+        server_call(PROTO_EDIT_ABORT, NULL, 0, &reply, NULL);
+    }
+    printf("User '%s' released write lock.\n", user->name);
    
     // Reset exit flag after handling it
     priority_exit_flag = 0;
     
     // If owner is waiting, print message about waiting in queue
-    if (lock_info->owner_waiting) {
+    if (owner_is_waiting()) {
         printf("Owner has priority access. You are now in the queue.\n");
         printf("You may edit the document after the owner completes their edits.\n");
     }
-}
\ No newline at end of file
+}
+
+// Edit a few lines under a byte-range lock, so other users can edit other
+// parts of the document at the same time
+void edit_lines(User *user) {
+    int first_line, count;
+    printf("First line to edit: ");
+    if (scanf("%d", &first_line) != 1 || first_line < 1) {
+        printf("Invalid line number.\n");
+        while (getchar() != '\n');
+        return;
+    }
+    printf("Number of lines: ");
+    if (scanf("%d", &count) != 1 || count < 0) {
+        printf("Invalid line count.\n");
+        while (getchar() != '\n');
+        return;
+    }
+    getchar(); // Clear newline
+    
+    int fd = open(SHARED_DOC, O_RDWR);
+    if (fd == -1) {
+        perror("Error opening document for editing");
+        return;
+    }
+    
+    char *section;
+    size_t section_len;
+    int handle = acquire_line_lock(fd, user, first_line, count, &section, &section_len);
+    if (handle < 0) {
+        close(fd);
+        return;
+    }
+    
+    // Each concurrent editor needs its own working copy
+    char copy_path[MAX_LINE];
+    snprintf(copy_path, sizeof(copy_path), "%s.%d", EDIT_COPY, (int)getpid());
+    
+    int copy_fd = open(copy_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool ready = copy_fd != -1 && write(copy_fd, section, section_len) == (ssize_t)section_len;
+    if (copy_fd != -1) {
+        close(copy_fd);
+    }
+    
+    if (!ready) {
+        perror("Error creating editor working copy");
+    } else {
+        int time_allocation = time_allocation_for(user);
+        printf("Opening editor for user '%s' on lines %d-%d (Time allocation: %d seconds)...\n",
+               user->name, first_line, first_line + count - 1, time_allocation);
+        
+        if (run_editor(user, copy_path, time_allocation, NULL)) {
+            commit_range_edit(handle, section, section_len, copy_path, user->name);
+        }
+        
+        // nano -B leaves the original lines as a backup
+        char backup[MAX_LINE + 1];
+        snprintf(backup, sizeof(backup), "%s~", copy_path);
+        unlink(backup);
+    }
+    
+    free(section);
+    release_range_lock(fd, user, handle);
+    close(fd);
+    
+    // Reset exit flag after handling it
+    priority_exit_flag = 0;
+}
+
+// List the document's sections and ask for one. Returns false when the
+// whole document is wanted (choice 0) or the choice is invalid.
+bool choose_section(const char *action, char *title) {
+    SectionSpan spans[SECTION_MAX];
+    int count = list_sections(spans, SECTION_MAX);
+    if (count <= 1) {
+        return false;  // Nothing to choose between
+    }
+    
+    printf("\n--- Sections ---\n");
+    printf("0. Whole document\n");
+    for (int i = 0; i < count; i++) {
+        printf("%d. %s (%zu bytes)", i + 1, spans[i].title, spans[i].length);
+        int slot = find_section_slot(spans[i].title);
+        int remaining;
+        if (slot >= 0 && section_time_remaining(slot, &remaining)) {
+            printf(" - being edited, %d seconds left", remaining > 0 ? remaining : 0);
+        }
+        printf("\n");
+    }
+    
+    int choice;
+    printf("Section to %s: ", action);
+    if (scanf("%d", &choice) != 1) {
+        choice = 0;
+    }
+    while (getchar() != '\n');
+    
+    if (choice < 1 || choice > count) {
+        return false;
+    }
+    strcpy(title, spans[choice - 1].title);
+    return true;
+}
+
+void view_section(User *user, const char *title) {
+    int fd = open(SHARED_DOC, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening document for reading");
+        return;
+    }
+    
+    SectionLock lock;
+    if (!acquire_section_lock(fd, user, title, RANGE_READ, &lock)) {
+        close(fd);
+        return;
+    }
+    
+    printf("\n--- Section: %s ---\n", title);
+    fflush(stdout);
+    if (write(STDOUT_FILENO, lock.text, lock.length) != (ssize_t)lock.length) {
+        perror("Error writing section");
+    }
+    printf("\n--- End of Section ---\n");
+    
+    release_section_lock(fd, user, &lock);
+    close(fd);
+}
+
+// Edit one section; other users can view and edit the other sections
+// meanwhile
+void edit_section(User *user, const char *title) {
+    int fd = open(SHARED_DOC, O_RDWR);
+    if (fd == -1) {
+        perror("Error opening document for editing");
+        return;
+    }
+    
+    SectionLock lock;
+    if (!acquire_section_lock(fd, user, title, RANGE_WRITE, &lock)) {
+        close(fd);
+        return;
+    }
+    
+    // Each concurrent editor needs its own working copy
+    char copy_path[MAX_LINE];
+    snprintf(copy_path, sizeof(copy_path), "%s.%d", EDIT_COPY, (int)getpid());
+    
+    int copy_fd = open(copy_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool ready = copy_fd != -1 && write(copy_fd, lock.text, lock.length) == (ssize_t)lock.length;
+    if (copy_fd != -1) {
+        close(copy_fd);
+    }
+    
+    if (!ready) {
+        perror("Error creating editor working copy");
+    } else {
+        int time_allocation = time_allocation_for(user);
+        start_section_edit(&lock, time_allocation);
+        printf("Opening editor for user '%s' on section '%s' (Time allocation: %d seconds)...\n",
+               user->name, title, time_allocation);
+        
+        if (run_editor(user, copy_path, time_allocation,
+                       &doc_tables->sections.slots[lock.slot].editor_pid)) {
+            commit_section_edit(&lock, copy_path, user->name);
+        }
+        stop_section_edit(&lock);
+        
+        // nano -B leaves the original section as a backup
+        char backup[MAX_LINE + 1];
+        snprintf(backup, sizeof(backup), "%s~", copy_path);
+        unlink(backup);
+    }
+    
+    release_section_lock(fd, user, &lock);
+    close(fd);
+    
+    // Reset exit flag after handling it
+    priority_exit_flag = 0;
+}
+
+// Join the owner's live editing session. Everyone in it types at once
+// with no lock to wait for; the hub saves the merged text.
+void edit_live(User *user) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(PRIORITY_SIGNAL, SIG_IGN);
+        execl(COLLAB_EDITOR, COLLAB_EDITOR, "--collab", COLLAB_SOCKET, user->name, NULL);
+        perror("Failed to start live editor");
+        exit(EXIT_FAILURE);
+    } else if (pid > 0) {
+        int status;
+        waitpid(pid, &status, 0);
+        printf("\nLive editing session left by '%s'.\n", user->name);
+    } else {
+        perror("Fork failed");
+    }
+}
@@ -0,0 +1,280 @@
+// userdir.c
+// User directory. Slots are probed linearly from the name's hash; a
+// removed user leaves a deleted mark so later probes go on past it, and
+// the marks are cleared when the table is rebuilt. The table is rebuilt,
+// twice as large if need be, whenever three quarters of its slots are
+// used, and the shared memory object grows with it. Each process maps it
+// at the size it has seen so far and maps it again when the capacity
+// outgrows that.
+
+#define _GNU_SOURCE  // mremap
+#include "userdir.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static UserDirectory *dir = NULL;
+static size_t dir_size = 0;
+static int dir_fd = -1;
+
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;  // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+static size_t table_size(uint32_t capacity) {
+    return sizeof(UserDirectory) + (size_t)capacity * sizeof(UserSlot);
+}
+
+// Map the first size bytes of the object, keeping what is there
+static bool map_size(size_t size) {
+    void *map = dir == NULL ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dir_fd, 0)
+                            : mremap(dir, dir_size, size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    dir = map;
+    dir_size = size;
+    return true;
+}
+
+static bool map_slots(uint32_t capacity) {
+    return table_size(capacity) <= dir_size || map_size(table_size(capacity));
+}
+
+// Slot holding the user, or -1
+static int find_slot(const char *name, uint32_t hash, uint32_t capacity) {
+    uint32_t mask = capacity - 1;
+    uint32_t s = hash & mask;
+    for (uint32_t i = 0; i < capacity; i++, s = (s + 1) & mask) {
+        const UserSlot *slot = &dir->slots[s];
+        if (slot->deleted) {
+            continue;
+        }
+        if (slot->user.name[0] == '\0') {
+            return -1;
+        }
+        if (slot->hash == hash && strncmp(slot->user.name, name, USERDIR_NAME_MAX) == 0) {
+            return s;
+        }
+    }
+    return -1;
+}
+
+// Caller makes sure there is a free slot
+static void insert_slot(const UserRecord *user, uint32_t hash, uint32_t order) {
+    uint32_t mask = atomic_load_explicit(&dir->capacity, memory_order_relaxed) - 1;
+    uint32_t s = hash & mask;
+    while (dir->slots[s].user.name[0] != '\0') {
+        s = (s + 1) & mask;
+    }
+    UserSlot *slot = &dir->slots[s];
+    if (!slot->deleted) {
+        dir->used++;
+    }
+    slot->user = *user;
+    slot->hash = hash;
+    slot->order = order;
+    slot->deleted = false;
+}
+
+// Readers retry while the generation is odd or has moved
+static void begin_change(void) {
+    atomic_fetch_add_explicit(&dir->generation, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void end_change(void) {
+    atomic_fetch_add_explicit(&dir->generation, 1, memory_order_release);
+}
+
+// Create an empty directory and map it. Processes forked afterwards
+// share it; its creator removes it with shm_unlink() when done.
+bool userdir_create(const char *name) {
+    userdir_detach();
+    shm_unlink(name);  // Left behind by an owner that crashed
+    dir_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (dir_fd == -1) {
+        perror("Failed to create user directory");
+        return false;
+    }
+    if (ftruncate(dir_fd, table_size(USERDIR_MIN_CAPACITY)) == -1 ||
+        !map_size(table_size(USERDIR_MIN_CAPACITY))) {
+        perror("Failed to map user directory");
+        userdir_detach();
+        shm_unlink(name);
+        return false;
+    }
+    atomic_store(&dir->capacity, USERDIR_MIN_CAPACITY);
+    return true;
+}
+
+// Map an existing directory for lookups, in place of the one mapped now
+bool userdir_attach(const char *name) {
+    userdir_detach();
+    dir_fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (dir_fd == -1) {
+        return false;
+    }
+    UserDirectory *map = mmap(NULL, sizeof(UserDirectory), PROT_READ, MAP_SHARED, dir_fd, 0);
+    if (map == MAP_FAILED) {
+        userdir_detach();
+        return false;
+    }
+    dir = map;
+    dir_size = sizeof(UserDirectory);
+    return true;
+}
+
+void userdir_detach(void) {
+    if (dir != NULL) {
+        munmap(dir, dir_size);
+        dir = NULL;
+        dir_size = 0;
+    }
+    if (dir_fd != -1) {
+        close(dir_fd);
+        dir_fd = -1;
+    }
+}
+
+uint64_t userdir_generation(void) {
+    return dir ? atomic_load_explicit(&dir->generation, memory_order_acquire) : 0;
+}
+
+// Copy the user's record; false if there is no such user
+bool userdir_lookup(const char *name, UserRecord *user) {
+    if (dir == NULL || strlen(name) >= USERDIR_NAME_MAX) {
+        return false;
+    }
+    uint32_t hash = hash_name(name);
+    for (;;) {
+        uint64_t generation = atomic_load_explicit(&dir->generation, memory_order_acquire);
+        if (generation & 1) {
+            sched_yield();
+            continue;
+        }
+        uint32_t capacity = atomic_load_explicit(&dir->capacity, memory_order_relaxed);
+        if (!map_slots(capacity)) {
+            return false;
+        }
+        int s = find_slot(name, hash, capacity);
+        if (s >= 0) {
+            memcpy(user, &dir->slots[s].user, sizeof(*user));
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&dir->generation, memory_order_relaxed) == generation) {
+            return s >= 0;
+        }
+    }
+}
+
+// Rehash into a table with room for needed users at half load, growing
+// the object first if that takes more slots
+static bool rebuild(uint32_t needed) {
+    uint32_t old_capacity = atomic_load_explicit(&dir->capacity, memory_order_relaxed);
+    uint32_t capacity = old_capacity;
+    while ((uint64_t)needed * 2 > capacity) {
+        capacity *= 2;
+    }
+    if (capacity > old_capacity &&
+        (ftruncate(dir_fd, table_size(capacity)) == -1 || !map_size(table_size(capacity)))) {
+        return false;
+    }
+    UserSlot *live = malloc((dir->count + 1) * sizeof(UserSlot));
+    if (live == NULL) {
+        return false;
+    }
+    uint32_t count = 0;
+    for (uint32_t s = 0; s < old_capacity; s++) {
+        if (dir->slots[s].user.name[0] != '\0') {
+            live[count++] = dir->slots[s];
+        }
+    }
+
+    begin_change();
+    memset(dir->slots, 0, (size_t)capacity * sizeof(UserSlot));
+    atomic_store_explicit(&dir->capacity, capacity, memory_order_relaxed);
+    dir->used = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        insert_slot(&live[i].user, live[i].hash, live[i].order);
+    }
+    end_change();
+    free(live);
+    return true;
+}
+
+// Add the user, or replace the record of the user with that name.
+// Returns false if the table could not grow.
+bool userdir_put(const UserRecord *user) {
+    uint32_t hash = hash_name(user->name);
+    uint32_t capacity = atomic_load_explicit(&dir->capacity, memory_order_relaxed);
+    int s = find_slot(user->name, hash, capacity);
+    if (s >= 0) {
+        begin_change();
+        dir->slots[s].user = *user;
+        end_change();
+        return true;
+    }
+    if ((uint64_t)(dir->used + 1) * 4 > (uint64_t)capacity * 3 && !rebuild(dir->count + 1)) {
+        return false;
+    }
+    begin_change();
+    insert_slot(user, hash, dir->next_order++);
+    dir->count++;
+    end_change();
+    return true;
+}
+
+bool userdir_remove(const char *name) {
+    uint32_t capacity = atomic_load_explicit(&dir->capacity, memory_order_relaxed);
+    int s = find_slot(name, hash_name(name), capacity);
+    if (s < 0) {
+        return false;
+    }
+    begin_change();
+    memset(&dir->slots[s].user, 0, sizeof(UserRecord));
+    dir->slots[s].deleted = true;
+    dir->count--;
+    end_change();
+    return true;
+}
+
+static int compare_order(const void *a, const void *b) {
+    uint32_t x = ((const UserSlot *)a)->order, y = ((const UserSlot *)b)->order;
+    return (x > y) - (x < y);
+}
+
+// Every user, in the order they were added; the caller frees the array
+UserRecord *userdir_list(size_t *count) {
+    uint32_t capacity = atomic_load_explicit(&dir->capacity, memory_order_relaxed);
+    UserSlot *live = malloc((dir->count + 1) * sizeof(UserSlot));
+    UserRecord *users = malloc((dir->count + 1) * sizeof(UserRecord));
+    if (live == NULL || users == NULL) {
+        free(live);
+        free(users);
+        return NULL;
+    }
+    size_t n = 0;
+    for (uint32_t s = 0; s < capacity; s++) {
+        if (dir->slots[s].user.name[0] != '\0') {
+            live[n++] = dir->slots[s];
+        }
+    }
+    qsort(live, n, sizeof(UserSlot), compare_order);
+    for (size_t i = 0; i < n; i++) {
+        users[i] = live[i].user;
+    }
+    free(live);
+    *count = n;
+    return users;
+}
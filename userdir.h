@@ -0,0 +1,56 @@
+// userdir.h
+// User directory: the request server's user table, kept in shared memory
+// as an open-addressing hash table keyed by name. The server is its only
+// writer; any process mapping it looks users up without a lock. A
+// generation counter is odd while the server changes the table, so a
+// reader that sees it odd, or sees it move during a lookup, tries again.
+// The table doubles as it fills, so there is no cap on the number of users.
+// Each document has its own directory, in a POSIX shared memory object
+// with the name passed in.
+
+#ifndef USERDIR_H
+#define USERDIR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define USERDIR_NAME_MAX 50
+#define USERDIR_MIN_CAPACITY 64           // Slots; always a power of two
+
+typedef struct {
+    char name[USERDIR_NAME_MAX];
+    int32_t priority;
+    int32_t access_type;
+    pid_t pid;          // Process of an open session, 0 if none
+    uint32_t record;    // Its record in the control file (control.h)
+} UserRecord;
+
+typedef struct {
+    UserRecord user;    // Empty name for a free slot
+    uint32_t hash;
+    uint32_t order;     // Insertion order, for listing
+    bool deleted;       // Removed; probes go on past it
+} UserSlot;
+
+typedef struct {
+    _Atomic uint64_t generation;  // Odd while the table is being changed
+    _Atomic uint32_t capacity;    // Slots that follow
+    uint32_t count;               // Users
+    uint32_t used;                // Slots holding a user or a deleted mark
+    uint32_t next_order;
+    UserSlot slots[];
+} UserDirectory;
+
+bool userdir_create(const char *name);
+bool userdir_attach(const char *name);
+void userdir_detach(void);
+bool userdir_lookup(const char *name, UserRecord *user);
+uint64_t userdir_generation(void);
+
+// Writer side, for the server only
+bool userdir_put(const UserRecord *user);
+bool userdir_remove(const char *name);
+UserRecord *userdir_list(size_t *count);
+
+#endif // USERDIR_H